@@ -0,0 +1,180 @@
+/* tfbench.cpp - microbenchmark of the FileActionQueue used by the tfmon event correlation code.
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+
+	Times the operations the correlation threads run on every event against the queue of a volume
+	(add, last item, removal in any order, membership, lookup by filename), for growing numbers of queued items,
+	and compares them with the former design (a vector and a map of vectors, scanned linearly on removal).
+
+	Build:
+	g++ -O2 -o tfbench tfbench.cpp -lpthread
+
+	Usage:
+	tfbench [max_items]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../../win/src/tfmon/FileActionQueue.h"
+
+#include <vector>
+#include <map>
+
+using std::vector;
+using std::map;
+
+
+/*
+Former queue (kept here for comparison only): removal and membership scan the whole queue.
+*/
+class LegacyQueue {
+private:
+	CRITICAL_SECTION criticalSection;
+	vector<FileActionInfo*> qActionQueue;
+	map<wstring, vector<FileActionInfo*> > mActionMap;
+
+	void Dequeue(vector<FileActionInfo*> *v, FileActionInfo* lpAction) {
+		for(int i = 0, nCount = v->size(); i < nCount; ++i){
+			if(lpAction == v->at(i)) {
+				v->erase(v->begin() + i);
+				break;
+			}
+		}
+	}
+
+public:
+	LegacyQueue() { InitializeCriticalSection(&this->criticalSection); }
+	~LegacyQueue() { DeleteCriticalSection(&this->criticalSection); }
+
+	void Add(FileActionInfo* lpAction) {
+		EnterCriticalSection(&this->criticalSection);
+		this->mActionMap[lpAction->GetFileName()].push_back(lpAction);
+		this->qActionQueue.push_back(lpAction);
+		LeaveCriticalSection(&this->criticalSection);
+	}
+
+	void Remove(FileActionInfo* lpAction) {
+		EnterCriticalSection(&this->criticalSection);
+		this->Dequeue(&this->mActionMap[lpAction->GetFileName()], lpAction);
+		this->Dequeue(&this->qActionQueue, lpAction);
+		delete lpAction;
+		LeaveCriticalSection(&this->criticalSection);
+	}
+
+	FileActionInfo* Last() {
+		EnterCriticalSection(&this->criticalSection);
+		FileActionInfo* result = (this->qActionQueue.size() > 0) ? this->qActionQueue.back() : NULL;
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	FileActionInfo* Search(LPWSTR fileName, DWORD action, PCHAR drives) {
+		FileActionInfo* result = NULL;
+		EnterCriticalSection(&this->criticalSection);
+		vector<FileActionInfo*> *v = &this->mActionMap[fileName];
+		for(int i = 0, nCount = v->size(); i < nCount && !result; ++i){
+			FileActionInfo* lpAction = v->at(i);
+			if(lpAction->GetAction() != action) continue;
+			for(int j = 0; !result && drives[j]; ++j) {
+				if(lpAction->GetDrive() == drives[j]) result = lpAction;
+			}
+		}
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	BOOL Search(FileActionInfo* lpInfo) {
+		BOOL result = FALSE;
+		EnterCriticalSection(&this->criticalSection);
+		for(int i = 0, nCount = this->qActionQueue.size(); i < nCount && !result; ++i){
+			if(this->qActionQueue[i] == lpInfo) result = TRUE;
+		}
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+};
+
+
+FileActionArena arena;
+
+/*
+Records as a mass deletion produces them: same directory, distinct filenames.
+*/
+void MakeRecords(UINT nCount, vector<FileActionInfo*>* vecRecords) {
+	WCHAR buff[64];
+	for(UINT i = 0; i < nCount; ++i) {
+		swprintf(buff, 64, L"/home/user/documents/file-%08u.txt", i);
+		vecRecords->push_back(FileActionInfo::Create(&arena, buff, FILE_ACTION_REMOVED, 'a'));
+	}
+}
+
+// pseudo-random order (xorshift), the same for both queues
+void Shuffle(vector<FileActionInfo*>* vecRecords) {
+	DWORD x = 2463534242u;
+	for(UINT i = vecRecords->size(); i > 1; --i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		std::swap(vecRecords->at(i-1), vecRecords->at(x % i));
+	}
+}
+
+/*
+Queue nCount records, run the lookups the correlation code does, then remove them in random order (as pairings and delayed removals do).
+Returns the elapsed time in microseconds, per phase.
+*/
+template <class Queue> void Run(UINT nCount, ULONGLONG* lpAdd, ULONGLONG* lpLookup, ULONGLONG* lpRemove) {
+	Queue queue;
+	vector<FileActionInfo*> vecRecords;
+	MakeRecords(nCount, &vecRecords);
+	CHAR drives[] = { 'a', 0 };
+	UINT nFound = 0;
+
+	ULONGLONG ullStart = FileActionInfo::GetCurrentTicks();
+	for(UINT i = 0; i < nCount; ++i) {
+		queue.Add(vecRecords[i]);
+		if(queue.Last() == vecRecords[i]) ++nFound;
+	}
+	*lpAdd = FileActionInfo::GetCurrentTicks() - ullStart;
+
+	ullStart = FileActionInfo::GetCurrentTicks();
+	for(UINT i = 0; i < nCount; ++i) {
+		if(queue.Search(vecRecords[i])) ++nFound;
+		if(queue.Search(vecRecords[i]->GetFileName(), FILE_ACTION_REMOVED, drives)) ++nFound;
+		// miss (the former queue created an empty entry for each of them)
+		if(queue.Search((LPWSTR) L"missing.txt", FILE_ACTION_REMOVED, drives)) ++nFound;
+	}
+	*lpLookup = FileActionInfo::GetCurrentTicks() - ullStart;
+
+	Shuffle(&vecRecords);
+	ullStart = FileActionInfo::GetCurrentTicks();
+	for(UINT i = 0; i < nCount; ++i) queue.Remove(vecRecords[i]);
+	*lpRemove = FileActionInfo::GetCurrentTicks() - ullStart;
+
+	if(nFound != 3 * nCount) fprintf(stderr, "tfbench: unexpected lookup results (%u of %u)\n", nFound, 3 * nCount);
+}
+
+void Print(const char* szName, UINT nCount, ULONGLONG ullAdd, ULONGLONG ullLookup, ULONGLONG ullRemove) {
+	printf("%-8s %8u %12.1f %12.1f %12.1f\n", szName, nCount, (double) ullAdd * 1000 / nCount, (double) ullLookup * 1000 / nCount, (double) ullRemove * 1000 / nCount);
+}
+
+int main(int argc, char* argv[]) {
+	UINT nMax = (argc > 1) ? (UINT) atoi(argv[1]) : 50000;
+	if(!nMax) {
+		fprintf(stderr, "usage: tfbench [max_items]\n");
+		return 2;
+	}
+
+	printf("%-8s %8s %12s %12s %12s\n", "queue", "items", "add ns/op", "lookup ns/op", "remove ns/op");
+	for(UINT nCount = 1000; nCount <= nMax; nCount *= 4) {
+		ULONGLONG ullAdd, ullLookup, ullRemove;
+		Run<FileActionQueue>(nCount, &ullAdd, &ullLookup, &ullRemove);
+		Print("current", nCount, ullAdd, ullLookup, ullRemove);
+		Run<LegacyQueue>(nCount, &ullAdd, &ullLookup, &ullRemove);
+		Print("former", nCount, ullAdd, ullLookup, ullRemove);
+	}
+	return 0;
+}
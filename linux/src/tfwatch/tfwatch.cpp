@@ -0,0 +1,312 @@
+/* tfwatch.cpp - headless console driver for the tfmon filesystem monitoring core.
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+
+	Runs the very same event correlation code as tfmon.exe (FSChangeNotifier) on top of the inotify backend,
+	and prints correlated events on the standard output (one event per line, tab separated fields).
+	This allows load-testing the move/delete/restore detection on a Linux box.
+
+	Build:
+	g++ -O2 -o tfwatch tfwatch.cpp ../../../win/src/tfmon/FSChangeNotifier.cpp ../../../win/src/tfmon/InotifyWatcher.cpp ../../../win/src/tfmon/FanotifyWatcher.cpp \
+		../../../win/src/tfmon/EventCapture.cpp ../../../win/src/tfmon/ReplayWatcher.cpp ../../../win/src/tfmon/TaggedPathIndex.cpp \
+		../../../win/src/tfmon/ExclusionMatcher.cpp ../../../win/src/tfmon/FileFingerprint.cpp -lpthread
+
+	Usage:
+	tfwatch [-f] [-c capture_file] [-w window_ms] [-l ttl_s] [-m max_pending] [-t tagged_list] [-x excluded_path]... [-b recycle_bin]... [-e storm_threshold] path...
+	tfwatch -p -t tagged_list [-f] [-c capture_file] [-w window_ms] [-l ttl_s] [-m max_pending] [-x excluded_path]... [-b recycle_bin]... [-e storm_threshold]
+	tfwatch -r capture_file [-s] [-w window_ms] [-l ttl_s] [-m max_pending] [-t tagged_list] [-x excluded_path]... [-b recycle_bin]... [-e storm_threshold]
+	-f	watch whole filesystems with fanotify (requires CAP_SYS_ADMIN) instead of one inotify watch per directory
+	-c	append the raw events to given capture file
+	-r	replay a capture file (made by tfwatch or tfmon.exe) as fast as possible, then exit; roots are the recorded ones
+	-s	replay at the pace the events were recorded
+	-t	only print the moves and removals that involve one of the paths listed in given file (one per line, as output by 'tagger --files list'),
+		or a directory holding one of them; the list is kept up to date as printed events are applied to it
+		(identities of the listed files are captured as well, so that another file of the same name is not taken for a moved one)
+	-w	hold correlated events for given delay and print their net effect (i.e. A to B then B to C is printed as A to C)
+	-l	time-to-live (seconds, 0 for none) of the 'added' events kept as possible targets of a move from another volume
+	-m	maximum number of such events (0 for none)
+	-p	watch the directories holding the paths listed with -t (and the directories above them, without their subtree) instead of given paths
+	-x	drop the events on given directory, or matching given glob pattern (i.e. *.tmp, or node_modules for that name at any depth)
+	-e	number of events per second above which a subtree is quarantined (0 for none): its events are dropped until it has been quiet
+		for 5 seconds, then it is printed as OVERFLOW (along with a summary of the storm on the standard error)
+	-b	given directory is a recycle bin (i.e. ~/.local/share/Trash/files): removals toward it and restores from it are printed along with it
+		(without any, paths holding /Trash/ are taken as recycle bin items)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "../../../win/src/tfmon/FSChangeNotifier.h"
+#include "../../../win/src/tfmon/FanotifyWatcher.h"
+#include "../../../win/src/tfmon/ReplayWatcher.h"
+#include "../../../win/src/tfmon/TaggedPathIndex.h"
+
+
+// global counters (callbacks are never invoked concurrently)
+struct {
+	ULONGLONG	nAdded;
+	ULONGLONG	nMoved;
+	ULONGLONG	nRemoved;
+	ULONGLONG	nRestored;
+	ULONGLONG	nOverflows;
+	ULONGLONG	nIgnored;
+} Stats;
+
+// paths of interest (when a list was given)
+TaggedPathIndex* lpTagged = NULL;
+// maximum number of directories watched with their subtree (-p)
+#define TAGGED_COVER_MAX_ROOTS	64
+
+
+void printEvent(DWORD action, LPWSTR oldFileName, LPWSTR newFileName, LPVOID lpParam) {
+	const char* szAction = NULL;
+	switch(action) {
+	case FILE_ACTION_ADDED:		szAction = "ADDED";		++Stats.nAdded;		break;
+	case FILE_ACTION_MOVED:		szAction = "MOVED";		++Stats.nMoved;		break;
+	case FILE_ACTION_REMOVED:	szAction = "REMOVED";	++Stats.nRemoved;	break;
+	case FILE_ACTION_RESTORED:	szAction = "RESTORED";	++Stats.nRestored;	break;
+	case FILE_ACTION_OVERFLOW:	szAction = "OVERFLOW";	++Stats.nOverflows;	break;
+	case FILE_ACTION_STOPPED:
+		fprintf(stderr, "tfwatch: watcher thread stopped unexpectedly\n");
+		exit(1);
+	default:
+		return;
+	}
+	if(lpTagged && (action == FILE_ACTION_MOVED || action == FILE_ACTION_REMOVED)) {
+		if(!lpTagged->IsRelevant(oldFileName)) {
+			if(action == FILE_ACTION_MOVED) --Stats.nMoved;
+			else --Stats.nRemoved;
+			++Stats.nIgnored;
+			return;
+		}
+		if(action == FILE_ACTION_MOVED) lpTagged->Rename(oldFileName, newFileName);
+		else lpTagged->Remove(oldFileName);
+	}
+	if(action == FILE_ACTION_OVERFLOW) {
+		vector<EventStorm> vecStorms;
+		FSChangeNotifier::GetInstance()->TakeStorms(&vecStorms);
+		for(UINT i = 0; i < vecStorms.size(); ++i) {
+			fprintf(stderr, "tfwatch: event storm on %s: %u event(s) suspended over %llu ms (peak %u/s)\n", WCHARtoUTF8(vecStorms[i].path.c_str()).c_str(),
+				vecStorms[i].nSuspended, (unsigned long long) ((vecStorms[i].ullLast - vecStorms[i].ullStart) / 1000), vecStorms[i].nPeak * 1000 / FS_STORM_PERIOD);
+		}
+	}
+	printf("%s\t%s\t%s\n", szAction, oldFileName ? WCHARtoUTF8(oldFileName).c_str() : "", newFileName ? WCHARtoUTF8(newFileName).c_str() : "");
+	fflush(stdout);
+}
+
+void usage() {
+	fprintf(stderr, "usage: tfwatch [-f] [-c capture_file] [-w window_ms] [-l ttl_s] [-m max_pending] [-t tagged_list] [-x excluded_path]... [-b recycle_bin]... [-e storm_threshold] path...\n");
+	fprintf(stderr, "       tfwatch -p -t tagged_list [-f] [-c capture_file] [-w window_ms] [-l ttl_s] [-m max_pending] [-x excluded_path]... [-b recycle_bin]... [-e storm_threshold]\n");
+	fprintf(stderr, "       tfwatch -r capture_file [-s] [-w window_ms] [-l ttl_s] [-m max_pending] [-t tagged_list] [-x excluded_path]... [-b recycle_bin]... [-e storm_threshold]\n");
+	exit(2);
+}
+
+int main(int argc, char* argv[]) {
+	vector<wstring> vecPaths, vecExclusions, vecTagged, vecBins;
+	wstring capturePath, replayPath;
+	const char* taggedList = NULL;
+	BOOL bFanotify = FALSE, bRealTime = FALSE, bPlan = FALSE;
+	DWORD dwWindow = 0;
+	DWORD dwTTL = FS_PENDING_TTL;
+	UINT nMaxPending = FS_PENDING_MAX;
+	UINT nStormThreshold = FS_STORM_THRESHOLD;
+
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "-f") == 0) bFanotify = TRUE;
+		else if(strcmp(argv[i], "-s") == 0) bRealTime = TRUE;
+		else if(strcmp(argv[i], "-p") == 0) bPlan = TRUE;
+		else if(strcmp(argv[i], "-x") == 0) {
+			if(++i == argc) usage();
+			vecExclusions.push_back(UTF8toWCHAR(argv[i]));
+		}
+		else if(strcmp(argv[i], "-e") == 0) {
+			if(++i == argc) usage();
+			nStormThreshold = (UINT) atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-b") == 0) {
+			if(++i == argc) usage();
+			vecBins.push_back(UTF8toWCHAR(argv[i]));
+		}
+		else if(strcmp(argv[i], "-c") == 0) {
+			if(++i == argc) usage();
+			capturePath = UTF8toWCHAR(argv[i]);
+		}
+		else if(strcmp(argv[i], "-t") == 0) {
+			if(++i == argc) usage();
+			taggedList = argv[i];
+		}
+		else if(strcmp(argv[i], "-w") == 0) {
+			if(++i == argc) usage();
+			dwWindow = (DWORD) atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-l") == 0) {
+			if(++i == argc) usage();
+			dwTTL = (DWORD) atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-m") == 0) {
+			if(++i == argc) usage();
+			nMaxPending = (UINT) atoi(argv[i]);
+		}
+		else if(strcmp(argv[i], "-r") == 0) {
+			if(++i == argc) usage();
+			replayPath = UTF8toWCHAR(argv[i]);
+		}
+		else if(argv[i][0] == '-') usage();
+		else vecPaths.push_back(UTF8toWCHAR(argv[i]));
+	}
+	// with -p, watched paths are the directories holding the tagged paths
+	if(bPlan && (!taggedList || !replayPath.empty() || !vecPaths.empty())) usage();
+	if(!bPlan && (replayPath.empty() ? vecPaths.empty() : !vecPaths.empty())) usage();
+
+	if(taggedList) {
+		FILE* pFile = fopen(taggedList, "r");
+		if(!pFile) {
+			fprintf(stderr, "tfwatch: unable to read %s\n", taggedList);
+			return 1;
+		}
+		char line[4096];
+		while(fgets(line, sizeof(line), pFile)) {
+			SIZE_T len = strlen(line);
+			while(len && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+			if(len) vecTagged.push_back(UTF8toWCHAR(line));
+		}
+		fclose(pFile);
+		lpTagged = new TaggedPathIndex();
+		lpTagged->Build(vecTagged);
+		fprintf(stderr, "tfwatch: %u tagged path(s) indexed\n", lpTagged->GetCount());
+	}
+
+	// block termination signals before any thread is created: they are handled by main thread only
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	FSChangeNotifier* lpNotifier = FSChangeNotifier::GetInstance();
+
+	// initialize change watcher
+	ReplayWatcher* lpReplay = NULL;
+	WatcherBackend* lpBackend = NULL;
+	if(!replayPath.empty()) lpBackend = lpReplay = new ReplayWatcher(replayPath.c_str(), bRealTime);
+	else if(bFanotify) lpBackend = new FanotifyWatcher();
+	if(!lpNotifier->Init(lpBackend)) {
+		if(lpReplay) fprintf(stderr, "tfwatch: unable to read capture %s\n", WCHARtoUTF8(replayPath.c_str()).c_str());
+		else fprintf(stderr, "tfwatch: initialization error (%s)\n", strerror(lpNotifier->GetLastError()));
+		return 1;
+	}
+
+	// replayed roots are the recorded ones
+	vector<BOOL> vecSubTrees(vecPaths.size(), TRUE);
+	if(bPlan) {
+		vector<wstring> vecGuards;
+		TaggedPathIndex::GetCoveringDirs(vecTagged, TAGGED_COVER_MAX_ROOTS, &vecPaths);
+		TaggedPathIndex::GetAncestorDirs(vecPaths, &vecGuards);
+		vecSubTrees.assign(vecPaths.size(), TRUE);
+		// directories above the watched ones show when one of those is moved along with a parent
+		for(UINT i = 0; i < vecGuards.size(); ++i) {
+			vecPaths.push_back(vecGuards[i]);
+			vecSubTrees.push_back(FALSE);
+		}
+	}
+	if(lpReplay) {
+		for(UINT i = 0; i < lpReplay->GetRootCount(); ++i) {
+			vecPaths.push_back(lpReplay->GetRootPath(i));
+			vecSubTrees.push_back(lpReplay->GetRootSubTree(i));
+		}
+	}
+	if(!vecTagged.empty() && !lpReplay) {
+		fprintf(stderr, "tfwatch: %u tagged files tracked\n", lpNotifier->SetTrackedFiles(vecTagged));
+	}
+	if(!capturePath.empty() && !lpNotifier->StartCapture(capturePath.c_str())) {
+		fprintf(stderr, "tfwatch: unable to open capture %s\n", WCHARtoUTF8(capturePath.c_str()).c_str());
+		return 1;
+	}
+
+	// add paths to watch list
+	for(UINT i = 0; i < vecPaths.size(); ++i) {
+		if(lpNotifier->AddPath(vecPaths[i].c_str(), vecSubTrees[i]) != E_FILESYSMON_SUCCESS) {
+			fprintf(stderr, "tfwatch: unable to watch %s\n", WCHARtoUTF8(vecPaths[i].c_str()).c_str());
+			return 1;
+		}
+		fprintf(stderr, "tfwatch: watching %s%s\n", WCHARtoUTF8(vecPaths[i].c_str()).c_str(), vecSubTrees[i] ? "" : " (without subtree)");
+	}
+	for(UINT i = 0; i < vecExclusions.size(); ++i) {
+		lpNotifier->AddExclusion(vecExclusions[i].c_str());
+	}
+	lpNotifier->SetRecycleBins(vecBins);
+	lpNotifier->SetStormLimits(nStormThreshold * FS_STORM_PERIOD / 1000, FS_STORM_QUIET);
+
+	// bind output function with notifier
+	lpNotifier->bind(printEvent);
+	lpNotifier->SetCoalescingWindow(dwWindow);
+	lpNotifier->SetPendingLimits(dwTTL, nMaxPending);
+
+	// start watching thread
+	if(!lpNotifier->Start()) {
+		fprintf(stderr, "tfwatch: initialization error\n");
+		return 1;
+	}
+
+	ULONGLONG ullStart = GetTickCount64(), ullElapsed = 0;
+	if(lpReplay) {
+		// wait until all events are fed (or a termination signal is received), then for the pending removals
+		struct timespec ts = { 0, 10000000L };
+		while(lpReplay->GetFetchedCount() < lpReplay->GetEventCount() && sigtimedwait(&sigs, NULL, &ts) < 0);
+		ullElapsed = GetTickCount64() - ullStart;
+		if(lpReplay->GetFetchedCount() == lpReplay->GetEventCount()) Sleep(FS_REMOVAL_DELAY + dwWindow + 500);
+	}
+	else {
+		int sig;
+		sigwait(&sigs, &sig);
+	}
+
+	// interrupt and join watching threads
+	lpNotifier->Stop();
+	lpNotifier->StopCapture();
+
+	fprintf(stderr, "tfwatch: %llu added, %llu moved, %llu removed, %llu restored, %llu overflows\n",
+		(unsigned long long) Stats.nAdded, (unsigned long long) Stats.nMoved, (unsigned long long) Stats.nRemoved, (unsigned long long) Stats.nRestored, (unsigned long long) Stats.nOverflows);
+	for(UINT i = 0; i < lpNotifier->GetPathCount(); ++i) {
+		UINT nOverflows = lpNotifier->GetOverflowCount(i);
+		if(nOverflows) fprintf(stderr, "tfwatch: %u overflow(s) on %s\n", nOverflows, WCHARtoUTF8(lpNotifier->GetPath(i)).c_str());
+	}
+	if(lpTagged) {
+		fprintf(stderr, "tfwatch: %llu event(s) not involving tagged paths ignored, %u of %u lookups answered by the Bloom filter\n",
+			(unsigned long long) Stats.nIgnored, lpTagged->GetRejectCount(), lpTagged->GetQueryCount());
+	}
+	if(!vecTagged.empty() && !lpReplay) {
+		UINT nFingerprinted, nContentMoves;
+		lpNotifier->GetFingerprintStats(&nFingerprinted, &nContentMoves);
+		fprintf(stderr, "tfwatch: %u tagged file(s) fingerprinted, %u cross-volume move(s) recognized by content\n", nFingerprinted, nContentMoves);
+	}
+	if(dwWindow) {
+		fprintf(stderr, "tfwatch: %u correlated events notified as %u\n", lpNotifier->GetCorrelatedCount(), lpNotifier->GetNotifiedCount());
+	}
+	UINT nSubtrees, nFolded;
+	lpNotifier->GetSubtreeStats(&nSubtrees, &nFolded);
+	fprintf(stderr, "tfwatch: %u directory move(s) between volumes notified in place of %u moves of their content\n", nSubtrees, nFolded);
+	fprintf(stderr, "tfwatch: %u file(s) saved by replacement left unchanged\n", lpNotifier->GetSaveCount());
+	UINT nStorms, nSuspended;
+	lpNotifier->GetStormStats(&nStorms, &nSuspended);
+	fprintf(stderr, "tfwatch: %u event storm(s), %u event(s) suspended\n", nStorms, nSuspended);
+	UINT nPending, nExpired, nEvicted;
+	lpNotifier->GetPendingStats(&nPending, &nExpired, &nEvicted);
+	fprintf(stderr, "tfwatch: %u unmatched 'added' event(s) pending, %u expired, %u evicted\n", nPending, nExpired, nEvicted);
+	for(UINT i = 0; i < lpNotifier->GetVolumeCount(); ++i) {
+		CHAR drive;
+		UINT nSize, nCapacity, nHighWater, nStalls;
+		lpNotifier->GetRingStats(i, &drive, &nSize, &nCapacity, &nHighWater, &nStalls);
+		fprintf(stderr, "tfwatch: volume %d ring: %u/%u pending, high water %u, %u stall(s)\n", (int) drive, nSize, nCapacity, nHighWater, nStalls);
+	}
+	if(lpReplay) {
+		fprintf(stderr, "tfwatch: %u of %u events replayed in %llu ms\n", lpReplay->GetFetchedCount(), lpReplay->GetEventCount(), (unsigned long long) ullElapsed);
+	}
+
+	fflush(stdout);
+	return 0;
+}
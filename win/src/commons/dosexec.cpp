@@ -51,15 +51,17 @@ LPSTR WCHARtoCHAR(LPWSTR wstr, UINT codePage) {
  To free the memory, use a single call to LocalFree function.
 */
 LPWSTR DosExec(LPWSTR command){
-	// Allocate 1Mo to store the output (final buffer will be sized to actual output)
-    // If output exceeds that size, it will be truncated
-	const SIZE_T RESULT_SIZE = sizeof(char)*1024*1024;
-	char* output = (char*) LocalAlloc(LPTR, RESULT_SIZE);
+	// output is read as the command runs (a command producing more than the pipe can hold would otherwise never end)
+	// into a buffer grown as needed
+	SIZE_T size = 64*1024, count = 0;
+	char* output = (char*) LocalAlloc(LMEM_FIXED, size);
+	output[0] = '\0';
 
-	HANDLE readPipe, writePipe;
+	HANDLE readPipe = NULL, writePipe = NULL;
     SECURITY_ATTRIBUTES	security;
     STARTUPINFOA		start;
     PROCESS_INFORMATION	processInfo;
+	ZeroMemory(&processInfo, sizeof(PROCESS_INFORMATION));
     
     security.nLength = sizeof(SECURITY_ATTRIBUTES);
     security.bInheritHandle = true;
@@ -95,38 +97,32 @@ LPWSTR DosExec(LPWSTR command){
                            &processInfo             // pointer to PROCESS_INFORMATION
 	                     )){
 
-			// wait for the child process to start
-			for(UINT state = WAIT_TIMEOUT; state == WAIT_TIMEOUT; state = WaitForSingleObject(processInfo.hProcess, 100) );
-
-			DWORD bytesRead = 0, count = 0;
-			const int BUFF_SIZE = 1024;
-			char* buffer = (char*) malloc(sizeof(char)*BUFF_SIZE+1);
-			strcpy(output, "");
-			do {				
-				DWORD dwAvail = 0;
-				if (!PeekNamedPipe(readPipe, NULL, 0, NULL, &dwAvail, NULL)) {
-					// error, the child process might have ended
-					break;
+			// our copy of the write end is closed: reading ends (broken pipe) once the child process has exited
+			CloseHandle(writePipe);
+			writePipe = NULL;
+
+			const DWORD BUFF_SIZE = 4096;
+			DWORD bytesRead = 0;
+			for(;;) {
+				if(count + BUFF_SIZE + 1 > size) {
+					char* grown = (char*) LocalReAlloc(output, size * 2, LMEM_MOVEABLE);
+					if(!grown) break;
+					output = grown;
+					size *= 2;
 				}
-				if (!dwAvail) {
-					// no data available in the pipe
-					break;
-				}
-				ReadFile(readPipe, buffer, BUFF_SIZE, &bytesRead, NULL);
-				buffer[bytesRead] = '\0';
-				if((count+bytesRead) > RESULT_SIZE) break;
-				strcat(output, buffer);
+				if(!ReadFile(readPipe, output + count, BUFF_SIZE, &bytesRead, NULL) || !bytesRead) break;
 				count += bytesRead;
-			} while (bytesRead >= BUFF_SIZE);
-			free(buffer);
+			}
+			output[count] = '\0';
+			WaitForSingleObject(processInfo.hProcess, INFINITE);
         }
 
     }
 
-	CloseHandle(processInfo.hThread);
-    CloseHandle(processInfo.hProcess);
-    CloseHandle(writePipe);
-	CloseHandle(readPipe);
+	if(processInfo.hThread) CloseHandle(processInfo.hThread);
+    if(processInfo.hProcess) CloseHandle(processInfo.hProcess);
+    if(writePipe) CloseHandle(writePipe);
+	if(readPipe) CloseHandle(readPipe);
 
 	// convert result buffer to a wide-character string
 	LPWSTR result = OEMtoUNICODE(output);
@@ -0,0 +1,231 @@
+/* ConsistencyScanner.cpp - background check of the tagged files against the filesystem
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "ConsistencyScanner.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include <cwchar>
+#include <wctype.h>
+
+
+BOOL ConsistencyScanner::IsVolumePresent(LPCWSTR path, ULONGLONG device) {
+#ifdef _WIN32
+	WCHAR root[MAX_PATH];
+	if (!GetVolumePathNameW(path, root, MAX_PATH)) return FALSE;
+	UINT uiType = GetDriveTypeW(root);
+	if (uiType == DRIVE_UNKNOWN || uiType == DRIVE_NO_ROOT_DIR) return FALSE;
+	// removable drive without medium, or network drive that cannot be reached
+	if (GetFileAttributesW(root) == INVALID_FILE_ATTRIBUTES) return FALSE;
+	// another volume took the drive letter of the one that held the file
+	DWORD dwSerial = 0;
+	if (device && GetVolumeInformationW(root, NULL, 0, &dwSerial, NULL, NULL, NULL, 0)) return (dwSerial == (DWORD) device);
+	return TRUE;
+#else
+	// the root of a mounted filesystem cannot be removed: if the nearest existing directory above the file lies on another filesystem
+	// than the one that held it, that filesystem is no longer mounted
+	std::string filePath = WCHARtoUTF8(path);
+	struct stat st;
+	for (SIZE_T pos = filePath.rfind('/'); pos != std::string::npos; pos = (pos > 0) ? filePath.rfind('/', pos - 1) : std::string::npos) {
+		std::string dirPath = (pos > 0) ? filePath.substr(0, pos) : std::string("/");
+		if (stat(dirPath.c_str(), &st) == 0) {
+			if (device) return ((ULONGLONG) st.st_dev == device);
+			// filesystem is unknown (file was never seen): only a file whose directory is still there counts
+			return (pos == filePath.rfind('/'));
+		}
+		if (errno != ENOENT && errno != ENOTDIR) return FALSE;
+	}
+	return FALSE;
+#endif
+}
+
+BOOL ConsistencyScanner::IsMissing(LPCWSTR path, ULONGLONG device) {
+	FileIdentity identity;
+	return (StatPool::CheckPath(path, &identity) == STAT_STATE_NOT_FOUND && ConsistencyScanner::IsVolumePresent(path, device));
+}
+
+
+ConsistencyScanner::ConsistencyScanner(SCANLISTPROC lpfnList, SCANSTALEPROC lpfnStale, StatPool* lpPool, SCANIDLEPROC lpfnIdle, LPVOID lpParam) {
+	this->lpfnList = lpfnList;
+	this->lpfnStale = lpfnStale;
+	this->lpfnIdle = lpfnIdle;
+	this->lpParam = lpParam;
+	this->lpPool = lpPool;
+	this->nRate = SCAN_RATE;
+	this->dwIdle = SCAN_IDLE;
+	this->dwPeriod = SCAN_PERIOD;
+	this->nMaxDeletions = SCAN_MAX_DELETIONS;
+	this->hThread = NULL;
+	this->bStop = FALSE;
+	this->dwDelay = SCAN_START_DELAY;
+	this->nSweeps = 0;
+	this->nChecked = 0;
+	this->nMissing = 0;
+	this->nReplaced = 0;
+	this->nExcess = 0;
+	this->nSweepDeletions = 0;
+	InitializeCriticalSection(&this->csStop);
+	InitializeConditionVariable(&this->cvStop);
+}
+
+ConsistencyScanner::~ConsistencyScanner() {
+	this->Stop();
+	DeleteCriticalSection(&this->csStop);
+}
+
+wstring ConsistencyScanner::Key(LPCWSTR path) {
+	wstring result = path;
+#ifdef _WIN32
+	for (SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+	return result;
+}
+
+void ConsistencyScanner::SetLimits(UINT nRate, DWORD dwIdle, DWORD dwPeriod, UINT nMaxDeletions) {
+	this->nRate = nRate;
+	this->dwIdle = dwIdle;
+	this->dwPeriod = dwPeriod;
+	this->nMaxDeletions = nMaxDeletions;
+}
+
+BOOL ConsistencyScanner::Start(DWORD dwDelay) {
+	if (this->hThread) return TRUE;
+	this->bStop = FALSE;
+	this->dwDelay = dwDelay;
+	this->hThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) ConsistencyScanner::ThreadScan, (LPVOID) this, 0, NULL);
+	return (this->hThread != NULL);
+}
+
+void ConsistencyScanner::Stop() {
+	if (!this->hThread) return;
+	EnterCriticalSection(&this->csStop);
+	this->bStop = TRUE;
+	WakeConditionVariable(&this->cvStop);
+	LeaveCriticalSection(&this->csStop);
+
+	WaitForSingleObject(this->hThread, INFINITE);
+	CloseHandle(this->hThread);
+	this->hThread = NULL;
+	this->queSuspects.clear();
+}
+
+/*
+Wait until given tick (GetTickCount64). Returns FALSE if the scanner is being stopped.
+*/
+BOOL ConsistencyScanner::WaitUntil(ULONGLONG ullDue) {
+	EnterCriticalSection(&this->csStop);
+	for (ULONGLONG ullNow = GetTickCount64(); !this->bStop && ullNow < ullDue; ullNow = GetTickCount64()) {
+		SleepConditionVariableCS(&this->cvStop, &this->csStop, (DWORD) (ullDue - ullNow));
+	}
+	BOOL result = !this->bStop;
+	LeaveCriticalSection(&this->csStop);
+	return result;
+}
+
+/*
+Wait until the user has been inactive for the idle delay. Returns FALSE if the scanner is being stopped.
+*/
+BOOL ConsistencyScanner::WaitIdle() {
+	if (!this->lpfnIdle || !this->dwIdle) return this->WaitUntil(0);
+	for (DWORD dwIdle = this->lpfnIdle(this->lpParam); dwIdle < this->dwIdle; dwIdle = this->lpfnIdle(this->lpParam)) {
+		if (!this->WaitUntil(GetTickCount64() + this->dwIdle - dwIdle)) return FALSE;
+	}
+	return this->WaitUntil(0);
+}
+
+/*
+Check again the missing files that are due (or all of them, waiting for them to be due, if bAll is set): the ones still missing are appended
+to the batch, for deletion up to the cap of the sweep, and as excess beyond it.
+*/
+void ConsistencyScanner::Confirm(BOOL bAll, ScanBatch* lpBatch) {
+	ULONGLONG ullNow = GetTickCount64();
+	while (!this->queSuspects.empty()) {
+		// suspects are queued in the order they are due
+		Suspect& suspect = this->queSuspects.front();
+		if (suspect.ullDue > ullNow) {
+			if (!bAll) break;
+			if (!this->WaitUntil(suspect.ullDue)) break;
+		}
+		if (ConsistencyScanner::IsMissing(suspect.path.c_str(), suspect.device)) {
+			if (this->nSweepDeletions < this->nMaxDeletions) {
+				lpBatch->vecMissing.push_back(suspect.path);
+				++this->nSweepDeletions;
+			}
+			else lpBatch->vecExcess.push_back(suspect.path);
+		}
+		this->queSuspects.pop_front();
+	}
+}
+
+/*
+Returns FALSE if the list of tagged files could not be obtained, or if the sweep was interrupted.
+*/
+BOOL ConsistencyScanner::Sweep() {
+	vector<wstring> vecPaths;
+	if (!this->lpfnList(&vecPaths, this->lpParam)) return FALSE;
+
+	unordered_map<wstring, FileIdentity> mapSeen;
+	ScanBatch batch;
+	this->nSweepDeletions = 0;
+	for (UINT nFirst = 0, uiCount = vecPaths.size(); nFirst < uiCount; nFirst += SCAN_CHUNK_SIZE) {
+		if (!this->WaitIdle()) return FALSE;
+		ULONGLONG ullStart = GetTickCount64();
+		UINT nCount = (uiCount - nFirst < SCAN_CHUNK_SIZE) ? uiCount - nFirst : SCAN_CHUNK_SIZE;
+		vector<BYTE> vecStates(nCount, STAT_STATE_UNKNOWN);
+		vector<FileIdentity> vecIds(nCount);
+		this->lpPool->Check(vecPaths, nFirst, nCount, &vecStates, &vecIds);
+
+		for (UINT i = 0; i < nCount; ++i) {
+			const wstring& path = vecPaths[nFirst + i];
+			wstring key = ConsistencyScanner::Key(path.c_str());
+			unordered_map<wstring, FileIdentity>::iterator it = this->mapIds.find(key);
+			if (vecStates[i] != STAT_STATE_PRESENT || !vecIds[i].fileId) {
+				// previous identity is kept (the filesystem that held a file tells whether its volume is still there)
+				if (it != this->mapIds.end()) mapSeen[key] = it->second;
+				if (vecStates[i] == STAT_STATE_NOT_FOUND) this->queSuspects.push_back(Suspect(path, (it != this->mapIds.end()) ? it->second.device : 0, ullStart + SCAN_CONFIRM_DELAY));
+				continue;
+			}
+			if (it != this->mapIds.end() && it->second.fileId != vecIds[i].fileId) batch.vecReplaced.push_back(path);
+			mapSeen[key] = vecIds[i];
+		}
+		this->Confirm(FALSE, &batch);
+		this->nChecked += nCount;
+
+		if (!batch.IsEmpty()) {
+			this->nMissing += batch.vecMissing.size();
+			this->nExcess += batch.vecExcess.size();
+			this->nReplaced += batch.vecReplaced.size();
+			this->lpfnStale(&batch, this->lpParam);
+			batch.Clear();
+		}
+		if (this->nRate && !this->WaitUntil(ullStart + (ULONGLONG) nCount * 1000 / this->nRate)) return FALSE;
+	}
+
+	this->Confirm(TRUE, &batch);
+	if (!this->WaitUntil(0)) return FALSE;
+	if (!batch.IsEmpty()) {
+		this->nMissing += batch.vecMissing.size();
+		this->nExcess += batch.vecExcess.size();
+		this->lpfnStale(&batch, this->lpParam);
+	}
+	this->mapIds.swap(mapSeen);
+	++this->nSweeps;
+	return TRUE;
+}
+
+DWORD WINAPI ConsistencyScanner::ThreadScan(LPVOID lpvd) {
+	ConsistencyScanner* lpScanner = (ConsistencyScanner*) lpvd;
+
+	// a sweep that could not list the tagged files is retried after the period as well
+	for (DWORD dwDelay = lpScanner->dwDelay; lpScanner->WaitUntil(GetTickCount64() + dwDelay); dwDelay = lpScanner->dwPeriod) {
+		lpScanner->Sweep();
+	}
+	return 0;
+}
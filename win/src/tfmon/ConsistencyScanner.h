@@ -0,0 +1,174 @@
+/* ConsistencyScanner.h - background check of the tagged files against the filesystem
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+#include "StatPool.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+using std::wstring;
+using std::vector;
+using std::deque;
+using std::unordered_map;
+
+// delay (ms) before the first sweep (files changed while tfmon was not running are caught by it)
+#define SCAN_START_DELAY		60000
+// default delay (ms) between the end of a sweep and the start of the next one
+#define SCAN_PERIOD				3600000
+// default number of files checked per second
+#define SCAN_RATE				200
+// default time (ms) without user input before the scan goes on
+#define SCAN_IDLE				30000
+// number of files checked at once (a chunk)
+#define SCAN_CHUNK_SIZE			256
+// delay (ms) after which a missing file is checked again before being reported (its move or removal might not be notified yet)
+#define SCAN_CONFIRM_DELAY		10000
+// default maximum number of missing files a sweep hands over for deletion (beyond it, they are only reported)
+#define SCAN_MAX_DELETIONS		500
+
+
+// results of a chunk
+class ScanBatch {
+public:
+	// tagged paths that no longer exist on disk (their volume being present), to be deleted from the database
+	vector<wstring>		vecMissing;
+	// tagged paths whose file was replaced by another one since the previous sweep
+	vector<wstring>		vecReplaced;
+	// missing tagged paths beyond the deletion cap of the sweep: to be reported, not applied
+	vector<wstring>		vecExcess;
+
+	BOOL IsEmpty() { return this->vecMissing.empty() && this->vecReplaced.empty() && this->vecExcess.empty(); }
+	void Clear() {
+		this->vecMissing.clear();
+		this->vecReplaced.clear();
+		this->vecExcess.clear();
+	}
+};
+
+/*
+Retrieve the tagged paths (returns FALSE if the list could not be obtained).
+*/
+typedef BOOL (*SCANLISTPROC)(vector<wstring>* vecPaths, LPVOID lpParam);
+/*
+Receive a batch of results.
+*/
+typedef void (*SCANSTALEPROC)(ScanBatch* lpBatch, LPVOID lpParam);
+/*
+Time (ms) since the last input of the user.
+*/
+typedef DWORD (*SCANIDLEPROC)(LPVOID lpParam);
+
+
+/*
+Whatever is missed by the watchers (events lost, files changed while tfmon was not running, updates of the database that failed)
+is caught by periodic sweeps over the tagged files, run by a background thread: the list of tagged files is retrieved once per sweep,
+then walked by chunks of SCAN_CHUNK_SIZE files, whose existence and identity are checked by the workers of a stat pool (shared with the reconciler).
+Chunks are spaced so that no more than the rate limit of files are checked per second, and the sweep waits while the user is active
+(until no input was received for the idle delay). A sweep never blocks anything else: events keep being handled while it runs.
+A file is only missing if its volume is present: files of an unplugged drive or of an unmounted filesystem are left alone (see IsMissing).
+A missing file is checked again SCAN_CONFIRM_DELAY later, and only reported if it is still missing; beyond the deletion cap of a sweep,
+missing files are reported apart, so that a sweep never hands over more deletions than the cap.
+A file whose identity differs from the one seen by the previous sweep was replaced (i.e. saved by replacement, or deleted then created again):
+it is only reported. Results are handed over by batches (at most one per chunk). All callbacks are invoked from the scanning thread.
+*/
+class ConsistencyScanner {
+private:
+	// missing file, to be checked again
+	class Suspect {
+	public:
+		wstring		path;
+		ULONGLONG	device;
+		ULONGLONG	ullDue;
+
+		Suspect(const wstring& path, ULONGLONG device, ULONGLONG ullDue) {
+			this->path = path;
+			this->device = device;
+			this->ullDue = ullDue;
+		}
+	};
+
+	SCANLISTPROC			lpfnList;
+	SCANSTALEPROC			lpfnStale;
+	SCANIDLEPROC			lpfnIdle;
+	LPVOID					lpParam;
+	StatPool*				lpPool;
+	UINT					nRate;
+	DWORD					dwIdle;
+	DWORD					dwPeriod;
+	UINT					nMaxDeletions;
+
+	CRITICAL_SECTION		csStop;
+	CONDITION_VARIABLE		cvStop;
+	HANDLE					hThread;
+	BOOL					bStop;
+	DWORD					dwDelay;
+
+	// owned by the scanning thread: identities seen by the previous sweep, by path (case folded on Windows)
+	unordered_map<wstring, FileIdentity>	mapIds;
+	deque<Suspect>			queSuspects;
+	// missing files handed over for deletion by the current sweep
+	UINT					nSweepDeletions;
+
+	UINT					nSweeps;
+	UINT					nChecked;
+	UINT					nMissing;
+	UINT					nReplaced;
+	UINT					nExcess;
+
+	static wstring			Key(LPCWSTR path);
+	BOOL					WaitUntil(ULONGLONG ullDue);
+	BOOL					WaitIdle();
+	void					Confirm(BOOL bAll, ScanBatch* lpBatch);
+	BOOL					Sweep();
+	static DWORD WINAPI		ThreadScan(LPVOID lpvd);
+
+public:
+	/*
+	Files are checked by the workers of given pool (which is to outlive the scanner).
+	*/
+	ConsistencyScanner(SCANLISTPROC lpfnList, SCANSTALEPROC lpfnStale, StatPool* lpPool, SCANIDLEPROC lpfnIdle = NULL, LPVOID lpParam = NULL);
+	~ConsistencyScanner();
+
+	/*
+	Number of files checked per second (0 for no limit), time (ms) without user input before the scan goes on (0 to ignore the user),
+	delay (ms) between two sweeps, and number of missing files a sweep hands over for deletion. To be called before Start.
+	*/
+	void SetLimits(UINT nRate, DWORD dwIdle, DWORD dwPeriod, UINT nMaxDeletions = SCAN_MAX_DELETIONS);
+
+	/*
+	Given file does not exist while its volume is present (on Windows: the drive holding it is, and its root can be read;
+	otherwise: the nearest existing directory above it lies on the filesystem that held the file, given as device, or if unknown,
+	is the directory of the file). A volume that is absent makes its files unknown rather than missing.
+	*/
+	static BOOL IsMissing(LPCWSTR path, ULONGLONG device = 0);
+	/*
+	An unplugged drive, an unmapped network drive or an unmounted filesystem answers 'path not found' for all of its files:
+	given file, found missing, is only missing if this holds (see IsMissing).
+	*/
+	static BOOL IsVolumePresent(LPCWSTR path, ULONGLONG device = 0);
+
+	/*
+	The first sweep starts after given delay (ms).
+	*/
+	BOOL Start(DWORD dwDelay = SCAN_START_DELAY);
+	/*
+	A sweep in progress is interrupted (between two chunks); files waiting for confirmation are dropped.
+	*/
+	void Stop();
+
+	// number of sweeps completed, of files checked, of missing files reported (for deletion, and beyond the cap), and of replaced files reported
+	UINT GetSweepCount()	{ return this->nSweeps; }
+	UINT GetCheckedCount()	{ return this->nChecked; }
+	UINT GetMissingCount()	{ return this->nMissing; }
+	UINT GetExcessCount()	{ return this->nExcess; }
+	UINT GetReplacedCount()	{ return this->nReplaced; }
+};
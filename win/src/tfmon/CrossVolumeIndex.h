@@ -0,0 +1,290 @@
+/* CrossVolumeIndex.h - events that might be one half of a move between two volumes
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "FileActionInfo.h"
+
+#include <string>
+#include <map>
+#include <vector>
+
+using std::wstring;
+using std::multimap;
+using std::vector;
+
+// default time (seconds) an unmatched 'added' event is kept as the possible target of a move from another volume
+#define FS_PENDING_TTL			3600
+// default maximum number of unmatched 'added' events kept (the oldest ones are evicted beyond that)
+#define FS_PENDING_MAX			65536
+// expiry wheel: number of slots, and time (ms) covered by a slot
+#define FS_PENDING_WHEEL_SLOTS	512
+#define FS_PENDING_WHEEL_TICK	1000
+
+
+class CrossVolumeEntry {
+public:
+	wstring	filePath;
+	DWORD	action;
+	CHAR	drive;
+	// time (microseconds) at which the event was seen
+	ULONGLONG	ticks;
+	// position in the index (for removal in constant time)
+	multimap<wstring, CrossVolumeEntry*>::iterator	itIndex;
+	// 'added' entries only: tick at which the entry expires, links in its slot of the expiry wheel, and links in the order of publication
+	ULONGLONG			nExpiry;
+	CrossVolumeEntry*	lpSlotPrev;
+	CrossVolumeEntry*	lpSlotNext;
+	CrossVolumeEntry*	lpOlder;
+	CrossVolumeEntry*	lpNewer;
+
+	CrossVolumeEntry(LPCWSTR filePath, DWORD action, CHAR drive, ULONGLONG ticks) {
+		this->filePath = filePath;
+		this->action = action;
+		this->drive = drive;
+		this->ticks = ticks;
+		this->nExpiry = 0;
+		this->lpSlotPrev = this->lpSlotNext = NULL;
+		this->lpOlder = this->lpNewer = NULL;
+	}
+};
+
+/*
+A move between two volumes is seen as an 'added' event on the target volume and a 'removed' event on the source one.
+As each volume is handled by its own thread, both events may be correlated in any order.
+Volumes publish their unmatched 'added' events and their pending 'removed' events here, and look up the other half by filename.
+This is the only state shared between volumes: entries are copies, items remain owned by their volume.
+
+'Removed' entries are withdrawn by their volume once their delay is over. 'Added' entries are only taken when a matching removal shows up,
+which for most files never happens: they expire after a time-to-live, and the oldest ones are evicted when there are too many of them.
+Expiry relies on a hashed timer wheel: each slot chains the entries expiring during one tick (entries expiring after a full turn of the wheel
+wait for a later pass), and the slots elapsed since the last call are swept by each publication or lookup.
+Publishing, taking, withdrawing and expiring an entry take constant time (apart from the lookup by filename).
+*/
+class CrossVolumeIndex {
+private:
+	CRITICAL_SECTION criticalSection;
+	multimap<wstring, CrossVolumeEntry*> mapEntries;
+
+	// expiry wheel ('added' entries only)
+	CrossVolumeEntry*	vecSlots[FS_PENDING_WHEEL_SLOTS];
+	// last swept tick
+	ULONGLONG			nTick;
+	// publication order ('added' entries only), from the oldest one
+	CrossVolumeEntry*	lpOldest;
+	CrossVolumeEntry*	lpNewest;
+	UINT				nPending;
+
+	// time-to-live (in ticks, 0 for none) and maximum number of 'added' entries (0 for none)
+	ULONGLONG			nTTL;
+	UINT				nMaxPending;
+
+	UINT				nExpired;
+	UINT				nEvicted;
+
+	static ULONGLONG GetTick() {
+		return FileActionInfo::GetCurrentTicks() / (FS_PENDING_WHEEL_TICK * 1000);
+	}
+
+	void Link(CrossVolumeEntry* lpEntry) {
+		CrossVolumeEntry** lpSlot = &this->vecSlots[lpEntry->nExpiry % FS_PENDING_WHEEL_SLOTS];
+		lpEntry->lpSlotNext = *lpSlot;
+		if(*lpSlot) (*lpSlot)->lpSlotPrev = lpEntry;
+		*lpSlot = lpEntry;
+
+		lpEntry->lpOlder = this->lpNewest;
+		if(this->lpNewest) this->lpNewest->lpNewer = lpEntry;
+		else this->lpOldest = lpEntry;
+		this->lpNewest = lpEntry;
+		++this->nPending;
+	}
+
+	void Unlink(CrossVolumeEntry* lpEntry) {
+		if(lpEntry->lpSlotPrev) lpEntry->lpSlotPrev->lpSlotNext = lpEntry->lpSlotNext;
+		else this->vecSlots[lpEntry->nExpiry % FS_PENDING_WHEEL_SLOTS] = lpEntry->lpSlotNext;
+		if(lpEntry->lpSlotNext) lpEntry->lpSlotNext->lpSlotPrev = lpEntry->lpSlotPrev;
+
+		if(lpEntry->lpOlder) lpEntry->lpOlder->lpNewer = lpEntry->lpNewer;
+		else this->lpOldest = lpEntry->lpNewer;
+		if(lpEntry->lpNewer) lpEntry->lpNewer->lpOlder = lpEntry->lpOlder;
+		else this->lpNewest = lpEntry->lpOlder;
+		--this->nPending;
+	}
+
+	void Erase(CrossVolumeEntry* lpEntry) {
+		if(lpEntry->action == FILE_ACTION_ADDED) this->Unlink(lpEntry);
+		this->mapEntries.erase(lpEntry->itIndex);
+		delete lpEntry;
+	}
+
+	/*
+	Expire the 'added' entries whose time-to-live is over (slots are swept up to the current tick).
+	*/
+	void Sweep() {
+		ULONGLONG nNow = CrossVolumeIndex::GetTick();
+		// no need to sweep a slot twice
+		if(nNow - this->nTick > FS_PENDING_WHEEL_SLOTS) this->nTick = nNow - FS_PENDING_WHEEL_SLOTS;
+		while(this->nTick < nNow) {
+			++this->nTick;
+			CrossVolumeEntry* lpEntry = this->vecSlots[this->nTick % FS_PENDING_WHEEL_SLOTS];
+			while(lpEntry) {
+				CrossVolumeEntry* lpNext = lpEntry->lpSlotNext;
+				if(lpEntry->nExpiry <= this->nTick) {
+					this->Erase(lpEntry);
+					++this->nExpired;
+				}
+				lpEntry = lpNext;
+			}
+		}
+	}
+
+public:
+	CrossVolumeIndex() {
+		InitializeCriticalSection(&this->criticalSection);
+		for(UINT i = 0; i < FS_PENDING_WHEEL_SLOTS; ++i) this->vecSlots[i] = NULL;
+		this->nTick = CrossVolumeIndex::GetTick();
+		this->lpOldest = this->lpNewest = NULL;
+		this->nPending = 0;
+		this->nExpired = this->nEvicted = 0;
+		this->SetLimits(FS_PENDING_TTL, FS_PENDING_MAX);
+	}
+
+	~CrossVolumeIndex() {
+		for(multimap<wstring, CrossVolumeEntry*>::iterator it = this->mapEntries.begin(); it != this->mapEntries.end(); ++it) {
+			delete it->second;
+		}
+		DeleteCriticalSection(&this->criticalSection);
+	}
+
+	/*
+	Time-to-live (seconds) and maximum number of the unmatched 'added' events (0 for no limit). Applies to entries published afterward.
+	*/
+	void SetLimits(DWORD dwTTL, UINT nMaxPending) {
+		EnterCriticalSection(&this->criticalSection);
+		this->nTTL = ((ULONGLONG) dwTTL * 1000 + FS_PENDING_WHEEL_TICK - 1) / FS_PENDING_WHEEL_TICK;
+		this->nMaxPending = nMaxPending;
+		LeaveCriticalSection(&this->criticalSection);
+	}
+
+	void Publish(FileActionInfo* lpAction, CHAR drive) {
+		if(!lpAction->GetFileName()) return;
+		EnterCriticalSection(&this->criticalSection);
+		this->Sweep();
+		CrossVolumeEntry* lpEntry = new CrossVolumeEntry(lpAction->GetFilePath(), lpAction->GetAction(), drive, lpAction->GetTicks());
+		lpEntry->itIndex = this->mapEntries.insert(std::make_pair(wstring(lpAction->GetFileName()), lpEntry));
+		if(lpEntry->action == FILE_ACTION_ADDED) {
+			// without time-to-live, entries are kept until a full turn of the wheel brings them back, and so on
+			lpEntry->nExpiry = this->nTick + (this->nTTL ? this->nTTL : (ULONGLONG) -1 / 2);
+			this->Link(lpEntry);
+			while(this->nMaxPending && this->nPending > this->nMaxPending) {
+				this->Erase(this->lpOldest);
+				++this->nEvicted;
+			}
+		}
+		LeaveCriticalSection(&this->criticalSection);
+	}
+
+	/*
+	Remove the entry having given filename and action, published by a volume other than given drive, whose event is the closest in time to given ticks
+	(when the same filename is involved in several moves at once, halves seen together belong together).
+	Returns FALSE if there is none.
+	*/
+	BOOL Take(LPCWSTR fileName, DWORD action, CHAR drive, ULONGLONG ticks, wstring* filePath) {
+		CrossVolumeEntry* lpBest = NULL;
+		ULONGLONG ullBest = 0;
+		if(!fileName) return FALSE;
+		EnterCriticalSection(&this->criticalSection);
+		this->Sweep();
+		std::pair<multimap<wstring, CrossVolumeEntry*>::iterator, multimap<wstring, CrossVolumeEntry*>::iterator> range = this->mapEntries.equal_range(fileName);
+		for(multimap<wstring, CrossVolumeEntry*>::iterator it = range.first; it != range.second; ++it) {
+			if(it->second->action == action && it->second->drive != drive) {
+				ULONGLONG ullDistance = (it->second->ticks > ticks) ? it->second->ticks - ticks : ticks - it->second->ticks;
+				if(!lpBest || ullDistance < ullBest) {
+					lpBest = it->second;
+					ullBest = ullDistance;
+				}
+			}
+		}
+		if(lpBest) {
+			*filePath = lpBest->filePath;
+			this->Erase(lpBest);
+		}
+		LeaveCriticalSection(&this->criticalSection);
+		return lpBest != NULL;
+	}
+
+	/*
+	Remove the entry published for given item.
+	Returns FALSE if it is no longer there (i.e. it was taken by another volume, or it expired).
+	*/
+	BOOL Withdraw(FileActionInfo* lpAction, CHAR drive) {
+		BOOL result = FALSE;
+		if(!lpAction->GetFileName()) return result;
+		EnterCriticalSection(&this->criticalSection);
+		std::pair<multimap<wstring, CrossVolumeEntry*>::iterator, multimap<wstring, CrossVolumeEntry*>::iterator> range = this->mapEntries.equal_range(lpAction->GetFileName());
+		for(multimap<wstring, CrossVolumeEntry*>::iterator it = range.first; it != range.second; ++it) {
+			if(it->second->action == lpAction->GetAction() && it->second->drive == drive && it->second->filePath == lpAction->GetFilePath()) {
+				this->Erase(it->second);
+				result = TRUE;
+				break;
+			}
+		}
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	/*
+	Paths of the 'added' entries published by volumes other than given drive, whose event was seen at or after given ticks (at most nMax of them, latest first).
+	*/
+	void GetRecent(CHAR drive, ULONGLONG ullSince, UINT nMax, vector<wstring>* vecPaths) {
+		EnterCriticalSection(&this->criticalSection);
+		this->Sweep();
+		for(CrossVolumeEntry* lpEntry = this->lpNewest; lpEntry && vecPaths->size() < nMax && lpEntry->ticks >= ullSince; lpEntry = lpEntry->lpOlder) {
+			if(lpEntry->drive != drive) vecPaths->push_back(lpEntry->filePath);
+		}
+		LeaveCriticalSection(&this->criticalSection);
+	}
+
+	/*
+	Remove the entry having given path and action. Returns FALSE if it is no longer there.
+	*/
+	BOOL Claim(const wstring& filePath, DWORD action) {
+		BOOL result = FALSE;
+		SIZE_T pos = filePath.rfind(FS_PATH_SEPARATOR);
+		if(pos == wstring::npos) return result;
+		EnterCriticalSection(&this->criticalSection);
+		std::pair<multimap<wstring, CrossVolumeEntry*>::iterator, multimap<wstring, CrossVolumeEntry*>::iterator> range = this->mapEntries.equal_range(filePath.substr(pos + 1));
+		for(multimap<wstring, CrossVolumeEntry*>::iterator it = range.first; it != range.second; ++it) {
+			if(it->second->action == action && it->second->filePath == filePath) {
+				this->Erase(it->second);
+				result = TRUE;
+				break;
+			}
+		}
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	UINT Size() {
+		EnterCriticalSection(&this->criticalSection);
+		UINT result = this->mapEntries.size();
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	/*
+	Number of unmatched 'added' events currently kept, and number of them dropped so far because their time-to-live was over or because there were too many.
+	*/
+	void GetPendingStats(UINT* lpnPending, UINT* lpnExpired, UINT* lpnEvicted) {
+		EnterCriticalSection(&this->criticalSection);
+		this->Sweep();
+		*lpnPending = this->nPending;
+		*lpnExpired = this->nExpired;
+		*lpnEvicted = this->nEvicted;
+		LeaveCriticalSection(&this->criticalSection);
+	}
+};
@@ -0,0 +1,278 @@
+/* EventCapture.cpp - binary recording of the raw events delivered by the watcher backends
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "EventCapture.h"
+
+#include <map>
+using std::map;
+
+
+// paths are stored as UTF-8, whatever the platform they were captured on
+static string ToUTF8(LPCWSTR str) {
+#ifdef _WIN32
+	int len = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+	if(len <= 1) return string();
+	string result(len - 1, '\0');
+	WideCharToMultiByte(CP_UTF8, 0, str, -1, &result[0], len, NULL, NULL);
+	return result;
+#else
+	return WCHARtoUTF8(str);
+#endif
+}
+
+static wstring FromUTF8(const char* str, SIZE_T len) {
+#ifdef _WIN32
+	if(!len) return wstring();
+	int wlen = MultiByteToWideChar(CP_UTF8, 0, str, (int) len, NULL, 0);
+	wstring result(wlen, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, str, (int) len, &result[0], wlen);
+	return result;
+#else
+	return UTF8toWCHAR(str, len);
+#endif
+}
+
+static FILE* OpenFile(LPCWSTR path, LPCWSTR mode) {
+#ifdef _WIN32
+	return _wfopen(path, mode);
+#else
+	return fopen(WCHARtoUTF8(path).c_str(), WCHARtoUTF8(mode).c_str());
+#endif
+}
+
+static void PutVarint(string* buff, ULONGLONG value) {
+	do {
+		BYTE b = (BYTE) (value & 0x7F);
+		value >>= 7;
+		if(value) b |= 0x80;
+		*buff += (char) b;
+	} while(value);
+}
+
+static BOOL GetVarint(const string& buff, SIZE_T* pos, ULONGLONG* value) {
+	*value = 0;
+	for(UINT shift = 0; *pos < buff.size() && shift < 64; shift += 7) {
+		BYTE b = (BYTE) buff[(*pos)++];
+		*value |= (ULONGLONG) (b & 0x7F) << shift;
+		if(!(b & 0x80)) return TRUE;
+	}
+	return FALSE;
+}
+
+static void PutString(string* buff, const string& str) {
+	PutVarint(buff, str.size());
+	*buff += str;
+}
+
+static BOOL GetString(const string& buff, SIZE_T* pos, string* str) {
+	ULONGLONG len;
+	if(!GetVarint(buff, pos, &len) || len > buff.size() - *pos) return FALSE;
+	str->assign(buff, *pos, (SIZE_T) len);
+	*pos += (SIZE_T) len;
+	return TRUE;
+}
+
+/*
+Length of root if path lies within it (0 otherwise). Paths are case insensitive on Windows.
+*/
+static SIZE_T MatchRoot(LPCWSTR path, const wstring& root) {
+	SIZE_T len = root.size();
+	if(!len || wcslen(path) < len) return 0;
+#ifdef _WIN32
+	if(_wcsnicmp(path, root.c_str(), len) != 0) return 0;
+#else
+	if(wcsncmp(path, root.c_str(), len) != 0) return 0;
+#endif
+	if(root[len-1] != FS_PATH_SEPARATOR && path[len] && path[len] != FS_PATH_SEPARATOR) return 0;
+	return len;
+}
+
+
+EventCapture::EventCapture() {
+	this->pFile = NULL;
+	this->bOpen = FALSE;
+	this->ullStart = 0;
+	InitializeCriticalSection(&this->csFile);
+}
+
+EventCapture::~EventCapture() {
+	this->Close();
+	DeleteCriticalSection(&this->csFile);
+}
+
+BOOL EventCapture::Open(LPCWSTR capturePath) {
+	this->Close();
+	EnterCriticalSection(&this->csFile);
+	this->pFile = OpenFile(capturePath, L"ab");
+	if(this->pFile) {
+		this->ullStart = FileActionInfo::GetCurrentTicks();
+		// session header
+		this->buff.assign(CAPTURE_MAGIC);
+		this->buff += (char) CAPTURE_VERSION;
+		ULONGLONG ullTime = (ULONGLONG) time(NULL);
+		for(UINT i = 0; i < 8; ++i) this->buff += (char) ((ullTime >> (8 * i)) & 0xFF);
+		fwrite(this->buff.data(), 1, this->buff.size(), this->pFile);
+		for(UINT i = 0, uiCount = this->vecRoots.size(); i < uiCount; ++i) {
+			this->WriteRoot(i);
+		}
+		this->bOpen = TRUE;
+	}
+	LeaveCriticalSection(&this->csFile);
+	return (this->pFile != NULL);
+}
+
+void EventCapture::Close() {
+	EnterCriticalSection(&this->csFile);
+	this->bOpen = FALSE;
+	if(this->pFile) {
+		fclose(this->pFile);
+		this->pFile = NULL;
+	}
+	LeaveCriticalSection(&this->csFile);
+}
+
+void EventCapture::WriteRoot(UINT nRoot) {
+	CaptureRoot* lpRoot = &this->vecRoots[nRoot];
+	this->buff.clear();
+	this->buff += (char) CAPTURE_RECORD_ROOT;
+	PutVarint(&this->buff, nRoot);
+	this->buff += (char) lpRoot->drive;
+	this->buff += (char) (lpRoot->bSubTree ? 1 : 0);
+	PutString(&this->buff, ToUTF8(lpRoot->path.c_str()));
+	fwrite(this->buff.data(), 1, this->buff.size(), this->pFile);
+}
+
+void EventCapture::AddRoot(LPCWSTR rootPath, CHAR drive, BOOL bSubTree) {
+	EnterCriticalSection(&this->csFile);
+	UINT nRoot = 0, uiCount = this->vecRoots.size();
+	while(nRoot < uiCount && !(this->vecRoots[nRoot].path == rootPath && this->vecRoots[nRoot].bSubTree == bSubTree)) ++nRoot;
+	if(nRoot == uiCount) {
+		this->vecRoots.push_back(CaptureRoot(rootPath, drive, bSubTree));
+		if(this->pFile) this->WriteRoot(nRoot);
+	}
+	LeaveCriticalSection(&this->csFile);
+}
+
+void EventCapture::Write(vector<FileActionInfo*>* vecChanges) {
+	if(!this->bOpen) return;
+	EnterCriticalSection(&this->csFile);
+	if(this->pFile) {
+		for(UINT i = 0, uiCount = vecChanges->size(); i < uiCount; ++i) {
+			FileActionInfo* lpAction = vecChanges->at(i);
+			LPCWSTR path = lpAction->GetFilePath();
+
+			// events are recorded relatively to the most specific root they belong to
+			INT nRoot = -1;
+			SIZE_T len = 0;
+			for(UINT j = 0, uiSize = this->vecRoots.size(); j < uiSize; ++j) {
+				SIZE_T rootLen = MatchRoot(path, this->vecRoots[j].path);
+				if(rootLen > len) {
+					nRoot = j;
+					len = rootLen;
+				}
+			}
+			wstring relPath = path + len;
+			if(len && !relPath.empty() && relPath[0] == FS_PATH_SEPARATOR) relPath.erase(0, 1);
+			for(SIZE_T j = 0, uiSize = relPath.size(); j < uiSize; ++j) {
+				if(relPath[j] == FS_PATH_SEPARATOR) relPath[j] = L'/';
+			}
+
+			ULONGLONG ullTicks = lpAction->GetTicks();
+			this->buff.clear();
+			this->buff += (char) CAPTURE_RECORD_EVENT;
+			PutVarint(&this->buff, (ullTicks > this->ullStart) ? ullTicks - this->ullStart : 0);
+			this->buff += (char) lpAction->GetAction();
+			PutVarint(&this->buff, nRoot + 1);
+			PutString(&this->buff, ToUTF8(relPath.c_str()));
+			fwrite(this->buff.data(), 1, this->buff.size(), this->pFile);
+		}
+		// a crash should not lose more than the current batch
+		fflush(this->pFile);
+	}
+	LeaveCriticalSection(&this->csFile);
+}
+
+
+/*
+Captured paths are converted to the separator of current platform,
+so that a capture made on Windows can be replayed on Linux (i.e. "C:\dir" becomes "/C:/dir").
+*/
+static wstring LocalPath(wstring path, BOOL bAbsolute) {
+	for(SIZE_T i = 0, uiSize = path.size(); i < uiSize; ++i) {
+		if(path[i] == L'\\' || path[i] == L'/') path[i] = FS_PATH_SEPARATOR;
+	}
+#ifndef _WIN32
+	if(bAbsolute && (path.empty() || path[0] != FS_PATH_SEPARATOR)) path.insert(0, 1, FS_PATH_SEPARATOR);
+#endif
+	return path;
+}
+
+BOOL CaptureReader::Load(LPCWSTR capturePath) {
+	FILE* pFile = OpenFile(capturePath, L"rb");
+	if(!pFile) return FALSE;
+	string buff;
+	char chunk[65536];
+	SIZE_T n;
+	while((n = fread(chunk, 1, sizeof(chunk), pFile)) > 0) buff.append(chunk, n);
+	fclose(pFile);
+
+	const SIZE_T headerSize = strlen(CAPTURE_MAGIC) + 1 + 8;
+	if(buff.compare(0, strlen(CAPTURE_MAGIC), CAPTURE_MAGIC) != 0) return FALSE;
+
+	// session ids of the roots, mapped to their index in vecRoots
+	map<ULONGLONG, INT> mapRoots;
+	// offset of current session, so that sessions are replayed one after the other
+	ULONGLONG ullBase = 0, ullLast = 0;
+	SIZE_T pos = 0;
+	while(pos < buff.size()) {
+		if(buff.compare(pos, strlen(CAPTURE_MAGIC), CAPTURE_MAGIC) == 0) {
+			if(buff.size() - pos < headerSize || (BYTE) buff[pos + strlen(CAPTURE_MAGIC)] != CAPTURE_VERSION) break;
+			pos += headerSize;
+			mapRoots.clear();
+			ullBase = ullLast;
+			continue;
+		}
+		BYTE type = (BYTE) buff[pos++];
+		if(type == CAPTURE_RECORD_ROOT) {
+			ULONGLONG id;
+			string path;
+			if(!GetVarint(buff, &pos, &id) || buff.size() - pos < 2) break;
+			CHAR drive = buff[pos++];
+			BOOL bSubTree = (buff[pos++] != 0);
+			if(!GetString(buff, &pos, &path)) break;
+			wstring rootPath = LocalPath(FromUTF8(path.data(), path.size()), TRUE);
+			INT nRoot = 0, uiCount = this->vecRoots.size();
+			while(nRoot < uiCount && !(this->vecRoots[nRoot].path == rootPath && this->vecRoots[nRoot].bSubTree == bSubTree)) ++nRoot;
+			if(nRoot == uiCount) this->vecRoots.push_back(CaptureRoot(rootPath.c_str(), drive, bSubTree));
+			mapRoots[id] = nRoot;
+		}
+		else if(type == CAPTURE_RECORD_EVENT) {
+			ULONGLONG offset, id;
+			string path;
+			if(!GetVarint(buff, &pos, &offset) || pos == buff.size()) break;
+			DWORD action = (BYTE) buff[pos++];
+			if(!GetVarint(buff, &pos, &id) || !GetString(buff, &pos, &path)) break;
+			INT nRoot = -1;
+			wstring fullPath;
+			if(id && mapRoots.count(id - 1)) {
+				nRoot = mapRoots[id - 1];
+				const wstring& rootPath = this->vecRoots[nRoot].path;
+				fullPath = LocalPath(FromUTF8(path.data(), path.size()), FALSE);
+				if(fullPath.empty()) fullPath = rootPath;
+				else if(!rootPath.empty() && rootPath[rootPath.size()-1] == FS_PATH_SEPARATOR) fullPath = rootPath + fullPath;
+				else fullPath = rootPath + FS_PATH_SEPARATOR + fullPath;
+			}
+			else fullPath = LocalPath(FromUTF8(path.data(), path.size()), TRUE);
+			ullLast = ullBase + offset;
+			this->vecEvents.push_back(CaptureEvent(ullLast, action, nRoot, fullPath));
+		}
+		// unknown record: rest of the file cannot be decoded
+		else break;
+	}
+	return TRUE;
+}
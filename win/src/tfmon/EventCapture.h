@@ -0,0 +1,114 @@
+/* EventCapture.h - binary recording of the raw events delivered by the watcher backends
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+#include "FileActionInfo.h"
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::wstring;
+using std::vector;
+
+/*
+Capture file format (append-only, integers are little-endian, 'varint' stands for LEB128 unsigned integers).
+A file is a sequence of sessions, each of them starting with a header:
+	"TFMONCAP" (8 bytes), version (1 byte), start time as a time_t (8 bytes)
+followed by records, each starting with its type (1 byte):
+	'R' root:	id (varint), drive (1 byte), subtree flag (1 byte), path length (varint), path (UTF-8)
+	'E' event:	microseconds since session start (varint), action (1 byte), root id + 1 (varint, 0 if no root matched),
+				path length (varint), path relative to the root (UTF-8, '/' being used as separator)
+Root ids are only valid within their session. A record truncated at the end of the file (crash) is ignored.
+*/
+#define CAPTURE_MAGIC			"TFMONCAP"
+#define CAPTURE_VERSION			1
+#define CAPTURE_RECORD_ROOT		'R'
+#define CAPTURE_RECORD_EVENT	'E'
+
+
+class CaptureRoot {
+public:
+	wstring		path;
+	CHAR		drive;
+	BOOL		bSubTree;
+
+	CaptureRoot(LPCWSTR path, CHAR drive, BOOL bSubTree) {
+		this->path = path;
+		this->drive = drive;
+		this->bSubTree = bSubTree;
+	}
+};
+
+class CaptureEvent {
+public:
+	// microseconds since the beginning of the capture
+	ULONGLONG	offset;
+	DWORD		action;
+	// index in the roots of the reader (-1 if none)
+	INT			nRoot;
+	// full path, using the separator of current platform
+	wstring		path;
+
+	CaptureEvent(ULONGLONG offset, DWORD action, INT nRoot, const wstring& path) {
+		this->offset = offset;
+		this->action = action;
+		this->nRoot = nRoot;
+		this->path = path;
+	}
+};
+
+
+/*
+Writer side. Events are written from the watching threads, roots from the controlling one:
+all methods can be called concurrently. When no capture is open, Write costs a single test.
+*/
+class EventCapture {
+private:
+	CRITICAL_SECTION		csFile;
+	FILE*					pFile;
+	volatile BOOL			bOpen;
+	ULONGLONG				ullStart;
+	vector<CaptureRoot>		vecRoots;
+	string					buff;
+
+	void					WriteRoot(UINT nRoot);
+
+public:
+	EventCapture();
+	~EventCapture();
+
+	/*
+	Start appending to given file. Roots added so far are recorded first.
+	*/
+	BOOL Open(LPCWSTR capturePath);
+	void Close();
+	BOOL IsOpen() { return this->bOpen; }
+
+	/*
+	Roots are kept (even while no capture is open) so that events can be recorded relatively to them.
+	*/
+	void AddRoot(LPCWSTR rootPath, CHAR drive, BOOL bSubTree);
+
+	void Write(vector<FileActionInfo*>* vecChanges);
+};
+
+
+/*
+Reader side: loads a whole capture file. Sessions are laid end to end, and roots are merged by path.
+*/
+class CaptureReader {
+public:
+	vector<CaptureRoot>		vecRoots;
+	vector<CaptureEvent>	vecEvents;
+
+	BOOL Load(LPCWSTR capturePath);
+};
@@ -0,0 +1,216 @@
+/* ExclusionMatcher.cpp - compiled set of paths and patterns excluded from monitoring
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "ExclusionMatcher.h"
+
+#include <wctype.h>
+
+
+ExclusionNode* ExclusionNode::Find(WCHAR c) {
+	// children are sorted: binary search
+	UINT nLow = 0, nHigh = this->vecChildren.size();
+	while(nLow < nHigh) {
+		UINT nMid = (nLow + nHigh) / 2;
+		if(this->vecChildren[nMid]->c < c) nLow = nMid + 1;
+		else nHigh = nMid;
+	}
+	if(nLow < this->vecChildren.size() && this->vecChildren[nLow]->c == c) return this->vecChildren[nLow];
+	return NULL;
+}
+
+ExclusionNode* ExclusionNode::Insert(WCHAR c) {
+	UINT nIndex = 0;
+	while(nIndex < this->vecChildren.size() && this->vecChildren[nIndex]->c < c) ++nIndex;
+	if(nIndex < this->vecChildren.size() && this->vecChildren[nIndex]->c == c) return this->vecChildren[nIndex];
+	ExclusionNode* lpNode = new ExclusionNode(c);
+	this->vecChildren.insert(this->vecChildren.begin() + nIndex, lpNode);
+	return lpNode;
+}
+
+
+ExclusionMatcher::ExclusionMatcher() {
+	this->lpDirs = new ExclusionNode(0);
+	this->lpNames = new ExclusionNode(0);
+	this->lpPrefixes = new ExclusionNode(0);
+	this->lpSuffixes = new ExclusionNode(0);
+}
+
+ExclusionMatcher::~ExclusionMatcher() {
+	delete this->lpDirs;
+	delete this->lpNames;
+	delete this->lpPrefixes;
+	delete this->lpSuffixes;
+}
+
+void ExclusionMatcher::Clear() {
+	delete this->lpDirs;
+	delete this->lpNames;
+	delete this->lpPrefixes;
+	delete this->lpSuffixes;
+	this->lpDirs = new ExclusionNode(0);
+	this->lpNames = new ExclusionNode(0);
+	this->lpPrefixes = new ExclusionNode(0);
+	this->lpSuffixes = new ExclusionNode(0);
+	this->vecNameGlobs.clear();
+	this->vecGlobs.clear();
+	this->vecExclusions.clear();
+}
+
+WCHAR ExclusionMatcher::Fold(WCHAR c) {
+#ifdef _WIN32
+	return towlower(c);
+#else
+	return c;
+#endif
+}
+
+BOOL ExclusionMatcher::HasWildcard(const wstring& str, SIZE_T start, SIZE_T end) {
+	for(SIZE_T i = start; i < end; ++i) {
+		if(ExclusionMatcher::IsWildcard(str[i])) return TRUE;
+	}
+	return FALSE;
+}
+
+void ExclusionMatcher::Insert(ExclusionNode* lpRoot, const wstring& key, BOOL bReverse) {
+	ExclusionNode* lpNode = lpRoot;
+	for(SIZE_T i = 0, uiSize = key.size(); i < uiSize; ++i) {
+		lpNode = lpNode->Insert(bReverse ? key[uiSize-1-i] : key[i]);
+	}
+	lpNode->bEnd = TRUE;
+}
+
+/*
+Given pattern (already normalized) has no separator: it is matched against the names.
+*/
+void ExclusionMatcher::AddName(const wstring& name) {
+	SIZE_T len = name.size();
+	if(!ExclusionMatcher::HasWildcard(name, 0, len)) ExclusionMatcher::Insert(this->lpNames, name, FALSE);
+	else if(name[0] == L'*' && !ExclusionMatcher::HasWildcard(name, 1, len)) ExclusionMatcher::Insert(this->lpSuffixes, name.substr(1), TRUE);
+	else if(name[len-1] == L'*' && !ExclusionMatcher::HasWildcard(name, 0, len-1)) ExclusionMatcher::Insert(this->lpPrefixes, name.substr(0, len-1), FALSE);
+	else this->vecNameGlobs.push_back(name);
+}
+
+BOOL ExclusionMatcher::Add(LPCWSTR exclusion) {
+	wstring pattern;
+	for(LPCWSTR c = exclusion; *c; ++c) {
+		pattern += (*c == L'/' || *c == L'\\') ? FS_PATH_SEPARATOR : ExclusionMatcher::Fold(*c);
+	}
+	while(pattern.size() > 1 && pattern[pattern.size()-1] == FS_PATH_SEPARATOR) pattern.erase(pattern.size()-1);
+	if(pattern.empty()) return FALSE;
+
+	// prevent double insertion
+	for(UINT i = 0, uiCount = this->vecExclusions.size(); i < uiCount; ++i) {
+		if(this->vecExclusions[i] == pattern) return FALSE;
+	}
+	this->vecExclusions.push_back(pattern);
+
+	if(!ExclusionMatcher::HasWildcard(pattern, 0, pattern.size())) {
+		if(pattern.find(FS_PATH_SEPARATOR) == wstring::npos) this->AddName(pattern);
+		else ExclusionMatcher::Insert(this->lpDirs, pattern, FALSE);
+		return TRUE;
+	}
+
+	// a name at any depth ('**/name'), and whatever lies within it ('name/**'), is the name alone
+	wstring name = pattern;
+	if(name.size() > 3 && name[0] == L'*' && name[1] == L'*' && name[2] == FS_PATH_SEPARATOR) name.erase(0, 3);
+	if(name.size() > 3 && name[name.size()-1] == L'*' && name[name.size()-2] == L'*' && name[name.size()-3] == FS_PATH_SEPARATOR) name.erase(name.size()-3);
+	if(name.find(FS_PATH_SEPARATOR) == wstring::npos && name != L"**") this->AddName(name);
+	else this->vecGlobs.push_back(pattern);
+	return TRUE;
+}
+
+/*
+Match the characters in [str, end) against given pattern (str is folded on the fly).
+*/
+BOOL ExclusionMatcher::Glob(LPCWSTR pattern, LPCWSTR str, LPCWSTR end) {
+	while(*pattern) {
+		if(pattern[0] == L'*' && pattern[1] == L'*') {
+			pattern += 2;
+			// '**/' also stands for no directory at all
+			if(*pattern == FS_PATH_SEPARATOR && ExclusionMatcher::Glob(pattern + 1, str, end)) return TRUE;
+			for(LPCWSTR p = str; ; ++p) {
+				if(ExclusionMatcher::Glob(pattern, p, end)) return TRUE;
+				if(p == end) return FALSE;
+			}
+		}
+		else if(*pattern == L'*') {
+			++pattern;
+			for(LPCWSTR p = str; ; ++p) {
+				if(ExclusionMatcher::Glob(pattern, p, end)) return TRUE;
+				if(p == end || *p == FS_PATH_SEPARATOR) return FALSE;
+			}
+		}
+		else if(*pattern == L'?') {
+			if(str == end || *str == FS_PATH_SEPARATOR) return FALSE;
+			++pattern;
+			++str;
+		}
+		else {
+			if(str == end || ExclusionMatcher::Fold(*str) != *pattern) return FALSE;
+			++pattern;
+			++str;
+		}
+	}
+	return str == end;
+}
+
+/*
+Path is an excluded directory, or lies within one.
+*/
+BOOL ExclusionMatcher::MatchDir(LPCWSTR path, SIZE_T len) {
+	ExclusionNode* lpNode = this->lpDirs;
+	for(SIZE_T i = 0; i < len; ++i) {
+		if(!(lpNode = lpNode->Find(ExclusionMatcher::Fold(path[i])))) return FALSE;
+		// excluded directory ends here (and not in the middle of a name)
+		if(lpNode->bEnd && (i+1 == len || path[i+1] == FS_PATH_SEPARATOR || path[i] == FS_PATH_SEPARATOR)) return TRUE;
+	}
+	return FALSE;
+}
+
+BOOL ExclusionMatcher::MatchName(LPCWSTR name, SIZE_T len) {
+	ExclusionNode* lpNode = this->lpNames;
+	for(SIZE_T i = 0; lpNode && i < len; ++i) lpNode = lpNode->Find(ExclusionMatcher::Fold(name[i]));
+	if(lpNode && lpNode->bEnd) return TRUE;
+
+	lpNode = this->lpPrefixes;
+	for(SIZE_T i = 0; lpNode; ++i) {
+		if(lpNode->bEnd) return TRUE;
+		if(i == len) break;
+		lpNode = lpNode->Find(ExclusionMatcher::Fold(name[i]));
+	}
+
+	lpNode = this->lpSuffixes;
+	for(SIZE_T i = len; lpNode; --i) {
+		if(lpNode->bEnd) return TRUE;
+		if(i == 0) break;
+		lpNode = lpNode->Find(ExclusionMatcher::Fold(name[i-1]));
+	}
+
+	for(UINT i = 0, uiCount = this->vecNameGlobs.size(); i < uiCount; ++i) {
+		if(ExclusionMatcher::Glob(this->vecNameGlobs[i].c_str(), name, name + len)) return TRUE;
+	}
+	return FALSE;
+}
+
+BOOL ExclusionMatcher::IsExcluded(LPCWSTR path) {
+	SIZE_T len = wcslen(path);
+	if(this->MatchDir(path, len)) return TRUE;
+
+	// every name along the path
+	for(SIZE_T start = 0; start < len; ) {
+		SIZE_T end = start;
+		while(end < len && path[end] != FS_PATH_SEPARATOR) ++end;
+		if(end > start && this->MatchName(path + start, end - start)) return TRUE;
+		start = end + 1;
+	}
+
+	for(UINT i = 0, uiCount = this->vecGlobs.size(); i < uiCount; ++i) {
+		if(ExclusionMatcher::Glob(this->vecGlobs[i].c_str(), path, path + len)) return TRUE;
+	}
+	return FALSE;
+}
@@ -0,0 +1,98 @@
+/* ExclusionMatcher.h - compiled set of paths and patterns excluded from monitoring
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+
+#include <string>
+#include <vector>
+
+using std::wstring;
+using std::vector;
+
+
+/*
+Node of a character trie.
+*/
+class ExclusionNode {
+public:
+	WCHAR						c;
+	// sorted by character
+	vector<ExclusionNode*>		vecChildren;
+	// an inserted key ends here
+	BOOL						bEnd;
+
+	ExclusionNode(WCHAR c) {
+		this->c = c;
+		this->bEnd = FALSE;
+	}
+
+	~ExclusionNode() {
+		for(UINT i = 0, uiCount = this->vecChildren.size(); i < uiCount; ++i) {
+			delete this->vecChildren[i];
+		}
+	}
+
+	ExclusionNode* Find(WCHAR c);
+	ExclusionNode* Insert(WCHAR c);
+};
+
+/*
+Exclusions are either directories (every path within them is excluded) or glob patterns, in which
+'?' stands for any character but a separator, '*' for any sequence of them, and '**' for any sequence of characters (separators included).
+Either '/' or '\' can be used as separator in patterns.
+
+Exclusions are compiled into tries, so that the cost of a match depends on the length of the path, not on the number of exclusions:
+- directories (C:\Windows\Temp, /proc) are stored in a trie of the paths
+- patterns without separator (Thumbs.db, *.tmp, ~$*) are stored in tries of the names, and matched against every component of the path
+  (files within a directory named that way are excluded as well)
+- such a pattern preceded by '**' and a separator (at any depth) or followed by a separator and '**' (along with its content)
+  is stored as the pattern alone, since names are matched at any depth anyway
+Other patterns (with a separator and wildcards before the last name, or with wildcards in the middle of a name) are checked one after the other.
+Matching is case insensitive on Windows. This class does no locking.
+*/
+class ExclusionMatcher {
+private:
+	// excluded directories
+	ExclusionNode*			lpDirs;
+	// names, name prefixes ('abc*') and reversed name suffixes ('*abc')
+	ExclusionNode*			lpNames;
+	ExclusionNode*			lpPrefixes;
+	ExclusionNode*			lpSuffixes;
+	// patterns that could not be compiled into one of the tries (matched against the names, or against the whole path)
+	vector<wstring>			vecNameGlobs;
+	vector<wstring>			vecGlobs;
+	// exclusions as given (normalized), to prevent double insertion
+	vector<wstring>			vecExclusions;
+
+	static WCHAR			Fold(WCHAR c);
+	static BOOL				IsWildcard(WCHAR c) { return c == L'*' || c == L'?'; }
+	static BOOL				HasWildcard(const wstring& str, SIZE_T start, SIZE_T end);
+	static BOOL				Glob(LPCWSTR pattern, LPCWSTR str, LPCWSTR end);
+
+	static void				Insert(ExclusionNode* lpRoot, const wstring& key, BOOL bReverse);
+	void					AddName(const wstring& name);
+	BOOL					MatchDir(LPCWSTR path, SIZE_T len);
+	BOOL					MatchName(LPCWSTR name, SIZE_T len);
+
+public:
+	ExclusionMatcher();
+	~ExclusionMatcher();
+
+	/*
+	Add a directory or a glob pattern. Returns FALSE if it was already added.
+	*/
+	BOOL Add(LPCWSTR exclusion);
+	void Clear();
+
+	BOOL IsExcluded(LPCWSTR path);
+
+	UINT GetCount()			{ return this->vecExclusions.size(); }
+	// number of patterns that are checked one after the other
+	UINT GetGlobCount()		{ return this->vecNameGlobs.size() + this->vecGlobs.size(); }
+};
@@ -1,4 +1,4 @@
-/* FSChangeNotifier.cpp - interface for monitoring File System changes using ReadDirectoryChangesW
+/* FSChangeNotifier.cpp - interface for monitoring File System changes
 				  
     This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
     Copyright (C) Cedric Francoys, 2016, Yegen
@@ -8,98 +8,159 @@
 */
 
 
-#include <windows.h>
+#include "fscompat.h"
 #include <stdlib.h>
 #include "FSChangeNotifier.h"
 
+#ifdef _WIN32
+#include "Win32Watcher.h"
+
 DWORD WM_FSNOTIFY_ADDED		= RegisterWindowMessage(L"FSChangeNotifierAdd");
 DWORD WM_FSNOTIFY_MOVED		= RegisterWindowMessage(L"FSChangeNotifierMove");
 DWORD WM_FSNOTIFY_REMOVED	= RegisterWindowMessage(L"FSChangeNotifierRemove");
 DWORD WM_FSNOTIFY_RESTORED	= RegisterWindowMessage(L"FSChangeNotifierRestore");
+DWORD WM_FSNOTIFY_OVERFLOW	= RegisterWindowMessage(L"FSChangeNotifierOverflow");
 
 DWORD WM_FSNOTIFY_STOP		= RegisterWindowMessage(L"FSChangeNotifierThreadStopped");
 
-FSChangeNotifier::FSChangeNotifier() {	
-	this->hIOCP = NULL;
-	memset(this->drives, 0, 27);
-}
+// substring identifying recycle bin paths when their exact paths are not given (i.e. "X:\$RECYCLE.BIN\" or "X:\RECYCLER\")
+#define FS_RECYCLE_MARK		L"RECYCLE"
+#else
+#include "InotifyWatcher.h"
 
-FSChangeNotifier* FSChangeNotifier::GetInstance() {
-	static FSChangeNotifier fsInst;
-	return &fsInst;
+// substring identifying freedesktop.org trash paths when their exact paths are not given (i.e. "~/.local/share/Trash/files/")
+#define FS_RECYCLE_MARK		L"/Trash/"
+#endif
+
+/*
+Check whether path lies within root (or is root itself). Paths are case insensitive on Windows.
+*/
+static BOOL IsSubPath(wstring path, wstring root) {
+	if(path.empty() || path[path.size()-1] != FS_PATH_SEPARATOR) path += FS_PATH_SEPARATOR;
+	if(root.empty() || root[root.size()-1] != FS_PATH_SEPARATOR) root += FS_PATH_SEPARATOR;
+	if(path.size() < root.size()) return FALSE;
+#ifdef _WIN32
+	return (_wcsnicmp(path.c_str(), root.c_str(), root.size()) == 0);
+#else
+	return (path.compare(0, root.size(), root) == 0);
+#endif
 }
 
-FSChangeNotifier::~FSChangeNotifier() {
-	RemoveAllPaths();
-	if (this->hIOCP) CloseHandle(this->hIOCP);
+/*
+Key of a path in the tracked identities.
+*/
+static wstring TrackedKey(LPCWSTR filePath) {
+	wstring result = filePath;
+#ifdef _WIN32
+	for(SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+	return result;
 }
 
 /*
-BOOL FSChangeNotifier::AddPrivilege(LPCTSTR pszPrivName, BOOL bEnable) {
-	BOOL result = FALSE;
-	HANDLE hToken = NULL;
+Both items have the same extension (none counts as one). Case insensitive on Windows.
+*/
+static BOOL SameExtension(FileActionInfo* lpAction1, FileActionInfo* lpAction2) {
+	LPCWSTR ext1 = lpAction1->GetFileName() ? wcsrchr(lpAction1->GetFileName(), L'.') : NULL;
+	LPCWSTR ext2 = lpAction2->GetFileName() ? wcsrchr(lpAction2->GetFileName(), L'.') : NULL;
+	if(!ext1 || !ext2) return (ext1 == ext2);
+#ifdef _WIN32
+	return (_wcsicmp(ext1, ext2) == 0);
+#else
+	return (wcscmp(ext1, ext2) == 0);
+#endif
+}
 
-	if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &hToken)) {
-		TOKEN_PRIVILEGES tp = { 1 };        
-		if (LookupPrivilegeValue(NULL, pszPrivName,  &tp.Privileges[0].Luid)) {
-			tp.Privileges[0].Attributes = bEnable ?  SE_PRIVILEGE_ENABLED : 0;
-			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
-			result = (GetLastError() == ERROR_SUCCESS);		
-		}
-		CloseHandle(hToken);
-	} 
-	return result;
+/*
+Both items lie in the same directory.
+*/
+static BOOL SameDirectory(FileActionInfo* lpAction1, FileActionInfo* lpAction2) {
+	if(!lpAction1->GetFileName() || !lpAction2->GetFileName()) return FALSE;
+	SIZE_T len1 = lpAction1->GetFileName() - lpAction1->GetFilePath(), len2 = lpAction2->GetFileName() - lpAction2->GetFilePath();
+	if(len1 != len2) return FALSE;
+#ifdef _WIN32
+	return (_wcsnicmp(lpAction1->GetFilePath(), lpAction2->GetFilePath(), len1) == 0);
+#else
+	return (wcsncmp(lpAction1->GetFilePath(), lpAction2->GetFilePath(), len1) == 0);
+#endif
 }
+
+/*
+Both paths are the same. Case insensitive on Windows.
 */
+static BOOL SamePath(LPCWSTR path1, LPCWSTR path2) {
+#ifdef _WIN32
+	return (_wcsicmp(path1, path2) == 0);
+#else
+	return (wcscmp(path1, path2) == 0);
+#endif
+}
 
-BOOL FSChangeNotifier::Init() {
-	HANDLE hToken = NULL;
-	// adjust privileges for current process
-	if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &hToken)) {
-		TOKEN_PRIVILEGES tp = { 1 }; 
-// do we need this ?
-		if (LookupPrivilegeValue(NULL, SE_BACKUP_NAME,  &tp.Privileges[0].Luid)) {
-			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
-			if(GetLastError() != ERROR_SUCCESS) {
-				this->nLastError = GetLastError();
-				CloseHandle(hToken);
-				return FALSE;
-			}
-		}
-// do we need this ?
-		if (LookupPrivilegeValue(NULL, SE_RESTORE_NAME,  &tp.Privileges[0].Luid)) {
-			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
-			if(GetLastError() != ERROR_SUCCESS) {
-				this->nLastError = GetLastError();
-				CloseHandle(hToken);
-				return FALSE;
-			}
-		}
-		// we need this one enabled  (enabled by default for all user since win NT)
-		if (LookupPrivilegeValue(NULL, SE_CHANGE_NOTIFY_NAME,  &tp.Privileges[0].Luid)) {
-			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
-			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
-			if(GetLastError() != ERROR_SUCCESS) {
-				this->nLastError = GetLastError();
-				CloseHandle(hToken);
-				return FALSE;
-			}
-		}
-		CloseHandle(hToken);
-	} 
+FSChangeNotifier::FSChangeNotifier() {	
+	this->lpBackend = NULL;
+	this->bStarted = FALSE;
+	this->nLastError = E_FILESYSMON_SUCCESS;
+	this->hCoalescer = NULL;
+	this->bCoalescing = FALSE;
+	this->hScheduler = NULL;
+	this->bScheduling = FALSE;
+	InitializeCriticalSection(&this->csNotify);
+	InitializeCriticalSection(&this->csCoalesce);
+	InitializeConditionVariable(&this->cvCoalesce);
+	InitializeCriticalSection(&this->csSchedule);
+	InitializeConditionVariable(&this->cvSchedule);
+	InitializeCriticalSection(&this->csTracked);
+	InitializeCriticalSection(&this->csConfig);
+	InitializeCriticalSection(&this->csFingerprint);
+	InitializeConditionVariable(&this->cvFingerprint);
+	for(UINT i = 0; i < FS_FINGERPRINT_WORKERS; ++i) this->hFingerprinters[i] = NULL;
+	this->bFingerprinting = FALSE;
+	this->nFingerprinted = 0;
+	this->nContentMoves = 0;
+}
 
+FSChangeNotifier* FSChangeNotifier::GetInstance() {
+	static FSChangeNotifier fsInst;
+	return &fsInst;
+}
 
-	// Get a handle to the I/O completion port (limit threading to one instance)
-	if (!(this->hIOCP = CreateIoCompletionPort(	(HANDLE) INVALID_HANDLE_VALUE, NULL, 0, 1))) {
-		this->nLastError = GetLastError();
-		return FALSE;
+FSChangeNotifier::~FSChangeNotifier() {
+	for (UINT i = 0, uiCount = this->vecVolumes.size(); i < uiCount; ++i) {
+		delete this->vecVolumes[i];
+	}
+	if (this->lpBackend) delete this->lpBackend;
+	DeleteCriticalSection(&this->csNotify);
+	DeleteCriticalSection(&this->csCoalesce);
+	DeleteCriticalSection(&this->csSchedule);
+	for(UINT i = 0, uiCount = this->queFingerprints.size(); i < uiCount; ++i) {
+		delete this->queFingerprints[i];
 	}
+	DeleteCriticalSection(&this->csTracked);
+	DeleteCriticalSection(&this->csConfig);
+	DeleteCriticalSection(&this->csFingerprint);
+}
+
+BOOL FSChangeNotifier::Init(WatcherBackend* lpBackend) {
+	// volumes identifiers are given by current backend: keep it
+	if(!lpBackend && this->lpBackend) return TRUE;
+	if(!lpBackend) {
+#ifdef _WIN32
+		lpBackend = new Win32Watcher();
+#else
+		lpBackend = new InotifyWatcher();
+#endif
+	}
+	if(this->lpBackend && this->lpBackend != lpBackend) delete this->lpBackend;
+	this->lpBackend = lpBackend;
 
+	if(!this->lpBackend->Init()) {
+		this->nLastError = this->lpBackend->GetLastError();
+		return FALSE;
+	}
 	return TRUE;
 }
 
+#ifdef _WIN32
 void FSChangeNotifier::bind(HWND hWnd) {
 	// prevent double insertion
 	bool found = false;
@@ -109,314 +170,1336 @@ void FSChangeNotifier::bind(HWND hWnd) {
 		vechWndDest.push_back(hWnd);
 	}
 }
+#endif
+
+void FSChangeNotifier::bind(FSNOTIFYPROC lpfnNotify, LPVOID lpParam) {
+	// prevent double insertion
+	bool found = false;
+	for (int i = 0, uiCount = this->vecCallbacks.size(); !found && i < uiCount; ++i) {
+		if(this->vecCallbacks[i].lpfnNotify == lpfnNotify && this->vecCallbacks[i].lpParam == lpParam) found = true;
+	}if(!found) {
+		vecCallbacks.push_back(FSNotifyCallback(lpfnNotify, lpParam));
+	}
+}
+
+BOOL FSChangeNotifier::StartVolume(FSVolume* lpVolume) {
+	if(lpVolume->hThread) return TRUE;
+	lpVolume->hCorrelator = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) FSChangeNotifier::ThreadCorrelate, (LPVOID) lpVolume, 0, NULL);
+	if(!lpVolume->hCorrelator) return FALSE;
+	lpVolume->bRunning = TRUE;
+	lpVolume->hThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) FSChangeNotifier::ThreadWatch, (LPVOID) lpVolume, 0, NULL);
+	if(!lpVolume->hThread) {
+		lpVolume->bRunning = FALSE;
+		// no more events will come
+		lpVolume->nError = E_FILESYSMON_INTERRUPTED;
+		lpVolume->ring.Push(NULL);
+		WaitForSingleObject(lpVolume->hCorrelator, INFINITE);
+		CloseHandle(lpVolume->hCorrelator);
+		lpVolume->hCorrelator = NULL;
+	}
+	return (lpVolume->hThread != NULL);
+}
+
+/*
+Wait for given thread to leave.
+*/
+static void JoinThread(HANDLE hThread) {
+#ifdef _WIN32
+	// thread might be sending a message to the calling thread: dispatch sent messages while waiting
+	while(MsgWaitForMultipleObjects(1, &hThread, FALSE, INFINITE, QS_SENDMESSAGE) == WAIT_OBJECT_0 + 1) {
+		MSG msg;
+		PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE | PM_QS_SENDMESSAGE);
+	}
+#else
+	WaitForSingleObject(hThread, INFINITE);
+#endif
+	CloseHandle(hThread);
+}
+
+void FSChangeNotifier::StopVolume(FSVolume* lpVolume) {
+	if(!lpVolume->hThread) return;
+	// a thread that already left (backend failure) must not leave an interruption behind for the next one
+	if(lpVolume->bRunning) lpVolume->lpBackend->Interrupt();
+	// watching thread tells the correlation thread to stop once it has pushed its last event
+	JoinThread(lpVolume->hThread);
+	lpVolume->hThread = NULL;
+	JoinThread(lpVolume->hCorrelator);
+	lpVolume->hCorrelator = NULL;
+}
 
 BOOL FSChangeNotifier::Start() {
-	// start monitoring thread
-	this->hThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) FSChangeNotifier::ThreadWatch, NULL, 0, NULL);
-	return TRUE;
+	BOOL result = TRUE;
+	this->bStarted = TRUE;
+	if(this->coalescer.GetWindow() && !this->hCoalescer) {
+		this->bCoalescing = TRUE;
+		this->hCoalescer = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) FSChangeNotifier::ThreadCoalesce, (LPVOID) this, 0, NULL);
+		if(!this->hCoalescer) {
+			this->bCoalescing = FALSE;
+			result = FALSE;
+		}
+	}
+	if(!this->hFingerprinters[0]) {
+		this->bFingerprinting = TRUE;
+		for(UINT i = 0; i < FS_FINGERPRINT_WORKERS; ++i) {
+			this->hFingerprinters[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) FSChangeNotifier::ThreadFingerprint, (LPVOID) this, 0, NULL);
+			if(!this->hFingerprinters[i]) result = FALSE;
+		}
+	}
+	if(!this->hScheduler) {
+		this->bScheduling = TRUE;
+		this->hScheduler = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) FSChangeNotifier::ThreadSchedule, (LPVOID) this, 0, NULL);
+		if(!this->hScheduler) {
+			this->bScheduling = FALSE;
+			result = FALSE;
+		}
+	}
+	// start one monitoring thread per volume
+	for (UINT i = 0, uiCount = this->vecVolumes.size(); i < uiCount; ++i) {
+		if(!this->StartVolume(this->vecVolumes[i])) result = FALSE;
+	}
+	return result;
 }
 
 BOOL FSChangeNotifier::Stop() {
-	CloseHandle(this->hThread);
+	for (UINT i = 0, uiCount = this->vecVolumes.size(); i < uiCount; ++i) {
+		this->StopVolume(this->vecVolumes[i]);
+	}
+	// no more event can pair the pending removals: they are handled before the scheduling thread leaves
+	if(this->hScheduler) {
+		EnterCriticalSection(&this->csSchedule);
+		this->bScheduling = FALSE;
+		WakeConditionVariable(&this->cvSchedule);
+		LeaveCriticalSection(&this->csSchedule);
+		JoinThread(this->hScheduler);
+		this->hScheduler = NULL;
+	}
+	// comparisons handed over by the scheduling thread notify their outcome before the fingerprinting threads leave
+	if(this->hFingerprinters[0]) {
+		EnterCriticalSection(&this->csFingerprint);
+		this->bFingerprinting = FALSE;
+		WakeAllConditionVariable(&this->cvFingerprint);
+		LeaveCriticalSection(&this->csFingerprint);
+		for(UINT i = 0; i < FS_FINGERPRINT_WORKERS; ++i) {
+			if(this->hFingerprinters[i]) JoinThread(this->hFingerprinters[i]);
+			this->hFingerprinters[i] = NULL;
+		}
+	}
+	// held events are notified before the coalescing thread leaves
+	if(this->hCoalescer) {
+		EnterCriticalSection(&this->csCoalesce);
+		this->bCoalescing = FALSE;
+		WakeConditionVariable(&this->cvCoalesce);
+		LeaveCriticalSection(&this->csCoalesce);
+		JoinThread(this->hCoalescer);
+		this->hCoalescer = NULL;
+	}
+	this->bStarted = FALSE;
 	return TRUE;
 }
 
+FSVolume* FSChangeNotifier::GetVolume(CHAR drive) {
+	for (UINT i = 0, uiCount = this->vecVolumes.size(); i < uiCount; ++i) {
+		if(this->vecVolumes[i]->drive == drive) return this->vecVolumes[i];
+	}
+	return NULL;
+}
+
+INT FSChangeNotifier::FindPath(LPCWSTR pPath) {
+	for(UINT i = 0, uiCount = this->vecPaths.size(); i < uiCount; ++i) {
+		if(IsSubPath(pPath, this->vecPaths[i].path) && IsSubPath(this->vecPaths[i].path, pPath)) return i;
+	}
+	return -1;
+}
+
 INT FSChangeNotifier::AddPath(LPCWSTR pPath, BOOL bSubTree) {
-	// check IO completion port handler
-	if (!this->hIOCP) {
+	if (!this->lpBackend) {
 			// must call Init() method first !
 			return E_FILESYSMON_ERRORNOTINIT;
 	}	
 
+	// nothing to do if path is already covered
+	for(UINT i = 0, uiCount = this->vecPaths.size(); i < uiCount; ++i) {
+		FSWatchedPath* lpPath = &this->vecPaths[i];
+		if(lpPath->bSubTree && IsSubPath(pPath, lpPath->path)) return E_FILESYSMON_SUCCESS;
+		if(!bSubTree && this->FindPath(pPath) == (INT) i) return E_FILESYSMON_SUCCESS;
+	}
+
+	INT result = this->WatchPath(pPath, bSubTree);
+	if(result == E_FILESYSMON_SUCCESS) this->CollapsePaths();
+	return result;
+}
 
-	// Open handle to the directory to be monitored
-	// flag FILE_FLAG_OVERLAPPED allows asynchronous calls of ReadDirectoryChangesW
-	DirInfo* pDir = new DirInfo(pPath, bSubTree);
-	if ((pDir->hFile = CreateFile(pPath, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL)) == INVALID_HANDLE_VALUE) {
-		this->nLastError = GetLastError();
-		delete pDir;
-		return E_FILESYSMON_ERROROPENFILE;
+/*
+Add given path to the backend of its volume (volume is created if necessary).
+*/
+INT FSChangeNotifier::WatchPath(LPCWSTR pPath, BOOL bSubTree) {
+	// retrieve the volume holding the path, or create it
+	CHAR drive = this->lpBackend->GetDrive(pPath);
+	FSVolume* lpVolume = this->GetVolume(drive);
+	BOOL bNewVolume = (lpVolume == NULL);
+	if(bNewVolume) {
+		WatcherBackend* lpVolumeBackend = this->lpBackend->NewInstance();
+		if(!lpVolumeBackend->Init()) {
+			this->nLastError = lpVolumeBackend->GetLastError();
+			delete lpVolumeBackend;
+			return E_FILESYSMON_ERRORNOTINIT;
+		}
+		lpVolume = new FSVolume(drive, lpVolumeBackend);
 	}
 
-	// Allocate notification buffers (will be filled by the system when a notification occurs)
-	memset(&pDir->ol,  0, sizeof(pDir->ol));
-	pDir->pBuff = (FILE_NOTIFY_INFORMATION*) LocalAlloc(LPTR, sizeof(FILE_NOTIFY_INFORMATION)*MAX_BUFF_SIZE);
-	if(!pDir->pBuff) {
-		CloseHandle(pDir->hFile);
-		delete pDir;
-		return E_FILESYSMON_ERROROUTOFMEM;
+	// root must be known to the capture before its first event
+	this->capture.AddRoot(pPath, drive, bSubTree);
+	INT result = lpVolume->lpBackend->AddPath(pPath, bSubTree);
+	if(result != E_FILESYSMON_SUCCESS) {
+		this->nLastError = lpVolume->lpBackend->GetLastError();
+		if(bNewVolume) delete lpVolume;
+		return result;
 	}
 
-	// Associate directory handle with the IO completion port
-	if (CreateIoCompletionPort(pDir->hFile, this->hIOCP, (ULONG_PTR) pDir->hFile, 0) == NULL) {
-		this->nLastError = GetLastError();
-		CloseHandle(pDir->hFile);
-		delete pDir;
-		return E_FILESYSMON_ERRORADDTOIOCP;
+	if(bNewVolume) {
+		this->vecVolumes.push_back(lpVolume);
+		if(this->bStarted) this->StartVolume(lpVolume);
 	}
+	this->vecPaths.push_back(FSWatchedPath(pPath, bSubTree, lpVolume));
+	// event storms are bounded by the watched roots
+	EnterCriticalSection(&this->csSchedule);
+	this->storms.AddRoot(pPath);
+	LeaveCriticalSection(&this->csSchedule);
+	return E_FILESYSMON_SUCCESS;
+}
 
-	// Start monitoring for changes
-	DWORD dwBytesReturned;
-	if (!ReadDirectoryChangesW(pDir->hFile, pDir->pBuff, MAX_BUFF_SIZE * sizeof(FILE_NOTIFY_INFORMATION), bSubTree, FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME, &dwBytesReturned, &pDir->ol, NULL)) {
-		this->nLastError = GetLastError();
-		CloseHandle(pDir->hFile);
-		delete pDir;	
-		return E_FILESYSMON_ERRORREADDIR;
+/*
+Remove the paths that are covered by the last added one.
+*/
+void FSChangeNotifier::CollapsePaths() {
+	FSWatchedPath* lpLast = &this->vecPaths.back();
+	if(!lpLast->bSubTree) return;
+	wstring lastPath = lpLast->path;
+	for(INT i = this->vecPaths.size() - 2; i >= 0; --i) {
+		if(IsSubPath(this->vecPaths[i].path, lastPath)) this->RemovePath((UINT) i);
 	}
+}
 
-	// add direcory to watched directories queue	
-	this->vecDirs.push_back(pDir);
+INT FSChangeNotifier::AddExclusion(LPCWSTR pPath) {
+	EnterCriticalSection(&this->csConfig);
+	this->exclusions.Add(pPath);
+	LeaveCriticalSection(&this->csConfig);
 
-	// update drives list
-	BOOL bPresent = FALSE;
-	UINT i, uiCount;
-	for(i = 0, uiCount = strlen(this->drives); !bPresent && i < uiCount; ++i) {
-		if(this->drives[i] == pPath[0]) bPresent = TRUE;
-	} if(!bPresent) this->drives[i] = (CHAR) pPath[0];
+#ifdef _WIN32
+	// events might report the short (8.3) form of the path
+	WCHAR temp[FILE_NAME_MAX];
+	if(GetShortPathName(pPath, temp, FILE_NAME_MAX)) {
+		EnterCriticalSection(&this->csConfig);
+		this->exclusions.Add(temp);
+		LeaveCriticalSection(&this->csConfig);
+	}
+#endif
 
 	return E_FILESYSMON_SUCCESS;
 }
 
-INT FSChangeNotifier::AddExclusion(LPCWSTR pPath) {
-	WCHAR temp[FILE_NAME_MAX];
-	GetShortPathName(pPath, temp, FILE_NAME_MAX);
+/*
+Convert the index of a watched path to its index among the paths of its volume's backend.
+*/
+UINT FSChangeNotifier::GetVolumeIndex(UINT nIndex) {
+	UINT result = 0;
+	for(UINT i = 0; i < nIndex; ++i) {
+		if(this->vecPaths[i].lpVolume == this->vecPaths[nIndex].lpVolume) ++result;
+	}
+	return result;
+}
+
+void FSChangeNotifier::RemovePath(UINT nIndex) {
+	if(nIndex >= this->vecPaths.size()) return;
+	// volume is kept (with its thread) even if it has no path left
+	this->vecPaths[nIndex].lpVolume->lpBackend->RemovePath(this->GetVolumeIndex(nIndex));
+	EnterCriticalSection(&this->csSchedule);
+	this->storms.RemoveRoot(this->vecPaths[nIndex].path.c_str());
+	LeaveCriticalSection(&this->csSchedule);
+	this->vecPaths.erase(this->vecPaths.begin() + nIndex);
+}
+
+BOOL FSChangeNotifier::RemovePath(LPCWSTR pPath) {
+	INT nIndex = this->FindPath(pPath);
+	if(nIndex < 0) return FALSE;
+	this->RemovePath((UINT) nIndex);
+	return TRUE;
+}
+
+void FSChangeNotifier::RemoveAllPaths() {
+	for (UINT i = 0, uiCount = this->vecVolumes.size(); i < uiCount; ++i) {
+		this->vecVolumes[i]->lpBackend->RemoveAllPaths();
+	}
+	EnterCriticalSection(&this->csSchedule);
+	this->storms.ClearRoots();
+	LeaveCriticalSection(&this->csSchedule);
+	this->vecPaths.clear();
+}
 
-	this->vecExclusions.push_back(pPath);
-	this->vecExclusions.push_back(temp);
+INT FSChangeNotifier::ReplacePath(LPCWSTR pOldPath, LPCWSTR pNewPath, BOOL bSubTree) {
+	INT nIndex = this->FindPath(pOldPath);
+	if(nIndex < 0) return this->AddPath(pNewPath, bSubTree);
 
+	// new path is watched first, even if the old one covers it
+	INT result = this->WatchPath(pNewPath, bSubTree);
+	if(result != E_FILESYSMON_SUCCESS) return result;
+	this->RemovePath((UINT) nIndex);
+	this->CollapsePaths();
 	return E_FILESYSMON_SUCCESS;
 }
 
-void FSChangeNotifier::RemovePath(UINT nIndex) {
-	//sanity check
-	if (nIndex >= (int) this->vecDirs.size() || this->vecDirs.empty()) {
-		return;
+INT FSChangeNotifier::ReplacePath(LPCWSTR pOldPath, const vector<wstring>& vecNewPaths, BOOL bSubTree) {
+	INT nIndex = this->FindPath(pOldPath);
+	INT result = E_FILESYSMON_SUCCESS;
+	for(UINT i = 0, uiCount = vecNewPaths.size(); i < uiCount; ++i) {
+		INT nFound = this->FindPath(vecNewPaths[i].c_str());
+		if(nFound >= 0 && nFound != nIndex) continue;
+		// new paths are appended: index of the old one is kept
+		INT nResult = this->WatchPath(vecNewPaths[i].c_str(), bSubTree);
+		if(nResult != E_FILESYSMON_SUCCESS) result = nResult;
 	}
+	if(nIndex >= 0) this->RemovePath((UINT) nIndex);
+	return result;
+}
+
+BOOL FSChangeNotifier::IsFailed(UINT nIndex) {
+	if(nIndex >= this->vecPaths.size()) return FALSE;
+	return this->vecPaths[nIndex].lpVolume->lpBackend->IsFailed(this->GetVolumeIndex(nIndex));
+}
+
+LPCWSTR FSChangeNotifier::GetPath(UINT nIndex) {
+	if(nIndex >= this->vecPaths.size()) return NULL;
+	return this->vecPaths[nIndex].path.c_str();
+}
+
+BOOL FSChangeNotifier::IsSubTree(UINT nIndex) {
+	if(nIndex >= this->vecPaths.size()) return FALSE;
+	return this->vecPaths[nIndex].bSubTree;
+}
+
+UINT FSChangeNotifier::GetOverflowCount(UINT nIndex) {
+	if(nIndex >= this->vecPaths.size()) return 0;
+	return this->vecPaths[nIndex].lpVolume->lpBackend->GetOverflowCount(this->GetVolumeIndex(nIndex));
+}
 
-	if(this->vecDirs[nIndex]) {
-		if(this->vecDirs[nIndex]->hFile) {
-			CancelIo(this->vecDirs[nIndex]->hFile);
-//			CloseHandle(this->vecDirs[nIndex]->hFile);
+BOOL FSChangeNotifier::GetRingStats(UINT nVolume, CHAR* lpDrive, UINT* lpnSize, UINT* lpnCapacity, UINT* lpnHighWater, UINT* lpnStalls) {
+	if(nVolume >= this->vecVolumes.size()) return FALSE;
+	FSVolume* lpVolume = this->vecVolumes[nVolume];
+	if(lpDrive) *lpDrive = lpVolume->drive;
+	if(lpnSize) *lpnSize = lpVolume->ring.GetSize();
+	if(lpnCapacity) *lpnCapacity = lpVolume->ring.GetCapacity();
+	if(lpnHighWater) *lpnHighWater = lpVolume->ring.GetHighWater();
+	if(lpnStalls) *lpnStalls = lpVolume->ring.GetStalls();
+	return TRUE;
+}
+
+void FSChangeNotifier::SetCoalescingWindow(DWORD dwMilliseconds) {
+	EnterCriticalSection(&this->csCoalesce);
+	this->coalescer.SetWindow(dwMilliseconds);
+	LeaveCriticalSection(&this->csCoalesce);
+}
+
+DWORD FSChangeNotifier::GetCoalescingWindow() {
+	EnterCriticalSection(&this->csCoalesce);
+	DWORD result = this->coalescer.GetWindow();
+	LeaveCriticalSection(&this->csCoalesce);
+	return result;
+}
+
+UINT FSChangeNotifier::GetCorrelatedCount() {
+	EnterCriticalSection(&this->csCoalesce);
+	UINT result = this->coalescer.GetReceivedCount();
+	LeaveCriticalSection(&this->csCoalesce);
+	return result;
+}
+
+UINT FSChangeNotifier::GetNotifiedCount() {
+	EnterCriticalSection(&this->csCoalesce);
+	UINT result = this->coalescer.GetReleasedCount();
+	LeaveCriticalSection(&this->csCoalesce);
+	return result;
+}
+
+UINT FSChangeNotifier::SetRecycleBins(const vector<wstring>& vecPaths) {
+	EnterCriticalSection(&this->csConfig);
+	if(!this->bStarted) this->queRecycleBins.clear();
+	for(UINT i = 0, uiCount = vecPaths.size(); this->lpBackend && i < uiCount; ++i) {
+		wstring path = vecPaths[i];
+		if(path.empty()) continue;
+		if(path[path.size()-1] != FS_PATH_SEPARATOR) path += FS_PATH_SEPARATOR;
+		BOOL bFound = FALSE;
+		for(UINT j = 0, uiBins = this->queRecycleBins.size(); !bFound && j < uiBins; ++j) {
+			if(this->queRecycleBins[j].path == path) bFound = TRUE;
 		}
-		delete this->vecDirs[nIndex];
+		if(!bFound) this->queRecycleBins.push_back(FSRecycleBin(path, this->lpBackend->GetDrive(path.c_str())));
 	}
+	UINT result = this->queRecycleBins.size();
+	LeaveCriticalSection(&this->csConfig);
+	return result;
+}
 
-	this->vecDirs.erase(this->vecDirs.begin() + nIndex);
+void FSChangeNotifier::SetPendingLimits(DWORD dwTTL, UINT nMaxPending) {
+	this->crossIndex.SetLimits(dwTTL, nMaxPending);
 }
 
+void FSChangeNotifier::GetPendingStats(UINT* lpnPending, UINT* lpnExpired, UINT* lpnEvicted) {
+	this->crossIndex.GetPendingStats(lpnPending, lpnExpired, lpnEvicted);
+}
 
-void FSChangeNotifier::RemoveAllPaths() {
-	for (int i = 0, uiCount = this->vecDirs.size(); i < uiCount; ++i) {
-		this->RemovePath(0);
+void FSChangeNotifier::GetSubtreeStats(UINT* lpnSubtrees, UINT* lpnFolded) {
+	EnterCriticalSection(&this->csSchedule);
+	*lpnSubtrees = this->subtrees.GetSubtreeCount();
+	*lpnFolded = this->subtrees.GetFoldedCount();
+	LeaveCriticalSection(&this->csSchedule);
+}
+
+UINT FSChangeNotifier::GetSaveCount() {
+	EnterCriticalSection(&this->csSchedule);
+	UINT result = this->saves.GetSaveCount();
+	LeaveCriticalSection(&this->csSchedule);
+	return result;
+}
+
+void FSChangeNotifier::SetStormLimits(UINT nThreshold, DWORD dwQuiet) {
+	EnterCriticalSection(&this->csSchedule);
+	this->storms.SetLimits(nThreshold, dwQuiet);
+	LeaveCriticalSection(&this->csSchedule);
+}
+
+UINT FSChangeNotifier::TakeStorms(vector<EventStorm>* vecStorms) {
+	EnterCriticalSection(&this->csSchedule);
+	UINT result = this->queStorms.size();
+	vecStorms->insert(vecStorms->end(), this->queStorms.begin(), this->queStorms.end());
+	this->queStorms.clear();
+	LeaveCriticalSection(&this->csSchedule);
+	return result;
+}
+
+void FSChangeNotifier::GetStormStats(UINT* lpnStorms, UINT* lpnSuspended) {
+	EnterCriticalSection(&this->csSchedule);
+	*lpnStorms = this->storms.GetStormCount();
+	*lpnSuspended = this->storms.GetSuspendedCount();
+	LeaveCriticalSection(&this->csSchedule);
+}
+
+UINT FSChangeNotifier::SetTrackedFiles(const vector<wstring>& vecPaths) {
+	unordered_map<wstring, FSTrackedFile> mapFiles;
+	vector<FSFingerprintJob*> vecJobs;
+	EnterCriticalSection(&this->csTracked);
+	for(UINT i = 0, uiCount = vecPaths.size(); i < uiCount; ++i) {
+		wstring key = TrackedKey(vecPaths[i].c_str());
+		if(mapFiles.find(key) != mapFiles.end()) continue;
+		// file tracked already: its identity (kept in line with the notified changes) and its fingerprint are kept
+		unordered_map<wstring, FSTrackedFile>::iterator itOld = this->mapTracked.find(key);
+		if(itOld != this->mapTracked.end()) {
+			mapFiles[key] = itOld->second;
+			// (unless they are still to be read, and no job is queued for them any more, i.e. they were dropped when the notifier was stopped)
+			if(itOld->second.bQueued || (itOld->second.fileId && itOld->second.fingerprint.IsValid())) continue;
+		}
+		// identity and fingerprint of a new file are read by a fingerprinting thread
+		FSFingerprintJob* lpJob = new FSFingerprintJob(FS_FINGERPRINT_TRACK, vecPaths[i].c_str());
+		lpJob->fileId = mapFiles[key].fileId;
+		mapFiles[key].bQueued = TRUE;
+		vecJobs.push_back(lpJob);
 	}
+	this->mapTracked.swap(mapFiles);
+	UINT result = this->mapTracked.size();
+	LeaveCriticalSection(&this->csTracked);
+
+	for(UINT i = 0, uiCount = vecJobs.size(); i < uiCount; ++i) {
+		this->QueueFingerprint(vecJobs[i]);
+	}
+	return result;
 }
 
+UINT FSChangeNotifier::GetTrackedCount() {
+	EnterCriticalSection(&this->csTracked);
+	UINT result = this->mapTracked.size();
+	LeaveCriticalSection(&this->csTracked);
+	return result;
+}
 
-vector<FileActionInfo*>* FSChangeNotifier::FetchChanges() {
-	static vector<FileActionInfo*> vecChanges;
-	DWORD		dwBytesXFered = 0;
-	ULONG_PTR	ulKey = 0;
-	OVERLAPPED*	pOl;
-	
-	// reset queue
-	vecChanges.clear();
-
-	// get new completion key (ulKey) or wait for timeout 
-	if (!GetQueuedCompletionStatus(this->hIOCP, &dwBytesXFered, &ulKey, &pOl, INFINITE)) {
-		if (GetLastError() == WAIT_TIMEOUT)
-			this->nLastError = E_FILESYSMON_NOCHANGE;
-		else this->nLastError = E_FILESYSMON_ERRORDEQUE;
-		return NULL;
-	}
-
-	// identify which watched directory has been changed (ulKey should be a File handle)
-	DirInfo* pDir;	
-	int nIndex, uiCount = this->vecDirs.size();
-	for (nIndex = 0; nIndex < uiCount; ++nIndex) {
-		pDir = this->vecDirs.at(nIndex);
-		if (ulKey == (ULONG_PTR) pDir->hFile)
-			break;
+void FSChangeNotifier::GetFingerprintStats(UINT* lpnFingerprinted, UINT* lpnContentMoves) {
+	EnterCriticalSection(&this->csTracked);
+	*lpnFingerprinted = this->nFingerprinted;
+	*lpnContentMoves = this->nContentMoves;
+	LeaveCriticalSection(&this->csTracked);
+}
+
+/*
+Identity of given tracked file (0 if it is not tracked).
+*/
+ULONGLONG FSChangeNotifier::GetTrackedId(LPCWSTR filePath) {
+	ULONGLONG result = 0;
+	EnterCriticalSection(&this->csTracked);
+	if(!this->mapTracked.empty()) {
+		unordered_map<wstring, FSTrackedFile>::iterator it = this->mapTracked.find(TrackedKey(filePath));
+		if(it != this->mapTracked.end()) result = it->second.fileId;
 	}
-	// directory not found in queue: this->vecDirs and directories submitted to IOCompletionPort are no longer synched !
-	if (nIndex == uiCount) {
-		this->nLastError = E_FILESYSMON_ERRORUNKNOWN;
-		return NULL;
+	LeaveCriticalSection(&this->csTracked);
+	return result;
+}
+
+/*
+Keep the tracked files in line with the notified changes (a moved file keeps its fingerprint, its identity is read again since it might have changed volume).
+*/
+void FSChangeNotifier::UpdateTracked(DWORD action, LPWSTR oldFileName, LPWSTR newFileName) {
+	if(action != FILE_ACTION_MOVED && action != FILE_ACTION_REMOVED) return;
+	EnterCriticalSection(&this->csTracked);
+	if(!this->mapTracked.empty()) {
+		unordered_map<wstring, FSTrackedFile>::iterator it = this->mapTracked.find(TrackedKey(oldFileName));
+		if(it != this->mapTracked.end()) {
+			FSTrackedFile trackedFile = it->second;
+			this->mapTracked.erase(it);
+			if(action == FILE_ACTION_MOVED) {
+				// a job queued for the old path does not apply to the new one
+				trackedFile.bQueued = FALSE;
+				trackedFile.fileId = FileActionInfo::ReadFileId(newFileName);
+				this->mapTracked[TrackedKey(newFileName)] = trackedFile;
+			}
+		}
 	}
-	
-	// pDir->pBuff holds latest IO operations 
-	FILE_NOTIFY_INFORMATION* pIter = pDir->pBuff;
-	while (pIter) {
-		// retrieve file full-path
-		WCHAR tempPath[FILE_NAME_MAX];
-		memset(tempPath, 0, sizeof(WCHAR)*FILE_NAME_MAX);
-		wcscpy(tempPath, pDir->dirPath);
-// todo : we should have a distinct FILE_PATH_MAX constant 
-// next line could lead to buffer overflow
-		memcpy(tempPath+wcslen(tempPath), pIter->FileName, min(FILE_NAME_MAX-1, pIter->FileNameLength));
-// todo : force conversion to longName
-
-		// queue new change
-		vecChanges.push_back(new FileActionInfo(tempPath, pIter->Action));
-
-		if(pIter->NextEntryOffset == 0UL) break;	
-
-		pIter = (PFILE_NOTIFY_INFORMATION) ((LPBYTE)pIter + pIter->NextEntryOffset);
-
-		if ((DWORD)((BYTE*)pIter - (BYTE*)pDir->pBuff) > (MAX_BUFF_SIZE * sizeof(FILE_NOTIFY_INFORMATION)))	{
-// todo : improve this
-			// buffer overflow : give up and abandon further changes notification for current batch
-			break;
+	LeaveCriticalSection(&this->csTracked);
+}
+
+/*
+Tracked files lying within a directory moved along with its content follow it.
+*/
+void FSChangeNotifier::UpdateTrackedTree(LPCWSTR oldPath, LPCWSTR newPath) {
+	EnterCriticalSection(&this->csTracked);
+	if(!this->mapTracked.empty()) {
+		wstring prefix = TrackedKey(oldPath) + FS_PATH_SEPARATOR;
+		vector<wstring> vecKeys;
+		for(unordered_map<wstring, FSTrackedFile>::iterator it = this->mapTracked.begin(); it != this->mapTracked.end(); ++it) {
+			if(it->first.compare(0, prefix.size(), prefix) == 0) vecKeys.push_back(it->first);
 		}
+		wstring newPrefix = TrackedKey(newPath) + FS_PATH_SEPARATOR;
+		for(UINT i = 0, uiCount = vecKeys.size(); i < uiCount; ++i) {
+			FSTrackedFile trackedFile = this->mapTracked[vecKeys[i]];
+			this->mapTracked.erase(vecKeys[i]);
+			wstring key = newPrefix + vecKeys[i].substr(prefix.size());
+			trackedFile.bQueued = FALSE;
+			trackedFile.fileId = FileActionInfo::ReadFileId(key.c_str());
+			this->mapTracked[key] = trackedFile;
+		}
+	}
+	LeaveCriticalSection(&this->csTracked);
+}
 
+/*
+A tracked file saved by replacement is the same file for the receiver, but its identity and content changed: both are read again.
+*/
+void FSChangeNotifier::RefreshTracked(LPCWSTR filePath) {
+	FSFingerprintJob* lpJob = NULL;
+	EnterCriticalSection(&this->csTracked);
+	if(!this->mapTracked.empty()) {
+		unordered_map<wstring, FSTrackedFile>::iterator it = this->mapTracked.find(TrackedKey(filePath));
+		if(it != this->mapTracked.end()) {
+			it->second.fileId = FileActionInfo::ReadFileId(filePath);
+			it->second.fingerprint = FileFingerprint();
+			it->second.bQueued = TRUE;
+			lpJob = new FSFingerprintJob(FS_FINGERPRINT_TRACK, filePath);
+			lpJob->fileId = it->second.fileId;
+		}
+	}
+	LeaveCriticalSection(&this->csTracked);
+	if(lpJob) this->QueueFingerprint(lpJob);
+}
 
-	 }
+void FSChangeNotifier::QueueFingerprint(FSFingerprintJob* lpJob) {
+	EnterCriticalSection(&this->csFingerprint);
+	this->queFingerprints.push_back(lpJob);
+	WakeConditionVariable(&this->cvFingerprint);
+	LeaveCriticalSection(&this->csFingerprint);
+}
 
-	// re-register current directory for receiving further changes
-	DWORD dwBytesReturned = 0;
-	if (!ReadDirectoryChangesW(pDir->hFile, pDir->pBuff, MAX_BUFF_SIZE * sizeof(FILE_NOTIFY_INFORMATION), pDir->bSubTree, FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME, &dwBytesReturned, &pDir->ol, NULL)) {
-		this->nLastError = E_FILESYSMON_ERRORREADDIR;
-		return NULL;
+/*
+Given 'removed' event (of given volume) is about to be handled as an actual removal: if it is a tracked file whose fingerprint is known,
+and some files were recently added on other volumes, they are compared with it by a fingerprinting thread, which notifies the outcome.
+Returns FALSE if the removal has to be notified right away.
+*/
+BOOL FSChangeNotifier::MatchContent(FSVolume* lpVolume, FileActionInfo* lpAction) {
+	FSFingerprintJob* lpJob = NULL;
+	EnterCriticalSection(&this->csTracked);
+	if(!this->mapTracked.empty()) {
+		unordered_map<wstring, FSTrackedFile>::iterator it = this->mapTracked.find(TrackedKey(lpAction->GetFilePath()));
+		if(it != this->mapTracked.end() && it->second.fingerprint.IsValid()) {
+			lpJob = new FSFingerprintJob(FS_FINGERPRINT_MATCH, lpAction->GetFilePath(), lpVolume->drive);
+			lpJob->fingerprint = it->second.fingerprint;
+		}
 	}
+	LeaveCriticalSection(&this->csTracked);
+	if(!lpJob) return FALSE;
 
-	return &vecChanges;
+	ULONGLONG ullWindow = (ULONGLONG) FS_FINGERPRINT_WINDOW * 1000000;
+	ULONGLONG ullSince = (lpAction->GetTicks() > ullWindow) ? lpAction->GetTicks() - ullWindow : 0;
+	this->crossIndex.GetRecent(lpVolume->drive, ullSince, FS_FINGERPRINT_CANDIDATES, &lpJob->vecCandidates);
+	if(lpJob->vecCandidates.empty()) {
+		delete lpJob;
+		return FALSE;
+	}
+	this->QueueFingerprint(lpJob);
+	return TRUE;
 }
 
+void FSChangeNotifier::RunFingerprint(FSFingerprintJob* lpJob) {
+	if(lpJob->type == FS_FINGERPRINT_TRACK) {
+		if(!lpJob->fileId) {
+			// identity of a newly tracked file is read first (a file without identity is not tracked)
+			ULONGLONG fileId = FileActionInfo::ReadFileId(lpJob->filePath.c_str());
+			EnterCriticalSection(&this->csTracked);
+			unordered_map<wstring, FSTrackedFile>::iterator it = this->mapTracked.find(TrackedKey(lpJob->filePath.c_str()));
+			// file might have been moved, refreshed or released meanwhile
+			BOOL bPending = (it != this->mapTracked.end() && it->second.fileId == 0);
+			if(bPending) {
+				if(fileId) it->second.fileId = fileId;
+				else this->mapTracked.erase(it);
+			}
+			LeaveCriticalSection(&this->csTracked);
+			if(!bPending || !fileId) return;
+			lpJob->fileId = fileId;
+		}
+		FileFingerprint fingerprint;
+		if(!FileFingerprint::Read(lpJob->filePath.c_str(), &fingerprint)) return;
+		EnterCriticalSection(&this->csTracked);
+		unordered_map<wstring, FSTrackedFile>::iterator it = this->mapTracked.find(TrackedKey(lpJob->filePath.c_str()));
+		// file might have been replaced meanwhile
+		if(it != this->mapTracked.end() && it->second.fileId == lpJob->fileId) {
+			it->second.fingerprint = fingerprint;
+			++this->nFingerprinted;
+		}
+		LeaveCriticalSection(&this->csTracked);
+		return;
+	}
 
+	// candidates of another size are dismissed without being opened
+	for(UINT i = 0, uiCount = lpJob->vecCandidates.size(); i < uiCount; ++i) {
+		LPCWSTR candidatePath = lpJob->vecCandidates[i].c_str();
+		ULONGLONG size;
+		FileFingerprint fingerprint;
+		if(!FileFingerprint::ReadSize(candidatePath, &size) || size != lpJob->fingerprint.size) continue;
+		if(!FileFingerprint::Read(candidatePath, &fingerprint) || !(fingerprint == lpJob->fingerprint)) continue;
+		// copy might have been claimed by another removal, or paired by name, in the meantime
+		if(!this->crossIndex.Claim(lpJob->vecCandidates[i], FILE_ACTION_ADDED)) continue;
+		EnterCriticalSection(&this->csTracked);
+		++this->nContentMoves;
+		LeaveCriticalSection(&this->csTracked);
+		this->Notify(FILE_ACTION_MOVED, (LPWSTR) lpJob->filePath.c_str(), (LPWSTR) candidatePath);
+		return;
+	}
+	this->Notify(FILE_ACTION_REMOVED, (LPWSTR) lpJob->filePath.c_str(), NULL);
+}
+
+/*
+Serve the fingerprinting jobs. It is meant to be invoked as a thread routine (FS_FINGERPRINT_WORKERS of them), with the notifier as parameter.
+Once stopped, threads leave as soon as the queue is empty: pending comparisons still notify their outcome, pending reads of tracked files are dropped.
+*/
+DWORD WINAPI FSChangeNotifier::ThreadFingerprint(LPVOID lpvd) {
+	FSChangeNotifier* fsChangeNotifier = (FSChangeNotifier*) lpvd;
+	while(TRUE) {
+		EnterCriticalSection(&fsChangeNotifier->csFingerprint);
+		while(fsChangeNotifier->bFingerprinting && fsChangeNotifier->queFingerprints.empty()) {
+			SleepConditionVariableCS(&fsChangeNotifier->cvFingerprint, &fsChangeNotifier->csFingerprint, INFINITE);
+		}
+		if(fsChangeNotifier->queFingerprints.empty()) {
+			LeaveCriticalSection(&fsChangeNotifier->csFingerprint);
+			break;
+		}
+		FSFingerprintJob* lpJob = fsChangeNotifier->queFingerprints.front();
+		fsChangeNotifier->queFingerprints.pop_front();
+		// tracked files left are read again once tracked files are given anew
+		BOOL bDrop = (!fsChangeNotifier->bFingerprinting && lpJob->type == FS_FINGERPRINT_TRACK);
+		LeaveCriticalSection(&fsChangeNotifier->csFingerprint);
+
+		if(!bDrop) fsChangeNotifier->RunFingerprint(lpJob);
+		if(lpJob->type == FS_FINGERPRINT_TRACK) {
+			EnterCriticalSection(&fsChangeNotifier->csTracked);
+			unordered_map<wstring, FSTrackedFile>::iterator it = fsChangeNotifier->mapTracked.find(TrackedKey(lpJob->filePath.c_str()));
+			if(it != fsChangeNotifier->mapTracked.end()) it->second.bQueued = FALSE;
+			LeaveCriticalSection(&fsChangeNotifier->csTracked);
+		}
+		delete lpJob;
+	}
+	return 0;
+}
+
+BOOL FSChangeNotifier::StartCapture(LPCWSTR capturePath) {
+	return this->capture.Open(capturePath);
+}
+
+void FSChangeNotifier::StopCapture() {
+	this->capture.Close();
+}
+
+
+/*
+Correlated events go through the coalescing window, if any.
+Held moves between volumes whose new path the event refers to, and held moves of an original toward a temporary name that it refers to, are notified first.
+*/
 void FSChangeNotifier::Notify(DWORD action, LPWSTR oldFileName, LPWSTR newFileName) {
+	vector<CoalescedAction> vecRelease;
+	vector<HeldMove> vecHeld;
+	EnterCriticalSection(&this->csNotify);
+	if(oldFileName || newFileName) {
+		EnterCriticalSection(&this->csSchedule);
+		if(oldFileName) this->subtrees.ReleaseTargets(oldFileName, &vecHeld);
+		this->saves.ReleaseTargets(oldFileName, &vecHeld);
+		this->saves.ReleaseTargets(newFileName, &vecHeld);
+		LeaveCriticalSection(&this->csSchedule);
+		this->NotifyHeldMoves(&vecHeld);
+	}
+	this->UpdateTracked(action, oldFileName, newFileName);
+	EnterCriticalSection(&this->csCoalesce);
+	if(this->bCoalescing) {
+		this->coalescer.Add(action, oldFileName, newFileName, FileActionInfo::GetCurrentTicks(), &vecRelease);
+		WakeConditionVariable(&this->cvCoalesce);
+		LeaveCriticalSection(&this->csCoalesce);
+		this->Deliver(&vecRelease);
+	}
+	else {
+		// coalescing thread might have left events behind
+		this->coalescer.Flush(&vecRelease);
+		LeaveCriticalSection(&this->csCoalesce);
+		this->Deliver(&vecRelease);
+		this->Deliver(action, oldFileName, newFileName);
+	}
+	LeaveCriticalSection(&this->csNotify);
+}
+
+/*
+Hand an event over to the bound windows and callbacks (csNotify must be held).
+*/
+void FSChangeNotifier::Deliver(DWORD action, LPWSTR oldFileName, LPWSTR newFileName) {
+#ifdef _WIN32
+	DWORD msg = 0;
+	switch(action) {
+	case FILE_ACTION_ADDED:		msg = WM_FSNOTIFY_ADDED;	break;
+	case FILE_ACTION_MOVED:		msg = WM_FSNOTIFY_MOVED;	break;
+	case FILE_ACTION_REMOVED:	msg = WM_FSNOTIFY_REMOVED;	break;
+	case FILE_ACTION_RESTORED:	msg = WM_FSNOTIFY_RESTORED;	break;
+	case FILE_ACTION_OVERFLOW:	msg = WM_FSNOTIFY_OVERFLOW;	break;
+	case FILE_ACTION_STOPPED:	msg = WM_FSNOTIFY_STOP;		break;
+	}
 	for(int i = 0, j = vechWndDest.size(); i < j; ++i) {
-		SendMessage(vechWndDest[i], action, (WPARAM) oldFileName, (LPARAM) newFileName);
+		SendMessage(vechWndDest[i], msg, (WPARAM) oldFileName, (LPARAM) newFileName);
+	}
+#endif
+	for(int i = 0, j = vecCallbacks.size(); i < j; ++i) {
+		vecCallbacks[i].lpfnNotify(action, oldFileName, newFileName, vecCallbacks[i].lpParam);
 	}
 }
 
-DWORD WINAPI FSChangeNotifier::DelayedRemoval(LPVOID lpvd) {
-	FileActionInfo* lpAction = (FileActionInfo*) lpvd;
-	FSChangeNotifier* fsChangeNotifier = FSChangeNotifier::GetInstance();
-	HANDLE hMutex = CreateMutex(NULL, FALSE, L"FSChangeThreads");
+void FSChangeNotifier::Deliver(vector<CoalescedAction>* vecActions) {
+	for(UINT i = 0, uiCount = vecActions->size(); i < uiCount; ++i) {
+		CoalescedAction* lpAction = &vecActions->at(i);
+		this->Deliver(lpAction->action, lpAction->oldPath.empty() ? NULL : (LPWSTR) lpAction->oldPath.c_str(), lpAction->newPath.empty() ? NULL : (LPWSTR) lpAction->newPath.c_str());
+	}
+}
 
-	Sleep(2000);	 
-	// wait for mutex
-	
-	WaitForSingleObject(hMutex, INFINITE);
-	if(fsChangeNotifier->changesQueue.Search(lpAction)) {
-		// if 'removed' event is still in the queue, handle it as an actual removal
-		fsChangeNotifier->Notify(WM_FSNOTIFY_REMOVED, lpAction->GetFilePath(), NULL);
-		// remove event from the queue		
-		fsChangeNotifier->changesQueue.Remove(lpAction);
+/*
+Notify held events as their coalescing window ends. It is meant to be invoked as a thread routine, with the notifier as parameter.
+*/
+DWORD WINAPI FSChangeNotifier::ThreadCoalesce(LPVOID lpvd) {
+	FSChangeNotifier* fsChangeNotifier = (FSChangeNotifier*) lpvd;
+	vector<CoalescedAction> vecRelease;
+	BOOL bLast = FALSE;
+
+	while(!bLast) {
+		EnterCriticalSection(&fsChangeNotifier->csCoalesce);
+		while(fsChangeNotifier->bCoalescing) {
+			ULONGLONG ullNow = FileActionInfo::GetCurrentTicks(), ullDeadline = fsChangeNotifier->coalescer.GetNextDeadline();
+			if(!fsChangeNotifier->coalescer.IsEmpty() && ullDeadline <= ullNow) break;
+			SleepConditionVariableCS(&fsChangeNotifier->cvCoalesce, &fsChangeNotifier->csCoalesce, fsChangeNotifier->coalescer.IsEmpty() ? INFINITE : (DWORD) ((ullDeadline - ullNow + 999) / 1000));
+		}
+		bLast = !fsChangeNotifier->bCoalescing;
+		LeaveCriticalSection(&fsChangeNotifier->csCoalesce);
+
+		// notifications lock comes first
+		EnterCriticalSection(&fsChangeNotifier->csNotify);
+		EnterCriticalSection(&fsChangeNotifier->csCoalesce);
+		if(bLast) fsChangeNotifier->coalescer.Flush(&vecRelease);
+		else fsChangeNotifier->coalescer.Release(FileActionInfo::GetCurrentTicks(), &vecRelease);
+		LeaveCriticalSection(&fsChangeNotifier->csCoalesce);
+		fsChangeNotifier->Deliver(&vecRelease);
+		LeaveCriticalSection(&fsChangeNotifier->csNotify);
+		vecRelease.clear();
+	}
+	return 0;
+}
+
+/*
+Moves between volumes are held until the rest of their subtree shows up (see SubtreeAggregator.h).
+*/
+void FSChangeNotifier::NotifyCrossMove(LPCWSTR oldFileName, LPCWSTR newFileName) {
+	EnterCriticalSection(&this->csSchedule);
+	ULONGLONG ullDeadline = this->subtrees.GetNextDeadline();
+	this->subtrees.Add(oldFileName, newFileName, FileActionInfo::GetCurrentTicks());
+	// scheduling thread only has to wake up if it was waiting for a later deadline
+	if(!ullDeadline || this->subtrees.GetNextDeadline() < ullDeadline) WakeConditionVariable(&this->cvSchedule);
+	LeaveCriticalSection(&this->csSchedule);
+}
+
+/*
+Given 'removed' event is the source directory of held moves between volumes, renamed on the way (its target was created as a new directory):
+it is held along with them. Returns FALSE otherwise.
+*/
+BOOL FSChangeNotifier::AdoptSubtree(FileActionInfo* lpAction) {
+	wstring newRoot;
+	EnterCriticalSection(&this->csSchedule);
+	BOOL result = this->subtrees.FindRoot(lpAction->GetFilePath(), &newRoot);
+	LeaveCriticalSection(&this->csSchedule);
+	if(!result || !this->crossIndex.Claim(newRoot, FILE_ACTION_ADDED)) return FALSE;
+	this->NotifyCrossMove(lpAction->GetFilePath(), newRoot.c_str());
+	return TRUE;
+}
+
+void FSChangeNotifier::NotifyHeldMoves(vector<HeldMove>* vecMoves) {
+	for(UINT i = 0, uiCount = vecMoves->size(); i < uiCount; ++i) {
+		HeldMove* lpMove = &vecMoves->at(i);
+		if(lpMove->bSubtree) this->UpdateTrackedTree(lpMove->oldPath.c_str(), lpMove->newPath.c_str());
+		this->Notify(FILE_ACTION_MOVED, (LPWSTR) lpMove->oldPath.c_str(), (LPWSTR) lpMove->newPath.c_str());
 	}
-	ReleaseMutex(hMutex);
+}
+
+/*
+An 'added' event that does not complete a move on its own volume:
+it is either the target of a move from another volume (whose 'removed' event was seen first) or a new file.
+*/
+void FSChangeNotifier::NotifyAdded(FSVolume* lpVolume, FileActionInfo* lpAction) {
+	wstring srcPath;
+	if(this->crossIndex.Take(lpAction->GetFileName(), FILE_ACTION_REMOVED, lpVolume->drive, lpAction->GetTicks(), &srcPath)) {
+		// file moved (pending removal on the other volume will find its entry gone)
+		this->NotifyCrossMove(srcPath.c_str(), lpAction->GetFilePath());
+	}
+	else {
+		// file added
+		this->Notify(FILE_ACTION_ADDED, NULL, lpAction->GetFilePath());
+		// might be the beginning of a move toward another volume
+		this->crossIndex.Publish(lpAction, lpVolume->drive);
+	}
+	delete lpAction;
+}
 
+/*
+Handle the 'removed' events that were not paired within FS_REMOVAL_DELAY as actual removals, notify the moves between volumes once their subtree is complete,
+the moves toward a temporary name that turned out not to be part of a save, and the subtrees whose event storm is over (as overflowed).
+It is meant to be invoked as a thread routine, with the notifier as parameter: a single thread serves all volumes,
+waking up for the earliest deadline and handling every removal (and releasing every held move) that is due by then.
+*/
+DWORD WINAPI FSChangeNotifier::ThreadSchedule(LPVOID lpvd) {
+	FSChangeNotifier* fsChangeNotifier = (FSChangeNotifier*) lpvd;
+	vector<FSRemoval*> vecDue;
+	vector<HeldMove> vecMoves;
+	vector<EventStorm> vecStorms;
+	BOOL bLast = FALSE;
+
+	while(!bLast) {
+		EnterCriticalSection(&fsChangeNotifier->csSchedule);
+		while(fsChangeNotifier->bScheduling) {
+			ULONGLONG ullNow = FileActionInfo::GetCurrentTicks(), ullDeadline = fsChangeNotifier->removals.GetNextDeadline(), ullMoves = fsChangeNotifier->subtrees.GetNextDeadline(), ullSaves = fsChangeNotifier->saves.GetNextDeadline();
+			ULONGLONG ullStorms = fsChangeNotifier->storms.GetNextDeadline();
+			if(!ullDeadline || (ullMoves && ullMoves < ullDeadline)) ullDeadline = ullMoves;
+			if(!ullDeadline || (ullSaves && ullSaves < ullDeadline)) ullDeadline = ullSaves;
+			if(!ullDeadline || (ullStorms && ullStorms < ullDeadline)) ullDeadline = ullStorms;
+			if(ullDeadline && ullDeadline <= ullNow) break;
+			SleepConditionVariableCS(&fsChangeNotifier->cvSchedule, &fsChangeNotifier->csSchedule, !ullDeadline ? INFINITE : (DWORD) ((ullDeadline - ullNow + 999) / 1000));
+		}
+		bLast = !fsChangeNotifier->bScheduling;
+		fsChangeNotifier->removals.Take(FileActionInfo::GetCurrentTicks(), bLast, &vecDue);
+		LeaveCriticalSection(&fsChangeNotifier->csSchedule);
+
+		for(UINT i = 0, uiCount = vecDue.size(); i < uiCount; ++i) {
+			FSRemoval* lpRemoval = vecDue[i];
+			FSVolume* lpVolume = lpRemoval->lpVolume;
+			// volume lock comes first (removals are cancelled by the correlation thread while it holds it)
+			EnterCriticalSection(&lpVolume->csChanges);
+			EnterCriticalSection(&fsChangeNotifier->csSchedule);
+			BOOL bPending = fsChangeNotifier->removals.Complete(lpRemoval);
+			LeaveCriticalSection(&fsChangeNotifier->csSchedule);
+			if(bPending) {
+				// if 'removed' event was not paired with another volume either, handle it as an actual removal
+				// (a tracked file might still be recognized by its content among the files added on other volumes)
+				if(fsChangeNotifier->crossIndex.Withdraw(lpRemoval->lpAction, lpVolume->drive)) {
+					// file went to the recycle bin: it is notified along with it (and not looked for on other volumes)
+					if(lpRemoval->lpAction->IsTrashed()) fsChangeNotifier->Notify(FILE_ACTION_REMOVED, lpRemoval->lpAction->GetFilePath(), fsChangeNotifier->GetRecycleBin(lpVolume->drive));
+					else if(!fsChangeNotifier->MatchContent(lpVolume, lpRemoval->lpAction)) fsChangeNotifier->Notify(FILE_ACTION_REMOVED, lpRemoval->lpAction->GetFilePath(), NULL);
+				}
+				lpVolume->changesQueue.Remove(lpRemoval->lpAction);
+			}
+			LeaveCriticalSection(&lpVolume->csChanges);
+			delete lpRemoval;
+		}
+		vecDue.clear();
+
+		// notifications lock comes first
+		EnterCriticalSection(&fsChangeNotifier->csNotify);
+		EnterCriticalSection(&fsChangeNotifier->csSchedule);
+		if(bLast) {
+			fsChangeNotifier->saves.Flush(&vecMoves);
+			fsChangeNotifier->subtrees.Flush(&vecMoves);
+			fsChangeNotifier->storms.Flush(&vecStorms);
+		}
+		else {
+			fsChangeNotifier->saves.Release(FileActionInfo::GetCurrentTicks(), &vecMoves);
+			fsChangeNotifier->subtrees.Release(FileActionInfo::GetCurrentTicks(), &vecMoves);
+			fsChangeNotifier->storms.Release(FileActionInfo::GetCurrentTicks(), &vecStorms);
+		}
+		for(UINT i = 0, uiCount = vecStorms.size(); i < uiCount; ++i) {
+			if(fsChangeNotifier->queStorms.size() == FS_STORM_LOG) fsChangeNotifier->queStorms.pop_front();
+			fsChangeNotifier->queStorms.push_back(vecStorms[i]);
+		}
+		LeaveCriticalSection(&fsChangeNotifier->csSchedule);
+		fsChangeNotifier->NotifyHeldMoves(&vecMoves);
+		// changes within a subtree whose storm is over were not correlated: the receiver has to reconcile it
+		for(UINT i = 0, uiCount = vecStorms.size(); i < uiCount; ++i) {
+			fsChangeNotifier->Notify(FILE_ACTION_OVERFLOW, (LPWSTR) vecStorms[i].path.c_str(), NULL);
+		}
+		LeaveCriticalSection(&fsChangeNotifier->csNotify);
+		vecMoves.clear();
+		vecStorms.clear();
+	}
 	return 0;
 }
 
 /*
-This function uses FSChangeNotifier::FetchChanges to detect changes and calls FSChangeNotifier::Callback (pointer to user's custom function) passing action, file_old_name and file_new_name as parameters.
-It is meant to be invoked as a thread routine.
+Schedule given 'removed' event (queued by given volume) to be handled as an actual removal unless it is paired within given delay (ms).
+*/
+void FSChangeNotifier::ScheduleRemoval(FSVolume* lpVolume, FileActionInfo* lpAction, DWORD dwDelay) {
+	ULONGLONG ullDeadline = FileActionInfo::GetCurrentTicks() + (ULONGLONG) dwDelay * 1000;
+	EnterCriticalSection(&this->csSchedule);
+	BOOL bEarliest = this->removals.IsEmpty() || this->removals.GetNextDeadline() > ullDeadline;
+	this->removals.Schedule(lpVolume, lpAction, ullDeadline);
+	// scheduling thread only has to wake up if it was waiting for a later deadline
+	if(bEarliest) WakeConditionVariable(&this->cvSchedule);
+	LeaveCriticalSection(&this->csSchedule);
+}
+
+void FSChangeNotifier::CancelRemoval(FileActionInfo* lpAction) {
+	EnterCriticalSection(&this->csSchedule);
+	this->removals.Cancel(lpAction);
+	LeaveCriticalSection(&this->csSchedule);
+}
+
+/*
+Count given event toward the event storms. Returns TRUE if it lies within a quarantined subtree, in which case it is not to be correlated.
+Called by the correlation threads (csChanges held).
+*/
+BOOL FSChangeNotifier::FilterStorm(FileActionInfo* lpAction) {
+	// overflows refer to a whole root
+	if(lpAction->GetAction() == FILE_ACTION_OVERFLOW) return FALSE;
+	EnterCriticalSection(&this->csSchedule);
+	UINT nStorms = this->storms.GetStormCount();
+	BOOL result = this->storms.Filter(lpAction->GetFilePath(), lpAction->GetTicks());
+	// scheduling thread has to wait for the end of the new storm as well
+	if(this->storms.GetStormCount() != nStorms) WakeConditionVariable(&this->cvSchedule);
+	LeaveCriticalSection(&this->csSchedule);
+	return result;
+}
+
+/*
+Drop the pending 'removed' event of given path (seen at or after given ticks), unless it was paired with another volume in the meantime.
+Only a removal toward the recycle bin is dropped if bTrashed is set, and only another one otherwise. Returns FALSE if there is none.
+*/
+BOOL FSChangeNotifier::DropRemoval(FSVolume* lpVolume, LPCWSTR filePath, ULONGLONG ullSince, BOOL bTrashed) {
+	FileActionInfo* lpRemoved = lpVolume->changesQueue.NewestPath(filePath, FILE_ACTION_REMOVED, ullSince);
+	if(!lpRemoved || lpRemoved->IsTrashed() != bTrashed) return FALSE;
+	if(!this->crossIndex.Withdraw(lpRemoved, lpVolume->drive)) return FALSE;
+	this->CancelRemoval(lpRemoved);
+	lpVolume->changesQueue.Remove(lpRemoved);
+	return TRUE;
+}
+
+/*
+Events taking part in the save of a file by replacement (see SaveRecognizer.h), for a move (lpSource being its old name) or an addition (lpSource is NULL).
+Returns TRUE if given event is not to be notified:
+1) a file taking the name of an original that was set aside or removed within FS_SAVE_WINDOW is its new content: the original is unchanged
+(unless a tracked file is moved there, in which case the move is notified and the removal dropped)
+2) a move toward a temporary name, within the same directory, is held as an original being set aside
+Called by the correlation thread of given volume (csChanges held).
+*/
+BOOL FSChangeNotifier::FilterSave(FSVolume* lpVolume, FileActionInfo* lpSource, FileActionInfo* lpAction) {
+	ULONGLONG ullWindow = (ULONGLONG) FS_SAVE_WINDOW * 1000;
+	ULONGLONG ullSince = (lpAction->GetTicks() > ullWindow) ? lpAction->GetTicks() - ullWindow : 0;
+	wstring asidePath;
+
+	if(lpSource && this->GetTrackedId(lpSource->GetFilePath())) {
+		// tracked file replacing a removed one: that removal would otherwise be notified after the move
+		this->DropRemoval(lpVolume, lpAction->GetFilePath(), ullSince);
+	}
+	else {
+		EnterCriticalSection(&this->csSchedule);
+		BOOL bReplaced = this->saves.Replace(lpAction->GetFilePath(), FileActionInfo::GetCurrentTicks(), &asidePath);
+		LeaveCriticalSection(&this->csSchedule);
+		if(bReplaced) {
+			// set-aside file might already be removed
+			if(this->DropRemoval(lpVolume, asidePath.c_str(), 0)) {
+				EnterCriticalSection(&this->csSchedule);
+				this->saves.TakeRemoval(asidePath.c_str());
+				LeaveCriticalSection(&this->csSchedule);
+			}
+			this->RefreshTracked(lpAction->GetFilePath());
+			return TRUE;
+		}
+		if(this->DropRemoval(lpVolume, lpAction->GetFilePath(), ullSince)) {
+			EnterCriticalSection(&this->csSchedule);
+			this->saves.CountSave();
+			LeaveCriticalSection(&this->csSchedule);
+			this->RefreshTracked(lpAction->GetFilePath());
+			return TRUE;
+		}
+	}
+
+	if(lpSource && SaveRecognizer::IsTempName(lpAction->GetFileName()) && !SaveRecognizer::IsTempName(lpSource->GetFileName()) && SameDirectory(lpSource, lpAction)) {
+		EnterCriticalSection(&this->csSchedule);
+		ULONGLONG ullDeadline = this->saves.GetNextDeadline();
+		this->saves.Hold(lpSource->GetFilePath(), lpAction->GetFilePath(), FileActionInfo::GetCurrentTicks());
+		// scheduling thread only has to wake up if it was waiting for a later deadline
+		if(!ullDeadline || this->saves.GetNextDeadline() < ullDeadline) WakeConditionVariable(&this->cvSchedule);
+		LeaveCriticalSection(&this->csSchedule);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+This function uses WatcherBackend::FetchChanges to detect changes on a volume, and hands the fetched events over to the correlation thread.
+It is meant to be invoked as a thread routine, with the FSVolume to watch as parameter.
+Nothing else is done here, so that the OS buffers are drained as fast as possible:
+this thread only waits when the correlation thread falls behind by a whole ring.
+*/
+DWORD WINAPI FSChangeNotifier::ThreadWatch(LPVOID lpvd) {
+	FSVolume* lpVolume = (FSVolume*) lpvd;
+	FSChangeNotifier* fsChangeNotifier = FSChangeNotifier::GetInstance();
+	vector<FileActionInfo*> vecChanges;
+
+	// main loop
+	while ( lpVolume->lpBackend->FetchChanges(&vecChanges) ) {
+		fsChangeNotifier->capture.Write(&vecChanges);
+		for (UINT i = 0, uiCount = vecChanges.size(); i < uiCount; ++i) {
+			lpVolume->ring.Push(vecChanges[i]);
+		}
+		vecChanges.clear();
+	}
+	lpVolume->bRunning = FALSE;
+	lpVolume->nError = lpVolume->lpBackend->GetLastError();
+	// tell correlation thread to leave
+	lpVolume->ring.Push(NULL);
+	return 0;
+}
+
+/*
+Recycle bin holding given path (NULL if it lies within none of the recycle bins given to SetRecycleBins).
+Recycle bins are few (one per volume): they are simply compared in turn.
+*/
+LPWSTR FSChangeNotifier::FindRecycleBin(LPCWSTR filePath) {
+	LPWSTR result = NULL;
+	SIZE_T len = wcslen(filePath);
+	EnterCriticalSection(&this->csConfig);
+	for(UINT i = 0, uiCount = this->queRecycleBins.size(); !result && i < uiCount; ++i) {
+		wstring& path = this->queRecycleBins[i].path;
+		if(len <= path.size()) continue;
+#ifdef _WIN32
+		if(_wcsnicmp(filePath, path.c_str(), path.size()) == 0) result = (LPWSTR) path.c_str();
+#else
+		if(wcsncmp(filePath, path.c_str(), path.size()) == 0) result = (LPWSTR) path.c_str();
+#endif
+	}
+	LeaveCriticalSection(&this->csConfig);
+	return result;
+}
+
+/*
+Recycle bin of given volume (NULL if none was given).
+*/
+LPWSTR FSChangeNotifier::GetRecycleBin(CHAR drive) {
+	LPWSTR result = NULL;
+	EnterCriticalSection(&this->csConfig);
+	// latest one first: a volume given another recycle bin since it was started
+	for(INT i = this->queRecycleBins.size() - 1; !result && i >= 0; --i) {
+		if(this->queRecycleBins[i].drive == drive) result = (LPWSTR) this->queRecycleBins[i].path.c_str();
+	}
+	LeaveCriticalSection(&this->csConfig);
+	return result;
+}
+
+/*
+Given path is an item of a recycle bin.
+*/
+BOOL FSChangeNotifier::IsRecycled(LPCWSTR filePath) {
+	EnterCriticalSection(&this->csConfig);
+	BOOL bEmpty = this->queRecycleBins.empty();
+	LeaveCriticalSection(&this->csConfig);
+	if(bEmpty) return wcsstr(filePath, FS_RECYCLE_MARK) != NULL;
+	return this->FindRecycleBin(filePath) != NULL;
+}
+
+/*
+Given path is excluded from monitoring (see AddExclusion).
+*/
+BOOL FSChangeNotifier::IsExcluded(LPCWSTR filePath) {
+	EnterCriticalSection(&this->csConfig);
+	BOOL result = this->exclusions.IsExcluded(filePath);
+	LeaveCriticalSection(&this->csConfig);
+	return result;
+}
+
+/*
+Given 'added' event is an item of a recycle bin: the pending 'removed' event of given volume it comes from is marked as trashed.
+That is the event having the same file identity or else, among the FS_PAIRING_SCAN latest events not marked yet, the closest one in time
+having the same filename (freedesktop.org trash) or, failing that, the same extension (Windows renames the item $R<id>.<ext>).
+Windows also adds a $I<id>.<ext> item holding the original path: it is not the file itself.
+*/
+void FSChangeNotifier::MarkTrashed(FSVolume* lpVolume, FileActionInfo* lpAction) {
+	ULONGLONG ullWindow = (ULONGLONG) FS_REMOVAL_DELAY * 1000;
+	ULONGLONG ullSince = (lpAction->GetTicks() > ullWindow) ? lpAction->GetTicks() - ullWindow : 0;
+	FileActionInfo* lpBest = NULL;
+
+	if(!lpAction->GetFileName()) return;
+#ifdef _WIN32
+	if(wcsncmp(lpAction->GetFileName(), L"$I", 2) == 0) return;
+#endif
+	lpBest = lpVolume->changesQueue.Find(lpAction->GetFileId());
+	if(lpBest && lpBest->GetAction() == FILE_ACTION_REMOVED) {
+		lpBest->SetTrashed(TRUE);
+		return;
+	}
+	lpBest = NULL;
+
+	UINT nBestScore = 0, nScan = 0;
+	for(FileActionInfo* lpCandidate = lpVolume->changesQueue.Last(); lpCandidate && nScan < FS_PAIRING_SCAN && lpCandidate->GetTicks() >= ullSince; lpCandidate = lpVolume->changesQueue.Previous(lpCandidate), ++nScan) {
+		if(lpCandidate->GetAction() != FILE_ACTION_REMOVED || lpCandidate->IsTrashed() || this->IsRecycled(lpCandidate->GetFilePath())) continue;
+		if(lpCandidate->GetFileId() && lpAction->GetFileId()) continue;
+		UINT nScore = 0;
+		if(lpCandidate->GetFileName() && SamePath(lpCandidate->GetFileName(), lpAction->GetFileName())) nScore = 2;
+		else if(SameExtension(lpCandidate, lpAction)) nScore = 1;
+		// candidates are met from the latest one: on a tie, the closest in time wins
+		if(nScore > nBestScore) {
+			lpBest = lpCandidate;
+			nBestScore = nScore;
+		}
+	}
+	if(lpBest) lpBest->SetTrashed(TRUE);
+}
+
+/*
+Pending 'removed' event of given volume that given 'added' event completes, or NULL if there is none.
+An event having the same file identity is the one, whatever its name and age. Otherwise, the events seen within FS_REMOVAL_DELAY
+before the 'added' one are candidates (unless both identities are known and differ: a moved file keeps its identity), ranked by:
+1) same filename (file moved): the latest one, found through the filename index whatever the number of pending events
+2) recycle bin item (file restored, under a generated name): among the FS_PAIRING_SCAN latest events, the closest one in time having the same extension, if any
+Events of other files seen in-between do not prevent the pairing.
+*/
+FileActionInfo* FSChangeNotifier::PairRemoved(FSVolume* lpVolume, FileActionInfo* lpAction) {
+	ULONGLONG ullWindow = (ULONGLONG) FS_REMOVAL_DELAY * 1000;
+	ULONGLONG ullSince = (lpAction->GetTicks() > ullWindow) ? lpAction->GetTicks() - ullWindow : 0;
+	FileActionInfo* lpBest = NULL;
+
+	// identity of the new file is only worth reading if pending events have one
+	if(!lpAction->GetFileId() && lpVolume->changesQueue.GetIdentifiedCount()) lpAction->SetFileId(FileActionInfo::ReadFileId(lpAction->GetFilePath()));
+	if( (lpBest = lpVolume->changesQueue.Find(lpAction->GetFileId())) != NULL ) return lpBest;
+
+	if(lpAction->GetFileName()) lpBest = lpVolume->changesQueue.Newest(lpAction->GetFileName(), FILE_ACTION_REMOVED, ullSince);
+	if(lpBest) {
+		// identity of a tracked file tells whether the new file is the same one
+		ULONGLONG candidateId = (lpBest->GetFileId()) ? lpBest->GetFileId() : this->GetTrackedId(lpBest->GetFilePath());
+		if(candidateId && !lpAction->GetFileId()) lpAction->SetFileId(FileActionInfo::ReadFileId(lpAction->GetFilePath()));
+		if(!candidateId || !lpAction->GetFileId() || candidateId == lpAction->GetFileId()) return lpBest;
+		lpBest = NULL;
+	}
+
+	UINT nBestScore = 0, nScan = 0;
+	for(FileActionInfo* lpCandidate = lpVolume->changesQueue.Last(); lpCandidate && nScan < FS_PAIRING_SCAN && lpCandidate->GetTicks() >= ullSince; lpCandidate = lpVolume->changesQueue.Previous(lpCandidate), ++nScan) {
+		if(lpCandidate->GetAction() != FILE_ACTION_REMOVED || !this->IsRecycled(lpCandidate->GetFilePath())) continue;
+		if(lpCandidate->GetFileId() && lpAction->GetFileId()) continue;
+		UINT nScore = SameExtension(lpCandidate, lpAction) ? 2 : 1;
+		// candidates are met from the latest one: on a tie, the closest in time wins
+		if(nScore > nBestScore) {
+			lpBest = lpCandidate;
+			nBestScore = nScore;
+		}
+	}
+	return lpBest;
+}
+
+/*
+Pending old name of given volume that given new name completes, or NULL if there is none.
+Old names seen within FS_RENAME_WINDOW are candidates (backends deliver both names together, but watched roots sharing a volume may interleave),
+ranked by: same file identity, then same filename (file moved), then same directory (file renamed), then closest in time.
+*/
+FileActionInfo* FSChangeNotifier::PairOldName(FSVolume* lpVolume, FileActionInfo* lpAction) {
+	ULONGLONG ullWindow = (ULONGLONG) FS_RENAME_WINDOW * 1000;
+	ULONGLONG ullSince = (lpAction->GetTicks() > ullWindow) ? lpAction->GetTicks() - ullWindow : 0;
+	FileActionInfo* lpBest = NULL;
+	UINT nBestScore = 0, nScan = 0;
+
+	for(FileActionInfo* lpCandidate = lpVolume->renamesQueue.Last(); lpCandidate && nScan < FS_PAIRING_SCAN && lpCandidate->GetTicks() >= ullSince; lpCandidate = lpVolume->renamesQueue.Previous(lpCandidate), ++nScan) {
+		UINT nScore = 1;
+		if(lpCandidate->GetFileId() && lpCandidate->GetFileId() == lpAction->GetFileId()) nScore = 4;
+		else if(lpCandidate->GetFileName() && lpAction->GetFileName() && wcscmp(lpCandidate->GetFileName(), lpAction->GetFileName()) == 0) nScore = 3;
+		else if(SameDirectory(lpCandidate, lpAction)) nScore = 2;
+		if(nScore > nBestScore) {
+			lpBest = lpCandidate;
+			nBestScore = nScore;
+		}
+	}
+	return lpBest;
+}
+
+/*
+Drop the old names of given volume that waited for their new name longer than FS_RENAME_WINDOW (at given ticks).
+*/
+void FSChangeNotifier::ExpireOldNames(FSVolume* lpVolume, ULONGLONG ullNow) {
+	ULONGLONG ullWindow = (ULONGLONG) FS_RENAME_WINDOW * 1000;
+	FileActionInfo* lpAction;
+	while( (lpAction = lpVolume->renamesQueue.First()) != NULL && lpAction->GetTicks() + ullWindow < ullNow ) {
+		lpVolume->renamesQueue.Remove(lpAction);
+	}
+}
+
+/*
+This function correlates the events fetched by the watching thread of a volume and calls FSChangeNotifier::Notify passing action, file_old_name and file_new_name as parameters.
+It is meant to be invoked as a thread routine, with the FSVolume to watch as parameter.
 Possible invoked actions are: 
 - FILE_ACTION_ADDED		a file was created
 - FILE_ACTION_REMOVED	a file was deleted
 - FILE_ACTION_MOVED		a file was renamed or moved
 - FILE_ACTION_RESTORED	a file was brought back from recylce bin
+- FILE_ACTION_OVERFLOW	some events were lost for a watched root, or suspended for a subtree during an event storm (which should then be reconciled)
 
 Things that could be improved:
 - if two files with same filename are created during same session on different volumes and afteward one of them is deleted, this will erroneously be handled as a 'moved' event
 - a 'moved' event between two distinct volumes will also generate an 'added' event
-- with time, FILE_ACTION_INFO queue might grow big (because 'added' events are never deleted since they might be the beginning of a 'moved' event) : we could add a max delay for 'moved' events
+- a move between two volumes whose 'removed' event comes after the 'added' one has expired (see SetPendingLimits) is seen as an addition and a removal
 */
-DWORD WINAPI FSChangeNotifier::ThreadWatch(LPVOID lpvd) {
+DWORD WINAPI FSChangeNotifier::ThreadCorrelate(LPVOID lpvd) {
+	FSVolume* lpVolume = (FSVolume*) lpvd;
 	FSChangeNotifier* fsChangeNotifier = FSChangeNotifier::GetInstance();
-	vector<FileActionInfo*>* vecChanges;
-	FileActionInfo* lpAction;
-	HANDLE hMutex = CreateMutex(NULL, FALSE, L"FSChangeThreads");
+	FileActionInfo* lpNewAction;
+	wstring dstPath;
 
-	// main loop
-	while ( (vecChanges = fsChangeNotifier->FetchChanges()) ) {
-		for (UINT i = 0, uiCount = vecChanges->size(); i < uiCount; ++i) {
-			WaitForSingleObject(hMutex, INFINITE);
-
-			FileActionInfo* lpNewAction = vecChanges->at(i);
-			FileActionInfo* lpLastAction = fsChangeNotifier->changesQueue.Last();
-
-			// check for exclusion list
-			BOOL exclusion = FALSE;
-			for(UINT j = 0, uiSize = fsChangeNotifier->vecExclusions.size(); j < uiSize; ++j) {
-				if(wcsstr(lpNewAction->GetFilePath(), fsChangeNotifier->vecExclusions.at(j).c_str())) {
-					exclusion = TRUE;
-					break;
-				}				
-			} if(!exclusion) {
-				switch(lpNewAction->GetAction()) {
-				case FILE_ACTION_ADDED:					
-						if(lpLastAction && lpLastAction->GetAction() == FILE_ACTION_REMOVED && lpLastAction->GetDrive() == lpNewAction->GetDrive() ) {
-	// todo : use previously retrieved recycle bin(s) exact path
-							if(wcsstr(lpNewAction->GetFilePath(), L"RECYCLE")) {
-								// deletion toward recycle bin: delayed removal will handle this
-							}
-							else if(wcsstr(lpLastAction->GetFilePath(), L"RECYCLE")) {
-								// file restored
-								fsChangeNotifier->Notify(WM_FSNOTIFY_RESTORED, lpNewAction->GetFilePath(), NULL);
-								// remove 'added' event from queue
-								fsChangeNotifier->changesQueue.Remove(lpLastAction);
-							}
-							else {
-								if(wcscmp(lpLastAction->GetFileName(), lpNewAction->GetFileName()) == 0 ) {
-									// file moved
-									fsChangeNotifier->Notify(WM_FSNOTIFY_MOVED, lpLastAction->GetFilePath(), lpNewAction->GetFilePath());
-									// remove 'added' event from queue
-									fsChangeNotifier->changesQueue.Remove(lpLastAction);
-								}
-								else {
-									// file added
-									fsChangeNotifier->Notify(WM_FSNOTIFY_ADDED, NULL, lpNewAction->GetFilePath());
-									// push 'added' event to queue
-									fsChangeNotifier->changesQueue.Add(lpNewAction);
-								}							
+	// main loop (watching thread pushes NULL when it leaves)
+	while ( (lpNewAction = lpVolume->ring.Pop()) != NULL ) {
+		EnterCriticalSection(&lpVolume->csChanges);
+
+		FileActionInfo* lpPairedAction;
+		BOOL bIdentified, bSaved, bOldRecycled, bNewRecycled;
+
+		// old names left without their new name will never be paired
+		fsChangeNotifier->ExpireOldNames(lpVolume, lpNewAction->GetTicks());
+
+		// check for exclusion list
+		if(fsChangeNotifier->IsExcluded(lpNewAction->GetFilePath())) {
+			delete lpNewAction;
+		}
+		else if(fsChangeNotifier->FilterStorm(lpNewAction)) {
+			// subtree in an event storm: it is reconciled once quiet
+			delete lpNewAction;
+		}
+		else {
+			switch(lpNewAction->GetAction()) {
+			case FILE_ACTION_ADDED:
+				if(fsChangeNotifier->IsRecycled(lpNewAction->GetFilePath())) {
+					// deletion toward recycle bin: delayed removal will handle this (the removed file is marked as trashed)
+					fsChangeNotifier->MarkTrashed(lpVolume, lpNewAction);
+					delete lpNewAction;
+				}
+				else if(fsChangeNotifier->FilterSave(lpVolume, NULL, lpNewAction)) {
+					// file saved in place (or saved file replacing an original set aside)
+					delete lpNewAction;
+				}
+				else if( (lpPairedAction = fsChangeNotifier->PairRemoved(lpVolume, lpNewAction)) != NULL ) {
+					// 'removed' event might already have been paired with an 'added' event on another volume
+					if(fsChangeNotifier->crossIndex.Withdraw(lpPairedAction, lpVolume->drive)) {
+						if(fsChangeNotifier->IsRecycled(lpPairedAction->GetFilePath())) {
+							// file restored (unless its removal toward the recycle bin is still pending: nothing happened then)
+							if(!fsChangeNotifier->DropRemoval(lpVolume, lpNewAction->GetFilePath(), 0, TRUE)) {
+								fsChangeNotifier->Notify(FILE_ACTION_RESTORED, lpNewAction->GetFilePath(), fsChangeNotifier->FindRecycleBin(lpPairedAction->GetFilePath()));
 							}
 						}
 						else {
-							// file added
-							fsChangeNotifier->Notify(WM_FSNOTIFY_ADDED, NULL, lpNewAction->GetFilePath());
-							// push 'added' event to queue
-							fsChangeNotifier->changesQueue.Add(lpNewAction);
+							// file moved
+							fsChangeNotifier->Notify(FILE_ACTION_MOVED, lpPairedAction->GetFilePath(), lpNewAction->GetFilePath());
 						}
-					break;
-				case FILE_ACTION_REMOVED:
-					CHAR otherDrives[27];
-					for(UINT j = 0, k = 0, uiSize = strlen(fsChangeNotifier->drives); j < uiSize; ++j) {
-						if(fsChangeNotifier->drives[j] != lpNewAction->GetDrive()) {
-							otherDrives[k] = fsChangeNotifier->drives[j];
-							otherDrives[++k] = 0;
-						}					
+						delete lpNewAction;
 					}
-					// search the queue for an 'added' event for the same filename on a different volume				
-					if(lpAction = fsChangeNotifier->changesQueue.Search(lpNewAction->GetFileName(), FILE_ACTION_ADDED, otherDrives)) {
-						// file moved
-						fsChangeNotifier->Notify(WM_FSNOTIFY_MOVED, lpNewAction->GetFilePath(), lpAction->GetFilePath());
-						// remove 'removed' event from queue
-						fsChangeNotifier->changesQueue.Remove(lpAction);
+					else fsChangeNotifier->NotifyAdded(lpVolume, lpNewAction);
+					// remove 'removed' event from queue
+					fsChangeNotifier->CancelRemoval(lpPairedAction);
+					lpVolume->changesQueue.Remove(lpPairedAction);
+				}
+				else fsChangeNotifier->NotifyAdded(lpVolume, lpNewAction);
+				break;
+			case FILE_ACTION_REMOVED:
+				bIdentified = (lpNewAction->GetFileId() != 0);
+				EnterCriticalSection(&fsChangeNotifier->csSchedule);
+				bSaved = fsChangeNotifier->saves.TakeRemoval(lpNewAction->GetFilePath());
+				LeaveCriticalSection(&fsChangeNotifier->csSchedule);
+				if(bSaved) {
+					// original set aside by a save: file is unchanged
+					delete lpNewAction;
+				}
+				// search for an 'added' event for the same filename on a different volume				
+				else if(fsChangeNotifier->crossIndex.Take(lpNewAction->GetFileName(), FILE_ACTION_ADDED, lpVolume->drive, lpNewAction->GetTicks(), &dstPath)) {
+					// file moved
+					fsChangeNotifier->NotifyCrossMove(lpNewAction->GetFilePath(), dstPath.c_str());
+					delete lpNewAction;
+				}
+				else if(fsChangeNotifier->AdoptSubtree(lpNewAction)) {
+					// directory moved (and renamed) along with its content
+					delete lpNewAction;
+				}
+				else {
+					lpVolume->changesQueue.Add(lpNewAction);
+					// target might still show up on another volume
+					fsChangeNotifier->crossIndex.Publish(lpNewAction, lpVolume->drive);
+					fsChangeNotifier->ScheduleRemoval(lpVolume, lpNewAction, bIdentified ? FS_IDENTIFIED_REMOVAL_DELAY : FS_REMOVAL_DELAY);
+				}
+				break;
+			case FILE_ACTION_RENAMED_OLD_NAME:
+				// wait for the new name
+				lpVolume->renamesQueue.Add(lpNewAction);
+				break;
+			case FILE_ACTION_RENAMED_NEW_NAME:
+				if( (lpPairedAction = fsChangeNotifier->PairOldName(lpVolume, lpNewAction)) != NULL ) {
+					bOldRecycled = fsChangeNotifier->IsRecycled(lpPairedAction->GetFilePath());
+					bNewRecycled = fsChangeNotifier->IsRecycled(lpNewAction->GetFilePath());
+					// renamed into the recycle bin (freedesktop.org trash), or out of it
+					if(bNewRecycled && !bOldRecycled) {
+						fsChangeNotifier->Notify(FILE_ACTION_REMOVED, lpPairedAction->GetFilePath(), fsChangeNotifier->FindRecycleBin(lpNewAction->GetFilePath()));
+					}
+					else if(bOldRecycled && !bNewRecycled) {
+						if(!fsChangeNotifier->DropRemoval(lpVolume, lpNewAction->GetFilePath(), 0, TRUE)) {
+							fsChangeNotifier->Notify(FILE_ACTION_RESTORED, lpNewAction->GetFilePath(), fsChangeNotifier->FindRecycleBin(lpPairedAction->GetFilePath()));
+						}
 					}
-					else {
-						fsChangeNotifier->changesQueue.Add(lpNewAction);					
-						CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) DelayedRemoval, (LPVOID) lpNewAction, 0, NULL);
+					// part of a save: file is unchanged (or its move is held until the save completes)
+					else if(!fsChangeNotifier->FilterSave(lpVolume, lpPairedAction, lpNewAction)) {
+						fsChangeNotifier->Notify(FILE_ACTION_MOVED, lpPairedAction->GetFilePath(), lpNewAction->GetFilePath());
 					}
-					break;
-				case FILE_ACTION_RENAMED_OLD_NAME:
-					// push 'renamed' event to queue
-					fsChangeNotifier->changesQueue.Add(lpNewAction);
-					break;
-				case FILE_ACTION_RENAMED_NEW_NAME:
-					if(lpLastAction && lpLastAction->GetAction() == FILE_ACTION_RENAMED_OLD_NAME) {					
-						fsChangeNotifier->Notify(WM_FSNOTIFY_MOVED, lpLastAction->GetFilePath(), lpNewAction->GetFilePath());
-						fsChangeNotifier->changesQueue.Remove(lpLastAction);
-					}				
-					break;
-				default:
-					delete lpNewAction;
-					break;
+					lpVolume->renamesQueue.Remove(lpPairedAction);
 				}
+				delete lpNewAction;
+				break;
+			case FILE_ACTION_OVERFLOW:
+				// pending events of that root can no longer be trusted to be paired: let the receiver reconcile it
+				fsChangeNotifier->Notify(FILE_ACTION_OVERFLOW, lpNewAction->GetFilePath(), NULL);
+				delete lpNewAction;
+				break;
+			default:
+				delete lpNewAction;
+				break;
 			}
-			ReleaseMutex(hMutex);
 		}
+		LeaveCriticalSection(&lpVolume->csChanges);
+	}
+	// old names still waiting will never be paired
+	EnterCriticalSection(&lpVolume->csChanges);
+	fsChangeNotifier->ExpireOldNames(lpVolume, (ULONGLONG) -1);
+	LeaveCriticalSection(&lpVolume->csChanges);
+	// an interruption is a regular stop
+	if(lpVolume->nError != E_FILESYSMON_INTERRUPTED) {
+		fsChangeNotifier->nLastError = lpVolume->nError;
+		fsChangeNotifier->Notify(FILE_ACTION_STOPPED, NULL, NULL);
 	}
-	fsChangeNotifier->Notify(WM_FSNOTIFY_STOP, NULL, NULL);
 	return 0;
 }
\ No newline at end of file
@@ -1,4 +1,4 @@
-/* FSChangeNotifier.h - interface for monitoring File System changes using ReadDirectoryChangesW				  	
+/* FSChangeNotifier.h - interface for monitoring File System changes
 
     This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
     Copyright (C) Cedric Francoys, 2016, Yegen
@@ -9,105 +9,420 @@
 
 
 #pragma once
-#include <Windows.h>
+#include "fscompat.h"
+#include "WatcherBackend.h"
 #include "FileActionInfo.h"
 #include "FileActionQueue.h"
+#include "FileActionRing.h"
+#include "CrossVolumeIndex.h"
+#include "FileActionCoalescer.h"
+#include "EventCapture.h"
+#include "ExclusionMatcher.h"
+#include "RemovalScheduler.h"
+#include "SubtreeAggregator.h"
+#include "SaveRecognizer.h"
+#include "StormDetector.h"
+#include "FileFingerprint.h"
 
 #include <vector>
+#include <deque>
+#include <unordered_map>
 using std::vector;
+using std::deque;
+using std::unordered_map;
 
-#ifndef FILE_NAME_MAX
-	#define FILE_NAME_MAX 1024
-#endif
-
-#define MAX_BUFF_SIZE  256
+// delay (ms) after which a 'removed' event that was not paired is handled as an actual removal
+#define FS_REMOVAL_DELAY	2000
+// same delay, for a 'removed' event whose file identity was reported by the backend (the 'added' half of a move on the same volume comes along with it)
+#define FS_IDENTIFIED_REMOVAL_DELAY	500
+// number of threads reading fingerprints
+#define FS_FINGERPRINT_WORKERS		2
+// a removed tracked file is looked for among the files added on other volumes during that time (s) before its removal (copying a large file takes a while)
+#define FS_FINGERPRINT_WINDOW		600
+// maximum number of added files compared with a removed tracked file
+#define FS_FINGERPRINT_CANDIDATES	32
+// time (ms) an old name waits for its new name
+#define FS_RENAME_WINDOW	1000
+// maximum number of pending events examined (from the latest one) when no candidate shares the filename of the event to pair
+#define FS_PAIRING_SCAN		64
+// maximum number of ended storms kept until they are taken (see TakeStorms)
+#define FS_STORM_LOG		64
 
+#ifdef _WIN32
 // messages defined in FSChangeNotifier.cpp
 extern DWORD WM_FSNOTIFY_ADDED;
 extern DWORD WM_FSNOTIFY_MOVED;
 extern DWORD WM_FSNOTIFY_REMOVED;
 extern DWORD WM_FSNOTIFY_RESTORED;
+extern DWORD WM_FSNOTIFY_OVERFLOW;
 extern DWORD WM_FSNOTIFY_STOP;
+#endif
+
+/*
+Prototype of the functions that can be bound to the notifier.
+action is one of FILE_ACTION_ADDED, FILE_ACTION_MOVED, FILE_ACTION_REMOVED, FILE_ACTION_RESTORED, FILE_ACTION_OVERFLOW, FILE_ACTION_STOPPED
+(for FILE_ACTION_OVERFLOW, oldFileName is the watched root for which events were lost, or the subtree whose events were suspended during an event storm)
+For FILE_ACTION_REMOVED, newFileName is the recycle bin the file went to (NULL if it was deleted for good or if its recycle bin is unknown, see SetRecycleBins),
+and for FILE_ACTION_RESTORED the recycle bin it was brought back from.
+*/
+typedef void (*FSNOTIFYPROC)(DWORD action, LPWSTR oldFileName, LPWSTR newFileName, LPVOID lpParam);
+
+class FSNotifyCallback {
+public:
+	FSNOTIFYPROC	lpfnNotify;
+	LPVOID			lpParam;
+
+	FSNotifyCallback(FSNOTIFYPROC lpfnNotify, LPVOID lpParam) {
+		this->lpfnNotify = lpfnNotify;
+		this->lpParam = lpParam;
+	}
+};
+
 
-class DirInfo {
+/*
+Each watched volume has its own backend and its own pair of threads:
+the watching thread fetches and decodes the events of that volume and hands them over to the correlation thread through a ring,
+so that the OS buffers keep being drained while notifications are delivered.
+Ordering is kept inside a volume, and a burst of changes on a volume does not delay the others.
+*/
+class FSVolume {
 public:
-	LPWSTR						dirPath;
-	OVERLAPPED					ol;
-	HANDLE						hFile;
-	BOOL						bSubTree;
-	FILE_NOTIFY_INFORMATION*	pBuff;
-
-	DirInfo(LPCWSTR dirPath, BOOL bSubTree = FALSE) {
-		this->dirPath	= (LPWSTR) LocalAlloc(LPTR, sizeof(WCHAR)*(wcslen(dirPath)+2));
-		wcscpy(this->dirPath, dirPath);
-		// add separator at the end of the path, if not present
-		if(dirPath[wcslen(dirPath)-1] != '\\') wcscat(this->dirPath, L"\\");
-		this->bSubTree	= bSubTree;
-		this->pBuff		= NULL;
+	CHAR					drive;
+	WatcherBackend*			lpBackend;
+	HANDLE					hThread;
+	HANDLE					hCorrelator;
+	// cleared by the watching thread when it leaves
+	volatile BOOL			bRunning;
+	// error the watching thread left with
+	INT						nError;
+	FileActionRing			ring;
+	CRITICAL_SECTION		csChanges;
+	// pending halves: 'removed' events waiting for their delay, and old names waiting for their new name
+	FileActionQueue			changesQueue;
+	FileActionQueue			renamesQueue;
+
+	FSVolume(CHAR drive, WatcherBackend* lpBackend) {
+		this->drive = drive;
+		this->lpBackend = lpBackend;
+		this->hThread = NULL;
+		this->hCorrelator = NULL;
+		this->bRunning = FALSE;
+		this->nError = E_FILESYSMON_SUCCESS;
+		InitializeCriticalSection(&this->csChanges);
 	}
 
-	~DirInfo() {
-		if (this->pBuff) LocalFree(this->pBuff);
-		LocalFree(this->dirPath);
+	~FSVolume() {
+		delete this->lpBackend;
+		DeleteCriticalSection(&this->csChanges);
 	}
 };
 
 
+// file whose moves matter to the receiver (i.e. a tagged file)
+class FSTrackedFile {
+public:
+	// identity of the file within its volume (0 until read by a fingerprinting thread)
+	ULONGLONG				fileId;
+	// invalid until read by a fingerprinting thread
+	FileFingerprint			fingerprint;
+	// a fingerprinting job is queued for the file (under its current path)
+	BOOL					bQueued;
 
+	FSTrackedFile() {
+		this->fileId = 0;
+		this->bQueued = FALSE;
+	}
+};
 
-enum {
-	E_FILESYSMON_SUCCESS,
-	E_FILESYSMON_ERRORUNKNOWN,
-	E_FILESYSMON_ERRORNOTINIT,
-	E_FILESYSMON_ERROROUTOFMEM,
-	E_FILESYSMON_ERROROPENFILE,
-	E_FILESYSMON_ERRORADDTOIOCP,
-	E_FILESYSMON_ERRORREADDIR,
-	E_FILESYSMON_NOCHANGE,
-	E_FILESYSMON_ERRORDEQUE
+
+// recycle bin of a volume
+class FSRecycleBin {
+public:
+	// exact path, ending with a separator
+	wstring					path;
+	CHAR					drive;
+
+	FSRecycleBin(const wstring& path, CHAR drive) {
+		this->path = path;
+		this->drive = drive;
+	}
 };
 
-/* 
+
+class FSWatchedPath {
+public:
+	wstring					path;
+	BOOL					bSubTree;
+	FSVolume*				lpVolume;
+
+	FSWatchedPath(LPCWSTR path, BOOL bSubTree, FSVolume* lpVolume) {
+		this->path = path;
+		this->bSubTree = bSubTree;
+		this->lpVolume = lpVolume;
+	}
+};
+
+
+/*
 This class uses the Singleton pattern.
+Raw events are obtained from a WatcherBackend (ReadDirectoryChangesW on Windows, inotify on Linux) and correlated here.
 */
 class FSChangeNotifier {
 private:
 	FSChangeNotifier();
 
-	HANDLE					hIOCP;
-	HANDLE					hThread;
-	vector<DirInfo*>		vecDirs;
-	vector<wstring>			vecExclusions;
+	// backend given at init: identifies volumes and provides an instance for each of them
+	WatcherBackend*			lpBackend;
+	vector<FSVolume*>		vecVolumes;
+	// watched paths (in order of addition)
+	vector<FSWatchedPath>	vecPaths;
+	BOOL					bStarted;
+	CrossVolumeIndex		crossIndex;
+	// notifications are delivered one at a time
+	CRITICAL_SECTION		csNotify;
+	// correlated events waiting for the end of their coalescing window
+	FileActionCoalescer		coalescer;
+	CRITICAL_SECTION		csCoalesce;
+	CONDITION_VARIABLE		cvCoalesce;
+	HANDLE					hCoalescer;
+	volatile BOOL			bCoalescing;
+	// 'removed' events of all volumes waiting for their delay, moves between volumes waiting for the rest of their subtree,
+	// originals set aside while their file is saved, and subtrees quarantined until their event storm is over (same lock and thread)
+	RemovalScheduler		removals;
+	SubtreeAggregator		subtrees;
+	SaveRecognizer			saves;
+	StormDetector			storms;
+	// storms that ended, until they are taken
+	deque<EventStorm>		queStorms;
+	CRITICAL_SECTION		csSchedule;
+	CONDITION_VARIABLE		cvSchedule;
+	HANDLE					hScheduler;
+	volatile BOOL			bScheduling;
+	// paths and patterns whose events are dropped
+	ExclusionMatcher		exclusions;
+	// recycle bins of the volumes (if none is given, paths holding FS_RECYCLE_MARK are taken as recycle bin items)
+	// while started, recycle bins are only appended: their paths stay valid for the events referring to them
+	deque<FSRecycleBin>		queRecycleBins;
+	// exclusions and recycle bins can be given while volumes are watched (no other lock is taken while holding it)
+	CRITICAL_SECTION		csConfig;
+	// tracked files, by path (case folded on Windows)
+	unordered_map<wstring, FSTrackedFile>	mapTracked;
+	CRITICAL_SECTION		csTracked;
+	// fingerprinting jobs, served by a pool of threads
+	deque<FSFingerprintJob*>	queFingerprints;
+	CRITICAL_SECTION		csFingerprint;
+	CONDITION_VARIABLE		cvFingerprint;
+	HANDLE					hFingerprinters[FS_FINGERPRINT_WORKERS];
+	volatile BOOL			bFingerprinting;
+	UINT					nFingerprinted;
+	UINT					nContentMoves;
+	// raw events, as delivered by the backends
+	EventCapture			capture;
+#ifdef _WIN32
 	vector<HWND>			vechWndDest;
+#endif
+	vector<FSNotifyCallback>vecCallbacks;
 
-
-	FileActionQueue			changesQueue;
-	CHAR					drives[27];
 	INT						nLastError;
 
-	vector<FileActionInfo*>*FetchChanges();
+	FSVolume*				GetVolume(CHAR drive);
+	BOOL					StartVolume(FSVolume* lpVolume);
+	void					StopVolume(FSVolume* lpVolume);
+	UINT					GetVolumeIndex(UINT nIndex);
+	INT						FindPath(LPCWSTR pPath);
+	INT						WatchPath(LPCWSTR pPath, BOOL bSubTree);
+	void					CollapsePaths();
 	void					Notify(DWORD action, LPWSTR oldFileName, LPWSTR newFileName);
-	static DWORD WINAPI		DelayedRemoval(LPVOID lpvd);
+	void					NotifyCrossMove(LPCWSTR oldFileName, LPCWSTR newFileName);
+	void					NotifyHeldMoves(vector<HeldMove>* vecMoves);
+	BOOL					AdoptSubtree(FileActionInfo* lpAction);
+	void					Deliver(DWORD action, LPWSTR oldFileName, LPWSTR newFileName);
+	void					Deliver(vector<CoalescedAction>* vecActions);
+	void					NotifyAdded(FSVolume* lpVolume, FileActionInfo* lpAction);
+	FileActionInfo*			PairRemoved(FSVolume* lpVolume, FileActionInfo* lpAction);
+	FileActionInfo*			PairOldName(FSVolume* lpVolume, FileActionInfo* lpAction);
+	void					ExpireOldNames(FSVolume* lpVolume, ULONGLONG ullNow);
+	void					ScheduleRemoval(FSVolume* lpVolume, FileActionInfo* lpAction, DWORD dwDelay);
+	BOOL					DropRemoval(FSVolume* lpVolume, LPCWSTR filePath, ULONGLONG ullSince, BOOL bTrashed = FALSE);
+	BOOL					FilterSave(FSVolume* lpVolume, FileActionInfo* lpSource, FileActionInfo* lpAction);
+	BOOL					FilterStorm(FileActionInfo* lpAction);
+	LPWSTR					FindRecycleBin(LPCWSTR filePath);
+	LPWSTR					GetRecycleBin(CHAR drive);
+	BOOL					IsRecycled(LPCWSTR filePath);
+	BOOL					IsExcluded(LPCWSTR filePath);
+	void					MarkTrashed(FSVolume* lpVolume, FileActionInfo* lpAction);
+	ULONGLONG				GetTrackedId(LPCWSTR filePath);
+	void					UpdateTracked(DWORD action, LPWSTR oldFileName, LPWSTR newFileName);
+	void					UpdateTrackedTree(LPCWSTR oldPath, LPCWSTR newPath);
+	void					RefreshTracked(LPCWSTR filePath);
+	void					QueueFingerprint(FSFingerprintJob* lpJob);
+	BOOL					MatchContent(FSVolume* lpVolume, FileActionInfo* lpAction);
+	void					RunFingerprint(FSFingerprintJob* lpJob);
+	static DWORD WINAPI		ThreadFingerprint(LPVOID lpvd);
+	void					CancelRemoval(FileActionInfo* lpAction);
+	static DWORD WINAPI		ThreadSchedule(LPVOID lpvd);
 	static DWORD WINAPI		ThreadWatch(LPVOID lpvd);
+	static DWORD WINAPI		ThreadCorrelate(LPVOID lpvd);
+	static DWORD WINAPI		ThreadCoalesce(LPVOID lpvd);
 
 public:
 	static FSChangeNotifier* GetInstance();
 	~FSChangeNotifier();
-	
-	/* 
+
+#ifdef _WIN32
+	/*
 	Bind a window so that it will receive messages when a change occurs.
-	Message to be expected are: WM_FSNOTIFY_ADDED, WM_FSNOTIFY_MOVED, WM_FSNOTIFY_REMOVED, WM_FSNOTIFY_RESTORED
+	Message to be expected are: WM_FSNOTIFY_ADDED, WM_FSNOTIFY_MOVED, WM_FSNOTIFY_REMOVED, WM_FSNOTIFY_RESTORED, WM_FSNOTIFY_OVERFLOW
 	*/
 	void bind(HWND);
+#endif
 
-	BOOL Init();
+	/*
+	Bind a function that will be called (from one of the correlation threads, or from the removal scheduling or coalescing ones) when a change occurs.
+	Calls are never made concurrently.
+	*/
+	void bind(FSNOTIFYPROC lpfnNotify, LPVOID lpParam = NULL);
+
+	/*
+	Use given backend (ownership is transferred) or, if none is given, the default one for current platform.
+	Once initialized, calling Init without backend has no effect.
+	*/
+	BOOL Init(WatcherBackend* lpBackend = NULL);
 
+	/*
+	Start the threads of each volume (volumes added afterwards get theirs right away).
+	*/
 	BOOL Start();
+	/*
+	Stop and wait for the threads of all volumes (events already fetched are correlated first, and pending removals are notified). Watched paths are kept: Start resumes monitoring.
+	*/
 	BOOL Stop();
 
+	/*
+	Paths can be added, removed or replaced while monitoring, without disturbing the other ones.
+	These methods (and the getters below) are meant to be called from a single controlling thread.
+	A path that lies within an already watched subtree is not added twice,
+	and watched paths lying within a newly added subtree are removed (events would otherwise be reported twice).
+	*/
 	INT AddPath(LPCWSTR pPath, BOOL bSubTree = true);
+	/*
+	Events on given directory (and below it) are dropped. Glob patterns are accepted as well (see ExclusionMatcher).
+	Exclusions can be added while the volumes are watched.
+	*/
 	INT AddExclusion(LPCWSTR pPath);
+	/*
+	Exact paths of the recycle bins (i.e. "C:\$RECYCLE.BIN\<SID>\", "~/.local/share/Trash/files/"), replacing the previously given ones.
+	A 'removed' event followed by the addition of an item to the recycle bin of its volume is notified along with that recycle bin,
+	and an item of a recycle bin brought back is notified as restored. Without any, paths holding FS_RECYCLE_MARK are taken as recycle bin items.
+	Recycle bins are meant to be given after Init. Once started, the given recycle bins are added to the previous ones (a bin of a volume
+	no longer present is harmless), so that the volumes can keep being watched. Returns the number of recycle bins kept.
+	*/
+	UINT SetRecycleBins(const vector<wstring>& vecPaths);
 
 	void RemovePath(UINT nIndex); //zero based index
+	BOOL RemovePath(LPCWSTR pPath);
 	void RemoveAllPaths();
-};
\ No newline at end of file
+	/*
+	New path is watched before the old one is released, so that no change is missed in-between.
+	*/
+	INT ReplacePath(LPCWSTR pOldPath, LPCWSTR pNewPath, BOOL bSubTree = true);
+	/*
+	Same, for several new paths (typically lying within the old one): paths watched already are left as they are, and a new path
+	that cannot be watched does not keep the old one from being released. Returns the error of the last path that failed, if any.
+	*/
+	INT ReplacePath(LPCWSTR pOldPath, const vector<wstring>& vecNewPaths, BOOL bSubTree = true);
+
+	UINT GetPathCount() { return this->vecPaths.size(); }
+	LPCWSTR GetPath(UINT nIndex);
+	// given watched path is watched along with its subtree
+	BOOL IsSubTree(UINT nIndex);
+
+	/*
+	Number of times events were lost for given watched path (zero based index).
+	*/
+	UINT GetOverflowCount(UINT nIndex);
+	/*
+	Watch of given watched path (zero based index) stopped, see WatcherBackend::IsFailed.
+	*/
+	BOOL IsFailed(UINT nIndex);
+
+	/*
+	Backpressure of the volumes (zero based index): number of events currently waiting for correlation,
+	capacity of the ring, highest number of events that waited at once, and number of times decoding had to wait for room.
+	*/
+	UINT GetVolumeCount() { return this->vecVolumes.size(); }
+	BOOL GetRingStats(UINT nVolume, CHAR* lpDrive, UINT* lpnSize, UINT* lpnCapacity, UINT* lpnHighWater, UINT* lpnStalls);
+
+	/*
+	Hold correlated events for given delay (ms) before notifying them, so that chains of events on a same file are notified as their net effect
+	(see FileActionCoalescer.h). 0 (default) notifies events as soon as they are correlated.
+	Takes effect on next call to Start.
+	*/
+	void SetCoalescingWindow(DWORD dwMilliseconds);
+	DWORD GetCoalescingWindow();
+	/*
+	Number of correlated events that went through the coalescing window, and number of them left once folded.
+	*/
+	UINT GetCorrelatedCount();
+	UINT GetNotifiedCount();
+
+	/*
+	Time-to-live (seconds) and maximum number of the 'added' events kept as possible targets of a move from another volume
+	(0 for no limit, see CrossVolumeIndex.h).
+	*/
+	void SetPendingLimits(DWORD dwTTL, UINT nMaxPending);
+	void GetPendingStats(UINT* lpnPending, UINT* lpnExpired, UINT* lpnEvicted);
+	/*
+	Moves between volumes are held for FS_SUBTREE_WINDOW, so that a directory moved to another volume is notified as a single move (see SubtreeAggregator.h).
+	Number of directory moves notified in place of their content, and number of moves of their items folded into them.
+	*/
+	void GetSubtreeStats(UINT* lpnSubtrees, UINT* lpnFolded);
+	/*
+	Files saved by replacement (temporary file renamed over the original, see SaveRecognizer.h) are left unchanged: neither their move nor their removal is notified.
+	Number of saves recognized.
+	*/
+	UINT GetSaveCount();
+
+	/*
+	A subtree receiving more than given number of events per FS_STORM_PERIOD (i.e. node_modules during an install) is quarantined:
+	its events are dropped until it has been quiet for given delay (ms), then FILE_ACTION_OVERFLOW is notified for it,
+	so that it gets a single reconciliation instead of one correlation per event (see StormDetector.h). A watched root, or a directory above one,
+	is never quarantined. A threshold of 0 disables the detection.
+	*/
+	void SetStormLimits(UINT nThreshold, DWORD dwQuiet);
+	/*
+	Append the storms that ended since the previous call (at most FS_STORM_LOG of them) to vecStorms. Returns the number of storms appended.
+	*/
+	UINT TakeStorms(vector<EventStorm>* vecStorms);
+	/*
+	Number of subtrees quarantined, and number of events suspended.
+	*/
+	void GetStormStats(UINT* lpnStorms, UINT* lpnSuspended);
+
+	/*
+	Track given files (typically the tagged ones), replacing the previously tracked ones (identities follow the notified moves).
+	When the backend does not report identities, a 'removed' event of a tracked file is not paired with an 'added' event of the same name
+	whose file has another identity. A matching identity is not taken as a proof, though: inode numbers are reused as soon as a file is deleted.
+	No file is opened by the caller: files tracked already keep their identity, and those of the new ones are read in the background
+	(by the fingerprinting threads, once started), a file whose identity cannot be read being dropped. Returns the number of files tracked.
+
+	The content fingerprints of the new tracked files are then read in the background (fingerprints of files tracked already are kept).
+	A tracked file whose removal is not paired by name is compared with the files recently added on other volumes:
+	a copy having the same fingerprint makes it a move between volumes, even if the file was renamed on the way.
+	*/
+	UINT SetTrackedFiles(const vector<wstring>& vecPaths);
+	UINT GetTrackedCount();
+	/*
+	Number of tracked files whose fingerprint was read, and number of moves between volumes recognized by content.
+	*/
+	void GetFingerprintStats(UINT* lpnFingerprinted, UINT* lpnContentMoves);
+
+	/*
+	Record every raw event (before exclusions and correlation) to given file, see EventCapture.h.
+	A capture can be replayed with ReplayWatcher.
+	*/
+	BOOL StartCapture(LPCWSTR capturePath);
+	void StopCapture();
+
+	INT GetLastError() { return this->nLastError; }
+};
@@ -0,0 +1,383 @@
+/* FanotifyWatcher.cpp - filesystem events backend based on Linux fanotify (whole filesystem marks)
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "FanotifyWatcher.h"
+
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+
+#ifndef FAN_RENAME
+	#define FAN_RENAME							0x10000000
+	#define FAN_EVENT_INFO_TYPE_OLD_DFID_NAME	10
+	#define FAN_EVENT_INFO_TYPE_NEW_DFID_NAME	12
+#endif
+
+#define FANOTIFY_MASK	(FAN_CREATE | FAN_DELETE | FAN_ONDIR)
+
+
+/* Retrieve the identifier of the filesystem holding given path (0 on failure).
+*/
+static ULONGLONG GetFsid(const char* path) {
+	struct statfs st;
+	if (statfs(path, &st) != 0) return 0;
+	ULONGLONG fsid = 0;
+	memcpy(&fsid, &st.f_fsid, sizeof(fsid));
+	return fsid;
+}
+
+
+FanotifyWatcher::FanotifyWatcher() {
+	this->fd = -1;
+	this->fdInterrupt = -1;
+	this->pBuff = NULL;
+	this->dwMask = FANOTIFY_MASK | FAN_RENAME;
+	InitializeCriticalSection(&this->csRoots);
+}
+
+FanotifyWatcher::~FanotifyWatcher() {
+	RemoveAllPaths();
+	if (this->fd >= 0) close(this->fd);
+	if (this->fdInterrupt >= 0) close(this->fdInterrupt);
+	if (this->pBuff) free(this->pBuff);
+	DeleteCriticalSection(&this->csRoots);
+}
+
+BOOL FanotifyWatcher::Init() {
+	if ((this->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE)) < 0 || (this->fdInterrupt = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		this->nLastError = errno;
+		return FALSE;
+	}
+	if (!(this->pBuff = (char*) aligned_alloc(__alignof__(struct fanotify_event_metadata), FANOTIFY_BUFF_SIZE))) {
+		this->nLastError = E_FILESYSMON_ERROROUTOFMEM;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+FanotifyMount* FanotifyWatcher::FindMount(ULONGLONG fsid) {
+	for (UINT i = 0, uiCount = this->vecMounts.size(); i < uiCount; ++i) {
+		if (this->vecMounts[i].fsid == fsid) return &this->vecMounts[i];
+	}
+	return NULL;
+}
+
+FanotifyRoot* FanotifyWatcher::FindRoot(const wstring& path) {
+	for (UINT i = 0, uiCount = this->vecRoots.size(); i < uiCount; ++i) {
+		FanotifyRoot* lpRoot = this->vecRoots[i];
+		if (path.size() > lpRoot->rootPath.size() && path.compare(0, lpRoot->rootPath.size(), lpRoot->rootPath) == 0) {
+			if (lpRoot->bSubTree || path.find(FS_PATH_SEPARATOR, lpRoot->rootPath.size()) == wstring::npos) return lpRoot;
+		}
+	}
+	return NULL;
+}
+
+INT FanotifyWatcher::AddPath(LPCWSTR pPath, BOOL bSubTree) {
+	if (this->fd < 0) {
+			// must call Init() method first !
+			return E_FILESYSMON_ERRORNOTINIT;
+	}
+
+	string path = WCHARtoUTF8(pPath);
+	ULONGLONG fsid = GetFsid(path.c_str());
+	if (!fsid) {
+		this->nLastError = errno;
+		return E_FILESYSMON_ERROROPENFILE;
+	}
+
+	EnterCriticalSection(&this->csRoots);
+	FanotifyMount* lpMount = this->FindMount(fsid);
+	if (!lpMount || !lpMount->nRefs) {
+		// first root on this filesystem: mark the whole filesystem
+		int mountFd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (mountFd < 0) {
+			this->nLastError = errno;
+			LeaveCriticalSection(&this->csRoots);
+			return E_FILESYSMON_ERROROPENFILE;
+		}
+		if (fanotify_mark(this->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, this->dwMask, AT_FDCWD, path.c_str()) != 0) {
+			// FAN_RENAME is not supported before Linux 5.17: fall back to FAN_MOVED_FROM/FAN_MOVED_TO pairs
+			if (errno == EINVAL && (this->dwMask & FAN_RENAME)) {
+				this->dwMask = FANOTIFY_MASK | FAN_MOVED_FROM | FAN_MOVED_TO;
+			}
+			if (fanotify_mark(this->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, this->dwMask, AT_FDCWD, path.c_str()) != 0) {
+				this->nLastError = errno;
+				close(mountFd);
+				LeaveCriticalSection(&this->csRoots);
+				return E_FILESYSMON_ERRORREADDIR;
+			}
+		}
+		if (!lpMount) {
+			FanotifyMount mount;
+			mount.fsid = fsid;
+			this->vecMounts.push_back(mount);
+			lpMount = &this->vecMounts.back();
+		}
+		lpMount->mountFd = mountFd;
+		lpMount->markPath = path;
+		lpMount->nRefs = 0;
+	}
+	++lpMount->nRefs;
+
+	this->vecRoots.push_back(new FanotifyRoot(pPath, bSubTree, fsid));
+	LeaveCriticalSection(&this->csRoots);
+
+	return E_FILESYSMON_SUCCESS;
+}
+
+void FanotifyWatcher::RemovePath(UINT nIndex) {
+	EnterCriticalSection(&this->csRoots);
+	//sanity check
+	if (nIndex >= this->vecRoots.size()) {
+		LeaveCriticalSection(&this->csRoots);
+		return;
+	}
+	FanotifyRoot* lpRoot = this->vecRoots[nIndex];
+	FanotifyMount* lpMount = this->FindMount(lpRoot->fsid);
+	if (lpMount && lpMount->nRefs && --lpMount->nRefs == 0) {
+		// last root on this filesystem: remove the mark (mount entry is kept for a later root on the same filesystem)
+		fanotify_mark(this->fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, this->dwMask, AT_FDCWD, lpMount->markPath.c_str());
+		close(lpMount->mountFd);
+		lpMount->mountFd = -1;
+	}
+	this->vecRoots.erase(this->vecRoots.begin() + nIndex);
+	delete lpRoot;
+	LeaveCriticalSection(&this->csRoots);
+}
+
+void FanotifyWatcher::RemoveAllPaths() {
+	EnterCriticalSection(&this->csRoots);
+	while (!this->vecRoots.empty()) {
+		this->RemovePath(0);
+	}
+	LeaveCriticalSection(&this->csRoots);
+}
+
+/*
+Paths have no drive letter: each filesystem gets its own identifier ('a', 'b', ...).
+*/
+CHAR FanotifyWatcher::GetDrive(LPCWSTR pPath) {
+	return this->GetDrive(GetFsid(WCHARtoUTF8(pPath).c_str()));
+}
+
+CHAR FanotifyWatcher::GetDrive(ULONGLONG fsid) {
+	UINT i, uiCount;
+	for (i = 0, uiCount = this->vecFsids.size(); i < uiCount; ++i) {
+		if (this->vecFsids[i] == fsid) break;
+	}
+	if (i == uiCount) this->vecFsids.push_back(fsid);
+	return (CHAR) ('a' + (i % 26));
+}
+
+UINT FanotifyWatcher::GetOverflowCount(UINT nIndex) {
+	UINT result = 0;
+	EnterCriticalSection(&this->csRoots);
+	if (nIndex < this->vecRoots.size()) result = this->vecRoots[nIndex]->nOverflows;
+	LeaveCriticalSection(&this->csRoots);
+	return result;
+}
+
+void FanotifyWatcher::Interrupt() {
+	uint64_t nValue = 1;
+	if (this->fdInterrupt < 0) return;
+	ssize_t nWritten = write(this->fdInterrupt, &nValue, sizeof(nValue));
+	(void) nWritten;
+}
+
+/*
+Turn a (directory handle, entry name) pair into the directory path and the entry path.
+*/
+BOOL FanotifyWatcher::ResolvePath(ULONGLONG fsid, LPVOID lpHandle, const char* name, wstring& dirPath, wstring& path) {
+	struct file_handle* fh = (struct file_handle*) lpHandle;
+	UINT nBytes;
+	memcpy(&nBytes, &fh->handle_bytes, sizeof(nBytes));
+
+	// cache key is made of the filesystem identifier and the raw handle (type and bytes)
+	string key((const char*) &fsid, sizeof(fsid));
+	key.append((const char*) lpHandle + sizeof(unsigned int), sizeof(int) + nBytes);
+
+	LPCWSTR cached = this->cache.Get(key);
+	if (cached) dirPath = cached;
+	else {
+		FanotifyMount* lpMount = this->FindMount(fsid);
+		if (!lpMount || lpMount->mountFd < 0 || nBytes > MAX_HANDLE_SZ) return FALSE;
+
+		// handle might not be suitably aligned inside the events buffer
+		union {
+			struct file_handle	fh;
+			char				buff[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+		} handle;
+		memcpy(handle.buff, lpHandle, sizeof(struct file_handle) + nBytes);
+
+		int dirFd = open_by_handle_at(lpMount->mountFd, &handle.fh, O_PATH | O_CLOEXEC);
+		if (dirFd < 0) return FALSE;
+
+		char procPath[64], target[PATH_MAX];
+		snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", dirFd);
+		ssize_t len = readlink(procPath, target, sizeof(target));
+		close(dirFd);
+		if (len <= 0 || len >= (ssize_t) sizeof(target)) return FALSE;
+
+		dirPath = UTF8toWCHAR(target, len);
+		this->cache.Put(key, dirPath);
+	}
+
+	path = dirPath;
+	if (path.empty() || path[path.size()-1] != FS_PATH_SEPARATOR) path += FS_PATH_SEPARATOR;
+	path += UTF8toWCHAR(name);
+	return TRUE;
+}
+
+/*
+Report a move the way ReadDirectoryChangesW does (only the ends that lie within watched roots are reported).
+*/
+void FanotifyWatcher::PushMove(vector<FileActionInfo*>* vecChanges, const wstring& oldDir, const wstring& oldPath, const wstring& newDir, const wstring& newPath) {
+	FanotifyRoot* lpOldRoot = oldPath.empty() ? NULL : this->FindRoot(oldPath);
+	FanotifyRoot* lpNewRoot = newPath.empty() ? NULL : this->FindRoot(newPath);
+
+	if (lpOldRoot && lpNewRoot && oldDir == newDir) {
+		CHAR drive = this->GetDrive(lpNewRoot->fsid);
+		this->PushChange(vecChanges, oldPath.c_str(), FILE_ACTION_RENAMED_OLD_NAME, drive);
+		this->PushChange(vecChanges, newPath.c_str(), FILE_ACTION_RENAMED_NEW_NAME, drive);
+		return;
+	}
+	FileActionInfo* lpRemoved = (lpOldRoot) ? this->PushChange(vecChanges, oldPath.c_str(), FILE_ACTION_REMOVED, this->GetDrive(lpOldRoot->fsid)) : NULL;
+	FileActionInfo* lpAdded = (lpNewRoot) ? this->PushChange(vecChanges, newPath.c_str(), FILE_ACTION_ADDED, this->GetDrive(lpNewRoot->fsid)) : NULL;
+	// both ends of a move between directories: give them the identity of the moved item
+	if (lpRemoved && lpAdded && lpRemoved->GetDrive() == lpAdded->GetDrive()) {
+		ULONGLONG fileId = FileActionInfo::ReadFileId(lpAdded->GetFilePath());
+		lpRemoved->SetFileId(fileId);
+		lpAdded->SetFileId(fileId);
+	}
+}
+
+BOOL FanotifyWatcher::FetchChanges(vector<FileActionInfo*>* vecChanges) {
+	if (this->fd < 0) {
+		this->nLastError = E_FILESYSMON_ERRORNOTINIT;
+		return FALSE;
+	}
+
+	while (TRUE) {
+		struct pollfd pfds[2] = { { this->fd, POLLIN, 0 }, { this->fdInterrupt, POLLIN, 0 } };
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			this->nLastError = E_FILESYSMON_ERRORDEQUE;
+			return FALSE;
+		}
+		if (pfds[1].revents) {
+			uint64_t nValue;
+			ssize_t nRead = read(this->fdInterrupt, &nValue, sizeof(nValue));
+			(void) nRead;
+			this->nLastError = E_FILESYSMON_INTERRUPTED;
+			return FALSE;
+		}
+
+		ssize_t len = read(this->fd, this->pBuff, FANOTIFY_BUFF_SIZE);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			this->nLastError = E_FILESYSMON_ERRORDEQUE;
+			return FALSE;
+		}
+
+		EnterCriticalSection(&this->csRoots);
+
+		// FAN_MOVED_FROM waiting for the FAN_MOVED_TO that follows it (no cookie with fanotify)
+		wstring movedFromDir, movedFromPath;
+
+		struct fanotify_event_metadata* meta = (struct fanotify_event_metadata*) this->pBuff;
+		for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+			if (meta->vers != FANOTIFY_METADATA_VERSION) {
+				LeaveCriticalSection(&this->csRoots);
+				this->nLastError = E_FILESYSMON_ERRORDEQUE;
+				return FALSE;
+			}
+			if (meta->fd >= 0) close(meta->fd);
+
+			if (meta->mask & FAN_Q_OVERFLOW) {
+				// the queue is shared by all marks: events might have been lost for any root
+				for (UINT i = 0, uiCount = this->vecRoots.size(); i < uiCount; ++i) {
+					FanotifyRoot* lpRoot = this->vecRoots[i];
+					++lpRoot->nOverflows;
+					this->PushChange(vecChanges, lpRoot->rootPath.c_str(), FILE_ACTION_OVERFLOW, this->GetDrive(lpRoot->fsid));
+				}
+				continue;
+			}
+
+			// retrieve paths from the information records
+			wstring dir, path, oldDir, oldPath;
+			char* ptr = (char*) meta + meta->metadata_len;
+			char* end = (char*) meta + meta->event_len;
+			while (ptr + sizeof(struct fanotify_event_info_header) <= end) {
+				struct fanotify_event_info_header* hdr = (struct fanotify_event_info_header*) ptr;
+				if (!hdr->len) break;
+				if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || hdr->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME || hdr->info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME) {
+					struct fanotify_event_info_fid* fid = (struct fanotify_event_info_fid*) ptr;
+					struct file_handle* fh = (struct file_handle*) fid->handle;
+					UINT nBytes;
+					memcpy(&nBytes, &fh->handle_bytes, sizeof(nBytes));
+					const char* name = (const char*) fid->handle + sizeof(struct file_handle) + nBytes;
+					ULONGLONG fsid;
+					memcpy(&fsid, &fid->fsid, sizeof(fsid));
+
+					if (hdr->info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME) this->ResolvePath(fsid, fid->handle, name, oldDir, oldPath);
+					else this->ResolvePath(fsid, fid->handle, name, dir, path);
+				}
+				ptr += hdr->len;
+			}
+
+			BOOL bDir = (meta->mask & FAN_ONDIR) ? TRUE : FALSE;
+
+			// any event other than FAN_MOVED_TO completes the pending move as a removal
+			if (!movedFromPath.empty() && !(meta->mask & FAN_MOVED_TO)) {
+				this->PushMove(vecChanges, movedFromDir, movedFromPath, L"", L"");
+				movedFromPath.clear();
+			}
+
+			if (meta->mask & FAN_RENAME) {
+				if (bDir && !oldPath.empty()) this->cache.Invalidate(oldPath);
+				this->PushMove(vecChanges, oldDir, oldPath, dir, path);
+				continue;
+			}
+			if (path.empty()) continue;
+
+			if (meta->mask & FAN_MOVED_FROM) {
+				if (bDir) this->cache.Invalidate(path);
+				movedFromDir = dir;
+				movedFromPath = path;
+			}
+			else if (meta->mask & FAN_MOVED_TO) {
+				this->PushMove(vecChanges, movedFromDir, movedFromPath, dir, path);
+				movedFromPath.clear();
+			}
+			else if ((meta->mask & FAN_CREATE) && (meta->mask & FAN_DELETE)) {
+				// merged events: only the net effect can be known
+				struct stat st;
+				if (lstat(WCHARtoUTF8(path.c_str()).c_str(), &st) != 0) {
+					if (bDir) this->cache.Invalidate(path);
+					this->PushMove(vecChanges, dir, path, L"", L"");
+				}
+			}
+			else if (meta->mask & FAN_CREATE) {
+				this->PushMove(vecChanges, L"", L"", dir, path);
+			}
+			else if (meta->mask & FAN_DELETE) {
+				if (bDir) this->cache.Invalidate(path);
+				this->PushMove(vecChanges, dir, path, L"", L"");
+			}
+		}
+		if (!movedFromPath.empty()) this->PushMove(vecChanges, movedFromDir, movedFromPath, L"", L"");
+		LeaveCriticalSection(&this->csRoots);
+
+		if (!vecChanges->empty()) return TRUE;
+	}
+}
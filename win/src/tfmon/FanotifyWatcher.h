@@ -0,0 +1,189 @@
+/* FanotifyWatcher.h - filesystem events backend based on Linux fanotify (whole filesystem marks)
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+#include "WatcherBackend.h"
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+
+using std::string;
+using std::wstring;
+using std::vector;
+using std::list;
+using std::multimap;
+using std::unordered_map;
+
+#define FANOTIFY_BUFF_SIZE		65536
+#define FANOTIFY_CACHE_SIZE		16384
+
+
+/*
+LRU cache of directory file handles to directory paths.
+Resolving a handle costs an open_by_handle_at and a readlink: with a cache, only the first event in a directory pays for it.
+Entries are also indexed by path (in order), so that dropping a directory along with its sub-directories only visits their entries.
+This class does no locking.
+*/
+class HandlePathCache {
+private:
+	typedef list< std::pair<string, wstring> >	LRUList;
+	// several handles might resolve to the same path (a directory removed, and another one created in its place)
+	typedef multimap<wstring, string>			PathIndex;
+
+	UINT									nCapacity;
+	LRUList									lruList;
+	unordered_map<string, LRUList::iterator>mapEntries;
+	PathIndex								mapPaths;
+
+	void Unindex(const wstring& path, const string& key) {
+		std::pair<PathIndex::iterator, PathIndex::iterator> range = this->mapPaths.equal_range(path);
+		for(PathIndex::iterator it = range.first; it != range.second; ++it) {
+			if(it->second == key) {
+				this->mapPaths.erase(it);
+				return;
+			}
+		}
+	}
+
+	// drop the entries whose path lies in [first, last)
+	void Erase(PathIndex::iterator first, PathIndex::iterator last) {
+		for(PathIndex::iterator it = first; it != last; ++it) {
+			unordered_map<string, LRUList::iterator>::iterator itEntry = this->mapEntries.find(it->second);
+			if(itEntry == this->mapEntries.end()) continue;
+			this->lruList.erase(itEntry->second);
+			this->mapEntries.erase(itEntry);
+		}
+		this->mapPaths.erase(first, last);
+	}
+
+public:
+	HandlePathCache(UINT nCapacity = FANOTIFY_CACHE_SIZE) {
+		this->nCapacity = nCapacity;
+	}
+
+	LPCWSTR Get(const string& key) {
+		unordered_map<string, LRUList::iterator>::iterator it = this->mapEntries.find(key);
+		if(it == this->mapEntries.end()) return NULL;
+		// move entry to the front of the list (most recently used)
+		this->lruList.splice(this->lruList.begin(), this->lruList, it->second);
+		return it->second->second.c_str();
+	}
+
+	void Put(const string& key, const wstring& path) {
+		unordered_map<string, LRUList::iterator>::iterator it = this->mapEntries.find(key);
+		if(it != this->mapEntries.end()) {
+			this->Unindex(it->second->second, key);
+			it->second->second = path;
+			this->mapPaths.insert(std::make_pair(path, key));
+			this->lruList.splice(this->lruList.begin(), this->lruList, it->second);
+			return;
+		}
+		this->lruList.push_front(std::make_pair(key, path));
+		this->mapEntries[key] = this->lruList.begin();
+		this->mapPaths.insert(std::make_pair(path, key));
+		if(this->mapEntries.size() > this->nCapacity) {
+			this->Unindex(this->lruList.back().second, this->lruList.back().first);
+			this->mapEntries.erase(this->lruList.back().first);
+			this->lruList.pop_back();
+		}
+	}
+
+	/*
+	Drop the given directory and all its sub-directories (their path changed or they no longer exist).
+	Sub-directories are the paths starting with the directory and a separator: they are contiguous in the index.
+	*/
+	void Invalidate(const wstring& dirPath) {
+		std::pair<PathIndex::iterator, PathIndex::iterator> range = this->mapPaths.equal_range(dirPath);
+		this->Erase(range.first, range.second);
+		wstring first = dirPath + FS_PATH_SEPARATOR;
+		wstring last = dirPath + (wchar_t) (FS_PATH_SEPARATOR + 1);
+		this->Erase(this->mapPaths.lower_bound(first), this->mapPaths.lower_bound(last));
+	}
+};
+
+
+class FanotifyRoot {
+public:
+	wstring			rootPath;	// always ends with a separator
+	BOOL			bSubTree;
+	ULONGLONG		fsid;
+	UINT			nOverflows;
+
+	FanotifyRoot(LPCWSTR rootPath, BOOL bSubTree, ULONGLONG fsid) {
+		this->rootPath = rootPath;
+		// add separator at the end of the path, if not present
+		if(this->rootPath.empty() || this->rootPath[this->rootPath.size()-1] != FS_PATH_SEPARATOR) this->rootPath += FS_PATH_SEPARATOR;
+		this->bSubTree = bSubTree;
+		this->fsid = fsid;
+		this->nOverflows = 0;
+	}
+};
+
+/*
+One mark per filesystem, whatever the number of roots and directories it holds.
+*/
+class FanotifyMount {
+public:
+	ULONGLONG		fsid;
+	int				mountFd;	// any descriptor on the filesystem (required by open_by_handle_at)
+	string			markPath;
+	UINT			nRefs;
+};
+
+/*
+Watching a whole filesystem with FAN_MARK_FILESYSTEM and FAN_REPORT_DFID_NAME: setup cost does not depend on the number of directories.
+Events carry the handle of the parent directory and the name of the entry, handles being turned back into paths through a HandlePathCache.
+Events outside of the watched roots are dropped.
+
+Events are translated so that they match what ReadDirectoryChangesW would report (see InotifyWatcher).
+Requires CAP_SYS_ADMIN and Linux 5.9 (FAN_RENAME, which reports both ends of a move in a single event, is used when available).
+
+Note: paths are resolved when events are read, so an event on a directory that has been moved since then is reported under its new location.
+*/
+class FanotifyWatcher : public WatcherBackend {
+private:
+	int						fd;
+	// signaled by Interrupt
+	int						fdInterrupt;
+	char*					pBuff;
+	uint64_t				dwMask;
+	// guards roots and mounts against concurrent AddPath/RemovePath
+	CRITICAL_SECTION		csRoots;
+	vector<FanotifyRoot*>	vecRoots;
+	vector<FanotifyMount>	vecMounts;
+	// filesystems in order of appearance (gives drive identifiers)
+	vector<ULONGLONG>		vecFsids;
+	HandlePathCache			cache;
+
+	FanotifyMount*			FindMount(ULONGLONG fsid);
+	FanotifyRoot*			FindRoot(const wstring& path);
+	CHAR					GetDrive(ULONGLONG fsid);
+	BOOL					ResolvePath(ULONGLONG fsid, LPVOID lpHandle, const char* name, wstring& dirPath, wstring& path);
+	void					PushMove(vector<FileActionInfo*>* vecChanges, const wstring& oldDir, const wstring& oldPath, const wstring& newDir, const wstring& newPath);
+
+public:
+	FanotifyWatcher();
+	~FanotifyWatcher();
+
+	BOOL Init();
+	WatcherBackend* NewInstance() { return new FanotifyWatcher(); }
+
+	INT AddPath(LPCWSTR pPath, BOOL bSubTree);
+	void RemovePath(UINT nIndex);
+	void RemoveAllPaths();
+
+	CHAR GetDrive(LPCWSTR pPath);
+	UINT GetOverflowCount(UINT nIndex);
+
+	BOOL FetchChanges(vector<FileActionInfo*>* vecChanges);
+	void Interrupt();
+};
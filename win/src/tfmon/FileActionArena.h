@@ -0,0 +1,146 @@
+/* FileActionArena.h - block allocator for the event records produced by the watcher backends
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "fscompat.h"
+
+// size of the blocks records are carved from (a larger record gets a block of its own)
+#define FS_ARENA_BLOCK_SIZE		65536
+// number of released blocks kept for reuse
+#define FS_ARENA_POOL_MAX		64
+
+
+/*
+Block header, followed by the records.
+A block is referenced by each of its live records, plus once by its arena as long as records are carved from it.
+*/
+class FileActionBlock {
+public:
+	volatile LONG		nRefs;
+	SIZE_T				nSize;
+	SIZE_T				nUsed;
+	FileActionBlock*	lpNext;
+
+	static SIZE_T HeaderSize() { return (sizeof(FileActionBlock) + 15) & ~((SIZE_T) 15); }
+	LPBYTE Data() { return (LPBYTE) this + FileActionBlock::HeaderSize(); }
+};
+
+/*
+Released blocks, shared by all arenas. The pool is never destroyed: records might outlive any static object.
+*/
+class FileActionPool {
+private:
+	CRITICAL_SECTION	csPool;
+	FileActionBlock*	lpFree;
+	UINT				nFree;
+
+	FileActionPool() {
+		this->lpFree = NULL;
+		this->nFree = 0;
+		InitializeCriticalSection(&this->csPool);
+	}
+
+public:
+	static FileActionPool* GetInstance() {
+		static FileActionPool* lpPool = new FileActionPool();
+		return lpPool;
+	}
+
+	FileActionBlock* Get(SIZE_T nSize) {
+		FileActionBlock* lpBlock = NULL;
+		if(nSize <= FS_ARENA_BLOCK_SIZE) {
+			EnterCriticalSection(&this->csPool);
+			if(this->lpFree) {
+				lpBlock = this->lpFree;
+				this->lpFree = lpBlock->lpNext;
+				--this->nFree;
+			}
+			LeaveCriticalSection(&this->csPool);
+			nSize = FS_ARENA_BLOCK_SIZE;
+		}
+		if(!lpBlock) {
+			lpBlock = (FileActionBlock*) malloc(FileActionBlock::HeaderSize() + nSize);
+			if(!lpBlock) return NULL;
+			lpBlock->nSize = nSize;
+		}
+		lpBlock->nRefs = 0;
+		lpBlock->nUsed = 0;
+		lpBlock->lpNext = NULL;
+		return lpBlock;
+	}
+
+	void Put(FileActionBlock* lpBlock) {
+		if(lpBlock->nSize == FS_ARENA_BLOCK_SIZE) {
+			EnterCriticalSection(&this->csPool);
+			if(this->nFree < FS_ARENA_POOL_MAX) {
+				lpBlock->lpNext = this->lpFree;
+				this->lpFree = lpBlock;
+				++this->nFree;
+				lpBlock = NULL;
+			}
+			LeaveCriticalSection(&this->csPool);
+		}
+		if(lpBlock) free(lpBlock);
+	}
+};
+
+
+/*
+Records are carved one after the other from a current block. Once all the records of a block are released,
+the block is either reused in place (if it is still the current one) or handed back to the pool:
+in steady state, producing a record does not allocate.
+An arena is meant to be used by a single thread (the one fetching changes from a backend);
+records can be released from any thread.
+*/
+class FileActionArena {
+private:
+	FileActionBlock*	lpCurrent;
+
+public:
+	FileActionArena() {
+		this->lpCurrent = NULL;
+	}
+
+	~FileActionArena() {
+		if(this->lpCurrent) FileActionArena::Release(this->lpCurrent);
+	}
+
+	/*
+	Reserve nSize bytes (8-bytes aligned). The block holding them is referenced once more and returned in lplpBlock.
+	*/
+	LPVOID Alloc(SIZE_T nSize, FileActionBlock** lplpBlock) {
+		nSize = (nSize + 7) & ~((SIZE_T) 7);
+		FileActionBlock* lpBlock = this->lpCurrent;
+		if(lpBlock) {
+			// no record left in current block: start over
+			if(InterlockedCompareExchange(&lpBlock->nRefs, 1, 1) == 1) lpBlock->nUsed = 0;
+			if(lpBlock->nUsed + nSize > lpBlock->nSize) {
+				FileActionArena::Release(lpBlock);
+				this->lpCurrent = lpBlock = NULL;
+			}
+		}
+		if(!lpBlock) {
+			lpBlock = FileActionPool::GetInstance()->Get(nSize);
+			if(!lpBlock) return NULL;
+			// a record too large for a regular block is alone in its own
+			if(lpBlock->nSize == FS_ARENA_BLOCK_SIZE) {
+				lpBlock->nRefs = 1;
+				this->lpCurrent = lpBlock;
+			}
+		}
+		LPVOID result = lpBlock->Data() + lpBlock->nUsed;
+		lpBlock->nUsed += nSize;
+		InterlockedIncrement(&lpBlock->nRefs);
+		*lplpBlock = lpBlock;
+		return result;
+	}
+
+	static void Release(FileActionBlock* lpBlock) {
+		if(InterlockedDecrement(&lpBlock->nRefs) == 0) FileActionPool::GetInstance()->Put(lpBlock);
+	}
+};
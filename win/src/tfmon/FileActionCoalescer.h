@@ -0,0 +1,223 @@
+/* FileActionCoalescer.h - folding of correlated events into their net effect over a time window
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "FileActionInfo.h"
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+
+using std::wstring;
+using std::list;
+using std::multimap;
+using std::vector;
+
+
+/*
+Correlated event, as it will be notified (either path might be empty).
+*/
+class CoalescedAction {
+public:
+	DWORD		action;
+	wstring		oldPath;
+	wstring		newPath;
+	// time (microseconds, see FileActionInfo::GetCurrentTicks) at which the event is to be notified
+	ULONGLONG	deadline;
+	// only added, moved and removed events can be folded with later ones
+	BOOL		bFoldable;
+	// order of reception of the first event of the chain
+	UINT		nSeq;
+
+	CoalescedAction(DWORD action, LPCWSTR oldPath, LPCWSTR newPath, ULONGLONG deadline, UINT nSeq = 0) {
+		this->action = action;
+		if(oldPath) this->oldPath = oldPath;
+		if(newPath) this->newPath = newPath;
+		this->deadline = deadline;
+		this->bFoldable = (action == FILE_ACTION_ADDED || action == FILE_ACTION_MOVED || action == FILE_ACTION_REMOVED);
+		this->nSeq = nSeq;
+	}
+};
+
+/*
+Correlated events are held for a window (starting with the first event of a chain) and folded with the ones that follow on the same file:
+- a file moved several times is notified once, from its first to its last path (A to B then B to C gives A to C)
+- a file moved back to its original path is not notified at all
+- a file created then removed is not notified at all, and a file moved then removed is notified as removed from its original path
+(along with the recycle bin it went to, if any)
+Held events are notified in the order their chain started. A chain is not folded further when an event held after it refers to its new path
+(held events are then released up to that one, so that the receiver sees changes on a given path in order).
+Other events (restore, overflow, ...) are not folded.
+This class does no locking.
+*/
+class FileActionCoalescer {
+private:
+	typedef list<CoalescedAction>::iterator		Entry;
+
+	list<CoalescedAction>			lstActions;
+	// held events by the paths they refer to (both old and new)
+	multimap<wstring, Entry>		mapPaths;
+	// in microseconds
+	ULONGLONG						ullWindow;
+	UINT							nSeq;
+	UINT							nReceived;
+	UINT							nReleased;
+
+	void Index(Entry it) {
+		if(!it->oldPath.empty()) this->mapPaths.insert(std::make_pair(it->oldPath, it));
+		// new path of a removed file is the recycle bin it went to (not a path of the file)
+		if(!it->newPath.empty() && it->newPath != it->oldPath && it->action != FILE_ACTION_REMOVED) this->mapPaths.insert(std::make_pair(it->newPath, it));
+	}
+
+	void Unindex(Entry it) {
+		this->Unindex(it, it->oldPath);
+		if(it->newPath != it->oldPath) this->Unindex(it, it->newPath);
+	}
+
+	void Unindex(Entry it, const wstring& path) {
+		if(path.empty()) return;
+		std::pair<multimap<wstring, Entry>::iterator, multimap<wstring, Entry>::iterator> range = this->mapPaths.equal_range(path);
+		for(multimap<wstring, Entry>::iterator m = range.first; m != range.second; ++m) {
+			if(m->second == it) {
+				this->mapPaths.erase(m);
+				break;
+			}
+		}
+	}
+
+	void Drop(Entry it) {
+		this->Unindex(it);
+		this->lstActions.erase(it);
+	}
+
+	/*
+	Held chain whose file currently has given path (lstActions.end() if there is none).
+	*/
+	Entry FindCurrent(LPCWSTR path) {
+		Entry result = this->lstActions.end();
+		std::pair<multimap<wstring, Entry>::iterator, multimap<wstring, Entry>::iterator> range = this->mapPaths.equal_range(path);
+		for(multimap<wstring, Entry>::iterator m = range.first; m != range.second; ++m) {
+			Entry it = m->second;
+			// a removed file has no current path
+			if(it->bFoldable && it->newPath == path && (result == this->lstActions.end() || it->nSeq > result->nSeq)) result = it;
+		}
+		return result;
+	}
+
+	/*
+	Release held events, from the oldest one, up to the last one referring to given path, if that one was received after given entry.
+	Returns TRUE if given entry was released.
+	*/
+	BOOL ReleaseConflicts(Entry it, LPCWSTR path, vector<CoalescedAction>* vecRelease) {
+		UINT nLast = it->nSeq;
+		std::pair<multimap<wstring, Entry>::iterator, multimap<wstring, Entry>::iterator> range = this->mapPaths.equal_range(path);
+		for(multimap<wstring, Entry>::iterator m = range.first; m != range.second; ++m) {
+			if(m->second->nSeq > nLast) nLast = m->second->nSeq;
+		}
+		if(nLast == it->nSeq) return FALSE;
+		while(!this->lstActions.empty() && this->lstActions.front().nSeq <= nLast) this->Pop(vecRelease);
+		return TRUE;
+	}
+
+	void Pop(vector<CoalescedAction>* vecRelease) {
+		Entry it = this->lstActions.begin();
+		vecRelease->push_back(*it);
+		++this->nReleased;
+		this->Drop(it);
+	}
+
+	void Hold(DWORD action, LPCWSTR oldPath, LPCWSTR newPath, ULONGLONG now) {
+		this->lstActions.push_back(CoalescedAction(action, oldPath, newPath, now + this->ullWindow, ++this->nSeq));
+		this->Index(--this->lstActions.end());
+	}
+
+public:
+	FileActionCoalescer() {
+		this->ullWindow = 0;
+		this->nSeq = 0;
+		this->nReceived = 0;
+		this->nReleased = 0;
+	}
+
+	void SetWindow(DWORD dwMilliseconds) { this->ullWindow = (ULONGLONG) dwMilliseconds * 1000; }
+	DWORD GetWindow() { return (DWORD) (this->ullWindow / 1000); }
+
+	/*
+	Hold an event received at given time (microseconds). Events that have to be notified right away are appended to vecRelease.
+	*/
+	void Add(DWORD action, LPCWSTR oldPath, LPCWSTR newPath, ULONGLONG now, vector<CoalescedAction>* vecRelease) {
+		++this->nReceived;
+		Entry it;
+		switch(action) {
+		case FILE_ACTION_ADDED:
+			this->Hold(action, NULL, newPath, now);
+			break;
+		case FILE_ACTION_MOVED:
+			it = this->FindCurrent(oldPath);
+			if(it != this->lstActions.end() && !this->ReleaseConflicts(it, newPath, vecRelease)) {
+				this->Unindex(it);
+				if(it->action == FILE_ACTION_MOVED && it->oldPath == newPath) {
+					// moved back
+					this->lstActions.erase(it);
+				}
+				else {
+					it->newPath = newPath;
+					this->Index(it);
+				}
+			}
+			else this->Hold(action, oldPath, newPath, now);
+			break;
+		case FILE_ACTION_REMOVED:
+			it = this->FindCurrent(oldPath);
+			if(it != this->lstActions.end()) {
+				this->Unindex(it);
+				if(it->action == FILE_ACTION_ADDED) {
+					// created then removed
+					this->lstActions.erase(it);
+				}
+				else {
+					// moved then removed: file is gone from its original path
+					it->action = FILE_ACTION_REMOVED;
+					it->newPath = (newPath) ? newPath : L"";
+					this->Index(it);
+				}
+			}
+			else this->Hold(action, oldPath, newPath, now);
+			break;
+		case FILE_ACTION_RESTORED:
+			this->Hold(action, oldPath, newPath, now);
+			break;
+		default:
+			// not related to a file: whatever is held comes first
+			this->Flush(vecRelease);
+			vecRelease->push_back(CoalescedAction(action, oldPath, newPath, now));
+			++this->nReleased;
+			break;
+		}
+	}
+
+	/*
+	Append the events whose window is over to vecRelease.
+	*/
+	void Release(ULONGLONG now, vector<CoalescedAction>* vecRelease) {
+		while(!this->lstActions.empty() && this->lstActions.front().deadline <= now) this->Pop(vecRelease);
+	}
+
+	void Flush(vector<CoalescedAction>* vecRelease) {
+		while(!this->lstActions.empty()) this->Pop(vecRelease);
+	}
+
+	BOOL IsEmpty() { return this->lstActions.empty(); }
+	// deadline of the oldest held event (the earliest one)
+	ULONGLONG GetNextDeadline() { return this->lstActions.empty() ? 0 : this->lstActions.front().deadline; }
+	UINT GetSize() { return this->lstActions.size(); }
+	// number of events received, and number of events notified (the difference was folded away)
+	UINT GetReceivedCount() { return this->nReceived; }
+	UINT GetReleasedCount() { return this->nReleased; }
+};
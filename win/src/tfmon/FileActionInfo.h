@@ -1,6 +1,11 @@
 #pragma once
 
-#include <time.h>
+#include "fscompat.h"
+#include "FileActionArena.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
 
 /* constants defined in winnt.h :
 #define FILE_ACTION_ADDED                   0x00000001   
@@ -11,42 +16,141 @@
 */
 #define FILE_ACTION_MOVED			        0x00000008
 #define FILE_ACTION_RESTORED			    0x00000010
+#define FILE_ACTION_STOPPED				    0x00000020
+// events were lost for the watched root given as path (system buffer overflow)
+#define FILE_ACTION_OVERFLOW			    0x00000040
 
 
 /* Structure holding info about a file modification.
+Records are fixed-size headers followed by their path, carved from the FileActionArena of the backend that produced them:
+they are obtained with Create and released with delete (which hands the memory back to the arena).
 */
 class FileActionInfo {
 private:
+	FileActionBlock*	lpBlock;
 	LPWSTR	filePath;	
+	// offset of the filename in filePath (0 if the path holds no separator)
+	UINT	nameOffset;
 	DWORD	action;
-	time_t	timestamp;
-	// virtual members accessible through Getters
-	// CHAR	drive;
-	// LPWSTR fileName;
+	// monotonic time (microseconds) at which the event was seen: events are paired by their distance in time
+	ULONGLONG	ticks;
+	CHAR	drive;
+	// identity of the file within its volume (NTFS file ID, inode number), 0 if unknown
+	ULONGLONG	fileId;
+	// 'removed' event of a file that went to the recycle bin (an item was added to a recycle bin right after it)
+	BOOL	trashed;
+
+	// links of the FileActionQueue holding the record (in order of addition, and among the records having the same filename)
+	friend class FileActionQueue;
+	LPVOID			lpQueue;
+	FileActionInfo*	lpPrev;
+	FileActionInfo*	lpNext;
+	FileActionInfo*	lpNamePrev;
+	FileActionInfo*	lpNameNext;
+
+	FileActionInfo() {
+		this->fileId = 0;
+		this->trashed = FALSE;
+		this->lpQueue = NULL;
+		this->lpPrev = this->lpNext = NULL;
+		this->lpNamePrev = this->lpNameNext = NULL;
+	}
+
+	// records can only be built inside an arena
+	static void* operator new(size_t, LPVOID lpPlace) { return lpPlace; }
+	static void operator delete(void*, LPVOID) {}
+
 public:
 
-	FileActionInfo(LPCWSTR filePath, DWORD action) {		
-		this->filePath = (LPWSTR) GlobalAlloc(GPTR, sizeof(WCHAR)*(wcslen(filePath)+1));
-		wcscpy(this->filePath, filePath);
-		this->action = action;
-		this->timestamp = time(NULL);
+	/* Build a record whose path is dirPath followed by fileName (a separator is inserted if needed).
+	Neither string has to be null-terminated, and fileName might hold sub-directories.
+	On Windows, the drive is the letter the path starts with. 
+	Other backends (where paths have no drive letter) give the identifier of the volume holding the file.
+	If no ticks are given, the event is stamped with current time (replayed events keep their recorded timing).
+	Returns NULL if memory is exhausted.
+	*/
+	static FileActionInfo* Create(FileActionArena* lpArena, LPCWSTR dirPath, SIZE_T dirLength, LPCWSTR fileName, SIZE_T nameLength, DWORD action, CHAR drive = 0, ULONGLONG ticks = 0) {
+		BOOL bSeparator = (dirLength && nameLength && dirPath[dirLength-1] != FS_PATH_SEPARATOR);
+		SIZE_T pathLength = dirLength + (bSeparator ? 1 : 0) + nameLength;
+		FileActionBlock* lpBlock;
+		LPBYTE lpMem = (LPBYTE) lpArena->Alloc(sizeof(FileActionInfo) + sizeof(WCHAR)*(pathLength+1), &lpBlock);
+		if(!lpMem) return NULL;
+
+		FileActionInfo* lpAction = new(lpMem) FileActionInfo();
+		lpAction->lpBlock = lpBlock;
+		lpAction->filePath = (LPWSTR) (lpMem + sizeof(FileActionInfo));
+		memcpy(lpAction->filePath, dirPath, sizeof(WCHAR)*dirLength);
+		if(bSeparator) lpAction->filePath[dirLength] = FS_PATH_SEPARATOR;
+		memcpy(lpAction->filePath + pathLength - nameLength, fileName, sizeof(WCHAR)*nameLength);
+		lpAction->filePath[pathLength] = 0;
+
+		// filename starts after the last separator: only the part given as fileName has to be searched, if any
+		// (dirPath is always followed by a separator)
+		SIZE_T i = pathLength, stop = (nameLength) ? pathLength - nameLength : 0;
+		while(i > stop && lpAction->filePath[i-1] != FS_PATH_SEPARATOR) --i;
+		lpAction->nameOffset = (UINT) i;
+
+		lpAction->action = action;
+		lpAction->ticks = (ticks)?ticks:FileActionInfo::GetCurrentTicks();
+		lpAction->drive = (drive)?drive:(CHAR) lpAction->filePath[0];
+		return lpAction;
+	}
+
+	static FileActionInfo* Create(FileActionArena* lpArena, LPCWSTR filePath, DWORD action, CHAR drive = 0, ULONGLONG ticks = 0) {
+		return FileActionInfo::Create(lpArena, filePath, wcslen(filePath), NULL, 0, action, drive, ticks);
 	}
-    
-	~FileActionInfo() { GlobalFree(this->filePath);	}
+
+	// memory goes back to the arena when the record is destroyed
+	~FileActionInfo() { FileActionArena::Release(this->lpBlock); }
+	static void operator delete(void*) {}
 
 	LPWSTR GetFilePath() { return this->filePath; }
 	DWORD GetAction() { return this->action; }
-	time_t GetTimeStamp() { return this->timestamp; }
+	ULONGLONG GetTicks() { return this->ticks; }
+
+	CHAR GetDrive() { return this->drive; }
 
-	CHAR GetDrive() {
-		CHAR result = 0;
-		if(wcslen(this->filePath) > 0) result = (CHAR) this->filePath[0];		
-		return result;
+	ULONGLONG GetFileId() { return this->fileId; }
+	void SetFileId(ULONGLONG fileId) { this->fileId = fileId; }
+
+	BOOL IsTrashed() { return this->trashed; }
+	void SetTrashed(BOOL trashed) { this->trashed = trashed; }
+
+	/* Identity of the file (or directory) at given path, within its volume. Returns 0 if it cannot be read.
+	*/
+	static ULONGLONG ReadFileId(LPCWSTR filePath) {
+#ifdef _WIN32
+		BY_HANDLE_FILE_INFORMATION info;
+		// no access right is needed to query the file index (FILE_FLAG_BACKUP_SEMANTICS allows to open directories)
+		HANDLE hFile = CreateFileW(filePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+		if(hFile == INVALID_HANDLE_VALUE) return 0;
+		BOOL bRead = GetFileInformationByHandle(hFile, &info);
+		CloseHandle(hFile);
+		return (bRead) ? ((ULONGLONG) info.nFileIndexHigh << 32) | info.nFileIndexLow : 0;
+#else
+		struct stat st;
+		if(lstat(WCHARtoUTF8(filePath).c_str(), &st) != 0) return 0;
+		return (ULONGLONG) st.st_ino;
+#endif
 	}
     
+	/* Current value of the monotonic clock events are stamped with (microseconds).
+	*/
+	static ULONGLONG GetCurrentTicks() {
+		static LONGLONG llFrequency = 0;
+		LARGE_INTEGER li;
+		if(!llFrequency) {
+			QueryPerformanceFrequency(&li);
+			llFrequency = li.QuadPart;
+		}
+		QueryPerformanceCounter(&li);
+		// split to avoid overflowing with high frequency counters
+		return (ULONGLONG) (li.QuadPart / llFrequency) * 1000000 + (ULONGLONG) (li.QuadPart % llFrequency) * 1000000 / llFrequency;
+	}
+
+	/* Returns NULL if the path holds no separator.
+	*/
 	LPWSTR GetFileName() {
-		LPWSTR result = wcsrchr(this->filePath, '\\');
-		if(result) result += sizeof(WCHAR);
-		return result;
+		return (this->nameOffset) ? this->filePath + this->nameOffset : NULL;
 	}
-};
\ No newline at end of file
+};
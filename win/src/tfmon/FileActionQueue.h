@@ -4,125 +4,237 @@
 
 #include <string>
 #include <cwchar>
-#include <vector>
-#include <map>
+#include <wctype.h>
+#include <unordered_map>
 
 using std::wstring;
-using std::vector;
-using std::map;
+using std::unordered_map;
 
 
-/* Retrieve file name from a file path. 
-If string does not contains backslashes (given string is not a path), 
-then function returns NULL.
-*/
 /*
-LPWSTR GetFileName(LPWSTR filePath) {
-	LPWSTR result = wcsrchr(filePath, '\\');
-	if(result) result += sizeof(WCHAR);
-	return result;
-}
-*/
-
-/*
-There are two structures storing pointers to FileActionInfo items : a vector and a map. 
-This is because we need to be able to:
-1) quickly retrieve the latest added item
-2) quickly search among all queued items (in which case we use fileName as hashcode)
+Queued items are linked together through the records themselves (no allocation besides the buckets), twice:
+1) in order of addition, so that the latest added item can be retrieved (and any item removed) in constant time
+2) among the items having the same filename, whose list is found through a hash map keyed by filename (case folded on Windows)
+Items whose file identity is known are also indexed by it (the latest one wins if several items share an identity).
+Each record knows the queue it belongs to, so that membership is checked in constant time as well.
+A record can only be held by one queue at a time.
 */
 class FileActionQueue {
 private:
-	LPCRITICAL_SECTION criticalSection; 
-	vector<FileActionInfo*> *qActionQueue;
-	map<wstring, vector<FileActionInfo*>> *mActionMap;
-
-	void Queue(vector<FileActionInfo*> *v, FileActionInfo* lpAction) {
-		v->push_back(lpAction);
+	// items having a given filename, in order of addition
+	class Bucket {
+	public:
+		FileActionInfo*	lpFirst;
+		FileActionInfo*	lpLast;
+
+		Bucket() {
+			this->lpFirst = this->lpLast = NULL;
+		}
+	};
+
+	CRITICAL_SECTION				criticalSection;
+	FileActionInfo*					lpFirst;
+	FileActionInfo*					lpLast;
+	UINT							nSize;
+	unordered_map<wstring, Bucket>	mapNames;
+	unordered_map<ULONGLONG, FileActionInfo*>	mapIds;
+
+	static wstring Key(LPCWSTR fileName) {
+		wstring result = (fileName) ? fileName : L"";
+#ifdef _WIN32
+		for(SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+		return result;
 	}
 
-	void Dequeue(vector<FileActionInfo*> *v, FileActionInfo* lpAction) {
-		for(int i = 0, nCount = v->size(); i < nCount; ++i){
-			if(lpAction == v->at(i)) {
-				v->erase(v->begin() + i);
-				break;
-			}
+	void Unlink(FileActionInfo* lpAction) {
+		if(lpAction->lpPrev) lpAction->lpPrev->lpNext = lpAction->lpNext;
+		else this->lpFirst = lpAction->lpNext;
+		if(lpAction->lpNext) lpAction->lpNext->lpPrev = lpAction->lpPrev;
+		else this->lpLast = lpAction->lpPrev;
+
+		if(!lpAction->lpNamePrev || !lpAction->lpNameNext) {
+			// bucket has to be updated (and released if it is left empty)
+			unordered_map<wstring, Bucket>::iterator it = this->mapNames.find(FileActionQueue::Key(lpAction->GetFileName()));
+			if(!lpAction->lpNamePrev) it->second.lpFirst = lpAction->lpNameNext;
+			if(!lpAction->lpNameNext) it->second.lpLast = lpAction->lpNamePrev;
+			if(!it->second.lpFirst) this->mapNames.erase(it);
+		}
+		if(lpAction->lpNamePrev) lpAction->lpNamePrev->lpNameNext = lpAction->lpNameNext;
+		if(lpAction->lpNameNext) lpAction->lpNameNext->lpNamePrev = lpAction->lpNamePrev;
+
+		if(lpAction->GetFileId()) {
+			unordered_map<ULONGLONG, FileActionInfo*>::iterator it = this->mapIds.find(lpAction->GetFileId());
+			if(it != this->mapIds.end() && it->second == lpAction) this->mapIds.erase(it);
 		}
+
+		lpAction->lpQueue = NULL;
+		lpAction->lpPrev = lpAction->lpNext = NULL;
+		lpAction->lpNamePrev = lpAction->lpNameNext = NULL;
+		--this->nSize;
 	}
 
 public:
     FileActionQueue() {
-        this->qActionQueue = new vector<FileActionInfo*>;
-        this->mActionMap = new map<wstring, vector<FileActionInfo*>>;
-		this->criticalSection = new CRITICAL_SECTION;
-		InitializeCriticalSection(this->criticalSection);
+		this->lpFirst = this->lpLast = NULL;
+		this->nSize = 0;
+		InitializeCriticalSection(&this->criticalSection);
     }
-    
+
     ~FileActionQueue() {
-        delete this->qActionQueue;
-        delete this->mActionMap;
-		DeleteCriticalSection(this->criticalSection);
-		delete this->criticalSection;
+		DeleteCriticalSection(&this->criticalSection);
     }
 
 	void Add(FileActionInfo* lpAction) {
-		EnterCriticalSection(this->criticalSection);
-		this->Queue(&((*this->mActionMap)[lpAction->GetFileName()]), lpAction);
-		this->Queue(this->qActionQueue, lpAction);
-		LeaveCriticalSection(this->criticalSection);
+		EnterCriticalSection(&this->criticalSection);
+		lpAction->lpQueue = this;
+		lpAction->lpNext = NULL;
+		lpAction->lpPrev = this->lpLast;
+		if(this->lpLast) this->lpLast->lpNext = lpAction;
+		else this->lpFirst = lpAction;
+		this->lpLast = lpAction;
+
+		Bucket* lpBucket = &this->mapNames[FileActionQueue::Key(lpAction->GetFileName())];
+		lpAction->lpNameNext = NULL;
+		lpAction->lpNamePrev = lpBucket->lpLast;
+		if(lpBucket->lpLast) lpBucket->lpLast->lpNameNext = lpAction;
+		else lpBucket->lpFirst = lpAction;
+		lpBucket->lpLast = lpAction;
+		if(lpAction->GetFileId()) this->mapIds[lpAction->GetFileId()] = lpAction;
+		++this->nSize;
+		LeaveCriticalSection(&this->criticalSection);
 	}
 
+	/*
+	Remove given item from the queue and delete it.
+	*/
 	void Remove(FileActionInfo* lpAction) {
 		if(lpAction) {
-			EnterCriticalSection(this->criticalSection);
-			this->Dequeue(&((*this->mActionMap)[lpAction->GetFileName()]), lpAction);
-			this->Dequeue(this->qActionQueue, lpAction);
+			EnterCriticalSection(&this->criticalSection);
+			if(lpAction->lpQueue == this) this->Unlink(lpAction);
 			delete lpAction;
-			LeaveCriticalSection(this->criticalSection);
+			LeaveCriticalSection(&this->criticalSection);
 		}
 	}
 
 	UINT Size() {
-		return this->qActionQueue->size();
+		EnterCriticalSection(&this->criticalSection);
+		UINT result = this->nSize;
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
 	}
 
 	FileActionInfo* Last() {
+		EnterCriticalSection(&this->criticalSection);
+		FileActionInfo* result = this->lpLast;
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	// number of items indexed by file identity
+	UINT GetIdentifiedCount() {
+		EnterCriticalSection(&this->criticalSection);
+		UINT result = this->mapIds.size();
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	FileActionInfo* First() {
+		EnterCriticalSection(&this->criticalSection);
+		FileActionInfo* result = this->lpFirst;
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	/*
+	Item queued right before given one (NULL if it is the first one, or if it is not held by the queue).
+	*/
+	FileActionInfo* Previous(FileActionInfo* lpAction) {
+		EnterCriticalSection(&this->criticalSection);
+		FileActionInfo* result = (lpAction->lpQueue == this) ? lpAction->lpPrev : NULL;
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	/*
+	Latest queued item having given filename and action, and whose event was seen at or after given ticks.
+	*/
+	FileActionInfo* Newest(LPCWSTR fileName, DWORD action, ULONGLONG ullSince) {
 		FileActionInfo* result = NULL;
-		vector<FileActionInfo*> *v = this->qActionQueue;
-		EnterCriticalSection(this->criticalSection);
-		if(v->size() > 0)  result = v->at(v->size()-1);
-		LeaveCriticalSection(this->criticalSection);
+		EnterCriticalSection(&this->criticalSection);
+		unordered_map<wstring, Bucket>::iterator it = this->mapNames.find(FileActionQueue::Key(fileName));
+		if(it != this->mapNames.end()) {
+			// items of a bucket are in order of addition (hence of their events): walk back until the window is left
+			for(FileActionInfo* lpAction = it->second.lpLast; lpAction && !result && lpAction->GetTicks() >= ullSince; lpAction = lpAction->lpNamePrev) {
+				if(lpAction->GetAction() == action) result = lpAction;
+			}
+		}
+		LeaveCriticalSection(&this->criticalSection);
 		return result;
 	}
 
+	/*
+	Latest queued item having given path and action, and whose event was seen at or after given ticks (paths are case insensitive on Windows).
+	*/
+	FileActionInfo* NewestPath(LPCWSTR filePath, DWORD action, ULONGLONG ullSince) {
+		FileActionInfo* result = NULL;
+		LPCWSTR fileName = wcsrchr(filePath, FS_PATH_SEPARATOR);
+		EnterCriticalSection(&this->criticalSection);
+		unordered_map<wstring, Bucket>::iterator it = this->mapNames.find(FileActionQueue::Key(fileName ? fileName + 1 : NULL));
+		if(it != this->mapNames.end()) {
+			for(FileActionInfo* lpAction = it->second.lpLast; lpAction && !result && lpAction->GetTicks() >= ullSince; lpAction = lpAction->lpNamePrev) {
+#ifdef _WIN32
+				if(lpAction->GetAction() == action && _wcsicmp(lpAction->GetFilePath(), filePath) == 0) result = lpAction;
+#else
+				if(lpAction->GetAction() == action && wcscmp(lpAction->GetFilePath(), filePath) == 0) result = lpAction;
+#endif
+			}
+		}
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	/*
+	Latest queued item having given file identity (NULL if there is none, or if given identity is 0).
+	*/
+	FileActionInfo* Find(ULONGLONG fileId) {
+		FileActionInfo* result = NULL;
+		if(!fileId) return result;
+		EnterCriticalSection(&this->criticalSection);
+		unordered_map<ULONGLONG, FileActionInfo*>::iterator it = this->mapIds.find(fileId);
+		if(it != this->mapIds.end()) result = it->second;
+		LeaveCriticalSection(&this->criticalSection);
+		return result;
+	}
+
+	/*
+	Oldest queued item having given filename and action, and lying on one of given drives (null-terminated list).
+	*/
 	FileActionInfo* Search(LPWSTR fileName, DWORD action, PCHAR drives) {
 		FileActionInfo* result = NULL;
-		vector<FileActionInfo*> *v;
-		EnterCriticalSection(this->criticalSection);
-		if( v = &((*this->mActionMap)[fileName])) {
-			for(int i = 0, nCount = v->size(); i < nCount && !result; ++i){
-				FileActionInfo* lpAction = v->at(i);
+		EnterCriticalSection(&this->criticalSection);
+		unordered_map<wstring, Bucket>::iterator it = this->mapNames.find(FileActionQueue::Key(fileName));
+		if(it != this->mapNames.end()) {
+			for(FileActionInfo* lpAction = it->second.lpFirst; lpAction && !result; lpAction = lpAction->lpNameNext) {
 				if(lpAction->GetAction() == action) {
-					int j = 0;
-					while(!result && drives[j]) {
+					for(int j = 0; !result && drives[j]; ++j) {
 						if(lpAction->GetDrive() == drives[j]) result = lpAction;
-						++j;
-					}			
+					}
 				}
 			}
 		}
-		LeaveCriticalSection(this->criticalSection);
+		LeaveCriticalSection(&this->criticalSection);
 		return result;
 	}
 
+	/*
+	Given item is currently held by the queue.
+	*/
 	BOOL Search(FileActionInfo* lpInfo) {
-		BOOL result = FALSE;
-		vector<FileActionInfo*> *v = this->qActionQueue;
-		EnterCriticalSection(this->criticalSection);
-		for(int i = 0, nCount = v->size(); i < nCount && !result; ++i){
-			if(v->at(i) == lpInfo) result = TRUE;
-		}
-		LeaveCriticalSection(this->criticalSection);
+		EnterCriticalSection(&this->criticalSection);
+		BOOL result = (lpInfo->lpQueue == this);
+		LeaveCriticalSection(&this->criticalSection);
 		return result;
 	}
 
-};
\ No newline at end of file
+};
@@ -0,0 +1,115 @@
+/* FileActionRing.h - bounded single-producer/single-consumer queue of event records
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "fscompat.h"
+#include "FileActionInfo.h"
+
+// capacity of a ring (power of 2)
+#define FS_RING_SIZE	4096
+
+
+/*
+Hands the records decoded by a volume's I/O thread over to its correlation thread.
+Push and Pop do not lock as long as the ring is neither full nor empty:
+indexes only grow (wrapping around), each of them being written by a single side.
+A side that has to wait (producer on a full ring, consumer on an empty one) sleeps until the other side wakes it up.
+*/
+class FileActionRing {
+private:
+	FileActionInfo*		items[FS_RING_SIZE];
+	// next slot to read (written by consumer only)
+	volatile DWORD		nHead;
+	// next slot to write (written by producer only)
+	volatile DWORD		nTail;
+
+	CRITICAL_SECTION	csWait;
+	CONDITION_VARIABLE	cvWait;
+	volatile LONG		bConsumerWaiting;
+	volatile LONG		bProducerWaiting;
+
+	// backpressure statistics
+	volatile DWORD		nHighWater;
+	volatile DWORD		nStalls;
+
+	void Wake() {
+		EnterCriticalSection(&this->csWait);
+		WakeAllConditionVariable(&this->cvWait);
+		LeaveCriticalSection(&this->csWait);
+	}
+
+public:
+	FileActionRing() {
+		this->nHead = this->nTail = 0;
+		this->bConsumerWaiting = this->bProducerWaiting = FALSE;
+		this->nHighWater = this->nStalls = 0;
+		InitializeCriticalSection(&this->csWait);
+		InitializeConditionVariable(&this->cvWait);
+	}
+
+	~FileActionRing() {
+		DeleteCriticalSection(&this->csWait);
+	}
+
+	/*
+	Producer side. Waits while the ring is full (the decoding thread is then held back by the correlation one).
+	A NULL item can be pushed to tell the consumer that no more items will follow.
+	*/
+	void Push(FileActionInfo* lpAction) {
+		DWORD nTail = this->nTail;
+		if(nTail - this->nHead == FS_RING_SIZE) {
+			++this->nStalls;
+			EnterCriticalSection(&this->csWait);
+			this->bProducerWaiting = TRUE;
+			MemoryBarrier();
+			while(nTail - this->nHead == FS_RING_SIZE) SleepConditionVariableCS(&this->cvWait, &this->csWait, INFINITE);
+			this->bProducerWaiting = FALSE;
+			LeaveCriticalSection(&this->csWait);
+		}
+		this->items[nTail & (FS_RING_SIZE - 1)] = lpAction;
+		// item must be visible before the index that publishes it
+		MemoryBarrier();
+		this->nTail = nTail + 1;
+		MemoryBarrier();
+
+		DWORD nSize = nTail + 1 - this->nHead;
+		if(nSize > this->nHighWater) this->nHighWater = nSize;
+		if(this->bConsumerWaiting) this->Wake();
+	}
+
+	/*
+	Consumer side. Waits until an item is available.
+	*/
+	FileActionInfo* Pop() {
+		DWORD nHead = this->nHead;
+		if(this->nTail == nHead) {
+			EnterCriticalSection(&this->csWait);
+			this->bConsumerWaiting = TRUE;
+			MemoryBarrier();
+			while(this->nTail == nHead) SleepConditionVariableCS(&this->cvWait, &this->csWait, INFINITE);
+			this->bConsumerWaiting = FALSE;
+			LeaveCriticalSection(&this->csWait);
+		}
+		MemoryBarrier();
+		FileActionInfo* lpAction = this->items[nHead & (FS_RING_SIZE - 1)];
+		// slot must be read before it is handed back to the producer
+		MemoryBarrier();
+		this->nHead = nHead + 1;
+		MemoryBarrier();
+
+		if(this->bProducerWaiting) this->Wake();
+		return lpAction;
+	}
+
+	UINT GetSize()		{ return (UINT) (this->nTail - this->nHead); }
+	UINT GetCapacity()	{ return FS_RING_SIZE; }
+	// highest number of items held at once
+	UINT GetHighWater()	{ return (UINT) this->nHighWater; }
+	// number of times the producer had to wait for room
+	UINT GetStalls()	{ return (UINT) this->nStalls; }
+};
@@ -0,0 +1,93 @@
+/* FileFingerprint.cpp - cheap fingerprint of a file content (size and sampled blocks)
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "FileFingerprint.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+
+#define FNV_OFFSET_BASIS	14695981039346656037ULL
+#define FNV_PRIME			1099511628211ULL
+
+static void Hash(ULONGLONG* lpHash, const BYTE* lpData, SIZE_T len) {
+	for(SIZE_T i = 0; i < len; ++i) {
+		*lpHash ^= lpData[i];
+		*lpHash *= FNV_PRIME;
+	}
+}
+
+BOOL FileFingerprint::ReadSize(LPCWSTR filePath, ULONGLONG* lpSize) {
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if(!GetFileAttributesExW(filePath, GetFileExInfoStandard, &data) || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) return FALSE;
+	*lpSize = ((ULONGLONG) data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#else
+	struct stat st;
+	if(stat(WCHARtoUTF8(filePath).c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return FALSE;
+	*lpSize = (ULONGLONG) st.st_size;
+#endif
+	return TRUE;
+}
+
+BOOL FileFingerprint::Read(LPCWSTR filePath, FileFingerprint* lpFingerprint) {
+	BYTE buff[FS_FINGERPRINT_BLOCK];
+	ULONGLONG size, hash = FNV_OFFSET_BASIS;
+	BOOL result = TRUE;
+
+#ifdef _WIN32
+	HANDLE hFile = CreateFileW(filePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if(hFile == INVALID_HANDLE_VALUE) return FALSE;
+	LARGE_INTEGER li;
+	if(!GetFileSizeEx(hFile, &li)) {
+		CloseHandle(hFile);
+		return FALSE;
+	}
+	size = (ULONGLONG) li.QuadPart;
+#else
+	int fd = open(WCHARtoUTF8(filePath).c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return FALSE;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return FALSE;
+	}
+	size = (ULONGLONG) st.st_size;
+#endif
+
+	// small files are read whole (as consecutive blocks)
+	UINT nBlocks = (UINT) ((size + FS_FINGERPRINT_BLOCK - 1) / FS_FINGERPRINT_BLOCK);
+	if(nBlocks > FS_FINGERPRINT_SAMPLES) nBlocks = FS_FINGERPRINT_SAMPLES;
+	for(UINT i = 0; i < nBlocks && result; ++i) {
+		ULONGLONG offset = (size <= (ULONGLONG) FS_FINGERPRINT_SAMPLES * FS_FINGERPRINT_BLOCK) ? (ULONGLONG) i * FS_FINGERPRINT_BLOCK
+						 : (size - FS_FINGERPRINT_BLOCK) / (FS_FINGERPRINT_SAMPLES - 1) * i;
+		SIZE_T len = (SIZE_T) ((size - offset < FS_FINGERPRINT_BLOCK) ? size - offset : FS_FINGERPRINT_BLOCK);
+#ifdef _WIN32
+		OVERLAPPED ol = {0};
+		DWORD dwRead = 0;
+		ol.Offset = (DWORD) offset;
+		ol.OffsetHigh = (DWORD) (offset >> 32);
+		result = ReadFile(hFile, buff, (DWORD) len, &dwRead, &ol) && dwRead == len;
+#else
+		result = (pread(fd, buff, len, (off_t) offset) == (ssize_t) len);
+#endif
+		if(result) Hash(&hash, buff, len);
+	}
+
+#ifdef _WIN32
+	CloseHandle(hFile);
+#else
+	close(fd);
+#endif
+	if(!result) return FALSE;
+	lpFingerprint->size = size;
+	lpFingerprint->hash = hash;
+	return TRUE;
+}
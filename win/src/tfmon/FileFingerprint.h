@@ -0,0 +1,78 @@
+/* FileFingerprint.h - cheap fingerprint of a file content (size and sampled blocks)
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+
+#include <string>
+#include <vector>
+
+using std::wstring;
+using std::vector;
+
+// size (bytes) of a sampled block
+#define FS_FINGERPRINT_BLOCK	4096
+// number of sampled blocks (the first one, the last one, and evenly spaced ones in-between)
+#define FS_FINGERPRINT_SAMPLES	4
+
+
+/*
+A fingerprint is made of the size of a file and of a 64 bits hash (FNV-1a) over a few blocks of its content
+(files smaller than the sampled blocks are hashed whole). Reading it costs a handful of reads whatever the size of the file:
+it is not meant to prove that two files are identical, only to recognize a file that was copied elsewhere.
+Empty files all share the same fingerprint: a fingerprint is only valid for a non-empty file.
+*/
+class FileFingerprint {
+public:
+	ULONGLONG	size;
+	ULONGLONG	hash;
+
+	FileFingerprint() {
+		this->size = 0;
+		this->hash = 0;
+	}
+
+	BOOL IsValid() { return this->size > 0; }
+	BOOL operator==(const FileFingerprint& other) const { return this->size == other.size && this->hash == other.hash; }
+
+	/*
+	Size of the file at given path. Returns FALSE if it cannot be read (a fingerprint is only worth reading for a file of the expected size).
+	*/
+	static BOOL ReadSize(LPCWSTR filePath, ULONGLONG* lpSize);
+	/*
+	Returns FALSE if the file cannot be read.
+	*/
+	static BOOL Read(LPCWSTR filePath, FileFingerprint* lpFingerprint);
+};
+
+
+#define FS_FINGERPRINT_TRACK	1
+#define FS_FINGERPRINT_MATCH	2
+
+/*
+Work handed over to the fingerprinting threads:
+- FS_FINGERPRINT_TRACK	fingerprint a tracked file (filePath), known under given identity (0: its identity is read first)
+- FS_FINGERPRINT_MATCH	a tracked file (filePath, whose fingerprint is given) was removed from volume drive: look for a copy of it among
+						the candidate files added on other volumes (latest first), and notify either a move or a removal
+*/
+class FSFingerprintJob {
+public:
+	DWORD				type;
+	wstring				filePath;
+	CHAR				drive;
+	ULONGLONG			fileId;
+	FileFingerprint		fingerprint;
+	vector<wstring>		vecCandidates;
+
+	FSFingerprintJob(DWORD type, LPCWSTR filePath, CHAR drive = 0) {
+		this->type = type;
+		this->filePath = filePath;
+		this->drive = drive;
+		this->fileId = 0;
+	}
+};
@@ -0,0 +1,355 @@
+/* InotifyWatcher.cpp - filesystem events backend based on Linux inotify
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "InotifyWatcher.h"
+
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#define INOTIFY_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+
+InotifyWatcher::InotifyWatcher() {
+	this->fd = -1;
+	this->fdInterrupt = -1;
+	this->pBuff = NULL;
+	InitializeCriticalSection(&this->csWatches);
+	this->nPendingCookie = 0;
+	this->nPendingWd = -1;
+	this->bPendingDir = FALSE;
+	this->nWatchErrors = 0;
+}
+
+InotifyWatcher::~InotifyWatcher() {
+	RemoveAllPaths();
+	if (this->fd >= 0) close(this->fd);
+	if (this->fdInterrupt >= 0) close(this->fdInterrupt);
+	if (this->pBuff) free(this->pBuff);
+	DeleteCriticalSection(&this->csWatches);
+}
+
+BOOL InotifyWatcher::Init() {
+	if ((this->fd = inotify_init1(IN_CLOEXEC)) < 0 || (this->fdInterrupt = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		this->nLastError = errno;
+		return FALSE;
+	}
+	// buffer must be suitably aligned for struct inotify_event
+	if (!(this->pBuff = (char*) aligned_alloc(__alignof__(struct inotify_event), INOTIFY_BUFF_SIZE))) {
+		this->nLastError = E_FILESYSMON_ERROROUTOFMEM;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+INT InotifyWatcher::AddPath(LPCWSTR pPath, BOOL bSubTree) {
+	if (this->fd < 0) {
+			// must call Init() method first !
+			return E_FILESYSMON_ERRORNOTINIT;
+	}
+
+	InotifyRoot* lpRoot = new InotifyRoot(pPath, bSubTree, this->GetDrive(pPath));
+	EnterCriticalSection(&this->csWatches);
+	if (!this->AddWatch(lpRoot->rootPath, lpRoot)) {
+		LeaveCriticalSection(&this->csWatches);
+		delete lpRoot;
+		return E_FILESYSMON_ERROROPENFILE;
+	}
+	this->vecRoots.push_back(lpRoot);
+
+	if (bSubTree) this->AddWatchTree(lpRoot->rootPath, lpRoot, NULL);
+	LeaveCriticalSection(&this->csWatches);
+
+	return E_FILESYSMON_SUCCESS;
+}
+
+void InotifyWatcher::RemovePath(UINT nIndex) {
+	EnterCriticalSection(&this->csWatches);
+	//sanity check
+	if (nIndex < this->vecRoots.size()) {
+		InotifyRoot* lpRoot = this->vecRoots[nIndex];
+		this->RemoveWatches(L"", lpRoot);
+		this->vecRoots.erase(this->vecRoots.begin() + nIndex);
+		delete lpRoot;
+	}
+	LeaveCriticalSection(&this->csWatches);
+}
+
+void InotifyWatcher::RemoveAllPaths() {
+	EnterCriticalSection(&this->csWatches);
+	while (!this->vecRoots.empty()) {
+		this->RemovePath(0);
+	}
+	LeaveCriticalSection(&this->csWatches);
+}
+
+/*
+Paths have no drive letter: each distinct device gets its own identifier ('a', 'b', ...).
+*/
+CHAR InotifyWatcher::GetDrive(LPCWSTR pPath) {
+	struct stat st;
+	if (stat(WCHARtoUTF8(pPath).c_str(), &st) != 0) return 0;
+	UINT i, uiCount;
+	for (i = 0, uiCount = this->vecDevices.size(); i < uiCount; ++i) {
+		if (this->vecDevices[i] == st.st_dev) break;
+	}
+	if (i == uiCount) this->vecDevices.push_back(st.st_dev);
+	return (CHAR) ('a' + (i % 26));
+}
+
+UINT InotifyWatcher::GetOverflowCount(UINT nIndex) {
+	UINT result = 0;
+	EnterCriticalSection(&this->csWatches);
+	if (nIndex < this->vecRoots.size()) result = this->vecRoots[nIndex]->nOverflows;
+	LeaveCriticalSection(&this->csWatches);
+	return result;
+}
+
+void InotifyWatcher::Interrupt() {
+	uint64_t nValue = 1;
+	if (this->fdInterrupt < 0) return;
+	ssize_t nWritten = write(this->fdInterrupt, &nValue, sizeof(nValue));
+	(void) nWritten;
+}
+
+BOOL InotifyWatcher::AddWatch(const wstring& dirPath, InotifyRoot* lpRoot) {
+	int wd = inotify_add_watch(this->fd, WCHARtoUTF8(dirPath.c_str()).c_str(), INOTIFY_MASK);
+	if (wd < 0) {
+		this->nLastError = errno;
+		++this->nWatchErrors;
+		return FALSE;
+	}
+	// the same directory might be watched already (wd is then re-used by the kernel)
+	map<int, InotifyWatch*>::iterator it = this->mapWatches.find(wd);
+	if (it != this->mapWatches.end()) {
+		it->second->dirPath = dirPath;
+		it->second->lpRoot = lpRoot;
+	}
+	else this->mapWatches[wd] = new InotifyWatch(dirPath, lpRoot);
+	return TRUE;
+}
+
+/*
+Recursively add watches on all sub-directories of dirPath (which is expected to be watched already).
+If vecAdded is given, an 'added' event is generated for every entry found:
+this covers entries created inside a new directory before its watch was set.
+*/
+void InotifyWatcher::AddWatchTree(const wstring& dirPath, InotifyRoot* lpRoot, vector<FileActionInfo*>* vecAdded) {
+	std::string path = WCHARtoUTF8(dirPath.c_str());
+	DIR* dir = opendir(path.c_str());
+	if (!dir) return;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+		BOOL bDir = (entry->d_type == DT_DIR);
+		if (entry->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if (lstat((path + entry->d_name).c_str(), &st) == 0) bDir = S_ISDIR(st.st_mode);
+		}
+
+		wstring entryPath = dirPath + UTF8toWCHAR(entry->d_name);
+		if (vecAdded) this->PushChange(vecAdded, entryPath.c_str(), FILE_ACTION_ADDED, lpRoot->drive);
+
+		if (bDir) {
+			entryPath += FS_PATH_SEPARATOR;
+			if (this->AddWatch(entryPath, lpRoot)) this->AddWatchTree(entryPath, lpRoot, vecAdded);
+		}
+	}
+	closedir(dir);
+}
+
+/*
+Remove all watches whose directory starts with given prefix (and, if specified, belong to given root).
+*/
+void InotifyWatcher::RemoveWatches(const wstring& prefix, InotifyRoot* lpRoot) {
+	map<int, InotifyWatch*>::iterator it = this->mapWatches.begin();
+	while (it != this->mapWatches.end()) {
+		InotifyWatch* lpWatch = it->second;
+		if ((!lpRoot || lpWatch->lpRoot == lpRoot) && lpWatch->dirPath.compare(0, prefix.size(), prefix) == 0) {
+			inotify_rm_watch(this->fd, it->first);
+			delete lpWatch;
+			this->mapWatches.erase(it++);
+		}
+		else ++it;
+	}
+}
+
+/*
+A directory moved inside the watched subtrees keeps its watches: only their paths have to be updated.
+*/
+void InotifyWatcher::MoveWatches(const wstring& oldPrefix, const wstring& newPrefix) {
+	for (map<int, InotifyWatch*>::iterator it = this->mapWatches.begin(); it != this->mapWatches.end(); ++it) {
+		InotifyWatch* lpWatch = it->second;
+		if (lpWatch->dirPath.compare(0, oldPrefix.size(), oldPrefix) == 0) {
+			lpWatch->dirPath = newPrefix + lpWatch->dirPath.substr(oldPrefix.size());
+		}
+	}
+}
+
+/*
+An IN_MOVED_FROM that was not followed by its IN_MOVED_TO: the item left the watched subtrees.
+*/
+void InotifyWatcher::FlushPending(vector<FileActionInfo*>* vecChanges) {
+	if (!this->nPendingCookie) return;
+
+	map<int, InotifyWatch*>::iterator it = this->mapWatches.find(this->nPendingWd);
+	CHAR drive = (it != this->mapWatches.end()) ? it->second->lpRoot->drive : 0;
+	this->PushChange(vecChanges, this->pendingPath.c_str(), FILE_ACTION_REMOVED, drive);
+
+	if (this->bPendingDir) this->RemoveWatches(this->pendingPath + FS_PATH_SEPARATOR);
+
+	this->nPendingCookie = 0;
+	this->nPendingWd = -1;
+	this->pendingPath.clear();
+}
+
+/*
+The inotify queue is shared by all watches: when it overflows, events might have been lost for any root.
+*/
+void InotifyWatcher::PushOverflow(vector<FileActionInfo*>* vecChanges) {
+	for (UINT i = 0, uiCount = this->vecRoots.size(); i < uiCount; ++i) {
+		InotifyRoot* lpRoot = this->vecRoots[i];
+		++lpRoot->nOverflows;
+		this->PushChange(vecChanges, lpRoot->rootPath.c_str(), FILE_ACTION_OVERFLOW, lpRoot->drive);
+	}
+}
+
+BOOL InotifyWatcher::FetchChanges(vector<FileActionInfo*>* vecChanges) {
+	if (this->fd < 0) {
+		this->nLastError = E_FILESYSMON_ERRORNOTINIT;
+		return FALSE;
+	}
+
+	while (TRUE) {
+		// a pending move is only given a short delay to be completed
+		struct pollfd pfds[2] = { { this->fd, POLLIN, 0 }, { this->fdInterrupt, POLLIN, 0 } };
+		int nReady = poll(pfds, 2, this->nPendingCookie ? INOTIFY_MOVE_TIMEOUT : -1);
+		if (nReady < 0) {
+			if (errno == EINTR) continue;
+			this->nLastError = E_FILESYSMON_ERRORDEQUE;
+			return FALSE;
+		}
+		if (nReady == 0 || pfds[1].revents) {
+			EnterCriticalSection(&this->csWatches);
+			this->FlushPending(vecChanges);
+			LeaveCriticalSection(&this->csWatches);
+			if (!vecChanges->empty()) return TRUE;
+			if (pfds[1].revents) {
+				// changes already fetched are returned first: interruption is only consumed once there is none left
+				uint64_t nValue;
+				ssize_t nRead = read(this->fdInterrupt, &nValue, sizeof(nValue));
+				(void) nRead;
+				this->nLastError = E_FILESYSMON_INTERRUPTED;
+				return FALSE;
+			}
+			continue;
+		}
+
+		ssize_t len = read(this->fd, this->pBuff, INOTIFY_BUFF_SIZE);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			this->nLastError = E_FILESYSMON_ERRORDEQUE;
+			return FALSE;
+		}
+
+		EnterCriticalSection(&this->csWatches);
+		for (char* ptr = this->pBuff; ptr < this->pBuff + len; ) {
+			struct inotify_event* ev = (struct inotify_event*) ptr;
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				this->FlushPending(vecChanges);
+				this->PushOverflow(vecChanges);
+				continue;
+			}
+
+			map<int, InotifyWatch*>::iterator it = this->mapWatches.find(ev->wd);
+			if (it == this->mapWatches.end()) continue;
+			InotifyWatch* lpWatch = it->second;
+
+			if (ev->mask & IN_IGNORED) {
+				// watched directory was deleted (or unmounted)
+				delete lpWatch;
+				this->mapWatches.erase(it);
+				continue;
+			}
+			if (!ev->len) continue;
+
+			// records are built from the directory of the watch and the name (decoded in a reused buffer)
+			const wstring& dirPath = lpWatch->dirPath;
+			this->name.clear();
+			UTF8toWCHAR(ev->name, (SIZE_T) -1, &this->name);
+			BOOL bDir = (ev->mask & IN_ISDIR) ? TRUE : FALSE;
+			CHAR drive = lpWatch->lpRoot->drive;
+			BOOL bSubTree = lpWatch->lpRoot->bSubTree;
+
+			// any event other than the expected IN_MOVED_TO completes the pending move as a removal
+			if (this->nPendingCookie && !((ev->mask & IN_MOVED_TO) && ev->cookie == this->nPendingCookie)) {
+				this->FlushPending(vecChanges);
+			}
+
+			if (ev->mask & IN_CREATE) {
+				this->PushChange(vecChanges, dirPath.c_str(), dirPath.size(), this->name.c_str(), this->name.size(), FILE_ACTION_ADDED, drive);
+				if (bDir && bSubTree) {
+					wstring subDir = dirPath + this->name + FS_PATH_SEPARATOR;
+					if (this->AddWatch(subDir, lpWatch->lpRoot)) this->AddWatchTree(subDir, lpWatch->lpRoot, vecChanges);
+				}
+			}
+			else if (ev->mask & IN_DELETE) {
+				this->PushChange(vecChanges, dirPath.c_str(), dirPath.size(), this->name.c_str(), this->name.size(), FILE_ACTION_REMOVED, drive);
+			}
+			else if (ev->mask & IN_MOVED_FROM) {
+				this->nPendingCookie = ev->cookie;
+				this->nPendingWd = ev->wd;
+				this->pendingPath.assign(dirPath);
+				this->pendingPath += this->name;
+				this->bPendingDir = bDir;
+			}
+			else if (ev->mask & IN_MOVED_TO) {
+				if (this->nPendingCookie && ev->cookie == this->nPendingCookie) {
+					if (this->nPendingWd == ev->wd) {
+						this->PushChange(vecChanges, this->pendingPath.c_str(), FILE_ACTION_RENAMED_OLD_NAME, drive);
+						this->PushChange(vecChanges, dirPath.c_str(), dirPath.size(), this->name.c_str(), this->name.size(), FILE_ACTION_RENAMED_NEW_NAME, drive);
+					}
+					else {
+						map<int, InotifyWatch*>::iterator itFrom = this->mapWatches.find(this->nPendingWd);
+						CHAR driveFrom = (itFrom != this->mapWatches.end()) ? itFrom->second->lpRoot->drive : drive;
+						FileActionInfo* lpRemoved = this->PushChange(vecChanges, this->pendingPath.c_str(), FILE_ACTION_REMOVED, driveFrom);
+						FileActionInfo* lpAdded = this->PushChange(vecChanges, dirPath.c_str(), dirPath.size(), this->name.c_str(), this->name.size(), FILE_ACTION_ADDED, drive);
+						// the cookie tells both halves belong together: give them the identity of the moved item
+						if (lpRemoved && lpAdded && driveFrom == drive) {
+							ULONGLONG fileId = FileActionInfo::ReadFileId(lpAdded->GetFilePath());
+							lpRemoved->SetFileId(fileId);
+							lpAdded->SetFileId(fileId);
+						}
+					}
+					if (bDir) this->MoveWatches(this->pendingPath + FS_PATH_SEPARATOR, dirPath + this->name + FS_PATH_SEPARATOR);
+					this->nPendingCookie = 0;
+					this->nPendingWd = -1;
+					this->pendingPath.clear();
+				}
+				else {
+					// moved in from outside of the watched subtrees
+					this->PushChange(vecChanges, dirPath.c_str(), dirPath.size(), this->name.c_str(), this->name.size(), FILE_ACTION_ADDED, drive);
+					if (bDir && bSubTree) {
+						wstring subDir = dirPath + this->name + FS_PATH_SEPARATOR;
+						if (this->AddWatch(subDir, lpWatch->lpRoot)) this->AddWatchTree(subDir, lpWatch->lpRoot, NULL);
+					}
+				}
+			}
+		}
+		LeaveCriticalSection(&this->csWatches);
+
+		if (!vecChanges->empty() && !this->nPendingCookie) return TRUE;
+	}
+}
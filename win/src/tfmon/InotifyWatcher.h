@@ -0,0 +1,116 @@
+/* InotifyWatcher.h - filesystem events backend based on Linux inotify
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+#include "WatcherBackend.h"
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+using std::wstring;
+using std::vector;
+using std::map;
+
+#define INOTIFY_BUFF_SIZE		65536
+// delay (ms) after which an IN_MOVED_FROM event without matching IN_MOVED_TO is handled as a removal
+#define INOTIFY_MOVE_TIMEOUT	50
+
+
+class InotifyRoot {
+public:
+	wstring			rootPath;
+	BOOL			bSubTree;
+	CHAR			drive;
+	UINT			nOverflows;
+
+	InotifyRoot(LPCWSTR rootPath, BOOL bSubTree, CHAR drive) {
+		this->rootPath = rootPath;
+		// add separator at the end of the path, if not present
+		if(this->rootPath.empty() || this->rootPath[this->rootPath.size()-1] != FS_PATH_SEPARATOR) this->rootPath += FS_PATH_SEPARATOR;
+		this->bSubTree = bSubTree;
+		this->drive = drive;
+		this->nOverflows = 0;
+	}
+};
+
+/*
+inotify has no recursive mode: a watch descriptor is added for each directory of a watched subtree,
+and descriptors are maintained as directories get created, moved or deleted.
+*/
+class InotifyWatch {
+public:
+	wstring			dirPath;	// always ends with a separator
+	InotifyRoot*	lpRoot;
+
+	InotifyWatch(const wstring& dirPath, InotifyRoot* lpRoot) {
+		this->dirPath = dirPath;
+		this->lpRoot = lpRoot;
+	}
+};
+
+/*
+Events are translated so that they match what ReadDirectoryChangesW would report:
+- a move inside a same directory (IN_MOVED_FROM/IN_MOVED_TO sharing a cookie, same watch) gives FILE_ACTION_RENAMED_OLD_NAME + FILE_ACTION_RENAMED_NEW_NAME
+- a move between two directories gives FILE_ACTION_REMOVED + FILE_ACTION_ADDED
+- a move from/to outside of the watched subtrees gives a single FILE_ACTION_ADDED or FILE_ACTION_REMOVED
+*/
+class InotifyWatcher : public WatcherBackend {
+private:
+	int						fd;
+	// signaled by Interrupt
+	int						fdInterrupt;
+	char*					pBuff;
+	// guards roots and watches against concurrent AddPath/RemovePath
+	CRITICAL_SECTION		csWatches;
+	vector<InotifyRoot*>	vecRoots;
+	map<int, InotifyWatch*>	mapWatches;
+	vector<dev_t>			vecDevices;
+
+	// pending IN_MOVED_FROM event, waiting for its IN_MOVED_TO counterpart
+	uint32_t				nPendingCookie;
+	int						nPendingWd;
+	wstring					pendingPath;
+	BOOL					bPendingDir;
+	// name of the event being decoded
+	wstring					name;
+
+	UINT					nWatchErrors;
+
+	BOOL					AddWatch(const wstring& dirPath, InotifyRoot* lpRoot);
+	void					AddWatchTree(const wstring& dirPath, InotifyRoot* lpRoot, vector<FileActionInfo*>* vecAdded);
+	void					RemoveWatches(const wstring& prefix, InotifyRoot* lpRoot = NULL);
+	void					MoveWatches(const wstring& oldPrefix, const wstring& newPrefix);
+	void					FlushPending(vector<FileActionInfo*>* vecChanges);
+	void					PushOverflow(vector<FileActionInfo*>* vecChanges);
+
+public:
+	InotifyWatcher();
+	~InotifyWatcher();
+
+	BOOL Init();
+	WatcherBackend* NewInstance() { return new InotifyWatcher(); }
+
+	INT AddPath(LPCWSTR pPath, BOOL bSubTree);
+	void RemovePath(UINT nIndex);
+	void RemoveAllPaths();
+
+	CHAR GetDrive(LPCWSTR pPath);
+	UINT GetOverflowCount(UINT nIndex);
+
+	BOOL FetchChanges(vector<FileActionInfo*>* vecChanges);
+	void Interrupt();
+
+	/*
+	Number of directories that could not be watched (i.e. fs.inotify.max_user_watches reached).
+	*/
+	UINT GetWatchErrors() { return this->nWatchErrors; }
+};
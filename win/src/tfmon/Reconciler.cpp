@@ -0,0 +1,163 @@
+/* Reconciler.cpp - re-synchronization of watched roots for which filesystem events were lost
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "Reconciler.h"
+#include "ConsistencyScanner.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+
+/*
+Files of a root that cannot be read are unknown rather than missing (its drive was unplugged or its share dropped, or it was removed).
+*/
+static BOOL RootIsPresent(LPCWSTR pPath) {
+#ifdef _WIN32
+	DWORD dwAttributes = GetFileAttributes(pPath);
+	return (dwAttributes != INVALID_FILE_ATTRIBUTES && (dwAttributes & FILE_ATTRIBUTE_DIRECTORY));
+#else
+	struct stat st;
+	return (stat(WCHARtoUTF8(pPath).c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+#endif
+}
+
+Reconciler::Reconciler(RECONCILELISTPROC lpfnList, RECONCILEMISSINGPROC lpfnMissing, StatPool* lpPool, LPVOID lpParam) {
+	this->lpfnList = lpfnList;
+	this->lpfnMissing = lpfnMissing;
+	this->lpParam = lpParam;
+	this->lpPool = lpPool;
+	this->nMaxDeletions = RECONCILE_MAX_DELETIONS;
+	this->hThread = NULL;
+	this->bStop = FALSE;
+	this->nPasses = 0;
+	this->nChecked = 0;
+	this->nMissing = 0;
+	this->nExcess = 0;
+	InitializeCriticalSection(&this->csPending);
+	InitializeConditionVariable(&this->cvPending);
+}
+
+Reconciler::~Reconciler() {
+	this->Stop();
+	DeleteCriticalSection(&this->csPending);
+}
+
+BOOL Reconciler::Start() {
+	if (this->hThread) return TRUE;
+	this->bStop = FALSE;
+	this->hThread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) Reconciler::ThreadDispatch, (LPVOID) this, 0, NULL);
+	return (this->hThread != NULL);
+}
+
+/*
+Pending roots are dropped; a pass in progress is completed first.
+*/
+void Reconciler::Stop() {
+	if (!this->hThread) return;
+	EnterCriticalSection(&this->csPending);
+	this->bStop = TRUE;
+	this->mapPending.clear();
+	WakeConditionVariable(&this->cvPending);
+	LeaveCriticalSection(&this->csPending);
+
+	WaitForSingleObject(this->hThread, INFINITE);
+	CloseHandle(this->hThread);
+	this->hThread = NULL;
+}
+
+void Reconciler::SetMaxDeletions(UINT nMaxDeletions) {
+	EnterCriticalSection(&this->csPending);
+	this->nMaxDeletions = nMaxDeletions;
+	LeaveCriticalSection(&this->csPending);
+}
+
+void Reconciler::Schedule(LPCWSTR rootPath) {
+	if (!rootPath) return;
+	wstring root = rootPath;
+	ULONGLONG ullDue = GetTickCount64() + RECONCILE_DELAY;
+
+	EnterCriticalSection(&this->csPending);
+	BOOL bCovered = FALSE;
+	map<wstring, ULONGLONG>::iterator it = this->mapPending.begin();
+	while (it != this->mapPending.end()) {
+		if (root.compare(0, it->first.size(), it->first) == 0) {
+			// same root or sub-path of a pending root
+			it->second = ullDue;
+			bCovered = TRUE;
+			++it;
+		}
+		else if (it->first.compare(0, root.size(), root) == 0) {
+			// pending root is covered by the new one
+			this->mapPending.erase(it++);
+		}
+		else ++it;
+	}
+	if (!bCovered) this->mapPending[root] = ullDue;
+	WakeConditionVariable(&this->cvPending);
+	LeaveCriticalSection(&this->csPending);
+}
+
+void Reconciler::Reconcile(const wstring& rootPath, UINT nMaxDeletions) {
+	if (!RootIsPresent(rootPath.c_str())) return;
+	vector<wstring> vecPaths;
+	if (!this->lpfnList(rootPath.c_str(), &vecPaths, this->lpParam)) return;
+
+	UINT uiCount = vecPaths.size();
+	vector<BYTE> vecStates(uiCount, STAT_STATE_UNKNOWN);
+	vector<FileIdentity> vecIds(uiCount);
+	this->lpPool->Check(vecPaths, 0, uiCount, &vecStates, &vecIds);
+
+	vector<wstring> vecResult;
+	vector<wstring> vecExcess;
+	for (UINT i = 0; i < uiCount; ++i) {
+		// a file is only missing if its volume is present (see ConsistencyScanner::IsMissing)
+		if (vecStates[i] != STAT_STATE_NOT_FOUND || !ConsistencyScanner::IsVolumePresent(vecPaths[i].c_str())) continue;
+		if (vecResult.size() < nMaxDeletions) vecResult.push_back(vecPaths[i]);
+		else vecExcess.push_back(vecPaths[i]);
+	}
+
+	++this->nPasses;
+	this->nChecked += uiCount;
+	this->nMissing += vecResult.size();
+	this->nExcess += vecExcess.size();
+
+	if (!vecResult.empty() || !vecExcess.empty()) this->lpfnMissing(rootPath.c_str(), &vecResult, &vecExcess, this->lpParam);
+}
+
+DWORD WINAPI Reconciler::ThreadDispatch(LPVOID lpvd) {
+	Reconciler* lpReconciler = (Reconciler*) lpvd;
+
+	EnterCriticalSection(&lpReconciler->csPending);
+	while (!lpReconciler->bStop) {
+		if (lpReconciler->mapPending.empty()) {
+			SleepConditionVariableCS(&lpReconciler->cvPending, &lpReconciler->csPending, INFINITE);
+			continue;
+		}
+		// pick the root that is due first
+		map<wstring, ULONGLONG>::iterator itNext = lpReconciler->mapPending.begin();
+		for (map<wstring, ULONGLONG>::iterator it = itNext; it != lpReconciler->mapPending.end(); ++it) {
+			if (it->second < itNext->second) itNext = it;
+		}
+		ULONGLONG ullNow = GetTickCount64();
+		if (itNext->second > ullNow) {
+			SleepConditionVariableCS(&lpReconciler->cvPending, &lpReconciler->csPending, (DWORD) (itNext->second - ullNow));
+			continue;
+		}
+		wstring rootPath = itNext->first;
+		lpReconciler->mapPending.erase(itNext);
+		UINT nMaxDeletions = lpReconciler->nMaxDeletions;
+
+		// an overflow occuring during the pass schedules the root again
+		LeaveCriticalSection(&lpReconciler->csPending);
+		lpReconciler->Reconcile(rootPath, nMaxDeletions);
+		EnterCriticalSection(&lpReconciler->csPending);
+	}
+	LeaveCriticalSection(&lpReconciler->csPending);
+	return 0;
+}
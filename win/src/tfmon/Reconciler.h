@@ -0,0 +1,94 @@
+/* Reconciler.h - re-synchronization of watched roots for which filesystem events were lost
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+#include "StatPool.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+using std::wstring;
+using std::vector;
+using std::map;
+
+// delay (ms) without new overflow before a root gets reconciled (further overflows are likely during a burst)
+#define RECONCILE_DELAY			5000
+// default maximum number of missing files a pass hands over for deletion (beyond it, they are only reported)
+#define RECONCILE_MAX_DELETIONS	500
+
+
+/*
+Retrieve the tagged paths located under given root (returns FALSE if the list could not be obtained).
+*/
+typedef BOOL (*RECONCILELISTPROC)(LPCWSTR rootPath, vector<wstring>* vecPaths, LPVOID lpParam);
+/*
+Receive the tagged paths located under given root that no longer exist on disk (their volume being present),
+and the ones beyond the deletion cap of the pass (to be reported, not applied).
+*/
+typedef void (*RECONCILEMISSINGPROC)(LPCWSTR rootPath, vector<wstring>* vecMissing, vector<wstring>* vecExcess, LPVOID lpParam);
+
+
+/*
+When a root overflows, moves and removals under it might have been missed.
+Scheduled roots are reconciled one at a time by a dispatcher thread: tagged paths under the root are listed
+and their presence on disk is checked by the workers of a stat pool (shared with the background scan).
+A root that cannot be read (i.e. its drive was unplugged) is not reconciled, and a file is only missing if its volume is present
+(see ConsistencyScanner::IsMissing). Beyond the deletion cap of a pass, missing files are reported apart: a pass never hands over
+more deletions than the cap. All callbacks are invoked from the dispatcher thread.
+*/
+class Reconciler {
+private:
+	RECONCILELISTPROC		lpfnList;
+	RECONCILEMISSINGPROC	lpfnMissing;
+	LPVOID					lpParam;
+	StatPool*				lpPool;
+	UINT					nMaxDeletions;
+
+	CRITICAL_SECTION		csPending;
+	CONDITION_VARIABLE		cvPending;
+	// scheduled roots, with the tick at which they are due
+	map<wstring, ULONGLONG>	mapPending;
+	HANDLE					hThread;
+	BOOL					bStop;
+
+	UINT					nPasses;
+	UINT					nChecked;
+	UINT					nMissing;
+	UINT					nExcess;
+
+	void					Reconcile(const wstring& rootPath, UINT nMaxDeletions);
+	static DWORD WINAPI		ThreadDispatch(LPVOID lpvd);
+
+public:
+	/*
+	Paths are checked by the workers of given pool (which is to outlive the reconciler).
+	*/
+	Reconciler(RECONCILELISTPROC lpfnList, RECONCILEMISSINGPROC lpfnMissing, StatPool* lpPool, LPVOID lpParam = NULL);
+	~Reconciler();
+
+	BOOL Start();
+	void Stop();
+
+	/*
+	Number of missing files a pass hands over for deletion (applies from the next pass).
+	*/
+	void SetMaxDeletions(UINT nMaxDeletions);
+
+	/*
+	Request a pass on given root. A root already pending is postponed rather than queued twice,
+	and a root that is a sub-path of a pending one is covered by the latter.
+	*/
+	void Schedule(LPCWSTR rootPath);
+
+	UINT GetPassCount()		{ return this->nPasses; }
+	UINT GetCheckedCount()	{ return this->nChecked; }
+	UINT GetMissingCount()	{ return this->nMissing; }
+	UINT GetExcessCount()	{ return this->nExcess; }
+};
@@ -0,0 +1,125 @@
+/* RemovalScheduler.h - deadlines of the 'removed' events waiting to be handled as actual removals
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "FileActionInfo.h"
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+using std::vector;
+using std::unordered_map;
+
+class FSVolume;
+
+
+// 'removed' event waiting to be handled as an actual removal
+class FSRemoval {
+public:
+	FSVolume*		lpVolume;
+	FileActionInfo*	lpAction;
+	// time (microseconds, see FileActionInfo::GetCurrentTicks) at which the event is handled as a removal
+	ULONGLONG		deadline;
+	// event was paired (its item might no longer exist)
+	BOOL			bCancelled;
+
+	FSRemoval(FSVolume* lpVolume, FileActionInfo* lpAction, ULONGLONG deadline) {
+		this->lpVolume = lpVolume;
+		this->lpAction = lpAction;
+		this->deadline = deadline;
+		this->bCancelled = FALSE;
+	}
+};
+
+/*
+Pending removals of all volumes, in a min-heap ordered by deadline, so that a single thread can wait for the earliest one
+and handle all the removals that are due at once.
+A removal is cancelled in constant time when its event gets paired: it is found by item, and only flagged
+(it leaves the heap when its deadline comes, and is then dropped).
+This class does no locking.
+*/
+class RemovalScheduler {
+private:
+	vector<FSRemoval*>							vecHeap;
+	// removals that are neither cancelled nor handled, by item
+	unordered_map<FileActionInfo*, FSRemoval*>	mapPending;
+	UINT										nScheduled;
+	UINT										nCancelled;
+
+	// earliest deadline on top
+	static bool Later(FSRemoval* a, FSRemoval* b) { return a->deadline > b->deadline; }
+
+	FSRemoval* Pop() {
+		std::pop_heap(this->vecHeap.begin(), this->vecHeap.end(), RemovalScheduler::Later);
+		FSRemoval* lpRemoval = this->vecHeap.back();
+		this->vecHeap.pop_back();
+		return lpRemoval;
+	}
+
+public:
+	RemovalScheduler() {
+		this->nScheduled = 0;
+		this->nCancelled = 0;
+	}
+
+	~RemovalScheduler() {
+		for(UINT i = 0, uiCount = this->vecHeap.size(); i < uiCount; ++i) {
+			delete this->vecHeap[i];
+		}
+	}
+
+	void Schedule(FSVolume* lpVolume, FileActionInfo* lpAction, ULONGLONG deadline) {
+		FSRemoval* lpRemoval = new FSRemoval(lpVolume, lpAction, deadline);
+		this->vecHeap.push_back(lpRemoval);
+		std::push_heap(this->vecHeap.begin(), this->vecHeap.end(), RemovalScheduler::Later);
+		this->mapPending[lpAction] = lpRemoval;
+		++this->nScheduled;
+	}
+
+	/*
+	Cancel the removal scheduled for given item. Returns FALSE if there is none.
+	*/
+	BOOL Cancel(FileActionInfo* lpAction) {
+		unordered_map<FileActionInfo*, FSRemoval*>::iterator it = this->mapPending.find(lpAction);
+		if(it == this->mapPending.end()) return FALSE;
+		it->second->bCancelled = TRUE;
+		this->mapPending.erase(it);
+		++this->nCancelled;
+		return TRUE;
+	}
+
+	/*
+	Take the removals whose deadline is over (all of them if bAll is set) and append them to vecDue (cancelled ones are dropped).
+	Their events might still be paired until they are handled: see Complete.
+	*/
+	void Take(ULONGLONG now, BOOL bAll, vector<FSRemoval*>* vecDue) {
+		while(!this->vecHeap.empty() && (bAll || this->vecHeap.front()->deadline <= now)) {
+			FSRemoval* lpRemoval = this->Pop();
+			if(lpRemoval->bCancelled) delete lpRemoval;
+			else vecDue->push_back(lpRemoval);
+		}
+	}
+
+	/*
+	A taken removal is about to be handled. Returns FALSE if it was cancelled since it was taken.
+	*/
+	BOOL Complete(FSRemoval* lpRemoval) {
+		if(lpRemoval->bCancelled) return FALSE;
+		this->mapPending.erase(lpRemoval->lpAction);
+		return TRUE;
+	}
+
+	BOOL IsEmpty() { return this->vecHeap.empty(); }
+	// earliest deadline (cancelled removals included)
+	ULONGLONG GetNextDeadline() { return this->vecHeap.empty() ? 0 : this->vecHeap.front()->deadline; }
+	// number of removals waiting for their deadline
+	UINT GetSize() { return this->mapPending.size(); }
+	UINT GetScheduledCount() { return this->nScheduled; }
+	UINT GetCancelledCount() { return this->nCancelled; }
+};
@@ -0,0 +1,230 @@
+/* ReplayWatcher.cpp - filesystem events backend feeding a capture file back to the correlation engine
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "ReplayWatcher.h"
+
+
+/*
+Check whether path lies within root (or is root itself).
+*/
+static BOOL IsSubPath(wstring path, wstring root) {
+	if(path.empty() || path[path.size()-1] != FS_PATH_SEPARATOR) path += FS_PATH_SEPARATOR;
+	if(root.empty() || root[root.size()-1] != FS_PATH_SEPARATOR) root += FS_PATH_SEPARATOR;
+	return (path.compare(0, root.size(), root) == 0);
+}
+
+
+ReplayWatcher::ReplayWatcher(LPCWSTR capturePath, BOOL bRealTime) {
+	this->capturePath = capturePath;
+	this->lpSource = new ReplaySource(bRealTime);
+	this->nNext = 0;
+	this->bInterrupted = FALSE;
+	InitializeCriticalSection(&this->csReplay);
+	InitializeConditionVariable(&this->cvReplay);
+}
+
+ReplayWatcher::ReplayWatcher(ReplaySource* lpSource) {
+	this->lpSource = lpSource;
+	this->nNext = 0;
+	this->bInterrupted = FALSE;
+	InitializeCriticalSection(&this->csReplay);
+	InitializeConditionVariable(&this->cvReplay);
+
+	EnterCriticalSection(&this->lpSource->csSource);
+	++this->lpSource->nRefs;
+	LeaveCriticalSection(&this->lpSource->csSource);
+}
+
+ReplayWatcher::~ReplayWatcher() {
+	EnterCriticalSection(&this->lpSource->csSource);
+	UINT nRefs = --this->lpSource->nRefs;
+	LeaveCriticalSection(&this->lpSource->csSource);
+	if(!nRefs) delete this->lpSource;
+	DeleteCriticalSection(&this->csReplay);
+}
+
+BOOL ReplayWatcher::Init() {
+	// instances share the capture loaded by the prototype
+	if(this->capturePath.empty()) return TRUE;
+	if(!this->lpSource->reader.Load(this->capturePath.c_str())) {
+		this->nLastError = E_FILESYSMON_ERROROPENFILE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+WatcherBackend* ReplayWatcher::NewInstance() {
+	return new ReplayWatcher(this->lpSource);
+}
+
+/*
+A recorded root is replayed by the instance that was given this very root or a subtree holding it.
+*/
+void ReplayWatcher::UpdateOwned() {
+	vector<CaptureRoot>& vecRoots = this->lpSource->reader.vecRoots;
+	this->vecOwned.assign(vecRoots.size(), 0);
+	for(UINT i = 0, uiCount = vecRoots.size(); i < uiCount; ++i) {
+		for(UINT j = 0, uiSize = this->vecPaths.size(); !this->vecOwned[i] && j < uiSize; ++j) {
+			if(vecRoots[i].path == this->vecPaths[j] || (vecRoots[i].bSubTree && IsSubPath(vecRoots[i].path, this->vecPaths[j]))) this->vecOwned[i] = 1;
+		}
+	}
+}
+
+INT ReplayWatcher::AddPath(LPCWSTR pPath, BOOL bSubTree) {
+	EnterCriticalSection(&this->csReplay);
+	this->vecPaths.push_back(pPath);
+	this->vecOverflows.push_back(0);
+	this->UpdateOwned();
+	LeaveCriticalSection(&this->csReplay);
+	return E_FILESYSMON_SUCCESS;
+}
+
+void ReplayWatcher::RemovePath(UINT nIndex) {
+	EnterCriticalSection(&this->csReplay);
+	//sanity check
+	if(nIndex < this->vecPaths.size()) {
+		this->vecPaths.erase(this->vecPaths.begin() + nIndex);
+		this->vecOverflows.erase(this->vecOverflows.begin() + nIndex);
+		this->UpdateOwned();
+	}
+	LeaveCriticalSection(&this->csReplay);
+}
+
+void ReplayWatcher::RemoveAllPaths() {
+	EnterCriticalSection(&this->csReplay);
+	this->vecPaths.clear();
+	this->vecOverflows.clear();
+	this->UpdateOwned();
+	LeaveCriticalSection(&this->csReplay);
+}
+
+/*
+Drive recorded for the most specific root holding given path.
+*/
+CHAR ReplayWatcher::GetDrive(LPCWSTR pPath) {
+	vector<CaptureRoot>& vecRoots = this->lpSource->reader.vecRoots;
+	CHAR result = 0;
+	SIZE_T len = 0;
+	for(UINT i = 0, uiCount = vecRoots.size(); i < uiCount; ++i) {
+		if(IsSubPath(pPath, vecRoots[i].path) && vecRoots[i].path.size() >= len) {
+			result = vecRoots[i].drive;
+			len = vecRoots[i].path.size();
+		}
+	}
+	return result;
+}
+
+UINT ReplayWatcher::GetOverflowCount(UINT nIndex) {
+	UINT result = 0;
+	EnterCriticalSection(&this->csReplay);
+	if(nIndex < this->vecOverflows.size()) result = this->vecOverflows[nIndex];
+	LeaveCriticalSection(&this->csReplay);
+	return result;
+}
+
+void ReplayWatcher::Interrupt() {
+	EnterCriticalSection(&this->csReplay);
+	this->bInterrupted = TRUE;
+	WakeConditionVariable(&this->cvReplay);
+	LeaveCriticalSection(&this->csReplay);
+}
+
+BOOL ReplayWatcher::FetchChanges(vector<FileActionInfo*>* vecChanges) {
+	vector<CaptureEvent>& vecEvents = this->lpSource->reader.vecEvents;
+	vector<CaptureRoot>& vecRoots = this->lpSource->reader.vecRoots;
+
+	EnterCriticalSection(&this->csReplay);
+	for(;;) {
+		if(this->bInterrupted) {
+			this->bInterrupted = FALSE;
+			this->nLastError = E_FILESYSMON_INTERRUPTED;
+			LeaveCriticalSection(&this->csReplay);
+			return FALSE;
+		}
+		// skip the events of the roots replayed by other instances
+		while(this->nNext < vecEvents.size() && (vecEvents[this->nNext].nRoot < 0 || !this->vecOwned[vecEvents[this->nNext].nRoot])) ++this->nNext;
+		if(this->nNext == vecEvents.size()) {
+			// end of capture: behave as an idle watcher
+			SleepConditionVariableCS(&this->cvReplay, &this->csReplay, INFINITE);
+			continue;
+		}
+
+		// replay starts with the first event fetched by any of the instances
+		ULONGLONG ullNow = GetTickCount64(), ullStart, ullStartTicks;
+		EnterCriticalSection(&this->lpSource->csSource);
+		if(!this->lpSource->ullStart) {
+			this->lpSource->ullStart = ullNow;
+			this->lpSource->ullStartTicks = FileActionInfo::GetCurrentTicks();
+		}
+		ullStart = this->lpSource->ullStart;
+		ullStartTicks = this->lpSource->ullStartTicks;
+		LeaveCriticalSection(&this->lpSource->csSource);
+
+		if(this->lpSource->bRealTime) {
+			ULONGLONG ullDue = ullStart + vecEvents[this->nNext].offset / 1000;
+			if(ullDue > ullNow) {
+				SleepConditionVariableCS(&this->cvReplay, &this->csReplay, (DWORD) (ullDue - ullNow));
+				continue;
+			}
+		}
+
+		UINT nCount = 0;
+		for(; this->nNext < vecEvents.size(); ++this->nNext) {
+			CaptureEvent* lpEvent = &vecEvents[this->nNext];
+			if(lpEvent->nRoot < 0 || !this->vecOwned[lpEvent->nRoot]) continue;
+			if(this->lpSource->bRealTime ? (ullStart + lpEvent->offset / 1000 > ullNow) : (nCount == REPLAY_BATCH_SIZE)) break;
+			if(lpEvent->action == FILE_ACTION_OVERFLOW) {
+				for(UINT i = 0, uiCount = this->vecPaths.size(); i < uiCount; ++i) {
+					if(IsSubPath(lpEvent->path, this->vecPaths[i])) ++this->vecOverflows[i];
+				}
+			}
+			// events keep their recorded spacing, even when replayed as fast as possible
+			this->PushChange(vecChanges, lpEvent->path.c_str(), lpEvent->action, vecRoots[lpEvent->nRoot].drive, ullStartTicks + lpEvent->offset);
+			++nCount;
+		}
+		LeaveCriticalSection(&this->csReplay);
+
+		EnterCriticalSection(&this->lpSource->csSource);
+		this->lpSource->nFetched += nCount;
+		LeaveCriticalSection(&this->lpSource->csSource);
+		return TRUE;
+	}
+}
+
+UINT ReplayWatcher::GetRootCount() {
+	return this->lpSource->reader.vecRoots.size();
+}
+
+LPCWSTR ReplayWatcher::GetRootPath(UINT nIndex) {
+	if(nIndex >= this->lpSource->reader.vecRoots.size()) return NULL;
+	return this->lpSource->reader.vecRoots[nIndex].path.c_str();
+}
+
+BOOL ReplayWatcher::GetRootSubTree(UINT nIndex) {
+	if(nIndex >= this->lpSource->reader.vecRoots.size()) return FALSE;
+	return this->lpSource->reader.vecRoots[nIndex].bSubTree;
+}
+
+/*
+Events that were not recorded relatively to a root cannot be replayed, and are not counted.
+*/
+UINT ReplayWatcher::GetEventCount() {
+	UINT result = 0;
+	vector<CaptureEvent>& vecEvents = this->lpSource->reader.vecEvents;
+	for(UINT i = 0, uiCount = vecEvents.size(); i < uiCount; ++i) {
+		if(vecEvents[i].nRoot >= 0) ++result;
+	}
+	return result;
+}
+
+UINT ReplayWatcher::GetFetchedCount() {
+	EnterCriticalSection(&this->lpSource->csSource);
+	UINT result = this->lpSource->nFetched;
+	LeaveCriticalSection(&this->lpSource->csSource);
+	return result;
+}
@@ -0,0 +1,104 @@
+/* ReplayWatcher.h - filesystem events backend feeding a capture file back to the correlation engine
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+#include "WatcherBackend.h"
+#include "EventCapture.h"
+
+#include <string>
+#include <vector>
+
+using std::wstring;
+using std::vector;
+
+// maximum number of events returned by a call to FetchChanges when replaying as fast as possible
+#define REPLAY_BATCH_SIZE	64
+
+
+/*
+Capture loaded by the prototype and shared by the instances of all volumes.
+*/
+class ReplaySource {
+public:
+	CaptureReader			reader;
+	BOOL					bRealTime;
+	CRITICAL_SECTION		csSource;
+	// tick (ms) at which the replay started (0 until the first call to FetchChanges), and matching event clock value
+	ULONGLONG				ullStart;
+	ULONGLONG				ullStartTicks;
+	UINT					nFetched;
+	UINT					nRefs;
+
+	ReplaySource(BOOL bRealTime) {
+		this->bRealTime = bRealTime;
+		this->ullStart = 0;
+		this->ullStartTicks = 0;
+		this->nFetched = 0;
+		this->nRefs = 1;
+		InitializeCriticalSection(&this->csSource);
+	}
+
+	~ReplaySource() {
+		DeleteCriticalSection(&this->csSource);
+	}
+};
+
+/*
+Events of a capture (see EventCapture.h) are returned by FetchChanges as if they were reported by the OS,
+either as fast as possible or at the pace they were recorded.
+The roots to add are the ones of the capture: an instance replays the events of the recorded roots lying within the paths it was given.
+*/
+class ReplayWatcher : public WatcherBackend {
+private:
+	wstring					capturePath;
+	ReplaySource*			lpSource;
+	// recorded roots replayed by this instance
+	vector<BYTE>			vecOwned;
+	vector<wstring>			vecPaths;
+	vector<UINT>			vecOverflows;
+	// index of the next event to examine
+	SIZE_T					nNext;
+
+	CRITICAL_SECTION		csReplay;
+	CONDITION_VARIABLE		cvReplay;
+	BOOL					bInterrupted;
+
+	ReplayWatcher(ReplaySource* lpSource);
+	void					UpdateOwned();
+
+public:
+	ReplayWatcher(LPCWSTR capturePath, BOOL bRealTime = FALSE);
+	~ReplayWatcher();
+
+	BOOL Init();
+	WatcherBackend* NewInstance();
+
+	INT AddPath(LPCWSTR pPath, BOOL bSubTree);
+	void RemovePath(UINT nIndex);
+	void RemoveAllPaths();
+
+	CHAR GetDrive(LPCWSTR pPath);
+	UINT GetOverflowCount(UINT nIndex);
+
+	BOOL FetchChanges(vector<FileActionInfo*>* vecChanges);
+	void Interrupt();
+
+	/*
+	Roots of the capture (available once initialized).
+	*/
+	UINT GetRootCount();
+	LPCWSTR GetRootPath(UINT nIndex);
+	BOOL GetRootSubTree(UINT nIndex);
+
+	/*
+	Total number of events of the capture, and number of them handed out so far (by all instances).
+	*/
+	UINT GetEventCount();
+	UINT GetFetchedCount();
+};
@@ -0,0 +1,202 @@
+/* SaveRecognizer.h - recognition of the files saved by replacement (write a temporary file, set the original aside, rename the temporary file over it)
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "SubtreeAggregator.h"
+
+#include <string>
+#include <vector>
+#include <cwchar>
+#include <wctype.h>
+#include <unordered_map>
+
+using std::wstring;
+using std::vector;
+using std::unordered_map;
+
+// time (ms) within which an original set aside (or removed) is expected to be replaced by the saved file, and the set-aside file to be removed
+#define FS_SAVE_WINDOW		2000
+
+
+// original set aside under a temporary name
+class AsideFile {
+public:
+	wstring		originalPath;
+	wstring		asidePath;
+	ULONGLONG	deadline;
+	// original name was taken by the saved file: only the removal of the set-aside file is still expected
+	BOOL		bReplaced;
+
+	AsideFile(LPCWSTR originalPath, LPCWSTR asidePath, ULONGLONG deadline) {
+		this->originalPath = originalPath;
+		this->asidePath = asidePath;
+		this->deadline = deadline;
+		this->bReplaced = FALSE;
+	}
+};
+
+/*
+Editors and office suites save a file by replacing it, i.e. for Word: write ~WRD0000.tmp, rename doc.docx to ~WRL0001.tmp, rename ~WRD0000.tmp to doc.docx, remove ~WRL0001.tmp
+(vim and emacs set the original aside as 'file~', other applications simply remove it before renaming the temporary file).
+A move of a file toward a temporary name is held for FS_SAVE_WINDOW: if the original name is taken again in the meantime, the file was saved in place
+(the move is dropped, as is the removal of the set-aside file), otherwise the move is released as it was.
+A held move is released before its window is over when a later event refers to one of its paths, so that changes on a given path are notified in order.
+This class does no locking.
+*/
+class SaveRecognizer {
+private:
+	// by set-aside path, and original path (case folded on Windows)
+	unordered_map<wstring, AsideFile>	mapAside;
+	unordered_map<wstring, wstring>		mapOriginals;
+	UINT								nSeq;
+	UINT								nSaves;
+
+	static wstring Key(LPCWSTR path) {
+		wstring result = path;
+#ifdef _WIN32
+		for(SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+		return result;
+	}
+
+	static BOOL StartsWith(LPCWSTR name, LPCWSTR prefix) {
+		for(; *prefix; ++name, ++prefix) {
+			if((WCHAR) towlower(*name) != *prefix) return FALSE;
+		}
+		return TRUE;
+	}
+
+	static BOOL EndsWith(LPCWSTR name, SIZE_T len, LPCWSTR suffix) {
+		SIZE_T suffixLen = wcslen(suffix);
+		if(len <= suffixLen) return FALSE;
+		for(SIZE_T i = 0; i < suffixLen; ++i) {
+			if((WCHAR) towlower(name[len - suffixLen + i]) != suffix[i]) return FALSE;
+		}
+		return TRUE;
+	}
+
+	void Erase(unordered_map<wstring, AsideFile>::iterator it) {
+		unordered_map<wstring, wstring>::iterator itOriginal = this->mapOriginals.find(SaveRecognizer::Key(it->second.originalPath.c_str()));
+		if(itOriginal != this->mapOriginals.end() && itOriginal->second == it->first) this->mapOriginals.erase(itOriginal);
+		this->mapAside.erase(it);
+	}
+
+	void Release(ULONGLONG now, BOOL bAll, vector<HeldMove>* vecRelease) {
+		for(unordered_map<wstring, AsideFile>::iterator it = this->mapAside.begin(); it != this->mapAside.end(); ) {
+			if(bAll || it->second.deadline <= now) {
+				if(!it->second.bReplaced) vecRelease->push_back(HeldMove(it->second.originalPath.c_str(), it->second.asidePath.c_str(), ++this->nSeq));
+				this->Erase(it++);
+			}
+			else ++it;
+		}
+	}
+
+public:
+	SaveRecognizer() {
+		this->nSeq = 0;
+		this->nSaves = 0;
+	}
+
+	/*
+	Given filename is one that applications give to their temporary files:
+	~$doc.docx, ~WRL0001.tmp, *.tmp, *.temp, *.swp, *.swx, *.bak, file~, .#file, .goutputstream-*, or 8 hexadecimal digits without extension (Excel).
+	*/
+	static BOOL IsTempName(LPCWSTR fileName) {
+		if(!fileName || !*fileName) return FALSE;
+		SIZE_T len = wcslen(fileName);
+		if(fileName[0] == L'~' || fileName[len-1] == L'~') return TRUE;
+		if(StartsWith(fileName, L".#") || StartsWith(fileName, L".goutputstream-")) return TRUE;
+		if(EndsWith(fileName, len, L".tmp") || EndsWith(fileName, len, L".temp") || EndsWith(fileName, len, L".swp") || EndsWith(fileName, len, L".swx") || EndsWith(fileName, len, L".bak")) return TRUE;
+		if(len != 8) return FALSE;
+		for(SIZE_T i = 0; i < len; ++i) {
+			if(!iswxdigit(fileName[i])) return FALSE;
+		}
+		return TRUE;
+	}
+
+	/*
+	Hold the move of an original toward a temporary name, received at given time (microseconds).
+	*/
+	void Hold(LPCWSTR originalPath, LPCWSTR asidePath, ULONGLONG now) {
+		wstring key = SaveRecognizer::Key(asidePath);
+		unordered_map<wstring, AsideFile>::iterator it = this->mapAside.find(key);
+		if(it != this->mapAside.end()) this->Erase(it);
+		this->mapAside.insert(std::make_pair(key, AsideFile(originalPath, asidePath, now + (ULONGLONG) FS_SAVE_WINDOW * 1000)));
+		this->mapOriginals[SaveRecognizer::Key(originalPath)] = key;
+	}
+
+	/*
+	Given path takes the name of an original that was set aside: the file was saved. The held move is dropped, and lpAsidePath is set to the path
+	whose removal is now expected. Returns FALSE if given path is not a held original.
+	*/
+	BOOL Replace(LPCWSTR path, ULONGLONG now, wstring* lpAsidePath) {
+		unordered_map<wstring, wstring>::iterator itOriginal = this->mapOriginals.find(SaveRecognizer::Key(path));
+		if(itOriginal == this->mapOriginals.end()) return FALSE;
+		unordered_map<wstring, AsideFile>::iterator it = this->mapAside.find(itOriginal->second);
+		this->mapOriginals.erase(itOriginal);
+		if(it == this->mapAside.end() || it->second.bReplaced) return FALSE;
+		it->second.bReplaced = TRUE;
+		it->second.deadline = now + (ULONGLONG) FS_SAVE_WINDOW * 1000;
+		*lpAsidePath = it->second.asidePath;
+		++this->nSaves;
+		return TRUE;
+	}
+
+	/*
+	Given path is the set-aside original of a recognized save: its removal is dropped. Returns FALSE otherwise.
+	*/
+	BOOL TakeRemoval(LPCWSTR path) {
+		unordered_map<wstring, AsideFile>::iterator it = this->mapAside.find(SaveRecognizer::Key(path));
+		if(it == this->mapAside.end() || !it->second.bReplaced) return FALSE;
+		this->Erase(it);
+		return TRUE;
+	}
+
+	/*
+	Append to vecRelease the held move that an event on given path depends on (the path is its original or set-aside path).
+	*/
+	void ReleaseTargets(LPCWSTR path, vector<HeldMove>* vecRelease) {
+		if(this->mapAside.empty() || !path) return;
+		wstring key = SaveRecognizer::Key(path);
+		unordered_map<wstring, AsideFile>::iterator it = this->mapAside.find(key);
+		if(it == this->mapAside.end()) {
+			unordered_map<wstring, wstring>::iterator itOriginal = this->mapOriginals.find(key);
+			if(itOriginal == this->mapOriginals.end()) return;
+			it = this->mapAside.find(itOriginal->second);
+		}
+		if(it == this->mapAside.end() || it->second.bReplaced) return;
+		vecRelease->push_back(HeldMove(it->second.originalPath.c_str(), it->second.asidePath.c_str(), ++this->nSeq));
+		this->Erase(it);
+	}
+
+	/*
+	Append the held moves whose window is over to vecRelease (expected removals that did not come are forgotten).
+	*/
+	void Release(ULONGLONG now, vector<HeldMove>* vecRelease) {
+		this->Release(now, FALSE, vecRelease);
+	}
+
+	void Flush(vector<HeldMove>* vecRelease) {
+		this->Release(0, TRUE, vecRelease);
+	}
+
+	// a save whose original was removed (instead of being set aside) is recognized by the caller
+	void CountSave() { ++this->nSaves; }
+
+	BOOL IsEmpty() { return this->mapAside.empty(); }
+	// earliest deadline (0 if nothing is held)
+	ULONGLONG GetNextDeadline() {
+		ULONGLONG result = 0;
+		for(unordered_map<wstring, AsideFile>::iterator it = this->mapAside.begin(); it != this->mapAside.end(); ++it) {
+			if(!result || it->second.deadline < result) result = it->second.deadline;
+		}
+		return result;
+	}
+	// number of saves recognized
+	UINT GetSaveCount() { return this->nSaves; }
+};
@@ -0,0 +1,150 @@
+/* StatPool.cpp - existence and identity of files, checked by a pool of persistent worker threads
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "StatPool.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+
+StatPool::StatPool(UINT nWorkers) {
+	this->nWorkers = nWorkers;
+	this->bRunning = FALSE;
+	InitializeCriticalSection(&this->csPool);
+	InitializeConditionVariable(&this->cvWork);
+	InitializeConditionVariable(&this->cvDone);
+}
+
+StatPool::~StatPool() {
+	this->Stop();
+	DeleteCriticalSection(&this->csPool);
+}
+
+BOOL StatPool::Start() {
+	BOOL result = TRUE;
+	EnterCriticalSection(&this->csPool);
+	BOOL bStarted = this->bRunning;
+	this->bRunning = TRUE;
+	LeaveCriticalSection(&this->csPool);
+	if (bStarted) return result;
+	for (UINT i = 0; i < this->nWorkers; ++i) {
+		HANDLE hWorker = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) StatPool::ThreadWork, (LPVOID) this, 0, NULL);
+		if (hWorker) this->vecWorkers.push_back(hWorker);
+		else result = FALSE;
+	}
+	return result;
+}
+
+void StatPool::Stop() {
+	EnterCriticalSection(&this->csPool);
+	this->bRunning = FALSE;
+	WakeAllConditionVariable(&this->cvWork);
+	LeaveCriticalSection(&this->csPool);
+	for (UINT i = 0, uiCount = this->vecWorkers.size(); i < uiCount; ++i) {
+		WaitForSingleObject(this->vecWorkers[i], INFINITE);
+		CloseHandle(this->vecWorkers[i]);
+	}
+	this->vecWorkers.clear();
+}
+
+BYTE StatPool::CheckPath(LPCWSTR pPath, FileIdentity* lpIdentity) {
+	lpIdentity->fileId = 0;
+	lpIdentity->device = 0;
+#ifdef _WIN32
+	// no access right is needed to query the file index
+	HANDLE hFile = CreateFileW(pPath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		DWORD dwError = ::GetLastError();
+		return (dwError == ERROR_FILE_NOT_FOUND || dwError == ERROR_PATH_NOT_FOUND) ? STAT_STATE_NOT_FOUND : STAT_STATE_UNKNOWN;
+	}
+	BY_HANDLE_FILE_INFORMATION info;
+	if (GetFileInformationByHandle(hFile, &info)) {
+		lpIdentity->fileId = ((ULONGLONG) info.nFileIndexHigh << 32) | info.nFileIndexLow;
+		lpIdentity->device = info.dwVolumeSerialNumber;
+	}
+	CloseHandle(hFile);
+	return STAT_STATE_PRESENT;
+#else
+	struct stat st;
+	if (lstat(WCHARtoUTF8(pPath).c_str(), &st) != 0) return (errno == ENOENT || errno == ENOTDIR) ? STAT_STATE_NOT_FOUND : STAT_STATE_UNKNOWN;
+	lpIdentity->fileId = (ULONGLONG) st.st_ino;
+	lpIdentity->device = (ULONGLONG) st.st_dev;
+	return STAT_STATE_PRESENT;
+#endif
+}
+
+/*
+Take the next grain of given request (csPool held): returns the number of files taken (0 if none is left), the first of them being lpnStart.
+A request whose files are all taken leaves the queue.
+*/
+UINT StatPool::Take(Request* lpRequest, UINT* lpnStart) {
+	UINT result = lpRequest->nCount - lpRequest->nTaken;
+	if (result > STAT_POOL_GRAIN) result = STAT_POOL_GRAIN;
+	*lpnStart = lpRequest->nTaken;
+	lpRequest->nTaken += result;
+	if (lpRequest->nTaken == lpRequest->nCount) {
+		for (deque<Request*>::iterator it = this->queRequests.begin(); it != this->queRequests.end(); ++it) {
+			if (*it != lpRequest) continue;
+			this->queRequests.erase(it);
+			break;
+		}
+	}
+	return result;
+}
+
+/*
+Check the files [nStart, nStart + nCount[ of given request (csPool not held): threads write to distinct items only.
+*/
+void StatPool::Run(Request* lpRequest, UINT nStart, UINT nCount) {
+	for (UINT i = nStart, uiEnd = nStart + nCount; i < uiEnd; ++i) {
+		(*lpRequest->lpStates)[i] = StatPool::CheckPath(lpRequest->lpPaths->at(lpRequest->nFirst + i).c_str(), &(*lpRequest->lpIds)[i]);
+	}
+}
+
+void StatPool::Check(const vector<wstring>& vecPaths, UINT nFirst, UINT nCount, vector<BYTE>* vecStates, vector<FileIdentity>* vecIds) {
+	if (!nCount) return;
+	Request request(&vecPaths, nFirst, nCount, vecStates, vecIds);
+	EnterCriticalSection(&this->csPool);
+	this->queRequests.push_back(&request);
+	WakeAllConditionVariable(&this->cvWork);
+	UINT nStart, nTaken;
+	while ((nTaken = this->Take(&request, &nStart)) > 0) {
+		LeaveCriticalSection(&this->csPool);
+		this->Run(&request, nStart, nTaken);
+		EnterCriticalSection(&this->csPool);
+		request.nDone += nTaken;
+	}
+	// grains taken by the workers
+	while (request.nDone < request.nCount) {
+		SleepConditionVariableCS(&this->cvDone, &this->csPool, INFINITE);
+	}
+	LeaveCriticalSection(&this->csPool);
+}
+
+DWORD WINAPI StatPool::ThreadWork(LPVOID lpvd) {
+	StatPool* lpPool = (StatPool*) lpvd;
+	EnterCriticalSection(&lpPool->csPool);
+	while (TRUE) {
+		while (lpPool->bRunning && lpPool->queRequests.empty()) {
+			SleepConditionVariableCS(&lpPool->cvWork, &lpPool->csPool, INFINITE);
+		}
+		if (lpPool->queRequests.empty()) break;
+		// the request stays in place until its owner has seen its last grain done
+		Request* lpRequest = lpPool->queRequests.front();
+		UINT nStart;
+		UINT nTaken = lpPool->Take(lpRequest, &nStart);
+		LeaveCriticalSection(&lpPool->csPool);
+		lpPool->Run(lpRequest, nStart, nTaken);
+		EnterCriticalSection(&lpPool->csPool);
+		lpRequest->nDone += nTaken;
+		if (lpRequest->nDone == lpRequest->nCount) WakeAllConditionVariable(&lpPool->cvDone);
+	}
+	LeaveCriticalSection(&lpPool->csPool);
+	return 0;
+}
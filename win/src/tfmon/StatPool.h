@@ -0,0 +1,111 @@
+/* StatPool.h - existence and identity of files, checked by a pool of persistent worker threads
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+
+using std::wstring;
+using std::vector;
+using std::deque;
+
+// number of worker threads of a pool
+#define STAT_POOL_WORKERS		4
+// number of files a thread takes from a request at once
+#define STAT_POOL_GRAIN			16
+
+// state of a checked file (a file we are not allowed to read is unknown rather than missing)
+#define STAT_STATE_UNKNOWN		0
+#define STAT_STATE_PRESENT		1
+#define STAT_STATE_NOT_FOUND	2
+
+
+// identity of a file, and filesystem holding it (0 if unknown)
+class FileIdentity {
+public:
+	ULONGLONG	fileId;
+	ULONGLONG	device;
+
+	FileIdentity() {
+		this->fileId = 0;
+		this->device = 0;
+	}
+};
+
+
+/*
+Files are checked (see Check) by worker threads that are started once (see Start) and kept until the pool is stopped,
+rather than by threads created for each set of files. Each call to Check is a request: the workers take its files by grains
+of STAT_POOL_GRAIN, and the calling thread takes its share as well, so that a request is served even if no worker could be started.
+Requests of several threads (i.e. the reconciler and the background scan) share the same workers, and are served in order.
+*/
+class StatPool {
+private:
+	// files [nFirst, nFirst + nCount[ of a list, to be checked
+	class Request {
+	public:
+		const vector<wstring>*	lpPaths;
+		UINT					nFirst;
+		UINT					nCount;
+		vector<BYTE>*			lpStates;
+		vector<FileIdentity>*	lpIds;
+		// files taken by a thread, and files checked
+		UINT					nTaken;
+		UINT					nDone;
+
+		Request(const vector<wstring>* lpPaths, UINT nFirst, UINT nCount, vector<BYTE>* lpStates, vector<FileIdentity>* lpIds) {
+			this->lpPaths = lpPaths;
+			this->nFirst = nFirst;
+			this->nCount = nCount;
+			this->lpStates = lpStates;
+			this->lpIds = lpIds;
+			this->nTaken = 0;
+			this->nDone = 0;
+		}
+	};
+
+	UINT					nWorkers;
+	vector<HANDLE>			vecWorkers;
+	BOOL					bRunning;
+	CRITICAL_SECTION		csPool;
+	// requests with files left to take, in order
+	deque<Request*>			queRequests;
+	CONDITION_VARIABLE		cvWork;
+	CONDITION_VARIABLE		cvDone;
+
+	UINT					Take(Request* lpRequest, UINT* lpnStart);
+	void					Run(Request* lpRequest, UINT nStart, UINT nCount);
+	static DWORD WINAPI		ThreadWork(LPVOID lpvd);
+
+public:
+	StatPool(UINT nWorkers = STAT_POOL_WORKERS);
+	~StatPool();
+
+	/*
+	Start the worker threads (no effect if they are running). Returns FALSE if some of them could not be started.
+	*/
+	BOOL Start();
+	/*
+	Requests in progress are completed before the workers leave.
+	*/
+	void Stop();
+
+	/*
+	Check the files [nFirst, nFirst + nCount[ of vecPaths: state and identity of file nFirst + i are written to item i of vecStates and vecIds
+	(both of nCount items at least). Returns once all of them are checked.
+	*/
+	void Check(const vector<wstring>& vecPaths, UINT nFirst, UINT nCount, vector<BYTE>* vecStates, vector<FileIdentity>* vecIds);
+
+	/*
+	Existence and identity of given file, from a single query.
+	*/
+	static BYTE CheckPath(LPCWSTR pPath, FileIdentity* lpIdentity);
+};
@@ -0,0 +1,247 @@
+/* StormDetector.h - detection of the subtrees producing event storms, whose events are suspended until they are quiet
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "fscompat.h"
+
+#include <string>
+#include <vector>
+#include <cwchar>
+#include <wctype.h>
+#include <unordered_map>
+
+using std::wstring;
+using std::vector;
+using std::unordered_map;
+
+// default number of events per FS_STORM_PERIOD above which a subtree is quarantined
+#define FS_STORM_THRESHOLD		2000
+// period (ms) over which events are counted
+#define FS_STORM_PERIOD			1000
+// default time (ms) without event after which a quarantined subtree is released
+#define FS_STORM_QUIET			5000
+
+
+// subtree whose events are suspended
+class EventStorm {
+public:
+	wstring		path;
+	// ticks (microseconds) at which the period that revealed the storm started, and of the latest event seen in the subtree
+	ULONGLONG	ullStart;
+	ULONGLONG	ullLast;
+	// events suspended, highest number of events over a period, and events of the current period
+	UINT		nSuspended;
+	UINT		nPeak;
+	UINT		nCurrent;
+
+	EventStorm(const wstring& path, ULONGLONG ullStart, ULONGLONG ullLast, UINT nCount) {
+		this->path = path;
+		this->ullStart = ullStart;
+		this->ullLast = ullLast;
+		this->nSuspended = 0;
+		this->nPeak = nCount;
+		this->nCurrent = nCount;
+	}
+};
+
+/*
+Events are counted, over periods of FS_STORM_PERIOD, for each directory above their path (a directory counts the events of its whole subtree),
+up to the deepest watched root holding it (see AddRoot): a root and the directories above it are never counted, hence never quarantined,
+and the events of a path lying within no root are not counted at all.
+As soon as a directory receives more than the threshold within a period, it is quarantined (the deepest one first, i.e. node_modules rather
+than the project holding it): its events are suspended (dropped before correlation) until the subtree has been quiet for the quiet delay.
+Released storms are then handed over, so that the subtree gets a single reconciliation instead of one correlation per event.
+A period ends with the first event received after it: counting costs one lookup per directory level, and nothing when no event comes.
+Paths are case insensitive on Windows. This class does no locking.
+*/
+class StormDetector {
+private:
+	class Counter {
+	public:
+		wstring		path;
+		UINT		nCount;
+
+		Counter() {
+			this->nCount = 0;
+		}
+	};
+
+	// by directory (case folded on Windows), for the current period
+	unordered_map<wstring, Counter>		mapCounts;
+	ULONGLONG							ullPeriod;
+	ULONGLONG							ullPeriodStart;
+	// quarantined subtrees, by directory (case folded on Windows)
+	unordered_map<wstring, EventStorm>	mapStorms;
+	// watched roots (case folded on Windows, without trailing separator), with the number of times each of them is watched
+	unordered_map<wstring, UINT>		mapRoots;
+	UINT								nThreshold;
+	ULONGLONG							ullQuiet;
+	UINT								nStorms;
+	UINT								nSuspended;
+
+	static wstring Key(LPCWSTR path) {
+		wstring result = path;
+#ifdef _WIN32
+		for(SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+		return result;
+	}
+
+	/*
+	Position of the separator that follows the deepest watched root above given key (wstring::npos if there is none).
+	*/
+	SIZE_T FindRoot(const wstring& key) {
+		for(SIZE_T pos = key.rfind(FS_PATH_SEPARATOR); pos != wstring::npos; pos = (pos > 0) ? key.rfind(FS_PATH_SEPARATOR, pos - 1) : wstring::npos) {
+			if(this->mapRoots.find(key.substr(0, pos)) != this->mapRoots.end()) return pos;
+		}
+		return wstring::npos;
+	}
+
+	/*
+	Start a new period at given ticks.
+	*/
+	void EndPeriod(ULONGLONG ullNow) {
+		for(unordered_map<wstring, EventStorm>::iterator it = this->mapStorms.begin(); it != this->mapStorms.end(); ++it) {
+			if(it->second.nCurrent > it->second.nPeak) it->second.nPeak = it->second.nCurrent;
+			it->second.nCurrent = 0;
+		}
+		this->mapCounts.clear();
+		this->ullPeriodStart = ullNow;
+	}
+
+	/*
+	Quarantine the directory of given key (the counter of the period over the threshold), at given ticks.
+	Its events no longer count for the directories above it.
+	*/
+	void Quarantine(const wstring& key, ULONGLONG ticks) {
+		Counter counter = this->mapCounts[key];
+		this->mapStorms.insert(std::make_pair(key, EventStorm(counter.path, this->ullPeriodStart, ticks, counter.nCount)));
+		++this->nStorms;
+		SIZE_T rootPos = this->FindRoot(key);
+		for(SIZE_T pos = key.rfind(FS_PATH_SEPARATOR); pos != wstring::npos && pos > rootPos; pos = key.rfind(FS_PATH_SEPARATOR, pos - 1)) {
+			unordered_map<wstring, Counter>::iterator it = this->mapCounts.find(key.substr(0, pos));
+			if(it != this->mapCounts.end()) it->second.nCount -= (counter.nCount < it->second.nCount) ? counter.nCount : it->second.nCount;
+		}
+		this->mapCounts.erase(key);
+	}
+
+	void Release(ULONGLONG now, BOOL bAll, vector<EventStorm>* vecRelease) {
+		for(unordered_map<wstring, EventStorm>::iterator it = this->mapStorms.begin(); it != this->mapStorms.end(); ) {
+			if(bAll || it->second.ullLast + this->ullQuiet <= now) {
+				if(it->second.nCurrent > it->second.nPeak) it->second.nPeak = it->second.nCurrent;
+				vecRelease->push_back(it->second);
+				this->mapStorms.erase(it++);
+			}
+			else ++it;
+		}
+	}
+
+public:
+	StormDetector() {
+		this->ullPeriod = (ULONGLONG) FS_STORM_PERIOD * 1000;
+		this->ullPeriodStart = 0;
+		this->nThreshold = FS_STORM_THRESHOLD;
+		this->ullQuiet = (ULONGLONG) FS_STORM_QUIET * 1000;
+		this->nStorms = 0;
+		this->nSuspended = 0;
+	}
+
+	/*
+	Number of events per FS_STORM_PERIOD above which a subtree is quarantined (0 disables the detection), and quiet delay (ms).
+	*/
+	void SetLimits(UINT nThreshold, DWORD dwQuiet) {
+		this->nThreshold = nThreshold;
+		this->ullQuiet = (ULONGLONG) dwQuiet * 1000;
+		if(!nThreshold) this->mapCounts.clear();
+	}
+
+	/*
+	Given directory is watched (again): the directories below it are counted.
+	*/
+	void AddRoot(LPCWSTR rootPath) {
+		wstring key = StormDetector::Key(rootPath);
+		if(!key.empty() && key[key.size()-1] == FS_PATH_SEPARATOR) key.erase(key.size()-1);
+		++this->mapRoots[key];
+	}
+
+	/*
+	Given directory is no longer watched (once per call to AddRoot).
+	*/
+	void RemoveRoot(LPCWSTR rootPath) {
+		wstring key = StormDetector::Key(rootPath);
+		if(!key.empty() && key[key.size()-1] == FS_PATH_SEPARATOR) key.erase(key.size()-1);
+		unordered_map<wstring, UINT>::iterator it = this->mapRoots.find(key);
+		if(it != this->mapRoots.end() && !--it->second) this->mapRoots.erase(it);
+	}
+
+	void ClearRoots() {
+		this->mapRoots.clear();
+	}
+
+	/*
+	Count an event on given path, seen at given ticks (microseconds). Returns TRUE if it lies within a quarantined subtree (the event is suspended).
+	*/
+	BOOL Filter(LPCWSTR filePath, ULONGLONG ticks) {
+		if(!this->nThreshold && this->mapStorms.empty()) return FALSE;
+		wstring key = StormDetector::Key(filePath);
+		SIZE_T rootPos = this->FindRoot(key);
+		if(rootPos == wstring::npos) return FALSE;
+		if(!this->mapStorms.empty()) {
+			for(SIZE_T pos = key.rfind(FS_PATH_SEPARATOR); pos != wstring::npos && pos > rootPos; pos = key.rfind(FS_PATH_SEPARATOR, pos - 1)) {
+				unordered_map<wstring, EventStorm>::iterator it = this->mapStorms.find(key.substr(0, pos));
+				if(it == this->mapStorms.end()) continue;
+				if(ticks > it->second.ullLast) it->second.ullLast = ticks;
+				++it->second.nSuspended;
+				++it->second.nCurrent;
+				++this->nSuspended;
+				return TRUE;
+			}
+		}
+		if(!this->nThreshold) return FALSE;
+
+		if(ticks >= this->ullPeriodStart + this->ullPeriod) this->EndPeriod(ticks);
+		wstring over;
+		// deepest directory first, up to the root (excluded)
+		for(SIZE_T pos = key.rfind(FS_PATH_SEPARATOR); pos != wstring::npos && pos > rootPos; pos = key.rfind(FS_PATH_SEPARATOR, pos - 1)) {
+			Counter& counter = this->mapCounts[key.substr(0, pos)];
+			if(!counter.nCount++) counter.path.assign(filePath, pos);
+			if(over.empty() && counter.nCount > this->nThreshold) over = key.substr(0, pos);
+		}
+		if(over.empty()) return FALSE;
+		// the event that reveals the storm is the first one suspended
+		this->Quarantine(over, ticks);
+		EventStorm& storm = this->mapStorms.find(over)->second;
+		++storm.nSuspended;
+		++this->nSuspended;
+		return TRUE;
+	}
+
+	/*
+	Append the storms of the subtrees that were quiet for the quiet delay (at given ticks) to vecRelease.
+	*/
+	void Release(ULONGLONG now, vector<EventStorm>* vecRelease) {
+		this->Release(now, FALSE, vecRelease);
+	}
+
+	void Flush(vector<EventStorm>* vecRelease) {
+		this->Release(0, TRUE, vecRelease);
+	}
+
+	BOOL IsEmpty() { return this->mapStorms.empty(); }
+	// earliest time at which a quarantined subtree might be released (0 if there is none)
+	ULONGLONG GetNextDeadline() {
+		ULONGLONG result = 0;
+		for(unordered_map<wstring, EventStorm>::iterator it = this->mapStorms.begin(); it != this->mapStorms.end(); ++it) {
+			if(!result || it->second.ullLast + this->ullQuiet < result) result = it->second.ullLast + this->ullQuiet;
+		}
+		return result;
+	}
+	// number of subtrees quarantined, and number of events suspended
+	UINT GetStormCount() { return this->nStorms; }
+	UINT GetSuspendedCount() { return this->nSuspended; }
+};
@@ -0,0 +1,252 @@
+/* SubtreeAggregator.h - folding of the moves between volumes of a directory's content into the move of the directory
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include "FileActionInfo.h"
+
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+using std::wstring;
+using std::map;
+using std::vector;
+using std::unordered_map;
+using std::unordered_set;
+
+// time (ms) a move between two volumes is held, waiting for the other moves of its subtree (extended as long as they keep coming)
+#define FS_SUBTREE_WINDOW		1000
+// maximum time (ms) the moves of a subtree are held in all
+#define FS_SUBTREE_MAX_HOLD		10000
+
+
+// move between two volumes, as it will be notified
+class HeldMove {
+public:
+	wstring		oldPath;
+	wstring		newPath;
+	// order of reception
+	UINT		nSeq;
+	// move of a directory whose content was moved along with it (and folded into it)
+	BOOL		bSubtree;
+
+	HeldMove(LPCWSTR oldPath, LPCWSTR newPath, UINT nSeq) {
+		this->oldPath = oldPath;
+		this->newPath = newPath;
+		this->nSeq = nSeq;
+		this->bSubtree = FALSE;
+	}
+};
+
+/*
+Moves sharing the same pair of roots (the paths left once their common trailing names are stripped):
+every item of a directory moved to another volume falls in the same group as the directory itself (C:\a\docs\f and D:\docs\f have roots C:\a and D:).
+*/
+class SubtreeGroup {
+public:
+	wstring				oldRoot;
+	wstring				newRoot;
+	ULONGLONG			ullFirst;
+	ULONGLONG			deadline;
+	vector<HeldMove>	vecMoves;
+	// new paths of the held moves
+	unordered_set<wstring>	setTargets;
+
+	SubtreeGroup(const wstring& oldRoot, const wstring& newRoot, ULONGLONG now) {
+		this->oldRoot = oldRoot;
+		this->newRoot = newRoot;
+		this->ullFirst = now;
+		this->deadline = now;
+	}
+};
+
+/*
+A directory moved to another volume is seen as as many moves as it holds items (each one paired by name), along with the move of the directory itself
+(usually the last one, since the source is deleted once copied; a directory renamed on the way is found through FindRoot). Moves between volumes are held while the moves of their group keep coming,
+then the moves lying within a held move of a directory (same relative path on both sides) are folded into it:
+the receiver gets a single move for the whole subtree.
+A group is released before its window is over when a later event refers to one of its new paths, so that changes on a given path are notified in order.
+This class does no locking.
+*/
+class SubtreeAggregator {
+private:
+	typedef std::pair<wstring, wstring>		GroupKey;
+
+	map<GroupKey, SubtreeGroup*>	mapGroups;
+	UINT							nSeq;
+	UINT							nReceived;
+	UINT							nSubtrees;
+	UINT							nFolded;
+
+	/*
+	Strip the names both paths end with (the root of a volume is kept).
+	*/
+	static void Split(const wstring& oldPath, const wstring& newPath, wstring* lpOldRoot, wstring* lpNewRoot) {
+		SIZE_T i = oldPath.size(), j = newPath.size();
+		while(i > 0 && j > 0) {
+			SIZE_T p = oldPath.rfind(FS_PATH_SEPARATOR, i - 1), q = newPath.rfind(FS_PATH_SEPARATOR, j - 1);
+			if(p == wstring::npos || q == wstring::npos || p == 0 || q == 0) break;
+			if(i - p != j - q || oldPath.compare(p, i - p, newPath, q, j - q) != 0) break;
+			i = p;
+			j = q;
+		}
+		*lpOldRoot = oldPath.substr(0, i);
+		*lpNewRoot = newPath.substr(0, j);
+	}
+
+	/*
+	Append the moves of given group to vecRelease, the ones lying within a moved directory being folded into it, and delete the group.
+	*/
+	void Release(SubtreeGroup* lpGroup, vector<HeldMove>* vecRelease) {
+		vector<HeldMove>& vecMoves = lpGroup->vecMoves;
+		unordered_map<wstring, UINT> mapSources;
+		for(UINT i = 0, uiCount = vecMoves.size(); i < uiCount; ++i) mapSources[vecMoves[i].oldPath] = i;
+
+		vector<BOOL> vecFolded(vecMoves.size(), FALSE);
+		for(UINT i = 0, uiCount = vecMoves.size(); i < uiCount; ++i) {
+			const wstring& oldPath = vecMoves[i].oldPath;
+			// directories above the source, up to the root of the group (which is the directory itself when it was renamed on the way)
+			for(SIZE_T pos = oldPath.rfind(FS_PATH_SEPARATOR); pos != wstring::npos && pos > 0 && pos >= lpGroup->oldRoot.size(); pos = oldPath.rfind(FS_PATH_SEPARATOR, pos - 1)) {
+				unordered_map<wstring, UINT>::iterator it = mapSources.find(oldPath.substr(0, pos));
+				if(it == mapSources.end()) continue;
+				HeldMove& dirMove = vecMoves[it->second];
+				SIZE_T len = dirMove.newPath.size();
+				// item kept its path relative to the directory
+				if(vecMoves[i].newPath.size() == len + oldPath.size() - pos && vecMoves[i].newPath.compare(0, len, dirMove.newPath) == 0 && vecMoves[i].newPath.compare(len, wstring::npos, oldPath, pos, wstring::npos) == 0) {
+					vecFolded[i] = TRUE;
+					dirMove.bSubtree = TRUE;
+					++this->nFolded;
+					break;
+				}
+			}
+		}
+		for(UINT i = 0, uiCount = vecMoves.size(); i < uiCount; ++i) {
+			if(vecFolded[i]) continue;
+			if(vecMoves[i].bSubtree) ++this->nSubtrees;
+			vecRelease->push_back(vecMoves[i]);
+		}
+		delete lpGroup;
+	}
+
+	// groups in the order they started
+	static bool Earlier(SubtreeGroup* a, SubtreeGroup* b) { return a->vecMoves[0].nSeq < b->vecMoves[0].nSeq; }
+
+	void Release(ULONGLONG now, BOOL bAll, vector<HeldMove>* vecRelease) {
+		vector<SubtreeGroup*> vecDue;
+		for(map<GroupKey, SubtreeGroup*>::iterator it = this->mapGroups.begin(); it != this->mapGroups.end(); ) {
+			if(bAll || it->second->deadline <= now) {
+				vecDue.push_back(it->second);
+				this->mapGroups.erase(it++);
+			}
+			else ++it;
+		}
+		std::sort(vecDue.begin(), vecDue.end(), SubtreeAggregator::Earlier);
+		for(UINT i = 0, uiCount = vecDue.size(); i < uiCount; ++i) this->Release(vecDue[i], vecRelease);
+	}
+
+	/*
+	Given path is one of the new paths held by given group, or lies within one of them.
+	*/
+	static BOOL IsTarget(SubtreeGroup* lpGroup, const wstring& path) {
+		if(path.size() < lpGroup->newRoot.size() || path.compare(0, lpGroup->newRoot.size(), lpGroup->newRoot) != 0) return FALSE;
+		if(lpGroup->setTargets.count(path)) return TRUE;
+		for(SIZE_T pos = path.rfind(FS_PATH_SEPARATOR); pos != wstring::npos && pos > 0 && pos >= lpGroup->newRoot.size(); pos = path.rfind(FS_PATH_SEPARATOR, pos - 1)) {
+			if(lpGroup->setTargets.count(path.substr(0, pos))) return TRUE;
+		}
+		return FALSE;
+	}
+
+public:
+	SubtreeAggregator() {
+		this->nSeq = 0;
+		this->nReceived = 0;
+		this->nSubtrees = 0;
+		this->nFolded = 0;
+	}
+
+	~SubtreeAggregator() {
+		for(map<GroupKey, SubtreeGroup*>::iterator it = this->mapGroups.begin(); it != this->mapGroups.end(); ++it) {
+			delete it->second;
+		}
+	}
+
+	/*
+	Hold a move between two volumes, received at given time (microseconds).
+	*/
+	void Add(LPCWSTR oldPath, LPCWSTR newPath, ULONGLONG now) {
+		GroupKey key;
+		SubtreeAggregator::Split(oldPath, newPath, &key.first, &key.second);
+		map<GroupKey, SubtreeGroup*>::iterator it = this->mapGroups.find(key);
+		SubtreeGroup* lpGroup = (it != this->mapGroups.end()) ? it->second : (this->mapGroups[key] = new SubtreeGroup(key.first, key.second, now));
+		lpGroup->vecMoves.push_back(HeldMove(oldPath, newPath, ++this->nSeq));
+		lpGroup->setTargets.insert(newPath);
+		lpGroup->deadline = now + (ULONGLONG) FS_SUBTREE_WINDOW * 1000;
+		if(lpGroup->deadline > lpGroup->ullFirst + (ULONGLONG) FS_SUBTREE_MAX_HOLD * 1000) lpGroup->deadline = lpGroup->ullFirst + (ULONGLONG) FS_SUBTREE_MAX_HOLD * 1000;
+		++this->nReceived;
+	}
+
+	/*
+	Append the moves of the groups whose window is over to vecRelease (groups are released in the order they started).
+	*/
+	void Release(ULONGLONG now, vector<HeldMove>* vecRelease) {
+		this->Release(now, FALSE, vecRelease);
+	}
+
+	void Flush(vector<HeldMove>* vecRelease) {
+		this->Release(0, TRUE, vecRelease);
+	}
+
+	/*
+	Append to vecRelease the moves of the groups that an event on given path depends on (i.e. the path is one of their new paths, or lies within one).
+	*/
+	void ReleaseTargets(LPCWSTR path, vector<HeldMove>* vecRelease) {
+		if(this->mapGroups.empty()) return;
+		wstring str = path;
+		vector<SubtreeGroup*> vecDue;
+		for(map<GroupKey, SubtreeGroup*>::iterator it = this->mapGroups.begin(); it != this->mapGroups.end(); ) {
+			if(SubtreeAggregator::IsTarget(it->second, str)) {
+				vecDue.push_back(it->second);
+				this->mapGroups.erase(it++);
+			}
+			else ++it;
+		}
+		std::sort(vecDue.begin(), vecDue.end(), SubtreeAggregator::Earlier);
+		for(UINT i = 0, uiCount = vecDue.size(); i < uiCount; ++i) this->Release(vecDue[i], vecRelease);
+	}
+
+	/*
+	A directory renamed on its way to another volume cannot be paired by name: it is recognized as the source root of a held group.
+	Returns FALSE if no group has given path as source root, otherwise the target root is set.
+	*/
+	BOOL FindRoot(LPCWSTR oldRoot, wstring* lpNewRoot) {
+		for(map<GroupKey, SubtreeGroup*>::iterator it = this->mapGroups.begin(); it != this->mapGroups.end(); ++it) {
+			if(it->first.first == oldRoot) {
+				*lpNewRoot = it->first.second;
+				return TRUE;
+			}
+		}
+		return FALSE;
+	}
+
+	BOOL IsEmpty() { return this->mapGroups.empty(); }
+	// earliest deadline (0 if no move is held)
+	ULONGLONG GetNextDeadline() {
+		ULONGLONG result = 0;
+		for(map<GroupKey, SubtreeGroup*>::iterator it = this->mapGroups.begin(); it != this->mapGroups.end(); ++it) {
+			if(!result || it->second->deadline < result) result = it->second->deadline;
+		}
+		return result;
+	}
+	// number of moves received, number of directory moves notified in place of their content, and number of moves folded into them
+	UINT GetReceivedCount() { return this->nReceived; }
+	UINT GetSubtreeCount() { return this->nSubtrees; }
+	UINT GetFoldedCount() { return this->nFolded; }
+};
@@ -0,0 +1,393 @@
+/* TaggedPathIndex.cpp - in-memory index of the paths known to the tagger database
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "TaggedPathIndex.h"
+
+#include <wctype.h>
+
+
+TaggedPathIndex::TaggedPathIndex() {
+	this->lpRoot = new TaggedPathNode(L"");
+	this->nPaths = 0;
+	this->nQueries = 0;
+	this->nRejects = 0;
+	this->BloomReset(0);
+}
+
+TaggedPathIndex::~TaggedPathIndex() {
+	delete this->lpRoot;
+}
+
+/*
+Paths are stored without trailing separator (and lowercased on Windows).
+*/
+wstring TaggedPathIndex::Key(LPCWSTR path) {
+	wstring result = path;
+	while(!result.empty() && result[result.size()-1] == FS_PATH_SEPARATOR) result.erase(result.size()-1);
+#ifdef _WIN32
+	for(SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+	return result;
+}
+
+/*
+Directory holding given path (the root of a volume is its own parent).
+*/
+wstring TaggedPathIndex::ParentDir(const wstring& path) {
+	SIZE_T pos = path.find_last_of(FS_PATH_SEPARATOR);
+	if(pos == wstring::npos) return wstring();
+	// root of the filesystem, or of a drive
+	if(pos == 0) return path.substr(0, 1);
+	wstring result = path.substr(0, pos);
+#ifdef _WIN32
+	if(result.size() == 2 && result[1] == L':') result += FS_PATH_SEPARATOR;
+#endif
+	return result;
+}
+
+UINT TaggedPathIndex::Depth(const wstring& key) {
+	UINT result = 0;
+	for(SIZE_T i = 0, uiSize = key.size(); i < uiSize; ++i) {
+		if(key[i] == FS_PATH_SEPARATOR) ++result;
+	}
+	return result;
+}
+
+/*
+Remove the directories lying within another one (directories are given by key).
+*/
+void TaggedPathIndex::Collapse(map<wstring, wstring>* mapDirs) {
+	for(map<wstring, wstring>::iterator it = mapDirs->begin(); it != mapDirs->end(); ) {
+		BOOL bCovered = FALSE;
+		for(wstring key = it->first; !bCovered && !key.empty(); ) {
+			SIZE_T pos = key.find_last_of(FS_PATH_SEPARATOR);
+			key = (pos == wstring::npos) ? wstring() : key.substr(0, pos);
+			if(pos != wstring::npos && mapDirs->count(key)) bCovered = TRUE;
+		}
+		if(bCovered) mapDirs->erase(it++);
+		else ++it;
+	}
+}
+
+void TaggedPathIndex::GetCoveringDirs(const vector<wstring>& vecPaths, UINT nMaxDirs, vector<wstring>* vecDirs) {
+	// directories by key (original case is kept for watching them)
+	map<wstring, wstring> mapDirs;
+	for(UINT i = 0, uiCount = vecPaths.size(); i < uiCount; ++i) {
+		wstring dir = TaggedPathIndex::ParentDir(vecPaths[i]);
+		if(!dir.empty()) mapDirs[TaggedPathIndex::Key(dir.c_str())] = dir;
+	}
+	TaggedPathIndex::Collapse(&mapDirs);
+
+	while(nMaxDirs && mapDirs.size() > nMaxDirs) {
+		UINT nDepth = 0;
+		for(map<wstring, wstring>::iterator it = mapDirs.begin(); it != mapDirs.end(); ++it) {
+			if(TaggedPathIndex::Depth(it->first) > nDepth) nDepth = TaggedPathIndex::Depth(it->first);
+		}
+		// only roots are left
+		if(!nDepth) break;
+		map<wstring, wstring> mapParents;
+		for(map<wstring, wstring>::iterator it = mapDirs.begin(); it != mapDirs.end(); ++it) {
+			if(TaggedPathIndex::Depth(it->first) < nDepth) mapParents[it->first] = it->second;
+			else {
+				wstring dir = TaggedPathIndex::ParentDir(it->second);
+				mapParents[TaggedPathIndex::Key(dir.c_str())] = dir;
+			}
+		}
+		TaggedPathIndex::Collapse(&mapParents);
+		mapDirs.swap(mapParents);
+	}
+
+	for(map<wstring, wstring>::iterator it = mapDirs.begin(); it != mapDirs.end(); ++it) {
+		vecDirs->push_back(it->second);
+	}
+}
+
+void TaggedPathIndex::GetAncestorDirs(const vector<wstring>& vecDirs, vector<wstring>* vecAncestors) {
+	map<wstring, wstring> mapDirs, mapAncestors;
+	for(UINT i = 0, uiCount = vecDirs.size(); i < uiCount; ++i) {
+		mapDirs[TaggedPathIndex::Key(vecDirs[i].c_str())] = vecDirs[i];
+	}
+	for(UINT i = 0, uiCount = vecDirs.size(); i < uiCount; ++i) {
+		wstring dir = vecDirs[i];
+		for(;;) {
+			wstring parent = TaggedPathIndex::ParentDir(dir);
+			if(parent.empty() || parent == dir) break;
+			wstring key = TaggedPathIndex::Key(parent.c_str());
+			if(mapAncestors.count(key)) break;
+			if(!mapDirs.count(key)) mapAncestors[key] = parent;
+			dir = parent;
+		}
+	}
+	for(map<wstring, wstring>::iterator it = mapAncestors.begin(); it != mapAncestors.end(); ++it) {
+		vecAncestors->push_back(it->second);
+	}
+}
+
+// 64-bit FNV-1a, split in two halves for double hashing
+void TaggedPathIndex::Hash(const wchar_t* key, SIZE_T len, DWORD* lpH1, DWORD* lpH2) {
+	ULONGLONG h = 14695981039346656037ULL;
+	for(SIZE_T i = 0; i < len; ++i) {
+		h ^= (ULONGLONG) key[i];
+		h *= 1099511628211ULL;
+	}
+	*lpH1 = (DWORD) h;
+	*lpH2 = (DWORD) (h >> 32) | 1;
+}
+
+void TaggedPathIndex::BloomReset(UINT nKeys) {
+	this->nBloomCapacity = (nKeys < 64) ? 64 : nKeys;
+	this->nBloomBits = this->nBloomCapacity * TAGGED_BLOOM_BITS_PER_KEY;
+	this->vecBloom.assign((this->nBloomBits + 31) / 32, 0);
+	this->nBloomKeys = 0;
+}
+
+/*
+Add given path and the directories above it.
+*/
+void TaggedPathIndex::BloomAdd(const wstring& key) {
+	for(SIZE_T len = key.size(); len > 0; ) {
+		DWORD h1, h2;
+		TaggedPathIndex::Hash(key.c_str(), len, &h1, &h2);
+		for(UINT i = 0; i < TAGGED_BLOOM_HASHES; ++i) {
+			DWORD nBit = (h1 + i * h2) % this->nBloomBits;
+			this->vecBloom[nBit / 32] |= (1 << (nBit % 32));
+		}
+		++this->nBloomKeys;
+		// parent directory
+		while(len > 0 && key[len-1] != FS_PATH_SEPARATOR) --len;
+		while(len > 0 && key[len-1] == FS_PATH_SEPARATOR) --len;
+	}
+}
+
+BOOL TaggedPathIndex::BloomTest(const wstring& key) {
+	DWORD h1, h2;
+	TaggedPathIndex::Hash(key.c_str(), key.size(), &h1, &h2);
+	for(UINT i = 0; i < TAGGED_BLOOM_HASHES; ++i) {
+		DWORD nBit = (h1 + i * h2) % this->nBloomBits;
+		if(!(this->vecBloom[nBit / 32] & (1 << (nBit % 32)))) return FALSE;
+	}
+	return TRUE;
+}
+
+TaggedPathNode* TaggedPathIndex::FindChild(TaggedPathNode* lpNode, WCHAR c, UINT* lpIndex) {
+	// children are sorted: binary search
+	UINT nLow = 0, nHigh = lpNode->vecChildren.size();
+	while(nLow < nHigh) {
+		UINT nMid = (nLow + nHigh) / 2;
+		if(lpNode->vecChildren[nMid]->label[0] < c) nLow = nMid + 1;
+		else nHigh = nMid;
+	}
+	if(lpIndex) *lpIndex = nLow;
+	if(nLow < lpNode->vecChildren.size() && lpNode->vecChildren[nLow]->label[0] == c) return lpNode->vecChildren[nLow];
+	return NULL;
+}
+
+/*
+Node where given key ends (NULL if no stored path starts with key).
+lpOffset receives the number of characters of the node's label that belong to the key (the key might end in the middle of a label).
+If given, vecPath receives the nodes walked through, from the root to the returned node.
+*/
+TaggedPathNode* TaggedPathIndex::Locate(const wstring& key, SIZE_T* lpOffset, vector<TaggedPathNode*>* vecPath) {
+	TaggedPathNode* lpNode = this->lpRoot;
+	SIZE_T pos = 0;
+	if(vecPath) vecPath->push_back(lpNode);
+	while(pos < key.size()) {
+		TaggedPathNode* lpChild = this->FindChild(lpNode, key[pos], NULL);
+		if(!lpChild) return NULL;
+		SIZE_T i = 0;
+		while(i < lpChild->label.size() && pos < key.size() && lpChild->label[i] == key[pos]) {
+			++i;
+			++pos;
+		}
+		if(vecPath) vecPath->push_back(lpChild);
+		if(i < lpChild->label.size()) {
+			if(pos < key.size()) return NULL;
+			*lpOffset = i;
+			return lpChild;
+		}
+		lpNode = lpChild;
+	}
+	*lpOffset = lpNode->label.size();
+	return lpNode;
+}
+
+BOOL TaggedPathIndex::Insert(const wstring& key) {
+	vector<TaggedPathNode*> vecPath;
+	TaggedPathNode* lpNode = this->lpRoot;
+	SIZE_T pos = 0;
+	for(;;) {
+		vecPath.push_back(lpNode);
+		if(pos == key.size()) {
+			if(lpNode->bTagged) return FALSE;
+			lpNode->bTagged = TRUE;
+			break;
+		}
+		UINT nIndex;
+		TaggedPathNode* lpChild = this->FindChild(lpNode, key[pos], &nIndex);
+		if(!lpChild) {
+			lpChild = new TaggedPathNode(key.substr(pos));
+			lpChild->bTagged = TRUE;
+			lpNode->vecChildren.insert(lpNode->vecChildren.begin() + nIndex, lpChild);
+			vecPath.push_back(lpChild);
+			break;
+		}
+		SIZE_T i = 0;
+		while(i < lpChild->label.size() && pos + i < key.size() && lpChild->label[i] == key[pos + i]) ++i;
+		if(i < lpChild->label.size()) {
+			// split the child at the end of the common part
+			TaggedPathNode* lpMiddle = new TaggedPathNode(lpChild->label.substr(0, i));
+			lpChild->label.erase(0, i);
+			lpMiddle->vecChildren.push_back(lpChild);
+			lpMiddle->nTagged = lpChild->nTagged;
+			lpNode->vecChildren[nIndex] = lpMiddle;
+			lpChild = lpMiddle;
+		}
+		lpNode = lpChild;
+		pos += i;
+	}
+	for(UINT i = 0, uiCount = vecPath.size(); i < uiCount; ++i) ++vecPath[i]->nTagged;
+	++this->nPaths;
+	return TRUE;
+}
+
+BOOL TaggedPathIndex::Erase(const wstring& key) {
+	vector<TaggedPathNode*> vecPath;
+	SIZE_T offset;
+	TaggedPathNode* lpNode = this->Locate(key, &offset, &vecPath);
+	if(!lpNode || offset < lpNode->label.size() || !lpNode->bTagged) return FALSE;
+	lpNode->bTagged = FALSE;
+	for(UINT i = 0, uiCount = vecPath.size(); i < uiCount; ++i) --vecPath[i]->nTagged;
+	--this->nPaths;
+
+	// drop the branch that no longer leads to a tagged path, and merge the nodes left with a single child
+	for(INT i = vecPath.size() - 1; i > 0; --i) {
+		TaggedPathNode* lpCurrent = vecPath[i];
+		TaggedPathNode* lpParent = vecPath[i-1];
+		UINT nIndex;
+		this->FindChild(lpParent, lpCurrent->label[0], &nIndex);
+		if(!lpCurrent->nTagged) {
+			lpParent->vecChildren.erase(lpParent->vecChildren.begin() + nIndex);
+			delete lpCurrent;
+		}
+		else if(!lpCurrent->bTagged && lpCurrent->vecChildren.size() == 1) {
+			TaggedPathNode* lpChild = lpCurrent->vecChildren[0];
+			lpChild->label.insert(0, lpCurrent->label);
+			lpCurrent->vecChildren.clear();
+			lpParent->vecChildren[nIndex] = lpChild;
+			delete lpCurrent;
+		}
+	}
+	return TRUE;
+}
+
+void TaggedPathIndex::Collect(TaggedPathNode* lpNode, wstring prefix, vector<wstring>* vecKeys) {
+	prefix += lpNode->label;
+	if(lpNode->bTagged) vecKeys->push_back(prefix);
+	for(UINT i = 0, uiCount = lpNode->vecChildren.size(); i < uiCount; ++i) {
+		this->Collect(lpNode->vecChildren[i], prefix, vecKeys);
+	}
+}
+
+BOOL TaggedPathIndex::HasUnder(const wstring& key) {
+	SIZE_T offset;
+	// every path starting with key followed by a separator is below it
+	TaggedPathNode* lpNode = this->Locate(key + FS_PATH_SEPARATOR, &offset, NULL);
+	return (lpNode && lpNode->nTagged > 0);
+}
+
+void TaggedPathIndex::Build(const vector<wstring>& vecPaths) {
+	this->Clear();
+	vector<wstring> vecKeys;
+	UINT nKeys = 0;
+	for(UINT i = 0, uiCount = vecPaths.size(); i < uiCount; ++i) {
+		wstring key = TaggedPathIndex::Key(vecPaths[i].c_str());
+		if(key.empty() || !this->Insert(key)) continue;
+		// the path and each of its directories
+		for(SIZE_T j = 0, uiSize = key.size(); j < uiSize; ++j) {
+			if(key[j] == FS_PATH_SEPARATOR) ++nKeys;
+		}
+		++nKeys;
+		vecKeys.push_back(key);
+	}
+	this->BloomReset(nKeys);
+	for(UINT i = 0, uiCount = vecKeys.size(); i < uiCount; ++i) {
+		this->BloomAdd(vecKeys[i]);
+	}
+}
+
+void TaggedPathIndex::Clear() {
+	delete this->lpRoot;
+	this->lpRoot = new TaggedPathNode(L"");
+	this->nPaths = 0;
+	this->BloomReset(0);
+}
+
+BOOL TaggedPathIndex::Add(LPCWSTR path) {
+	wstring key = TaggedPathIndex::Key(path);
+	if(key.empty() || !this->Insert(key)) return FALSE;
+	this->BloomAdd(key);
+	// filter is getting too small: size it again
+	if(this->nBloomKeys > 2 * this->nBloomCapacity) {
+		vector<wstring> vecKeys;
+		this->Collect(this->lpRoot, L"", &vecKeys);
+		this->BloomReset(this->nBloomKeys);
+		for(UINT i = 0, uiCount = vecKeys.size(); i < uiCount; ++i) {
+			this->BloomAdd(vecKeys[i]);
+		}
+	}
+	return TRUE;
+}
+
+BOOL TaggedPathIndex::Remove(LPCWSTR path) {
+	return this->Erase(TaggedPathIndex::Key(path));
+}
+
+UINT TaggedPathIndex::Rename(LPCWSTR oldPath, LPCWSTR newPath) {
+	wstring oldKey = TaggedPathIndex::Key(oldPath), newKey = TaggedPathIndex::Key(newPath);
+	vector<wstring> vecKeys;
+	if(this->Contains(oldPath)) vecKeys.push_back(oldKey);
+	SIZE_T offset;
+	wstring prefix = oldKey + FS_PATH_SEPARATOR;
+	TaggedPathNode* lpNode = this->Locate(prefix, &offset, NULL);
+	// labels are appended to what precedes the node
+	if(lpNode) this->Collect(lpNode, prefix.substr(0, prefix.size() - offset), &vecKeys);
+
+	for(UINT i = 0, uiCount = vecKeys.size(); i < uiCount; ++i) {
+		this->Erase(vecKeys[i]);
+	}
+	for(UINT i = 0, uiCount = vecKeys.size(); i < uiCount; ++i) {
+		wstring key = newKey + vecKeys[i].substr(oldKey.size());
+		this->Add(key.c_str());
+	}
+	return vecKeys.size();
+}
+
+BOOL TaggedPathIndex::Contains(LPCWSTR path) {
+	SIZE_T offset;
+	TaggedPathNode* lpNode = this->Locate(TaggedPathIndex::Key(path), &offset, NULL);
+	return (lpNode && offset == lpNode->label.size() && lpNode->bTagged);
+}
+
+BOOL TaggedPathIndex::ContainsUnder(LPCWSTR dirPath) {
+	return this->HasUnder(TaggedPathIndex::Key(dirPath));
+}
+
+BOOL TaggedPathIndex::IsRelevant(LPCWSTR path) {
+	++this->nQueries;
+	wstring key = TaggedPathIndex::Key(path);
+	// root of the filesystem
+	if(key.empty()) return (this->nPaths > 0);
+	if(!this->BloomTest(key)) {
+		++this->nRejects;
+		return FALSE;
+	}
+	SIZE_T offset;
+	TaggedPathNode* lpNode = this->Locate(key, &offset, NULL);
+	if(lpNode && offset == lpNode->label.size() && lpNode->bTagged) return TRUE;
+	return this->HasUnder(key);
+}
@@ -0,0 +1,133 @@
+/* TaggedPathIndex.h - in-memory index of the paths known to the tagger database
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+using std::wstring;
+using std::vector;
+using std::map;
+
+// size of the Bloom filter (bits per key: a tagged path or one of its directories)
+#define TAGGED_BLOOM_BITS_PER_KEY	10
+// number of bits set per key (about 1% of false positives with 10 bits per key)
+#define TAGGED_BLOOM_HASHES			7
+
+
+/*
+Node of the radix tree: label is the part of the path leading from the parent to this node.
+*/
+class TaggedPathNode {
+public:
+	wstring						label;
+	// sorted by first character of their label
+	vector<TaggedPathNode*>		vecChildren;
+	// a tagged path ends here
+	BOOL						bTagged;
+	// number of tagged paths ending here or below
+	UINT						nTagged;
+
+	TaggedPathNode(const wstring& label) {
+		this->label = label;
+		this->bTagged = FALSE;
+		this->nTagged = 0;
+	}
+
+	~TaggedPathNode() {
+		for(UINT i = 0, uiCount = this->vecChildren.size(); i < uiCount; ++i) {
+			delete this->vecChildren[i];
+		}
+	}
+};
+
+/*
+Tagged paths are stored in a radix tree, which answers both exact queries (is this file tagged?)
+and prefix queries (does this directory hold a tagged file?).
+A Bloom filter holding every tagged path and every directory above one is checked first:
+most paths (the untagged ones, outside of any tagged directory) are rejected without walking the tree.
+Removed paths stay in the filter (they only cause false positives) until the index is rebuilt.
+Paths are case insensitive on Windows. This class does no locking.
+*/
+class TaggedPathIndex {
+private:
+	TaggedPathNode*			lpRoot;
+	UINT					nPaths;
+
+	vector<DWORD>			vecBloom;
+	UINT					nBloomBits;
+	// keys added to the filter since it was sized
+	UINT					nBloomKeys;
+	UINT					nBloomCapacity;
+
+	UINT					nQueries;
+	UINT					nRejects;
+
+	static wstring			Key(LPCWSTR path);
+	static wstring			ParentDir(const wstring& path);
+	static UINT				Depth(const wstring& key);
+	static void				Collapse(map<wstring, wstring>* mapDirs);
+	static void				Hash(const wchar_t* key, SIZE_T len, DWORD* lpH1, DWORD* lpH2);
+
+	void					BloomReset(UINT nKeys);
+	void					BloomAdd(const wstring& key);
+	BOOL					BloomTest(const wstring& key);
+
+	TaggedPathNode*			FindChild(TaggedPathNode* lpNode, WCHAR c, UINT* lpIndex);
+	TaggedPathNode*			Locate(const wstring& key, SIZE_T* lpOffset, vector<TaggedPathNode*>* vecPath);
+	BOOL					Insert(const wstring& key);
+	BOOL					Erase(const wstring& key);
+	void					Collect(TaggedPathNode* lpNode, wstring prefix, vector<wstring>* vecKeys);
+	BOOL					HasUnder(const wstring& key);
+
+public:
+	TaggedPathIndex();
+	~TaggedPathIndex();
+
+	/*
+	Replace the content of the index with given paths.
+	*/
+	void Build(const vector<wstring>& vecPaths);
+	void Clear();
+
+	BOOL Add(LPCWSTR path);
+	BOOL Remove(LPCWSTR path);
+	/*
+	Move given path and the tagged paths below it. Returns the number of moved paths.
+	*/
+	UINT Rename(LPCWSTR oldPath, LPCWSTR newPath);
+
+	// path is tagged
+	BOOL Contains(LPCWSTR path);
+	// a tagged path lies below given directory
+	BOOL ContainsUnder(LPCWSTR dirPath);
+	/*
+	Path is tagged or is a directory holding a tagged path: changes on it matter to the tagger database.
+	*/
+	BOOL IsRelevant(LPCWSTR path);
+
+	/*
+	Smallest set of directories that, watched with their subtrees, cover all given paths:
+	the directories holding the paths, without the ones lying within another one of them.
+	If there are more than nMaxDirs of them, the deepest ones are replaced by their parent until there are few enough.
+	*/
+	static void GetCoveringDirs(const vector<wstring>& vecPaths, UINT nMaxDirs, vector<wstring>* vecDirs);
+	/*
+	Directories above the given ones, up to the root of their volume (given directories excluded).
+	Watching them (without their subtree) shows when one of the given directories is moved or removed along with one of its parents.
+	*/
+	static void GetAncestorDirs(const vector<wstring>& vecDirs, vector<wstring>* vecAncestors);
+
+	UINT GetCount()			{ return this->nPaths; }
+	// number of calls to IsRelevant, and number of them answered by the Bloom filter alone
+	UINT GetQueryCount()	{ return this->nQueries; }
+	UINT GetRejectCount()	{ return this->nRejects; }
+};
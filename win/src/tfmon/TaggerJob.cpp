@@ -0,0 +1,216 @@
+/* TaggerJob.cpp - updates of the tagger database, handed to tagger by batches of files
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "TaggerJob.h"
+
+#include <wctype.h>
+
+
+wstring TaggerJob::GetTarget(const wstring& filePath) {
+	if(!this->bSubtree || filePath.size() <= this->oldPath.size()) return this->newPath;
+	return this->newPath + filePath.substr(this->oldPath.size());
+}
+
+
+TaggerBatch::TaggerBatch(TAGGERRUNPROC lpfnRun, TAGGERKNOWSPROC lpfnKnows, LPVOID lpParam) {
+	this->lpfnRun = lpfnRun;
+	this->lpfnKnows = lpfnKnows;
+	this->lpParam = lpParam;
+	this->nBatchSize = TAGGER_BATCH_SIZE;
+	this->dwPrefix = lpfnKnows ? TAGGER_PREFIX_UNKNOWN : TAGGER_PREFIX_UNSUPPORTED;
+	this->nJobs = 0;
+	this->nRuns = 0;
+	this->nFiles = 0;
+	this->nPrefixRuns = 0;
+	this->nDeferred = 0;
+	this->bucket.SetLimits(TAGGER_RATE, TAGGER_BURST);
+}
+
+TaggerBatch::~TaggerBatch() {
+	for(UINT i = 0, uiCount = this->queDeferred.size(); i < uiCount; ++i) {
+		delete this->queDeferred[i];
+	}
+}
+
+wstring TaggerBatch::Key(const wstring& path) {
+	wstring result = path;
+#ifdef _WIN32
+	for(SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+	return result;
+}
+
+void TaggerBatch::AppendQuoted(wstring* lpCommand, const wstring& path) {
+	*lpCommand += L" \"";
+	*lpCommand += path;
+	*lpCommand += L"\"";
+}
+
+LPCWSTR TaggerBatch::GetOperation(DWORD type) {
+	switch(type) {
+	case TAGGER_JOB_RENAME:		return L" --files rename";
+	case TAGGER_JOB_DELETE:		return L" --files delete";
+	case TAGGER_JOB_RECOVER:	return L" --files recover";
+	}
+	return NULL;
+}
+
+/*
+Invocations handing the files of given job over one by one (or by batches, see SetBatchSize).
+*/
+void TaggerBatch::GetCommands(TaggerJob* lpJob, vector<TaggerInvocation*>* vecInvocations) {
+	LPCWSTR operation = TaggerBatch::GetOperation(lpJob->type);
+	wstring command, operands;
+	TaggerJob* lpBatchJob = NULL;
+	for(UINT i = 0, uiCount = lpJob->vecFiles.size(); i < uiCount; ++i) {
+		operands.clear();
+		TaggerBatch::AppendQuoted(&operands, lpJob->vecFiles[i]);
+		if(lpJob->type == TAGGER_JOB_RENAME) TaggerBatch::AppendQuoted(&operands, lpJob->GetTarget(lpJob->vecFiles[i]));
+		// current batch is full
+		if(lpBatchJob && (lpBatchJob->vecFiles.size() == this->nBatchSize || command.size() + operands.size() > TAGGER_COMMAND_MAX)) {
+			vecInvocations->push_back(new TaggerInvocation(command, lpBatchJob));
+			lpBatchJob = NULL;
+		}
+		if(!lpBatchJob) {
+			command = this->taggerCommand + operation;
+			lpBatchJob = new TaggerJob(lpJob->type, lpJob->oldPath.c_str(), lpJob->newPath.c_str(), lpJob->bSubtree);
+		}
+		command += operands;
+		lpBatchJob->vecFiles.push_back(lpJob->vecFiles[i]);
+	}
+	if(lpBatchJob) vecInvocations->push_back(new TaggerInvocation(command, lpBatchJob));
+}
+
+/*
+Invocations keep their order: once one is deferred, the following ones wait behind it.
+*/
+void TaggerBatch::Launch(TaggerInvocation* lpInvocation) {
+	if(this->queDeferred.empty() && this->bucket.Take(GetTickCount64())) this->Execute(lpInvocation);
+	else {
+		this->queDeferred.push_back(lpInvocation);
+		++this->nDeferred;
+	}
+}
+
+/*
+Run given invocation, and release it. The files of a prefix operation that tagger did not apply are queued ahead of the deferred invocations.
+*/
+void TaggerBatch::Execute(TaggerInvocation* lpInvocation) {
+	TaggerJob* lpJob = lpInvocation->lpJob;
+	BOOL bFallback = FALSE;
+	if(lpInvocation->bPrefix && this->dwPrefix == TAGGER_PREFIX_UNSUPPORTED) {
+		// prefix operations were found unsupported while this one was waiting
+		bFallback = TRUE;
+	}
+	else {
+		this->lpfnRun(lpInvocation->command.c_str(), this->lpParam);
+		++this->nRuns;
+		if(lpInvocation->bPrefix) ++this->nPrefixRuns;
+		if(lpInvocation->bPrefix && this->dwPrefix == TAGGER_PREFIX_UNKNOWN) {
+			// a rename or a deletion leaves no entry at the old path, a recovery brings it back
+			const wstring& filePath = lpJob->vecFiles[0];
+			BOOL bApplied;
+			if(lpJob->type == TAGGER_JOB_RENAME) bApplied = this->lpfnKnows(lpJob->GetTarget(filePath).c_str(), this->lpParam) && !this->lpfnKnows(filePath.c_str(), this->lpParam);
+			else if(lpJob->type == TAGGER_JOB_DELETE) bApplied = !this->lpfnKnows(filePath.c_str(), this->lpParam);
+			else bApplied = this->lpfnKnows(filePath.c_str(), this->lpParam);
+			this->dwPrefix = bApplied ? TAGGER_PREFIX_SUPPORTED : TAGGER_PREFIX_UNSUPPORTED;
+			bFallback = !bApplied;
+		}
+	}
+	if(bFallback) {
+		vector<TaggerInvocation*> vecInvocations;
+		this->GetCommands(lpJob, &vecInvocations);
+		this->queDeferred.insert(this->queDeferred.begin(), vecInvocations.begin(), vecInvocations.end());
+		this->nDeferred += vecInvocations.size();
+	}
+	delete lpInvocation;
+}
+
+UINT TaggerBatch::RunDeferred(BOOL bAll) {
+	UINT result = 0;
+	while(!this->queDeferred.empty() && (this->bucket.Take(GetTickCount64()) || bAll)) {
+		TaggerInvocation* lpInvocation = this->queDeferred.front();
+		this->queDeferred.pop_front();
+		this->Execute(lpInvocation);
+		++result;
+	}
+	return result;
+}
+
+/*
+Invocations are applied in order: a file renamed or recovered enters the listing (if it lies under the prefix) and a file renamed or deleted leaves it.
+A file handed over by an invocation was tagged when the invocation was made: a rename from outside of the prefix brings it in.
+*/
+void TaggerBatch::ApplyDeferred(LPCWSTR prefix, vector<wstring>* vecPaths) {
+	if(this->queDeferred.empty()) return;
+	wstring prefixKey = prefix ? TaggerBatch::Key(prefix) : wstring();
+	// listed paths, by key
+	map<wstring, wstring> mapPaths;
+	for(UINT i = 0, uiCount = vecPaths->size(); i < uiCount; ++i) mapPaths[TaggerBatch::Key(vecPaths->at(i))] = vecPaths->at(i);
+	for(UINT i = 0, uiCount = this->queDeferred.size(); i < uiCount; ++i) {
+		TaggerJob* lpJob = this->queDeferred[i]->lpJob;
+		for(UINT j = 0, uiFiles = lpJob->vecFiles.size(); j < uiFiles; ++j) {
+			const wstring& filePath = lpJob->vecFiles[j];
+			wstring entry = (lpJob->type == TAGGER_JOB_RENAME) ? lpJob->GetTarget(filePath) : filePath;
+			wstring entryKey = TaggerBatch::Key(entry);
+			if(lpJob->type != TAGGER_JOB_RECOVER) mapPaths.erase(TaggerBatch::Key(filePath));
+			if(lpJob->type != TAGGER_JOB_DELETE && entryKey.compare(0, prefixKey.size(), prefixKey) == 0) mapPaths[entryKey] = entry;
+		}
+	}
+	vecPaths->clear();
+	for(map<wstring, wstring>::iterator it = mapPaths.begin(); it != mapPaths.end(); ++it) vecPaths->push_back(it->second);
+}
+
+DWORD TaggerBatch::GetDeferredDelay() {
+	return this->bucket.GetDelay(GetTickCount64());
+}
+
+UINT TaggerBatch::Run(TaggerJob* lpJob) {
+	UINT result = 0;
+	LPCWSTR operation = TaggerBatch::GetOperation(lpJob->type);
+	if(!operation || lpJob->vecFiles.empty()) return result;
+	++this->nJobs;
+	this->nFiles += lpJob->vecFiles.size();
+
+	// files below the directory of a subtree job
+	TaggerJob* lpPrefixJob = NULL;
+	TaggerJob filesJob(lpJob->type, lpJob->oldPath.c_str(), lpJob->newPath.c_str(), lpJob->bSubtree);
+	if(lpJob->bSubtree && this->dwPrefix != TAGGER_PREFIX_UNSUPPORTED) {
+		wstring prefix = lpJob->oldPath + FS_PATH_SEPARATOR;
+		lpPrefixJob = new TaggerJob(lpJob->type, lpJob->oldPath.c_str(), lpJob->newPath.c_str(), TRUE);
+		for(UINT i = 0, uiCount = lpJob->vecFiles.size(); i < uiCount; ++i) {
+#ifdef _WIN32
+			BOOL bBelow = (_wcsnicmp(lpJob->vecFiles[i].c_str(), prefix.c_str(), prefix.size()) == 0);
+#else
+			BOOL bBelow = (wcsncmp(lpJob->vecFiles[i].c_str(), prefix.c_str(), prefix.size()) == 0);
+#endif
+			if(bBelow) lpPrefixJob->vecFiles.push_back(lpJob->vecFiles[i]);
+			else filesJob.vecFiles.push_back(lpJob->vecFiles[i]);
+		}
+		if(lpPrefixJob->vecFiles.size() < TAGGER_PREFIX_MIN) {
+			delete lpPrefixJob;
+			lpPrefixJob = NULL;
+		}
+	}
+	if(!lpPrefixJob) filesJob.vecFiles = lpJob->vecFiles;
+
+	// the directory itself (or a file), ahead of what lies below it
+	vector<TaggerInvocation*> vecInvocations;
+	this->GetCommands(&filesJob, &vecInvocations);
+	if(lpPrefixJob) {
+		wstring command = this->taggerCommand + operation;
+		TaggerBatch::AppendQuoted(&command, lpPrefixJob->oldPath + FS_PATH_SEPARATOR + L"*");
+		if(lpPrefixJob->type == TAGGER_JOB_RENAME) TaggerBatch::AppendQuoted(&command, lpPrefixJob->newPath + FS_PATH_SEPARATOR + L"*");
+		vecInvocations.push_back(new TaggerInvocation(command, lpPrefixJob, TRUE));
+	}
+	for(UINT i = 0, uiCount = vecInvocations.size(); i < uiCount; ++i) {
+		this->Launch(vecInvocations[i]);
+		++result;
+	}
+	return result;
+}
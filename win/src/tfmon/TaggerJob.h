@@ -0,0 +1,231 @@
+/* TaggerJob.h - updates of the tagger database, handed to tagger by batches of files
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+using std::wstring;
+using std::vector;
+using std::deque;
+using std::map;
+
+// operations on the tagger database
+#define TAGGER_JOB_RENAME		1
+#define TAGGER_JOB_DELETE		2
+#define TAGGER_JOB_RECOVER		3
+// default maximum number of files handed to a single invocation of tagger: tagger is not known to handle more than the first operand of
+// --files rename|delete|recover, so batching is only enabled by configuration, for a version of tagger that takes several
+// (directories are handed over as prefix operations instead, see TaggerBatch)
+#define TAGGER_BATCH_SIZE		1
+// support of prefix operations by tagger (--files rename|delete|recover given a "dir\*" pattern, as --files list is)
+#define TAGGER_PREFIX_UNKNOWN		0
+#define TAGGER_PREFIX_SUPPORTED		1
+#define TAGGER_PREFIX_UNSUPPORTED	2
+// minimum number of tagged files below a directory for its job to be handed over as a prefix operation
+#define TAGGER_PREFIX_MIN		2
+// maximum length (characters) of a command line (CreateProcess accepts 32767 of them)
+#define TAGGER_COMMAND_MAX		32000
+// default number of invocations of tagger per second, and number of invocations allowed at once (0 for no limit)
+#define TAGGER_RATE				10
+#define TAGGER_BURST			20
+
+
+/*
+Update of the tagger database following a filesystem event.
+An event on a directory makes a subtree job: it applies to every tagged file below the directory (prefix rename, delete or recover),
+as a single job whatever the number of files.
+*/
+class TaggerJob {
+public:
+	DWORD				type;
+	// path the event refers to, and its new path (renames only)
+	wstring				oldPath;
+	wstring				newPath;
+	BOOL				bSubtree;
+	// files the job applies to (their current path in the database), to be filled before the job is run
+	vector<wstring>		vecFiles;
+
+	TaggerJob(DWORD type, LPCWSTR oldPath, LPCWSTR newPath = NULL, BOOL bSubtree = FALSE) {
+		this->type = type;
+		if(oldPath) this->oldPath = oldPath;
+		if(newPath) this->newPath = newPath;
+		this->bSubtree = bSubtree;
+	}
+
+	/*
+	New path of given file (renames only): the part of its path below the old path is kept.
+	*/
+	wstring GetTarget(const wstring& filePath);
+};
+
+/*
+Token bucket: it holds up to nBurst tokens, and gets nRate tokens back per second. Times are in ms.
+With a rate of 0, a token is always available. This class does no locking.
+*/
+class TokenBucket {
+private:
+	UINT				nRate;
+	UINT				nBurst;
+	// in thousandths of a token
+	ULONGLONG			ullTokens;
+	ULONGLONG			ullLast;
+
+	void Refill(ULONGLONG now) {
+		if(now > this->ullLast) this->ullTokens += (now - this->ullLast) * this->nRate;
+		if(this->ullTokens > (ULONGLONG) this->nBurst * 1000) this->ullTokens = (ULONGLONG) this->nBurst * 1000;
+		this->ullLast = now;
+	}
+
+public:
+	TokenBucket(UINT nRate = 0, UINT nBurst = 0) {
+		this->SetLimits(nRate, nBurst);
+	}
+
+	void SetLimits(UINT nRate, UINT nBurst) {
+		this->nRate = nRate;
+		this->nBurst = (nBurst > 0) ? nBurst : 1;
+		this->ullTokens = (ULONGLONG) this->nBurst * 1000;
+		this->ullLast = 0;
+	}
+
+	BOOL Take(ULONGLONG now) {
+		if(!this->nRate) return TRUE;
+		this->Refill(now);
+		if(this->ullTokens < 1000) return FALSE;
+		this->ullTokens -= 1000;
+		return TRUE;
+	}
+
+	// time until a token is available (0 if one is)
+	DWORD GetDelay(ULONGLONG now) {
+		if(!this->nRate) return 0;
+		this->Refill(now);
+		return (this->ullTokens >= 1000) ? 0 : (DWORD) ((1000 - this->ullTokens + this->nRate - 1) / this->nRate);
+	}
+};
+
+/*
+Invocation of tagger, possibly deferred, along with the files it hands over (as a job of its own), so that a listing of the database
+can account for it while it waits (see TaggerBatch::ApplyDeferred). Once a prefix operation run while tagger is not known to support it yet
+has run, tagger is asked about the first of its files, and they are handed over one by one if it left them untouched.
+*/
+class TaggerInvocation {
+public:
+	wstring				command;
+	TaggerJob*			lpJob;
+	BOOL				bPrefix;
+
+	TaggerInvocation(const wstring& command, TaggerJob* lpJob, BOOL bPrefix = FALSE) {
+		this->command = command;
+		this->lpJob = lpJob;
+		this->bPrefix = bPrefix;
+	}
+
+	~TaggerInvocation() {
+		if(this->lpJob) delete this->lpJob;
+	}
+};
+
+/*
+Run given tagger command line. Invoked once per batch.
+*/
+typedef void (*TAGGERRUNPROC)(LPCWSTR command, LPVOID lpParam);
+/*
+Given file has an entry in the tagger database (invoked to check the first prefix operation).
+*/
+typedef BOOL (*TAGGERKNOWSPROC)(LPCWSTR filePath, LPVOID lpParam);
+
+/*
+The files of a job are handed to tagger by batches: each invocation of tagger takes as many files as the batch size and the length of
+a command line allow (a rename takes the old and new paths of each file, in turn), so that the number of processes launched
+grows with the number of tagged files divided by the batch size.
+With a batch size of 1 (the default), each file gets its own invocation: a larger size is only safe with a version of tagger
+taking several files per command (otherwise, the files but the first of each batch would silently keep their old entry).
+The files below the directory of a subtree job are handed over as a single prefix operation instead (i.e. --files rename "C:\old\*" "C:\new\*"),
+whatever their number. The first prefix operation is checked: if tagger left its files untouched, prefix operations are not supported
+by that version of tagger, and its files (along with those of any later subtree job) are handed over one by one.
+Invocations are capped by a token bucket: beyond it, they are deferred (in order) until RunDeferred is called, so that a burst of changes
+does not launch tagger without limit. The caller runs the deferred invocations once the bucket has refilled; a listing of the database
+obtained in the meantime is brought up to date with ApplyDeferred rather than by running them.
+*/
+class TaggerBatch {
+private:
+	TAGGERRUNPROC		lpfnRun;
+	TAGGERKNOWSPROC		lpfnKnows;
+	LPVOID				lpParam;
+	// command line of tagger (executable and global options)
+	wstring				taggerCommand;
+	UINT				nBatchSize;
+	DWORD				dwPrefix;
+	TokenBucket			bucket;
+	deque<TaggerInvocation*>	queDeferred;
+
+	UINT				nJobs;
+	UINT				nRuns;
+	UINT				nFiles;
+	UINT				nPrefixRuns;
+	UINT				nDeferred;
+
+	static wstring		Key(const wstring& path);
+	static void			AppendQuoted(wstring* lpCommand, const wstring& path);
+	static LPCWSTR		GetOperation(DWORD type);
+	void				GetCommands(TaggerJob* lpJob, vector<TaggerInvocation*>* vecInvocations);
+	void				Launch(TaggerInvocation* lpInvocation);
+	void				Execute(TaggerInvocation* lpInvocation);
+
+public:
+	TaggerBatch(TAGGERRUNPROC lpfnRun, TAGGERKNOWSPROC lpfnKnows = NULL, LPVOID lpParam = NULL);
+	~TaggerBatch();
+
+	void SetCommand(LPCWSTR taggerCommand)	{ this->taggerCommand = taggerCommand; }
+	void SetBatchSize(UINT nBatchSize)		{ this->nBatchSize = (nBatchSize > 0) ? nBatchSize : 1; }
+	UINT GetBatchSize()						{ return this->nBatchSize; }
+	/*
+	Directories are handed over as prefix operations (unless disabled, or found unsupported by tagger), see TAGGER_PREFIX_*.
+	*/
+	void SetPrefixEnabled(BOOL bEnabled) {
+		if(!bEnabled || !this->lpfnKnows) this->dwPrefix = TAGGER_PREFIX_UNSUPPORTED;
+		// (support is checked again, i.e. tagger might have been updated)
+		else if(this->dwPrefix == TAGGER_PREFIX_UNSUPPORTED) this->dwPrefix = TAGGER_PREFIX_UNKNOWN;
+	}
+	DWORD GetPrefixState()					{ return this->dwPrefix; }
+	/*
+	Number of invocations per second, and number of invocations allowed at once (a rate of 0 removes the limit).
+	*/
+	void SetRateLimit(UINT nRate, UINT nBurst)	{ this->bucket.SetLimits(nRate, nBurst); }
+
+	/*
+	Hand the files of given job to tagger. Returns the number of invocations (including the deferred ones).
+	*/
+	UINT Run(TaggerJob* lpJob);
+	/*
+	Run the deferred invocations that the bucket allows (all of them if bAll is set). Returns the number of invocations run.
+	*/
+	UINT RunDeferred(BOOL bAll = FALSE);
+	/*
+	Bring given listing of the database (paths starting with given prefix, or all of them if prefix is NULL) up to date
+	with the deferred invocations, as if they had been run. Nothing is run.
+	*/
+	void ApplyDeferred(LPCWSTR prefix, vector<wstring>* vecPaths);
+	// number of invocations waiting, and time (ms) until the next one can be run
+	UINT GetDeferredCount()	{ return this->queDeferred.size(); }
+	DWORD GetDeferredDelay();
+
+	// number of jobs run, of invocations of tagger (and of prefix operations among them), of files handed to it,
+	// and of invocations that had to be deferred
+	UINT GetJobCount()		{ return this->nJobs; }
+	UINT GetRunCount()		{ return this->nRuns; }
+	UINT GetPrefixRunCount()	{ return this->nPrefixRuns; }
+	UINT GetFileCount()		{ return this->nFiles; }
+	UINT GetDeferredTotal()	{ return this->nDeferred; }
+};
@@ -0,0 +1,215 @@
+/* TrashIndex.cpp - tagged files known to have gone to a recycle bin
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#include "TrashIndex.h"
+
+#include <cstdio>
+#include <wctype.h>
+
+using std::string;
+
+
+typedef map<wstring, pair<wstring, ULONGLONG> > TrashFiles;
+typedef map<wstring, TrashFiles> TrashBins;
+
+
+// the index file holds one line per file (recycle bin and path, separated by a tab), oldest first, as UTF-8
+static string ToUTF8(LPCWSTR str) {
+#ifdef _WIN32
+	int len = WideCharToMultiByte(CP_UTF8, 0, str, -1, NULL, 0, NULL, NULL);
+	if(len <= 1) return string();
+	string result(len - 1, '\0');
+	WideCharToMultiByte(CP_UTF8, 0, str, -1, &result[0], len, NULL, NULL);
+	return result;
+#else
+	return WCHARtoUTF8(str);
+#endif
+}
+
+static wstring FromUTF8(const char* str, SIZE_T len) {
+#ifdef _WIN32
+	if(!len) return wstring();
+	int wlen = MultiByteToWideChar(CP_UTF8, 0, str, (int) len, NULL, 0);
+	wstring result(wlen, L'\0');
+	MultiByteToWideChar(CP_UTF8, 0, str, (int) len, &result[0], wlen);
+	return result;
+#else
+	return UTF8toWCHAR(str, len);
+#endif
+}
+
+static FILE* OpenFile(LPCWSTR path, LPCWSTR mode) {
+#ifdef _WIN32
+	return _wfopen(path, mode);
+#else
+	return fopen(WCHARtoUTF8(path).c_str(), WCHARtoUTF8(mode).c_str());
+#endif
+}
+
+
+TrashIndex::TrashIndex() {
+	this->ullNextAge = 0;
+}
+
+wstring TrashIndex::Key(LPCWSTR path) {
+	wstring result = path;
+#ifdef _WIN32
+	for(SIZE_T i = 0, uiSize = result.size(); i < uiSize; ++i) result[i] = towlower(result[i]);
+#endif
+	return result;
+}
+
+void TrashIndex::Erase(TrashBins::iterator itBin, TrashFiles::iterator it) {
+	this->mapAge.erase(it->second.second);
+	itBin->second.erase(it);
+	if(itBin->second.empty()) this->mapBins.erase(itBin);
+}
+
+/*
+Files of given recycle bin whose keys start with given prefix leave the index, and are appended to vecFiles.
+The bin itself is left in place (if it has no more file, it is erased by the caller).
+*/
+UINT TrashIndex::TakeRange(TrashBins::iterator itBin, const wstring& prefix, vector<wstring>* vecFiles) {
+	UINT result = 0;
+	TrashFiles::iterator it = itBin->second.lower_bound(prefix);
+	while(it != itBin->second.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+		vecFiles->push_back(it->second.first);
+		this->mapAge.erase(it->second.second);
+		itBin->second.erase(it++);
+		++result;
+	}
+	return result;
+}
+
+/*
+Given tagged file went to given recycle bin.
+When the index is full, the file that went to a recycle bin first is forgotten.
+*/
+void TrashIndex::Add(LPCWSTR binPath, LPCWSTR filePath) {
+	wstring binKey = TrashIndex::Key(binPath);
+	wstring fileKey = TrashIndex::Key(filePath);
+	TrashFiles& mapFiles = this->mapBins[binKey];
+	TrashFiles::iterator it = mapFiles.find(fileKey);
+	// a file that went there again is as young as its latest removal
+	if(it != mapFiles.end()) this->mapAge.erase(it->second.second);
+	ULONGLONG ullAge = this->ullNextAge++;
+	mapFiles[fileKey] = std::make_pair(wstring(filePath), ullAge);
+	this->mapAge[ullAge] = std::make_pair(binKey, fileKey);
+
+	while(this->mapAge.size() > TRASH_INDEX_MAX) {
+		map<ULONGLONG, pair<wstring, wstring> >::iterator itOldest = this->mapAge.begin();
+		TrashBins::iterator itBin = this->mapBins.find(itOldest->second.first);
+		this->Erase(itBin, itBin->second.find(itOldest->second.second));
+	}
+}
+
+/*
+Given file was brought back from given recycle bin (from any of them if binPath is NULL): returns FALSE if it is not known to have gone there,
+otherwise it leaves the index and lpFilePath is set to its path as it was known.
+*/
+BOOL TrashIndex::Take(LPCWSTR binPath, LPCWSTR filePath, wstring* lpFilePath) {
+	wstring fileKey = TrashIndex::Key(filePath);
+	TrashBins::iterator itBin = binPath ? this->mapBins.find(TrashIndex::Key(binPath)) : this->mapBins.begin();
+	for(; itBin != this->mapBins.end(); ++itBin) {
+		TrashFiles::iterator it = itBin->second.find(fileKey);
+		if(it != itBin->second.end()) {
+			*lpFilePath = it->second.first;
+			this->Erase(itBin, it);
+			return TRUE;
+		}
+		if(binPath) break;
+	}
+	return FALSE;
+}
+
+/*
+Given directory was brought back from given recycle bin (from any of them if binPath is NULL): the files below it that went there
+leave the index, and are appended to vecFiles. Returns the number of files appended.
+They are retrieved with a range lookup (no scan of the recycle bin).
+*/
+UINT TrashIndex::TakeUnder(LPCWSTR binPath, LPCWSTR dirPath, vector<wstring>* vecFiles) {
+	UINT result = 0;
+	wstring prefix = TrashIndex::Key(dirPath);
+	if(prefix.empty() || prefix[prefix.size()-1] != FS_PATH_SEPARATOR) prefix += FS_PATH_SEPARATOR;
+	TrashBins::iterator itBin = binPath ? this->mapBins.find(TrashIndex::Key(binPath)) : this->mapBins.begin();
+	while(itBin != this->mapBins.end()) {
+		result += this->TakeRange(itBin, prefix, vecFiles);
+		if(itBin->second.empty()) this->mapBins.erase(itBin++);
+		else ++itBin;
+		if(binPath) break;
+	}
+	return result;
+}
+
+/*
+Given recycle bin was emptied: the files that went there can no longer be brought back and leave the index.
+Returns the number of files dropped.
+*/
+UINT TrashIndex::Drop(LPCWSTR binPath) {
+	TrashBins::iterator itBin = this->mapBins.find(TrashIndex::Key(binPath));
+	if(itBin == this->mapBins.end()) return 0;
+	UINT result = itBin->second.size();
+	for(TrashFiles::iterator it = itBin->second.begin(); it != itBin->second.end(); ++it) this->mapAge.erase(it->second.second);
+	this->mapBins.erase(itBin);
+	return result;
+}
+
+/*
+Replace the content of the index with the one saved to given file. Returns FALSE if the file could not be read (the index is then left empty).
+*/
+BOOL TrashIndex::Load(LPCWSTR indexPath) {
+	this->mapBins.clear();
+	this->mapAge.clear();
+	this->ullNextAge = 0;
+	FILE* pFile = OpenFile(indexPath, L"rb");
+	if(!pFile) return FALSE;
+	string buff;
+	char chunk[65536];
+	SIZE_T n;
+	while((n = fread(chunk, 1, sizeof(chunk), pFile)) > 0) buff.append(chunk, n);
+	fclose(pFile);
+
+	for(SIZE_T pos = 0, end; pos < buff.size(); pos = end + 1) {
+		end = buff.find('\n', pos);
+		if(end == string::npos) end = buff.size();
+		SIZE_T tab = buff.find('\t', pos);
+		if(tab == string::npos || tab >= end) continue;
+		wstring binPath = FromUTF8(buff.data() + pos, tab - pos);
+		wstring filePath = FromUTF8(buff.data() + tab + 1, end - tab - 1);
+		if(!binPath.empty() && !filePath.empty()) this->Add(binPath.c_str(), filePath.c_str());
+	}
+	return TRUE;
+}
+
+/*
+Write the content of the index to given file (oldest files first, so that Load keeps their order). Returns FALSE on failure.
+*/
+BOOL TrashIndex::Save(LPCWSTR indexPath) {
+	string buff;
+	for(map<ULONGLONG, pair<wstring, wstring> >::iterator it = this->mapAge.begin(); it != this->mapAge.end(); ++it) {
+		TrashBins::iterator itBin = this->mapBins.find(it->second.first);
+		buff += ToUTF8(it->second.first.c_str());
+		buff += '\t';
+		buff += ToUTF8(itBin->second.find(it->second.second)->second.first.c_str());
+		buff += '\n';
+	}
+	FILE* pFile = OpenFile(indexPath, L"wb");
+	if(!pFile) return FALSE;
+	BOOL result = (fwrite(buff.data(), 1, buff.size(), pFile) == buff.size());
+	if(fclose(pFile) != 0) result = FALSE;
+	return result;
+}
+
+UINT TrashIndex::GetCount() {
+	return this->mapAge.size();
+}
+
+UINT TrashIndex::GetCount(LPCWSTR binPath) {
+	TrashBins::iterator itBin = this->mapBins.find(TrashIndex::Key(binPath));
+	return (itBin == this->mapBins.end()) ? 0 : itBin->second.size();
+}
@@ -0,0 +1,61 @@
+/* TrashIndex.h - tagged files known to have gone to a recycle bin
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+using std::wstring;
+using std::vector;
+using std::map;
+using std::pair;
+
+
+// maximum number of files kept in the index: beyond it, the files that went to a recycle bin first are forgotten
+#define TRASH_INDEX_MAX		50000
+
+
+/*
+Tagged files removed toward a recycle bin, by recycle bin (its exact path) and by original path:
+a file brought back from a recycle bin is known to be tagged (and to have been deleted from the database) without asking tagger,
+and a restored file that is not in the index is not recovered (tagger cannot tell a deleted file from one that never was tagged).
+The index is kept across runs (see Load and Save); files that went to a recycle bin while it was not kept (i.e. tfmon was not running)
+are not known. Files of a recycle bin that was emptied are dropped (see Drop), the other ones only when the index is full.
+Paths are case insensitive on Windows. This class does no locking.
+*/
+class TrashIndex {
+private:
+	// by recycle bin, then by original path (case folded on Windows, ordered so that the files below a directory are a single range),
+	// giving the path as it was known and the age of the entry
+	map<wstring, map<wstring, pair<wstring, ULONGLONG> > >	mapBins;
+	// the same entries, oldest first: age giving the recycle bin and original path keys
+	map<ULONGLONG, pair<wstring, wstring> >	mapAge;
+	ULONGLONG				ullNextAge;
+
+	static wstring Key(LPCWSTR path);
+	void Erase(map<wstring, map<wstring, pair<wstring, ULONGLONG> > >::iterator itBin, map<wstring, pair<wstring, ULONGLONG> >::iterator it);
+	UINT TakeRange(map<wstring, map<wstring, pair<wstring, ULONGLONG> > >::iterator itBin, const wstring& prefix, vector<wstring>* vecFiles);
+
+public:
+	TrashIndex();
+
+	void Add(LPCWSTR binPath, LPCWSTR filePath);
+	BOOL Take(LPCWSTR binPath, LPCWSTR filePath, wstring* lpFilePath);
+	UINT TakeUnder(LPCWSTR binPath, LPCWSTR dirPath, vector<wstring>* vecFiles);
+	UINT Drop(LPCWSTR binPath);
+
+	BOOL Load(LPCWSTR indexPath);
+	BOOL Save(LPCWSTR indexPath);
+
+	UINT GetCount();
+	UINT GetCount(LPCWSTR binPath);
+};
@@ -0,0 +1,110 @@
+/* WatcherBackend.h - interface for the platform-specific sources of filesystem events
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+*/
+
+
+#pragma once
+#include "fscompat.h"
+#include "FileActionInfo.h"
+
+#include <vector>
+using std::vector;
+
+#ifndef FILE_NAME_MAX
+	#define FILE_NAME_MAX 1024
+#endif
+
+
+enum {
+	E_FILESYSMON_SUCCESS,
+	E_FILESYSMON_ERRORUNKNOWN,
+	E_FILESYSMON_ERRORNOTINIT,
+	E_FILESYSMON_ERROROUTOFMEM,
+	E_FILESYSMON_ERROROPENFILE,
+	E_FILESYSMON_ERRORADDTOIOCP,
+	E_FILESYSMON_ERRORREADDIR,
+	E_FILESYSMON_NOCHANGE,
+	E_FILESYSMON_ERRORDEQUE,
+	E_FILESYSMON_INTERRUPTED
+};
+
+/*
+A backend watches a set of root directories and turns the raw notifications of the underlying OS
+into FileActionInfo records, using the win32 actions codes:
+- FILE_ACTION_ADDED, FILE_ACTION_REMOVED
+- FILE_ACTION_RENAMED_OLD_NAME immediately followed by FILE_ACTION_RENAMED_NEW_NAME (rename inside a watched root)
+- FILE_ACTION_OVERFLOW, with the path of the watched root, when events were lost for that root
+Records may carry the identity of their file (see FileActionInfo::GetFileId): both halves of a move reported as a removal and an addition
+should then carry the same one, so that they are paired exactly.
+
+Correlation of these records (moves, restores, delayed removals) is not the backend's business: it is done by FSChangeNotifier.
+*/
+class WatcherBackend {
+protected:
+	INT						nLastError;
+	// records produced by FetchChanges
+	FileActionArena			arena;
+
+	/*
+	Append a new record to vecChanges, and return it (a record that cannot be allocated is dropped: NULL is returned).
+	*/
+	FileActionInfo* PushChange(vector<FileActionInfo*>* vecChanges, LPCWSTR dirPath, SIZE_T dirLength, LPCWSTR fileName, SIZE_T nameLength, DWORD action, CHAR drive = 0, ULONGLONG ticks = 0) {
+		FileActionInfo* lpAction = FileActionInfo::Create(&this->arena, dirPath, dirLength, fileName, nameLength, action, drive, ticks);
+		if(lpAction) vecChanges->push_back(lpAction);
+		return lpAction;
+	}
+
+	FileActionInfo* PushChange(vector<FileActionInfo*>* vecChanges, LPCWSTR filePath, DWORD action, CHAR drive = 0, ULONGLONG ticks = 0) {
+		return this->PushChange(vecChanges, filePath, wcslen(filePath), NULL, 0, action, drive, ticks);
+	}
+
+public:
+	WatcherBackend() { this->nLastError = E_FILESYSMON_SUCCESS; }
+	virtual ~WatcherBackend() {}
+
+	virtual BOOL Init() = 0;
+
+	/*
+	New (not initialized) backend of the same kind: each watched volume gets its own instance.
+	*/
+	virtual WatcherBackend* NewInstance() = 0;
+
+	/*
+	Paths can be added and removed while another thread is blocked in FetchChanges.
+	*/
+	virtual INT AddPath(LPCWSTR pPath, BOOL bSubTree) = 0;
+	virtual void RemovePath(UINT nIndex) = 0; //zero based index
+	virtual void RemoveAllPaths() = 0;
+
+	/*
+	Identifier of the volume holding given path, as it will be reported by FileActionInfo::GetDrive for events under that path.
+	*/
+	virtual CHAR GetDrive(LPCWSTR pPath) = 0;
+
+	/*
+	Number of times events were lost for given root (zero based index).
+	*/
+	virtual UINT GetOverflowCount(UINT nIndex) = 0;
+
+	/*
+	Watch of given root stopped (i.e. its directory was removed): no event is received for it any more, until it is removed and added again.
+	The other roots of the volume are still watched.
+	*/
+	virtual BOOL IsFailed(UINT nIndex) { return FALSE; }
+
+	/*
+	Wait for changes and append them to vecChanges (caller takes ownership of the appended items).
+	Returns FALSE if an unrecoverable error occured (reason can be retrieved with GetLastError).
+	*/
+	virtual BOOL FetchChanges(vector<FileActionInfo*>* vecChanges) = 0;
+
+	/*
+	Make a (possibly blocked) call to FetchChanges return FALSE, with last error E_FILESYSMON_INTERRUPTED.
+	*/
+	virtual void Interrupt() = 0;
+
+	INT GetLastError() { return this->nLastError; }
+};
@@ -0,0 +1,352 @@
+/* Win32Watcher.cpp - filesystem events backend based on ReadDirectoryChangesW and an I/O completion port
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+
+	Part of this code is based on the class CFileSysMon, defined in FileSysMon.cpp originally written by H. Seldon (hseldon@veridium.net), December 2010 <http://veridium.net>
+*/
+
+
+#include <windows.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include "Win32Watcher.h"
+
+
+READDIRECTORYCHANGESEXW Win32Watcher::lpfnReadDirectoryChangesEx = (READDIRECTORYCHANGESEXW) GetProcAddress(GetModuleHandle(L"kernel32.dll"), "ReadDirectoryChangesExW");
+
+Win32Watcher::Win32Watcher() {
+	this->hIOCP = NULL;
+	InitializeCriticalSection(&this->csDirs);
+}
+
+/*
+Must not be called while a thread is blocked in FetchChanges.
+*/
+Win32Watcher::~Win32Watcher() {
+	RemoveAllPaths();
+	if (this->hIOCP) {
+		// release removed directories once their cancelled request has completed
+		DWORD		dwBytesXFered;
+		ULONG_PTR	ulKey;
+		OVERLAPPED*	pOl;
+		while (GetQueuedCompletionStatus(this->hIOCP, &dwBytesXFered, &ulKey, &pOl, 100) || pOl) {
+			if (pOl && ulKey && ((DirInfo*) ulKey)->bClosing) delete (DirInfo*) ulKey;
+		}
+		CloseHandle(this->hIOCP);
+	}
+	DeleteCriticalSection(&this->csDirs);
+}
+
+/*
+BOOL Win32Watcher::AddPrivilege(LPCTSTR pszPrivName, BOOL bEnable) {
+	BOOL result = FALSE;
+	HANDLE hToken = NULL;
+
+	if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &hToken)) {
+		TOKEN_PRIVILEGES tp = { 1 };
+		if (LookupPrivilegeValue(NULL, pszPrivName,  &tp.Privileges[0].Luid)) {
+			tp.Privileges[0].Attributes = bEnable ?  SE_PRIVILEGE_ENABLED : 0;
+			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
+			result = (GetLastError() == ERROR_SUCCESS);
+		}
+		CloseHandle(hToken);
+	}
+	return result;
+}
+*/
+
+BOOL Win32Watcher::Init() {
+	HANDLE hToken = NULL;
+	// adjust privileges for current process
+	if (OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES, &hToken)) {
+		TOKEN_PRIVILEGES tp = { 1 };
+// do we need this ?
+		if (LookupPrivilegeValue(NULL, SE_BACKUP_NAME,  &tp.Privileges[0].Luid)) {
+			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
+			if(::GetLastError() != ERROR_SUCCESS) {
+				this->nLastError = ::GetLastError();
+				CloseHandle(hToken);
+				return FALSE;
+			}
+		}
+// do we need this ?
+		if (LookupPrivilegeValue(NULL, SE_RESTORE_NAME,  &tp.Privileges[0].Luid)) {
+			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
+			if(::GetLastError() != ERROR_SUCCESS) {
+				this->nLastError = ::GetLastError();
+				CloseHandle(hToken);
+				return FALSE;
+			}
+		}
+		// we need this one enabled  (enabled by default for all user since win NT)
+		if (LookupPrivilegeValue(NULL, SE_CHANGE_NOTIFY_NAME,  &tp.Privileges[0].Luid)) {
+			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+			AdjustTokenPrivileges(hToken, FALSE, &tp, sizeof(tp), NULL, NULL);
+			if(::GetLastError() != ERROR_SUCCESS) {
+				this->nLastError = ::GetLastError();
+				CloseHandle(hToken);
+				return FALSE;
+			}
+		}
+		CloseHandle(hToken);
+	}
+
+
+	// Get a handle to the I/O completion port (each volume has its own port, drained by the thread of that volume)
+	if (!(this->hIOCP = CreateIoCompletionPort(	(HANDLE) INVALID_HANDLE_VALUE, NULL, 0, 1))) {
+		this->nLastError = ::GetLastError();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+INT Win32Watcher::AddPath(LPCWSTR pPath, BOOL bSubTree) {
+	// check IO completion port handler
+	if (!this->hIOCP) {
+			// must call Init() method first !
+			return E_FILESYSMON_ERRORNOTINIT;
+	}
+
+
+	// Open handle to the directory to be monitored
+	// flag FILE_FLAG_OVERLAPPED allows asynchronous calls of ReadDirectoryChangesW
+	DirInfo* pDir = new DirInfo(pPath, bSubTree);
+	if ((pDir->hFile = CreateFile(pPath, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_DELETE | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL)) == INVALID_HANDLE_VALUE) {
+		this->nLastError = ::GetLastError();
+		delete pDir;
+		return E_FILESYSMON_ERROROPENFILE;
+	}
+
+	// Allocate notification buffers (will be filled by the system when a notification occurs)
+	memset(&pDir->ol,  0, sizeof(pDir->ol));
+	if(!pDir->AllocBuffer(0, MIN_BUFF_SIZE) || !pDir->AllocBuffer(1, MIN_BUFF_SIZE)) {
+		CloseHandle(pDir->hFile);
+		delete pDir;
+		return E_FILESYSMON_ERROROUTOFMEM;
+	}
+
+	// Associate directory handle with the IO completion port (completions will give the DirInfo straight away)
+	if (CreateIoCompletionPort(pDir->hFile, this->hIOCP, (ULONG_PTR) pDir, 0) == NULL) {
+		this->nLastError = ::GetLastError();
+		CloseHandle(pDir->hFile);
+		delete pDir;
+		return E_FILESYSMON_ERRORADDTOIOCP;
+	}
+
+	// Start monitoring for changes (file systems other than NTFS might not support extended records)
+	pDir->bExtended = (Win32Watcher::lpfnReadDirectoryChangesEx != NULL);
+	BOOL bArmed = this->Arm(pDir);
+	if (!bArmed && pDir->bExtended) {
+		pDir->bExtended = FALSE;
+		bArmed = this->Arm(pDir);
+	}
+	if (!bArmed) {
+		this->nLastError = ::GetLastError();
+		CloseHandle(pDir->hFile);
+		delete pDir;
+		return E_FILESYSMON_ERRORREADDIR;
+	}
+
+	// add direcory to watched directories queue
+	EnterCriticalSection(&this->csDirs);
+	this->vecDirs.push_back(pDir);
+	LeaveCriticalSection(&this->csDirs);
+
+	return E_FILESYSMON_SUCCESS;
+}
+
+/*
+Pending request is cancelled by closing the directory handle: its completion is still to be dequeued,
+so the DirInfo is only released by FetchChanges.
+*/
+void Win32Watcher::RemovePath(UINT nIndex) {
+	EnterCriticalSection(&this->csDirs);
+	//sanity check
+	if (nIndex < this->vecDirs.size()) {
+		DirInfo* pDir = this->vecDirs[nIndex];
+		this->vecDirs.erase(this->vecDirs.begin() + nIndex);
+		// a failed directory has no request left to complete
+		if (pDir->bFailed) delete pDir;
+		else {
+			pDir->bClosing = TRUE;
+			CloseHandle(pDir->hFile);
+			pDir->hFile = INVALID_HANDLE_VALUE;
+		}
+	}
+	LeaveCriticalSection(&this->csDirs);
+}
+
+
+void Win32Watcher::RemoveAllPaths() {
+	EnterCriticalSection(&this->csDirs);
+	while (!this->vecDirs.empty()) {
+		this->RemovePath(0);
+	}
+	LeaveCriticalSection(&this->csDirs);
+}
+
+CHAR Win32Watcher::GetDrive(LPCWSTR pPath) {
+	return (CHAR) pPath[0];
+}
+
+UINT Win32Watcher::GetOverflowCount(UINT nIndex) {
+	UINT result = 0;
+	EnterCriticalSection(&this->csDirs);
+	if (nIndex < this->vecDirs.size()) result = this->vecDirs[nIndex]->nOverflows;
+	LeaveCriticalSection(&this->csDirs);
+	return result;
+}
+
+BOOL Win32Watcher::IsFailed(UINT nIndex) {
+	BOOL result = FALSE;
+	EnterCriticalSection(&this->csDirs);
+	if (nIndex < this->vecDirs.size()) result = this->vecDirs[nIndex]->bFailed;
+	LeaveCriticalSection(&this->csDirs);
+	return result;
+}
+
+/*
+A completion packet without overlapped structure and with a null key is never sent by the system.
+*/
+void Win32Watcher::Interrupt() {
+	if (this->hIOCP) PostQueuedCompletionStatus(this->hIOCP, 0, 0, NULL);
+}
+
+/*
+Submit the active buffer of given directory to the system.
+*/
+BOOL Win32Watcher::Arm(DirInfo* pDir) {
+	DWORD dwBytesReturned = 0;
+	if (pDir->bExtended) return Win32Watcher::lpfnReadDirectoryChangesEx(pDir->hFile, pDir->pBuffs[pDir->nActive], pDir->dwBuffSizes[pDir->nActive], pDir->bSubTree, FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME, &dwBytesReturned, &pDir->ol, NULL, FS_NOTIFY_EXTENDED_CLASS);
+	return ReadDirectoryChangesW(pDir->hFile, pDir->pBuffs[pDir->nActive], pDir->dwBuffSizes[pDir->nActive], pDir->bSubTree, FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_FILE_NAME, &dwBytesReturned, &pDir->ol, NULL);
+}
+
+/*
+Watch of given directory cannot go on (i.e. the directory was removed, or its share is no longer reachable): other directories of the volume
+are still watched. The directory stays in vecDirs (indexes of the roots are kept), and an overflow of its root lets the receiver
+reconcile it and watch it again, or plan another directory instead. csDirs must be held.
+*/
+void Win32Watcher::Fail(DirInfo* pDir, vector<FileActionInfo*>* vecChanges) {
+	pDir->bFailed = TRUE;
+	CloseHandle(pDir->hFile);
+	pDir->hFile = INVALID_HANDLE_VALUE;
+	++pDir->nOverflows;
+	this->PushChange(vecChanges, pDir->dirPath, FILE_ACTION_OVERFLOW);
+}
+
+/*
+Compute the size of the next buffer to be armed for given directory, according to its observed events rate.
+A buffer that came back (almost) full, or not at all (overflow), doubles the size right away.
+*/
+DWORD Win32Watcher::AdaptBufferSize(DirInfo* pDir, DWORD dwBytesXFered) {
+	ULONGLONG ullNow = GetTickCount64();
+	ULONGLONG ullElapsed = max(ullNow - pDir->ullLastCompletion, 1ULL);
+	pDir->ullLastCompletion = ullNow;
+
+	DWORD dwFilledSize = pDir->dwBuffSizes[pDir->nActive];
+	ULONGLONG ullRate = (ULONGLONG) dwBytesXFered * 1000 / ullElapsed;
+	pDir->dwRate = (DWORD) min(((ULONGLONG) pDir->dwRate * 7 + ullRate) / 8, (ULONGLONG) MAXDWORD);
+
+	// twice the amount of bytes expected during the window, rounded to a power of 2
+	ULONGLONG ullTarget = (ULONGLONG) pDir->dwRate * BUFF_WINDOW / 1000 * 2;
+	DWORD dwSize = MIN_BUFF_SIZE;
+	while (dwSize < ullTarget && dwSize < MAX_BUFF_SIZE) dwSize *= 2;
+
+	if (dwBytesXFered == 0 || dwBytesXFered > dwFilledSize / 4 * 3) dwSize = max(dwSize, dwFilledSize * 2);
+
+	return min(dwSize, (DWORD) MAX_BUFF_SIZE);
+}
+
+BOOL Win32Watcher::FetchChanges(vector<FileActionInfo*>* vecChanges) {
+	DWORD		dwBytesXFered = 0;
+	ULONG_PTR	ulKey = 0;
+	OVERLAPPED*	pOl;
+
+	// get new completion key (ulKey) or wait for timeout
+	BOOL bCompleted = GetQueuedCompletionStatus(this->hIOCP, &dwBytesXFered, &ulKey, &pOl, INFINITE);
+	DWORD dwError = bCompleted ? ERROR_SUCCESS : ::GetLastError();
+	if (!pOl) {
+		// no request completed
+		if (bCompleted && ulKey == 0)
+			this->nLastError = E_FILESYSMON_INTERRUPTED;
+		else if (dwError == WAIT_TIMEOUT)
+			this->nLastError = E_FILESYSMON_NOCHANGE;
+		else this->nLastError = E_FILESYSMON_ERRORDEQUE;
+		return FALSE;
+	}
+
+	// completion key is the changed directory
+	DirInfo* pDir = (DirInfo*) ulKey;
+
+	EnterCriticalSection(&this->csDirs);
+	if (pDir->bClosing) {
+		// last completion of a removed directory (cancelled, or completed before removal)
+		LeaveCriticalSection(&this->csDirs);
+		delete pDir;
+		return TRUE;
+	}
+	// a request that completed with ERROR_NOTIFY_ENUM_DIR means that changes did not fit in the buffer
+	if (!bCompleted && dwError != ERROR_NOTIFY_ENUM_DIR) {
+		this->Fail(pDir, vecChanges);
+		LeaveCriticalSection(&this->csDirs);
+		return TRUE;
+	}
+
+	// swap buffers and re-register current directory for receiving further changes right away,
+	// so that no change occuring while decoding is missed
+	UINT nFilled = pDir->nActive;
+	DWORD dwSize = this->AdaptBufferSize(pDir, dwBytesXFered);
+	pDir->nActive = 1 - nFilled;
+	// on allocation failure, previous buffer is kept
+	pDir->AllocBuffer(pDir->nActive, dwSize);
+	// if the directory cannot be watched any more, the changes of the filled buffer are still delivered, ahead of its failure
+	BOOL bArmed = this->Arm(pDir);
+
+	// dwBytesXFered is 0 if the system could not fit the changes in the buffer: its content is not valid
+	if (dwBytesXFered == 0) {
+		if (!bArmed) this->Fail(pDir, vecChanges);
+		else {
+			++pDir->nOverflows;
+			this->PushChange(vecChanges, pDir->dirPath, FILE_ACTION_OVERFLOW);
+		}
+		LeaveCriticalSection(&this->csDirs);
+		return TRUE;
+	}
+
+	// filled buffer holds latest IO operations
+	// both kinds of records start with NextEntryOffset and Action: only the position of the name (and the file identity) differ
+	LPBYTE pBuff = (LPBYTE) pDir->pBuffs[nFilled];
+	LPBYTE pIter = pBuff;
+	SIZE_T nHeader = (pDir->bExtended) ? offsetof(FS_NOTIFY_EXTENDED_INFORMATION, FileName) : offsetof(FILE_NOTIFY_INFORMATION, FileName);
+	while (pIter) {
+		FILE_NOTIFY_INFORMATION* pInfo = (FILE_NOTIFY_INFORMATION*) pIter;
+		FS_NOTIFY_EXTENDED_INFORMATION* pExtended = (FS_NOTIFY_EXTENDED_INFORMATION*) pIter;
+		// queue new change: full-path is built right in the record (FileName is relative to the directory, and not null-terminated)
+// todo : force conversion to longName
+		if (pDir->bExtended) {
+			FileActionInfo* lpAction = this->PushChange(vecChanges, pDir->dirPath, pDir->dirLength, pExtended->FileName, pExtended->FileNameLength / sizeof(WCHAR), pExtended->Action);
+			if (lpAction) lpAction->SetFileId((ULONGLONG) pExtended->FileId.QuadPart);
+		}
+		else this->PushChange(vecChanges, pDir->dirPath, pDir->dirLength, pInfo->FileName, pInfo->FileNameLength / sizeof(WCHAR), pInfo->Action);
+
+		if(pInfo->NextEntryOffset == 0UL) break;
+
+		pIter += pInfo->NextEntryOffset;
+
+		if ((DWORD)(pIter - pBuff) + nHeader > dwBytesXFered)	{
+			// malformed record : remaining changes are lost
+			++pDir->nOverflows;
+			this->PushChange(vecChanges, pDir->dirPath, FILE_ACTION_OVERFLOW);
+			break;
+		}
+	 }
+	if (!bArmed) this->Fail(pDir, vecChanges);
+	LeaveCriticalSection(&this->csDirs);
+
+	return TRUE;
+}
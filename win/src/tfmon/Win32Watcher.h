@@ -0,0 +1,144 @@
+/* Win32Watcher.h - filesystem events backend based on ReadDirectoryChangesW and an I/O completion port
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+
+	Part of this code is based on the class CFileSysMon, defined in FileSysMon.cpp originally written by H. Seldon (hseldon@veridium.net), December 2010 <http://veridium.net>
+*/
+
+
+#pragma once
+#include <Windows.h>
+#include "WatcherBackend.h"
+
+// notification buffers sizes (in bytes)
+// ReadDirectoryChangesW fails on network drives with buffers larger than 64 KB
+#define MIN_BUFF_SIZE		(256 * sizeof(FILE_NOTIFY_INFORMATION))
+#define MAX_BUFF_SIZE		(64 * 1024)
+// buffers are sized to hold the events expected during that delay (ms) at the observed rate
+#define BUFF_WINDOW			250
+
+/*
+ReadDirectoryChangesExW (Windows 10 1709 and later) can report the identity of the files along with the events.
+It is resolved at runtime, and its records are declared here, so that the monitor still builds with older SDKs and runs on older systems.
+*/
+// ReadDirectoryNotifyExtendedInformation
+#define FS_NOTIFY_EXTENDED_CLASS	2
+
+typedef struct _FS_NOTIFY_EXTENDED_INFORMATION {
+	DWORD			NextEntryOffset;
+	DWORD			Action;
+	LARGE_INTEGER	CreationTime;
+	LARGE_INTEGER	LastModificationTime;
+	LARGE_INTEGER	LastChangeTime;
+	LARGE_INTEGER	LastAccessTime;
+	LARGE_INTEGER	AllocatedLength;
+	LARGE_INTEGER	FileSize;
+	DWORD			FileAttributes;
+	DWORD			ReparsePointTag;
+	LARGE_INTEGER	FileId;
+	LARGE_INTEGER	ParentFileId;
+	DWORD			FileNameLength;
+	WCHAR			FileName[1];
+} FS_NOTIFY_EXTENDED_INFORMATION;
+
+typedef BOOL (WINAPI *READDIRECTORYCHANGESEXW)(HANDLE, LPVOID, DWORD, BOOL, DWORD, LPDWORD, LPOVERLAPPED, LPOVERLAPPED_COMPLETION_ROUTINE, INT);
+
+class DirInfo {
+public:
+	LPWSTR						dirPath;
+	// length of dirPath (which always ends with a separator)
+	SIZE_T						dirLength;
+	OVERLAPPED					ol;
+	HANDLE						hFile;
+	BOOL						bSubTree;
+	// two notification buffers: the system fills the active one while the other one is being decoded
+	FILE_NOTIFY_INFORMATION*	pBuffs[2];
+	DWORD						dwBuffSizes[2];
+	UINT						nActive;
+	// observed events rate (bytes per second, exponentially weighted moving average)
+	DWORD						dwRate;
+	ULONGLONG					ullLastCompletion;
+	// number of times the system could not report all changes
+	UINT						nOverflows;
+	// directory was removed: instance is released when its pending request completes
+	BOOL						bClosing;
+	// watch of the directory failed (hFile is closed, and no request is pending): instance stays until the directory is removed
+	BOOL						bFailed;
+	// buffers hold FS_NOTIFY_EXTENDED_INFORMATION records (decided once, when the directory is added)
+	BOOL						bExtended;
+
+	DirInfo(LPCWSTR dirPath, BOOL bSubTree = FALSE) {
+		this->dirPath	= (LPWSTR) LocalAlloc(LPTR, sizeof(WCHAR)*(wcslen(dirPath)+2));
+		wcscpy(this->dirPath, dirPath);
+		// add separator at the end of the path, if not present
+		if(dirPath[wcslen(dirPath)-1] != '\\') wcscat(this->dirPath, L"\\");
+		this->dirLength	= wcslen(this->dirPath);
+		this->bSubTree	= bSubTree;
+		this->pBuffs[0]	= this->pBuffs[1] = NULL;
+		this->dwBuffSizes[0] = this->dwBuffSizes[1] = 0;
+		this->nActive	= 0;
+		this->dwRate	= 0;
+		this->ullLastCompletion = GetTickCount64();
+		this->nOverflows = 0;
+		this->bClosing = FALSE;
+		this->bFailed = FALSE;
+		this->bExtended = FALSE;
+	}
+
+	~DirInfo() {
+		if (this->pBuffs[0]) LocalFree(this->pBuffs[0]);
+		if (this->pBuffs[1]) LocalFree(this->pBuffs[1]);
+		LocalFree(this->dirPath);
+	}
+
+	/*
+	(Re)allocate one of the buffers. Must not be called on the buffer the system is currently filling.
+	*/
+	BOOL AllocBuffer(UINT nIndex, DWORD dwSize) {
+		if (this->pBuffs[nIndex] && this->dwBuffSizes[nIndex] == dwSize) return TRUE;
+		FILE_NOTIFY_INFORMATION* pBuff = (FILE_NOTIFY_INFORMATION*) LocalAlloc(LPTR, dwSize);
+		if (!pBuff) return FALSE;
+		if (this->pBuffs[nIndex]) LocalFree(this->pBuffs[nIndex]);
+		this->pBuffs[nIndex] = pBuff;
+		this->dwBuffSizes[nIndex] = dwSize;
+		return TRUE;
+	}
+};
+
+
+/*
+Each watched directory is associated with the completion port using its DirInfo as completion key.
+*/
+class Win32Watcher : public WatcherBackend {
+private:
+	HANDLE					hIOCP;
+	vector<DirInfo*>		vecDirs;
+	// guards vecDirs and DirInfo items against concurrent AddPath/RemovePath
+	CRITICAL_SECTION		csDirs;
+	// NULL if the system does not provide it
+	static READDIRECTORYCHANGESEXW	lpfnReadDirectoryChangesEx;
+
+	BOOL					Arm(DirInfo* pDir);
+	void					Fail(DirInfo* pDir, vector<FileActionInfo*>* vecChanges);
+	DWORD					AdaptBufferSize(DirInfo* pDir, DWORD dwBytesXFered);
+
+public:
+	Win32Watcher();
+	~Win32Watcher();
+
+	BOOL Init();
+	WatcherBackend* NewInstance() { return new Win32Watcher(); }
+
+	INT AddPath(LPCWSTR pPath, BOOL bSubTree);
+	void RemovePath(UINT nIndex);
+	void RemoveAllPaths();
+
+	CHAR GetDrive(LPCWSTR pPath);
+	UINT GetOverflowCount(UINT nIndex);
+	BOOL IsFailed(UINT nIndex);
+
+	BOOL FetchChanges(vector<FileActionInfo*>* vecChanges);
+	void Interrupt();
+};
@@ -0,0 +1,286 @@
+/* fscompat.h - minimal subset of the win32 API used by the filesystem monitoring core
+
+    This file is part of the tagger-ui suite <http://www.github.com/cedricfrancoys/tagger-ui>
+    Copyright (C) Cedric Francoys, 2016, Yegen
+    Some Right Reserved, GNU GPL 3 license <http://www.gnu.org/licenses/>
+
+	The event correlation code (FSChangeNotifier, FileActionQueue, FileActionInfo) is written against the win32 API.
+	On Windows this header simply includes windows.h.
+	On POSIX systems it maps the few types and functions the core relies on to their pthread/libc equivalents,
+	so that the same correlation code can be run headless (see linux/src/tfwatch).
+*/
+
+
+#pragma once
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#define FS_PATH_SEPARATOR	L'\\'
+
+#else
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <string>
+
+#define FS_PATH_SEPARATOR	L'/'
+
+#define WINAPI
+#define TRUE				1
+#define FALSE				0
+#define INFINITE			0xFFFFFFFF
+
+typedef int					BOOL;
+typedef int					INT;
+typedef unsigned int		UINT;
+typedef uint32_t			DWORD;
+typedef int32_t				LONG;
+typedef int64_t				LONGLONG;
+typedef uint64_t			ULONGLONG;
+typedef uintptr_t			ULONG_PTR;
+typedef size_t				SIZE_T;
+typedef unsigned char		BYTE;
+typedef BYTE*				LPBYTE;
+typedef char				CHAR;
+typedef CHAR*				PCHAR;
+typedef wchar_t				WCHAR;
+typedef WCHAR*				LPWSTR;
+typedef const WCHAR*		LPCWSTR;
+typedef void*				LPVOID;
+typedef void*				HANDLE;
+
+// constants defined in winnt.h
+#define FILE_ACTION_ADDED					0x00000001
+#define FILE_ACTION_REMOVED					0x00000002
+#define FILE_ACTION_MODIFIED				0x00000003
+#define FILE_ACTION_RENAMED_OLD_NAME		0x00000004
+#define FILE_ACTION_RENAMED_NEW_NAME		0x00000005
+
+// memory allocation (LPTR and GPTR both mean zero-initialized fixed memory)
+#define LPTR	0x0040
+#define GPTR	0x0040
+
+inline LPVOID LocalAlloc(UINT, SIZE_T uBytes)	{ return calloc(1, uBytes); }
+inline LPVOID LocalFree(LPVOID hMem)			{ free(hMem); return NULL; }
+inline LPVOID GlobalAlloc(UINT, SIZE_T uBytes)	{ return calloc(1, uBytes); }
+inline LPVOID GlobalFree(LPVOID hMem)			{ free(hMem); return NULL; }
+
+// strings
+#define _wcsicmp	wcscasecmp
+#define wcsicmp		wcscasecmp
+#define _wcsnicmp	wcsncasecmp
+
+inline DWORD GetLastError() { return (DWORD) errno; }
+
+// interlocked operations and memory barrier (full barriers, as their win32 counterparts)
+inline void MemoryBarrier()									{ __sync_synchronize(); }
+inline LONG InterlockedIncrement(volatile LONG* lpAddend)	{ return __sync_add_and_fetch(lpAddend, 1); }
+inline LONG InterlockedDecrement(volatile LONG* lpAddend)	{ return __sync_sub_and_fetch(lpAddend, 1); }
+inline LONG InterlockedCompareExchange(volatile LONG* lpDestination, LONG lExchange, LONG lComparand) {
+	return __sync_val_compare_and_swap(lpDestination, lComparand, lExchange);
+}
+
+// critical sections
+typedef pthread_mutex_t		CRITICAL_SECTION;
+typedef CRITICAL_SECTION*	LPCRITICAL_SECTION;
+
+inline void InitializeCriticalSection(LPCRITICAL_SECTION lpcs) {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	// win32 critical sections are re-entrant
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(lpcs, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+inline void EnterCriticalSection(LPCRITICAL_SECTION lpcs)	{ pthread_mutex_lock(lpcs); }
+inline void LeaveCriticalSection(LPCRITICAL_SECTION lpcs)	{ pthread_mutex_unlock(lpcs); }
+inline void DeleteCriticalSection(LPCRITICAL_SECTION lpcs)	{ pthread_mutex_destroy(lpcs); }
+
+// condition variables (available since Windows Vista)
+typedef pthread_cond_t		CONDITION_VARIABLE;
+typedef CONDITION_VARIABLE*	PCONDITION_VARIABLE;
+
+inline void InitializeConditionVariable(PCONDITION_VARIABLE lpcv) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(lpcv, &attr);
+	pthread_condattr_destroy(&attr);
+}
+inline void WakeConditionVariable(PCONDITION_VARIABLE lpcv)		{ pthread_cond_signal(lpcv); }
+inline void WakeAllConditionVariable(PCONDITION_VARIABLE lpcv)	{ pthread_cond_broadcast(lpcv); }
+
+/* Returns FALSE if the timeout elapsed. Critical section must have been entered exactly once by the caller.
+*/
+inline BOOL SleepConditionVariableCS(PCONDITION_VARIABLE lpcv, LPCRITICAL_SECTION lpcs, DWORD dwMilliseconds) {
+	if(dwMilliseconds == INFINITE) return pthread_cond_wait(lpcv, lpcs) == 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += dwMilliseconds / 1000;
+	ts.tv_nsec += (long) (dwMilliseconds % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return pthread_cond_timedwait(lpcv, lpcs, &ts) == 0;
+}
+
+// timing
+inline void Sleep(DWORD dwMilliseconds) {
+	struct timespec ts = { (time_t) (dwMilliseconds / 1000), (long) (dwMilliseconds % 1000) * 1000000L };
+	while(nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+inline ULONGLONG GetTickCount64() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ULONGLONG) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+typedef union {
+	struct {
+		DWORD	LowPart;
+		LONG	HighPart;
+	};
+	LONGLONG	QuadPart;
+} LARGE_INTEGER;
+
+// performance counter has a nanosecond resolution
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* lpFrequency) {
+	lpFrequency->QuadPart = 1000000000LL;
+	return TRUE;
+}
+
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER* lpPerformanceCount) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	lpPerformanceCount->QuadPart = (LONGLONG) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	return TRUE;
+}
+
+// threads
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpThreadParameter);
+
+struct FSCOMPAT_THREAD {
+	pthread_t				thread;
+	BOOL					bJoined;
+};
+
+struct FSCOMPAT_THREAD_START {
+	LPTHREAD_START_ROUTINE	lpStartAddress;
+	LPVOID					lpParameter;
+};
+
+inline void* FSCompat_ThreadProc(void* lpvd) {
+	// start block is owned by the thread (the handle might be closed before the thread even runs)
+	FSCOMPAT_THREAD_START start = *(FSCOMPAT_THREAD_START*) lpvd;
+	delete (FSCOMPAT_THREAD_START*) lpvd;
+	return (void*) (ULONG_PTR) start.lpStartAddress(start.lpParameter);
+}
+
+/* Only the arguments actually used by the monitoring core are honoured (start routine and parameter).
+*/
+inline HANDLE CreateThread(LPVOID, SIZE_T, LPTHREAD_START_ROUTINE lpStartAddress, LPVOID lpParameter, DWORD, DWORD*) {
+	FSCOMPAT_THREAD* lpThread = new FSCOMPAT_THREAD;
+	FSCOMPAT_THREAD_START* lpStart = new FSCOMPAT_THREAD_START;
+	lpStart->lpStartAddress = lpStartAddress;
+	lpStart->lpParameter = lpParameter;
+	lpThread->bJoined = FALSE;
+	if(pthread_create(&lpThread->thread, NULL, FSCompat_ThreadProc, lpStart) != 0) {
+		delete lpStart;
+		delete lpThread;
+		return NULL;
+	}
+	return (HANDLE) lpThread;
+}
+
+/* Only thread handles are supported, and only an INFINITE timeout.
+*/
+inline DWORD WaitForSingleObject(HANDLE hHandle, DWORD) {
+	FSCOMPAT_THREAD* lpThread = (FSCOMPAT_THREAD*) hHandle;
+	if(lpThread && !lpThread->bJoined) {
+		pthread_join(lpThread->thread, NULL);
+		lpThread->bJoined = TRUE;
+	}
+	return 0;
+}
+
+inline BOOL CloseHandle(HANDLE hHandle) {
+	FSCOMPAT_THREAD* lpThread = (FSCOMPAT_THREAD*) hHandle;
+	if(!lpThread) return FALSE;
+	// closing the handle of a running thread does not terminate it
+	if(!lpThread->bJoined) pthread_detach(lpThread->thread);
+	delete lpThread;
+	return TRUE;
+}
+
+/* Convert a wide-character string (UTF-32 on POSIX systems) to an UTF-8 encoded string (as expected by the kernel).
+*/
+inline std::string WCHARtoUTF8(LPCWSTR wstr) {
+	std::string result;
+	for(; *wstr; ++wstr) {
+		DWORD c = (DWORD) *wstr;
+		if(c < 0x80) {
+			result += (char) c;
+		}
+		else if(c < 0x800) {
+			result += (char) (0xC0 | (c >> 6));
+			result += (char) (0x80 | (c & 0x3F));
+		}
+		else if(c < 0x10000) {
+			result += (char) (0xE0 | (c >> 12));
+			result += (char) (0x80 | ((c >> 6) & 0x3F));
+			result += (char) (0x80 | (c & 0x3F));
+		}
+		else {
+			result += (char) (0xF0 | (c >> 18));
+			result += (char) (0x80 | ((c >> 12) & 0x3F));
+			result += (char) (0x80 | ((c >> 6) & 0x3F));
+			result += (char) (0x80 | (c & 0x3F));
+		}
+	}
+	return result;
+}
+
+/* Convert an UTF-8 encoded string to a wide-character string (appended to result, so that its buffer can be reused).
+ Invalid sequences are decoded byte by byte (latin-1), so that no file name is ever lost.
+*/
+inline void UTF8toWCHAR(const char* str, SIZE_T len, std::wstring* result) {
+	const unsigned char* p = (const unsigned char*) str;
+	const unsigned char* end = (len == (SIZE_T) -1) ? p + strlen(str) : p + len;
+	while(p < end) {
+		DWORD c = *p;
+		int n = (c >= 0xF0 && c < 0xF8) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+		if(c >= 0xF8 || (n && p + n >= end)) n = 0;
+		if(n) {
+			DWORD cp = c & (0x3F >> n);
+			int i;
+			for(i = 1; i <= n && (p[i] & 0xC0) == 0x80; ++i) cp = (cp << 6) | (p[i] & 0x3F);
+			if(i > n) {
+				*result += (WCHAR) cp;
+				p += n + 1;
+				continue;
+			}
+		}
+		*result += (WCHAR) c;
+		++p;
+	}
+}
+
+inline std::wstring UTF8toWCHAR(const char* str, SIZE_T len = (SIZE_T) -1) {
+	std::wstring result;
+	UTF8toWCHAR(str, len, &result);
+	return result;
+}
+
+#endif
@@ -18,6 +18,12 @@
 
 #include "tfmon.h" 
 #include "FSChangeNotifier.h"
+#include "StatPool.h"
+#include "Reconciler.h"
+#include "ConsistencyScanner.h"
+#include "TaggedPathIndex.h"
+#include "TaggerJob.h"
+#include "TrashIndex.h"
 
 
 #include "../commons/eventlistener.h" 
@@ -49,6 +55,24 @@ HWND hWndSettings;
 HWND hWndAbout;
 
 DWORD WM_NOTIFYICON = RegisterWindowMessage(L"TaggerNotifyIcon");
+// posted by the reconciler thread (wParam: root, lParam: ScanBatch of tagged paths no longer present, and beyond the deletion cap)
+DWORD WM_RECONCILED = RegisterWindowMessage(L"TaggerReconciled");
+// posted by the scanner thread (wParam: batch of results)
+DWORD WM_SCANNED = RegisterWindowMessage(L"TaggerScanned");
+
+
+// paths known to the tagger database: changes on other paths are not handed to tagger
+TaggedPathIndex taggedIndex;
+// index could be built (otherwise, every change is handed to tagger)
+BOOL bTaggedIndex = FALSE;
+// last write time of the tagger database when the index was last synchronized with it
+ULONGLONG ullTaggedStamp = 0;
+// delay (ms) between two checks of the tagger database for changes made by other applications (i.e. tftag)
+#define TAGGED_INDEX_CHECK_DELAY	2000
+// only the directories holding tagged files are watched (instead of whole drives)
+BOOL bWatchTagged = FALSE;
+// maximum number of directories watched with their subtree (beyond that, the deepest ones are merged into their parent)
+#define TAGGED_COVER_MAX_ROOTS		64
 
 
 // custom structure for holding settings data used during initialization
@@ -67,6 +91,44 @@ BOOL initDialogAbout();
 
 
 BOOL StartMonitoring();
+void watchDrives();
+void applyWatchPlan(const vector<wstring>& vecPaths);
+
+// existence of the tagged files is checked by a single pool of worker threads, shared by the reconciler and the scanner
+StatPool statPool;
+
+// reconciler callbacks (invoked from the reconciler thread)
+BOOL reconcileList(LPCWSTR rootPath, vector<wstring>* vecPaths, LPVOID lpParam);
+void reconcileMissing(LPCWSTR rootPath, vector<wstring>* vecMissing, vector<wstring>* vecExcess, LPVOID lpParam);
+
+// roots for which events were lost are re-checked against tagger DB
+Reconciler reconciler(reconcileList, reconcileMissing, &statPool);
+
+// scanner callbacks (invoked from the scanner thread)
+BOOL scanList(vector<wstring>* vecPaths, LPVOID lpParam);
+void scanStale(ScanBatch* lpBatch, LPVOID lpParam);
+DWORD scanIdle(LPVOID lpParam);
+
+// whatever was missed anyway (i.e. changes made while tfmon was not running) is caught by periodic sweeps over the tagged files
+ConsistencyScanner scanner(scanList, scanStale, &statPool, scanIdle);
+
+// index of tagged paths
+void refreshTaggedIndex(BOOL bForce);
+void ackTaggedIndex();
+
+// updates of the tagger database, handed to tagger by batches of files
+void runTagger(LPCWSTR command, LPVOID lpParam);
+BOOL knowsTagged(LPCWSTR filePath, LPVOID lpParam);
+TaggerBatch taggerBatch(runTagger, knowsTagged);
+// tagged files removed toward a recycle bin: a restored file is recovered without asking tagger whether it was tagged
+// (kept across runs in the local application data directory, which is not monitored)
+TrashIndex trashIndex;
+wstring trashIndexPath;
+LPCWSTR findRecycleBin(LPCWSTR path);
+BOOL isRecycleBinEmpty(LPCWSTR binPath);
+void listTagged(LPCWSTR path, BOOL bSubtree, vector<wstring>* vecFiles);
+UINT runJob(TaggerJob* lpJob);
+void runDeferred(BOOL bAll);
 
 void appendLog(UINT type, LPCWSTR str, BOOL isCommand=false);
 
@@ -77,7 +139,11 @@ void notifyIcon(HWND, WPARAM, LPARAM);
 void fileMove(HWND, WPARAM, LPARAM);
 void fileRemove(HWND, WPARAM, LPARAM);
 void fileRestore(HWND, WPARAM, LPARAM);
+void fileOverflow(HWND, WPARAM, LPARAM);
+void filesReconciled(HWND, WPARAM, LPARAM);
+void filesScanned(HWND, WPARAM, LPARAM);
 void watcherStopped(HWND, WPARAM, LPARAM);
+void timerElapsed(HWND, WPARAM, LPARAM);
 // dialogs callbacks
 void closeDialog(HWND, WPARAM, LPARAM);
 // context menu handlers
@@ -128,7 +194,11 @@ int WINAPI WinMain(HINSTANCE hInstance,	HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	wndEventListener->bind(hWnd, 0, WM_FSNOTIFY_MOVED, fileMove);
 	wndEventListener->bind(hWnd, 0, WM_FSNOTIFY_REMOVED, fileRemove);
 	wndEventListener->bind(hWnd, 0, WM_FSNOTIFY_RESTORED, fileRestore);
+	wndEventListener->bind(hWnd, 0, WM_FSNOTIFY_OVERFLOW, fileOverflow);
+	wndEventListener->bind(hWnd, 0, WM_RECONCILED, filesReconciled);
+	wndEventListener->bind(hWnd, 0, WM_SCANNED, filesScanned);
 	wndEventListener->bind(hWnd, 0, WM_FSNOTIFY_STOP, watcherStopped);
+	wndEventListener->bind(hWnd, 0, WM_TIMER, timerElapsed);
 	
 	// menu events
 	wndEventListener->bind(hWnd, IDD_DIALOG_ACTIVITY, 0, menuActivityLog);
@@ -191,11 +261,44 @@ BOOL StartMonitoring() {
 	wsprintf(outputBuff, L"tagger.exe version: %s", Settings.taggerVersion);
 	appendLog(ID_LOG_APP, outputBuff);
 
+	// optional number of files handed to a single invocation of tagger (HKLM/SOFTWARE/TaggerUI/Tagger_Batch_Size, DWORD)
+	// (1 by default: only a version of tagger that takes several files per command can be given more)
+	LPDWORD lpBatchSize = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Tagger_Batch_Size");
+	taggerBatch.SetCommand(Settings.taggerCommandLinePath);
+	taggerBatch.SetBatchSize(lpBatchSize ? *lpBatchSize : TAGGER_BATCH_SIZE);
+	if(lpBatchSize) LocalFree(lpBatchSize);
+	wsprintf(outputBuff, L"Files handed to tagger by batches of %u", taggerBatch.GetBatchSize());
+	appendLog(ID_LOG_APP, outputBuff);
+
+	// directories handed to tagger as prefix operations, unless disabled (HKLM/SOFTWARE/TaggerUI/Tagger_Prefix_Ops, DWORD, 0 to disable)
+	// (the first one is checked: with a version of tagger that does not support them, files are handed over one by one)
+	LPDWORD lpPrefixOps = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Tagger_Prefix_Ops");
+	taggerBatch.SetPrefixEnabled(!lpPrefixOps || *lpPrefixOps);
+	if(lpPrefixOps) LocalFree(lpPrefixOps);
+	if(taggerBatch.GetPrefixState() == TAGGER_PREFIX_UNSUPPORTED) appendLog(ID_LOG_APP, L"Tagged files below a directory handed to tagger one by one");
+	else appendLog(ID_LOG_APP, L"Tagged files below a directory handed to tagger as a single prefix operation");
+
+	// optional cap on the invocations of tagger (HKLM/SOFTWARE/TaggerUI/Tagger_Rate per second, and Tagger_Burst at once, DWORD values, 0 for no limit)
+	// invocations beyond it are deferred
+	LPDWORD lpRate = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Tagger_Rate");
+	LPDWORD lpBurst = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Tagger_Burst");
+	taggerBatch.SetRateLimit(lpRate ? *lpRate : TAGGER_RATE, lpBurst ? *lpBurst : TAGGER_BURST);
+	wsprintf(outputBuff, L"Tagger invoked at most %u time(s) per second (%u at once)", lpRate ? *lpRate : TAGGER_RATE, lpBurst ? *lpBurst : TAGGER_BURST);
+	appendLog(ID_LOG_APP, outputBuff);
+	if(lpRate) LocalFree(lpRate);
+	if(lpBurst) LocalFree(lpBurst);
+
 	appendLog(ID_LOG_APP, L"Retrieved drives and recycle bins:", true);
 // todo : check settings to know which kind of drives user wants to be watched
 
 
-	// retrieve environment data
+	// retrieve environment data (previous data is released on restart)
+	if(Settings.lpDrivesInfos) {
+		for(UINT i = 0; i < Settings.nDrives; ++i) {
+			LocalFree(Settings.lpDrivesInfos[i]);
+		}
+		LocalFree(Settings.lpDrivesInfos);
+	}
 	Settings.lpDrivesInfos = (LPDRIVEINFO*) LocalAlloc(LPTR, sizeof(LPDRIVEINFO)*26);
 	Settings.nDrives = 0;
 
@@ -246,25 +349,95 @@ BOOL StartMonitoring() {
 
 	FSChangeNotifier* lpNotifier = FSChangeNotifier::GetInstance();
 
-	// initialize change watcher
+	// initialize change watcher (no effect if already initialized)
 	if (!lpNotifier->Init()) {
 		MessageBox(0, L"Initialization Error", NULL, MB_ICONERROR);
 		return FALSE;
 	}
 
-	// add drives to watch list
-	appendLog(ID_LOG_APP, L"Drive(s) supported for monitoring:", true);
+	// optional recording of raw events (HKLM/SOFTWARE/TaggerUI/Capture_File), to be replayed with tfwatch
+	// (on restart, a capture going on to the same file is not interrupted)
+	static wstring currentCapture;
+	LPWSTR capturePath = (LPWSTR) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Capture_File");
+	if(capturePath && wcslen(capturePath)) {
+		if(currentCapture == capturePath) wsprintf(outputBuff, L"Capturing raw events to %s", capturePath);
+		else if(lpNotifier->StartCapture(capturePath)) {
+			currentCapture = capturePath;
+			wsprintf(outputBuff, L"Capturing raw events to %s", capturePath);
+		}
+		else {
+			currentCapture.clear();
+			wsprintf(outputBuff, L"Unable to open capture file %s", capturePath);
+		}
+		appendLog(ID_LOG_APP, outputBuff);
+	}
+	else {
+		currentCapture.clear();
+		lpNotifier->StopCapture();
+	}
+	if(capturePath) LocalFree(capturePath);
+
+	// optional coalescing window in ms (HKLM/SOFTWARE/TaggerUI/Coalescing_Window, DWORD): chains of changes are handed to tagger as their net effect
+	// (removals are notified FS_REMOVAL_DELAY after they occur: a shorter window does not fold them)
+	LPDWORD lpWindow = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Coalescing_Window");
+	lpNotifier->SetCoalescingWindow(lpWindow ? *lpWindow : 0);
+	if(lpWindow) {
+		wsprintf(outputBuff, L"Coalescing changes over %u ms", *lpWindow);
+		appendLog(ID_LOG_APP, outputBuff);
+		LocalFree(lpWindow);
+	}
+
+	// optional limits on the 'added' events kept as possible targets of a move from another volume
+	// (HKLM/SOFTWARE/TaggerUI/Pending_TTL in seconds, and Pending_Max, DWORD values, 0 for no limit)
+	LPDWORD lpTTL = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Pending_TTL");
+	LPDWORD lpMaxPending = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Pending_Max");
+	lpNotifier->SetPendingLimits(lpTTL ? *lpTTL : FS_PENDING_TTL, lpMaxPending ? *lpMaxPending : FS_PENDING_MAX);
+	UINT nPending, nExpired, nEvicted;
+	lpNotifier->GetPendingStats(&nPending, &nExpired, &nEvicted);
+	wsprintf(outputBuff, L"Unmatched added events kept for %u s (at most %u): %u pending, %u expired, %u evicted",
+		lpTTL ? *lpTTL : FS_PENDING_TTL, lpMaxPending ? *lpMaxPending : FS_PENDING_MAX, nPending, nExpired, nEvicted);
+	appendLog(ID_LOG_APP, outputBuff);
+	if(lpTTL) LocalFree(lpTTL);
+	if(lpMaxPending) LocalFree(lpMaxPending);
+
+	// optional event storm limits (HKLM/SOFTWARE/TaggerUI/Storm_Threshold in events per second, 0 to disable, and Storm_Quiet in ms, DWORD values):
+	// events of a subtree going over the threshold are suspended, and the subtree is reconciled once quiet
+	LPDWORD lpThreshold = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Storm_Threshold");
+	LPDWORD lpQuiet = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Storm_Quiet");
+	lpNotifier->SetStormLimits((lpThreshold ? *lpThreshold : FS_STORM_THRESHOLD) * FS_STORM_PERIOD / 1000, lpQuiet ? *lpQuiet : FS_STORM_QUIET);
+	wsprintf(outputBuff, L"Subtrees quarantined above %u events per second, until quiet for %u ms", lpThreshold ? *lpThreshold : FS_STORM_THRESHOLD, lpQuiet ? *lpQuiet : FS_STORM_QUIET);
+	appendLog(ID_LOG_APP, outputBuff);
+	if(lpThreshold) LocalFree(lpThreshold);
+	if(lpQuiet) LocalFree(lpQuiet);
+
+	// removals toward the recycle bin of a drive are told apart from actual deletions (exact paths, as retrieved for each drive)
+	vector<wstring> vecBins;
 	for(UINT i = 0; i < Settings.nDrives; ++i) {
-// todo : improve check to accept all theorically supported filesystems (NTFS, SMB 3+, CsvFS, ReFS)
-		if(wcsicmp(Settings.lpDrivesInfos[i]->szFileSystem, L"NTFS") == 0) {
-			if (lpNotifier->AddPath(Settings.lpDrivesInfos[i]->szDrive) == E_FILESYSMON_SUCCESS) {
-				wsprintf(outputBuff, L"%s", Settings.lpDrivesInfos[i]->szDrive);
-				appendLog(ID_LOG_APP, outputBuff);
-				continue;
-			}
-		}		
-		// wsprintf(outputBuff, L"Error adding drive %s to monitoring list", Settings.lpDrivesInfos[i]->szDrive);
-		// appendLog(ID_LOG_APP, outputBuff);
+		if(wcslen(Settings.lpDrivesInfos[i]->szRecycleBinPath)) vecBins.push_back(Settings.lpDrivesInfos[i]->szRecycleBinPath);
+	}
+	lpNotifier->SetRecycleBins(vecBins);
+	// files that went to them during previous runs (on restart, the index in memory is already up to date)
+	if(trashIndexPath.empty()) {
+		trashIndexPath = wstring(WinEnv_GetFolderPath(CSIDL_LOCAL_APPDATA)) + L"\\tfmon_trash.txt";
+		trashIndex.Load(trashIndexPath.c_str());
+	}
+	wsprintf(outputBuff, L"Tagged files known to be in a recycle bin: %u", trashIndex.GetCount());
+	appendLog(ID_LOG_APP, outputBuff);
+
+	// optional restriction of the watched paths to the directories holding tagged files (HKLM/SOFTWARE/TaggerUI/Watch_Tagged_Only, DWORD)
+	LPDWORD lpTaggedOnly = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Watch_Tagged_Only");
+	bWatchTagged = (lpTaggedOnly && *lpTaggedOnly);
+	if(lpTaggedOnly) LocalFree(lpTaggedOnly);
+
+	// changes are only handed to tagger for the paths it knows (in restricted mode, this also sets the watched paths)
+	refreshTaggedIndex(TRUE);
+	if(bWatchTagged) {
+		// tags added by other applications extend the watched paths
+		SetTimer(hWnd, ID_TIMER_TAGGED_INDEX, TAGGED_INDEX_CHECK_DELAY, NULL);
+	}
+	else {
+		KillTimer(hWnd, ID_TIMER_TAGGED_INDEX);
+		watchDrives();
 	}
 
 	appendLog(ID_LOG_APP, L"Path(s) excluded from monitoring:", true);
@@ -283,6 +456,15 @@ BOOL StartMonitoring() {
 	appendLog(ID_LOG_APP, WinEnv_GetFolderPath(CSIDL_MYTEMP));
 	appendLog(ID_LOG_APP, WinEnv_GetFolderPath(CSIDL_LOCAL_APPDATA));
 	appendLog(ID_LOG_APP, outputBuff);
+	// additional directories or glob patterns (HKLM/SOFTWARE/TaggerUI/Excluded_Paths, REG_MULTI_SZ), i.e. *.tmp or **\node_modules\**
+	LPWSTR lpExcluded = (LPWSTR) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Excluded_Paths");
+	if(lpExcluded) {
+		for(LPWSTR lpItem = lpExcluded; *lpItem; lpItem += wcslen(lpItem) + 1) {
+			lpNotifier->AddExclusion(lpItem);
+			appendLog(ID_LOG_APP, lpItem);
+		}
+		LocalFree(lpExcluded);
+	}
 
 	
 	// bind main window with notifier
@@ -294,10 +476,121 @@ BOOL StartMonitoring() {
 		MessageBox(0, L"Initialization Error", NULL, MB_ICONERROR);
 		return FALSE;
 	}
+	statPool.Start();
+	reconciler.Start();
+
+	// optional limits of the background scan (HKLM/SOFTWARE/TaggerUI/Scan_Rate in files per second, 0 for no limit, Scan_Idle in seconds
+	// without user input, 0 to ignore the user, Scan_Period in minutes between two sweeps, 0 to disable the scan,
+	// and Scan_Max_Deletions, missing files deleted from the database per sweep, DWORD values)
+	LPDWORD lpScanRate = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Scan_Rate");
+	LPDWORD lpScanIdle = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Scan_Idle");
+	LPDWORD lpScanPeriod = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Scan_Period");
+	LPDWORD lpScanDeletions = (LPDWORD) Registry_Read(HKEY_LOCAL_MACHINE, L"SOFTWARE\\TaggerUI", L"Scan_Max_Deletions");
+	UINT nScanRate = lpScanRate ? *lpScanRate : SCAN_RATE;
+	UINT nScanDeletions = lpScanDeletions ? *lpScanDeletions : SCAN_MAX_DELETIONS;
+	DWORD dwScanIdle = lpScanIdle ? *lpScanIdle * 1000 : SCAN_IDLE;
+	DWORD dwScanPeriod = lpScanPeriod ? *lpScanPeriod * 60000 : SCAN_PERIOD;
+	if(lpScanRate) LocalFree(lpScanRate);
+	if(lpScanIdle) LocalFree(lpScanIdle);
+	if(lpScanPeriod) LocalFree(lpScanPeriod);
+	if(lpScanDeletions) LocalFree(lpScanDeletions);
+	// the same cap applies to each pass of the reconciler
+	reconciler.SetMaxDeletions(nScanDeletions);
+	if(dwScanPeriod) {
+		scanner.SetLimits(nScanRate, dwScanIdle, dwScanPeriod, nScanDeletions);
+		scanner.Start();
+		wsprintf(outputBuff, L"Tagged files checked every %u min, %u per second, after %u s without user input", dwScanPeriod / 60000, nScanRate, dwScanIdle / 1000);
+		appendLog(ID_LOG_APP, outputBuff);
+		wsprintf(outputBuff, L"Missing files deleted from the database: at most %u per sweep", nScanDeletions);
+		appendLog(ID_LOG_APP, outputBuff);
+	}
+	else appendLog(ID_LOG_APP, L"Background scan of the tagged files disabled");
 
 	return TRUE;
 }
 
+/*
+Watch the supported drives, along with their subtree.
+*/
+void watchDrives() {
+	WCHAR outputBuff[1024];
+	FSChangeNotifier* lpNotifier = FSChangeNotifier::GetInstance();
+
+	// add drives to watch list (drives already watched are left untouched)
+	appendLog(ID_LOG_APP, L"Drive(s) supported for monitoring:", true);
+	vector<wstring> vecDrives;
+	for(UINT i = 0; i < Settings.nDrives; ++i) {
+// todo : improve check to accept all theorically supported filesystems (NTFS, SMB 3+, CsvFS, ReFS)
+		if(wcsicmp(Settings.lpDrivesInfos[i]->szFileSystem, L"NTFS") == 0) {
+			if (lpNotifier->AddPath(Settings.lpDrivesInfos[i]->szDrive) == E_FILESYSMON_SUCCESS) {
+				vecDrives.push_back(Settings.lpDrivesInfos[i]->szDrive);
+				wsprintf(outputBuff, L"%s", Settings.lpDrivesInfos[i]->szDrive);
+				appendLog(ID_LOG_APP, outputBuff);
+				continue;
+			}
+		}		
+		// wsprintf(outputBuff, L"Error adding drive %s to monitoring list", Settings.lpDrivesInfos[i]->szDrive);
+		// appendLog(ID_LOG_APP, outputBuff);
+	}
+	// release drives that are no longer available
+	for(INT i = lpNotifier->GetPathCount() - 1; i >= 0; --i) {
+		BOOL bFound = FALSE;
+		for(UINT j = 0; !bFound && j < vecDrives.size(); ++j) {
+			if(wcsicmp(lpNotifier->GetPath(i), vecDrives[j].c_str()) == 0) bFound = TRUE;
+		}
+		if(!bFound) lpNotifier->RemovePath((UINT) i);
+	}
+}
+
+/*
+Watch only the directories holding tagged files (with their subtree), and the directories above them (without it):
+the latter show when a watched directory is moved or removed along with one of its parents.
+Files moved out of the watched directories are seen as removed (their tags can still be recovered).
+*/
+void applyWatchPlan(const vector<wstring>& vecPaths) {
+	static WCHAR buff[4192];
+	FSChangeNotifier* lpNotifier = FSChangeNotifier::GetInstance();
+	vector<wstring> vecRoots, vecGuards;
+	TaggedPathIndex::GetCoveringDirs(vecPaths, TAGGED_COVER_MAX_ROOTS, &vecRoots);
+	TaggedPathIndex::GetAncestorDirs(vecRoots, &vecGuards);
+
+	// new directories are watched before the ones no longer needed are released, so that no change is missed in-between
+	for(UINT i = 0, uiCount = vecRoots.size(); i < uiCount; ++i) {
+		lpNotifier->AddPath(vecRoots[i].c_str(), TRUE);
+	}
+	for(INT i = lpNotifier->GetPathCount() - 1; i >= 0; --i) {
+		vector<wstring>* vecPlan = lpNotifier->IsSubTree(i) ? &vecRoots : &vecGuards;
+		BOOL bFound = FALSE;
+		for(UINT j = 0, uiCount = vecPlan->size(); !bFound && j < uiCount; ++j) {
+			if(wcsicmp(lpNotifier->GetPath(i), vecPlan->at(j).c_str()) == 0) bFound = TRUE;
+		}
+		if(bFound) continue;
+		// directories lying within a released subtree were not added above (they were covered by it): they are watched before it is released
+		vector<wstring> vecCovered;
+		wstring path = lpNotifier->GetPath(i);
+		UINT nLen = path.size();
+		for(UINT j = 0, uiCount = vecRoots.size(); lpNotifier->IsSubTree(i) && j < uiCount; ++j) {
+			LPCWSTR root = vecRoots[j].c_str();
+			if(nLen && _wcsnicmp(root, path.c_str(), nLen) == 0 && (path[nLen-1] == L'\\' || root[nLen] == L'\\')) vecCovered.push_back(vecRoots[j]);
+		}
+		if(vecCovered.empty()) lpNotifier->RemovePath((UINT) i);
+		else lpNotifier->ReplacePath(path.c_str(), vecCovered, TRUE);
+	}
+	// guards lying within a released subtree were not added above either
+	for(UINT i = 0, uiCount = vecRoots.size(); i < uiCount; ++i) {
+		lpNotifier->AddPath(vecRoots[i].c_str(), TRUE);
+	}
+	for(UINT i = 0, uiCount = vecGuards.size(); i < uiCount; ++i) {
+		lpNotifier->AddPath(vecGuards[i].c_str(), FALSE);
+	}
+
+	wsprintf(buff, L"Watching %u directory(ies) holding tagged files:", vecRoots.size());
+	appendLog(ID_LOG_APP, buff, true);
+	for(UINT i = 0, uiCount = vecRoots.size(); i < uiCount; ++i) {
+		appendLog(ID_LOG_APP, vecRoots[i].c_str());
+	}
+}
+
 
 BOOL initApp() {
 	Settings.taggerCommandLinePath = NULL;
@@ -396,15 +689,155 @@ BOOL initDialogAbout() {
 	return TRUE;
 }
 
+/*
+Run a tagger command line (invoked by taggerBatch, once per batch).
+*/
+void runTagger(LPCWSTR command, LPVOID lpParam) {
+	LPWSTR output = DosExec((LPWSTR) command);
+	appendLog(ID_LOG_TAGGER, command, true);
+	appendLog(ID_LOG_TAGGER, output);
+	LocalFree(output);
+}
+
+/*
+Check whether tagger has an entry for given file (invoked by taggerBatch, after its first prefix operation).
+Unlike listTagged, it does not account for the deferred invocations: the database itself is checked, right after the prefix operation ran.
+*/
+BOOL knowsTagged(LPCWSTR filePath, LPVOID lpParam) {
+	wstring command = wstring(Settings.taggerCommandLinePath) + L" --quiet --files list \"" + filePath + L"*\"";
+	LPWSTR output = DosExec((LPWSTR) command.c_str());
+	appendLog(ID_LOG_TAGGER, command.c_str(), true);
+	if(!output) return FALSE;
+	BOOL result = FALSE;
+	LPWSTR context = NULL;
+	for(LPWSTR line = wcstok_s(output, L"\n", &context); !result && line; line = wcstok_s(NULL, L"\n", &context)) {
+		SIZE_T len = wcslen(line);
+		if(len && line[len-1] == '\r') line[--len] = '\0';
+		if(_wcsicmp(line, filePath) == 0) result = TRUE;
+	}
+	LocalFree(output);
+	return result;
+}
+
+/*
+Log the outcome of the check of the first prefix operation, once known.
+*/
+void logPrefixState(DWORD dwBefore) {
+	if(dwBefore != TAGGER_PREFIX_UNKNOWN || taggerBatch.GetPrefixState() == TAGGER_PREFIX_UNKNOWN) return;
+	if(taggerBatch.GetPrefixState() == TAGGER_PREFIX_SUPPORTED) appendLog(ID_LOG_APP, L"Prefix operations supported by tagger");
+	else appendLog(ID_LOG_APP, L"Prefix operations not supported by tagger: tagged files below a directory are handed over one by one");
+}
+
+/*
+Hand given job to tagger. Invocations beyond the rate limit are deferred: a timer runs them as the bucket refills.
+*/
+UINT runJob(TaggerJob* lpJob) {
+	static WCHAR buff[4192];
+	UINT nDeferred = taggerBatch.GetDeferredCount();
+	DWORD dwPrefix = taggerBatch.GetPrefixState();
+	UINT result = taggerBatch.Run(lpJob);
+	logPrefixState(dwPrefix);
+	if(taggerBatch.GetDeferredCount() && !nDeferred) {
+		wsprintf(buff, L"Tagger rate limit reached: %u invocation(s) deferred", taggerBatch.GetDeferredCount());
+		appendLog(ID_LOG_APP, buff);
+		SetTimer(hWnd, ID_TIMER_TAGGER_QUEUE, max(taggerBatch.GetDeferredDelay(), (DWORD) USER_TIMER_MINIMUM), NULL);
+	}
+	return result;
+}
+
+/*
+Run the deferred invocations of tagger that the rate limit allows or, if bAll is set, all of them
+(before tfmon leaves, so that the database reflects every update handed to it; listings account for them instead, see listTagged).
+*/
+void runDeferred(BOOL bAll) {
+	if(!taggerBatch.GetDeferredCount()) return;
+	DWORD dwPrefix = taggerBatch.GetPrefixState();
+	UINT nRun = taggerBatch.RunDeferred(bAll);
+	logPrefixState(dwPrefix);
+	if(!nRun) return;
+	// database was changed by tfmon itself
+	ackTaggedIndex();
+	if(taggerBatch.GetDeferredCount()) SetTimer(hWnd, ID_TIMER_TAGGER_QUEUE, max(taggerBatch.GetDeferredDelay(), (DWORD) USER_TIMER_MINIMUM), NULL);
+	else KillTimer(hWnd, ID_TIMER_TAGGER_QUEUE);
+}
+
+/*
+Tagged files an event on given path applies to: the path itself and, if bSubtree is set, the files below it.
+They are retrieved with a single listing (the index is case folded: tagger lists the paths as it knows them),
+which is skipped when the index tells that there is nothing below the path.
+*/
+void listTagged(LPCWSTR path, BOOL bSubtree, vector<wstring>* vecFiles) {
+	static WCHAR buff[4192];
+	if(bTaggedIndex) {
+		if(taggedIndex.Contains(path)) vecFiles->push_back(path);
+		if(!bSubtree || !taggedIndex.ContainsUnder(path)) return;
+	}
+	wstring command = wstring(Settings.taggerCommandLinePath) + L" --quiet --files list \"" + path + L"*\"";
+	LPWSTR output = DosExec((LPWSTR) command.c_str());
+	appendLog(ID_LOG_TAGGER, command.c_str(), true);
+	if(!output) return;
+	vector<wstring> vecListed;
+	LPWSTR context = NULL;
+	for(LPWSTR line = wcstok_s(output, L"\n", &context); line; line = wcstok_s(NULL, L"\n", &context)) {
+		SIZE_T lineLen = wcslen(line);
+		if(lineLen && line[lineLen-1] == '\r') line[--lineLen] = '\0';
+		if(lineLen) vecListed.push_back(line);
+	}
+	LocalFree(output);
+	// invocations of tagger still deferred are accounted for (rather than run ahead of the rate limit)
+	taggerBatch.ApplyDeferred(path, &vecListed);
+
+	// paths sharing the same prefix are listed as well (i.e. 'dir2' for 'dir')
+	UINT nListed = 0;
+	SIZE_T len = wcslen(path);
+	for(UINT i = 0, uiCount = vecListed.size(); i < uiCount; ++i) {
+		LPCWSTR line = vecListed[i].c_str();
+		if(vecListed[i].size() < len || _wcsnicmp(line, path, len) != 0) continue;
+		if((line[len] == '\0' && !bTaggedIndex) || (line[len] == '\\' && bSubtree)) {
+			vecFiles->push_back(vecListed[i]);
+			++nListed;
+		}
+	}
+	wsprintf(buff, L"%u tagged file(s)", nListed);
+	appendLog(ID_LOG_TAGGER, buff);
+}
+
+/*
+Recycle bin of the drives holding given path (NULL if it lies within none of them).
+*/
+LPCWSTR findRecycleBin(LPCWSTR path) {
+	SIZE_T len = wcslen(path);
+	for(UINT i = 0; i < Settings.nDrives; ++i) {
+		LPCWSTR binPath = Settings.lpDrivesInfos[i]->szRecycleBinPath;
+		SIZE_T binLen = wcslen(binPath);
+		if(binLen && len > binLen && path[binLen] == '\\' && _wcsnicmp(path, binPath, binLen) == 0) return binPath;
+	}
+	return NULL;
+}
+
+/*
+Given recycle bin holds no more items (their data files are named $R<id>, along with a $I<id> file each).
+*/
+BOOL isRecycleBinEmpty(LPCWSTR binPath) {
+	WIN32_FIND_DATA fd;
+	HANDLE hFind = FindFirstFile((wstring(binPath) + L"\\$R*").c_str(), &fd);
+	if(hFind == INVALID_HANDLE_VALUE) return TRUE;
+	FindClose(hFind);
+	return FALSE;
+}
+
 void fileMove(HWND hWnd, WPARAM wParam, LPARAM lParam) {
 	static WCHAR buff[4192];
-	LPWSTR output;
 	LPWSTR oldFileName = (LPWSTR) wParam;
 	LPWSTR newFileName = (LPWSTR) lParam;
 
 	if(oldFileName == NULL || newFileName == NULL) return;
 	if(wcscmp(oldFileName, newFileName) == 0) return;	  // no change
 
+	// neither a tagged file nor a directory holding one: nothing to update
+	refreshTaggedIndex(FALSE);
+	if(bTaggedIndex && !taggedIndex.IsRelevant(oldFileName)) return;
+
 	appendLog(ID_LOG_FS, L"File moved:");
 	wsprintf(buff, L"    Src: %s", oldFileName);
 	appendLog(ID_LOG_FS, buff);
@@ -412,91 +845,68 @@ void fileMove(HWND hWnd, WPARAM wParam, LPARAM lParam) {
 	appendLog(ID_LOG_FS, buff);
 	appendLog(ID_LOG_FS, L"");
 
-	if(GetFileAttributes(newFileName) & FILE_ATTRIBUTE_DIRECTORY) {
-		// search for sub items (files or directories)
-		wsprintf(buff, L"%s --quiet --files list \"%s\\*\"", Settings.taggerCommandLinePath, oldFileName);
-		output = DosExec(buff);
-		appendLog(ID_LOG_TAGGER, buff, true);
-		appendLog(ID_LOG_TAGGER, output);
-		for(LPWSTR line = wcstok(output, L"\n"); line; line = wcstok(NULL, L"\n")) {
-			// for each line, replace oldFileName by newFileName
-			line[wcslen(line)-1] = '\0';			
-			wsprintf(buff, L"%s --files rename \"%s\" \"%s\\%s\"", Settings.taggerCommandLinePath, line, newFileName, line+wcslen(oldFileName)+1);
-			output = DosExec(buff);
-			appendLog(ID_LOG_TAGGER, buff, true);
-			appendLog(ID_LOG_TAGGER, output);
-		}
-	}
+	DWORD dwAttributes = GetFileAttributes(newFileName);
+	BOOL bDirectory = (dwAttributes != INVALID_FILE_ATTRIBUTES && (dwAttributes & FILE_ATTRIBUTE_DIRECTORY));
 
-	// check file's presence in database (retrieve tags already applied on the given file)
-	wsprintf(buff, L"%s query \"%s\"", Settings.taggerCommandLinePath, oldFileName);		
-	output = DosExec(buff);
-	appendLog(ID_LOG_TAGGER, buff, true);
-	appendLog(ID_LOG_TAGGER, output);
-
-	if(wcscmp(output, L"No tag currently applied on given file(s).\r\n") != 0) {
-		LocalFree(output);
-		// given file is in the tagger DB
-		wsprintf(buff, L"%s --files rename \"%s\" \"%s\"", Settings.taggerCommandLinePath, oldFileName, newFileName);
-		output = DosExec(buff);
-		appendLog(ID_LOG_TAGGER, buff, true);
-		appendLog(ID_LOG_TAGGER, output);
-	}
+	// the item and, for a directory, the tagged files below it are renamed as a single job
+	TaggerJob job(TAGGER_JOB_RENAME, oldFileName, newFileName, bDirectory);
+	listTagged(oldFileName, bDirectory, &job.vecFiles);
+	runJob(&job);
 
-	LocalFree(output);
+	taggedIndex.Rename(oldFileName, newFileName);
+	ackTaggedIndex();
+	// watched directories were planned with the old paths
+	if(bWatchTagged && bDirectory) refreshTaggedIndex(TRUE);
 }
 
 void fileRemove(HWND hWnd, WPARAM wParam, LPARAM lParam) {
 	static WCHAR buff[4192];
-	LPWSTR output;
 	LPWSTR oldFileName = (LPWSTR) wParam;
 	LPWSTR newFileName = (LPWSTR) lParam;
 
 	if(oldFileName == NULL) return;
 
+	// an item removed from a recycle bin: once it holds no more items, the files known to have gone there can no longer be restored
+	LPCWSTR binPath = findRecycleBin(oldFileName);
+	if(binPath) {
+		if(trashIndex.GetCount(binPath) && isRecycleBinEmpty(binPath)) {
+			wsprintf(buff, L"Recycle bin %s emptied: %u tagged file(s) can no longer be restored", binPath, trashIndex.Drop(binPath));
+			appendLog(ID_LOG_FS, buff);
+			trashIndex.Save(trashIndexPath.c_str());
+		}
+		return;
+	}
+
+	// not a tagged file: nothing to update
+	refreshTaggedIndex(FALSE);
+	if(bTaggedIndex && !taggedIndex.IsRelevant(oldFileName)) return;
+
 	appendLog(ID_LOG_FS, L"File deleted:");
 	wsprintf(buff, L"    %s", oldFileName);
 	appendLog(ID_LOG_FS, buff);
+	if(newFileName) {
+		wsprintf(buff, L"    to recycle bin %s", newFileName);
+		appendLog(ID_LOG_FS, buff);
+	}
 	appendLog(ID_LOG_FS, L"");
 
 	// note : as file is now deleted, we cannot ask windows file's attributes !!
-
-
-// todo : try to remove all files starting with given path
-/*
-		wsprintf(buff, L"%s --quiet --files list \"%s\\*\"", Settings.taggerCommandLinePath, oldFileName);
-		output = DosExec(buff);
-		appendLog(ID_LOG_TAGGER, buff, true);
-		appendLog(ID_LOG_TAGGER, output);
-		for(LPWSTR line = wcstok(output, L"\n"); line; line = wcstok(NULL, L"\n")) {
-			// for each line, replace oldFileName by newFileName
-			line[wcslen(line)-1] = '\0';			
-			wsprintf(buff, L"%s --files rename \"%s\" \"%s\\%s\"", Settings.taggerCommandLinePath, line, newFileName, line+wcslen(oldFileName)+1);
-			output = DosExec(buff);
-			appendLog(ID_LOG_TAGGER, buff, true);
-			appendLog(ID_LOG_TAGGER, output);
+	// tagged files below given path (if it was a directory) are deleted along with it, as a single job
+	TaggerJob job(TAGGER_JOB_DELETE, oldFileName, NULL, TRUE);
+	listTagged(oldFileName, TRUE, &job.vecFiles);
+	if(runJob(&job)) {
+		for(UINT i = 0, uiCount = job.vecFiles.size(); i < uiCount; ++i) {
+			taggedIndex.Remove(job.vecFiles[i].c_str());
+			// files that went to the recycle bin can be brought back
+			if(newFileName) trashIndex.Add(newFileName, job.vecFiles[i].c_str());
 		}
-*/
-	// check file's presence in database (retrieve tags already applied on the given file)
-	wsprintf(buff, L"%s query \"%s\"", Settings.taggerCommandLinePath, oldFileName);		
-	output = DosExec(buff);
-	appendLog(ID_LOG_TAGGER, buff, true);
-	appendLog(ID_LOG_TAGGER, output);
-
-	if(wcscmp(output, L"No tag currently applied on given file(s).\r\n") != 0) {
-		LocalFree(output);
-		// given file is in the tagger DB
-		wsprintf(buff, L"%s --files delete \"%s\"", Settings.taggerCommandLinePath, oldFileName);
-		output = DosExec(buff);
-		appendLog(ID_LOG_TAGGER, buff, true);
-		appendLog(ID_LOG_TAGGER, output);
+		if(newFileName) trashIndex.Save(trashIndexPath.c_str());
+		ackTaggedIndex();
 	}
-	LocalFree(output);
 }
 
 void fileRestore(HWND hWnd, WPARAM wParam, LPARAM lParam) {
 	static WCHAR buff[4192];
-	LPWSTR output;
 	LPWSTR oldFileName = (LPWSTR) wParam;
 	LPWSTR newFileName = (LPWSTR) lParam;
 
@@ -505,31 +915,342 @@ void fileRestore(HWND hWnd, WPARAM wParam, LPARAM lParam) {
 	appendLog(ID_LOG_FS, L"File restored:");
 	wsprintf(buff, L"    %s", oldFileName);
 	appendLog(ID_LOG_FS, buff);
+	if(newFileName) {
+		wsprintf(buff, L"    from recycle bin %s", newFileName);
+		appendLog(ID_LOG_FS, buff);
+	}
 	appendLog(ID_LOG_FS, L"");
 
-	// check if given file is actually non-existent
-// todo : most files will be non-existent in the DB, and we shouldn't try to recover them
-// add a feature to tagger.exe to check inside trash only
-	wsprintf(buff, L"%s query \"%s\"", Settings.taggerCommandLinePath, oldFileName);
-	output = DosExec(buff);
-	appendLog(ID_LOG_TAGGER, buff, true);
-	appendLog(ID_LOG_TAGGER, output);
+	DWORD dwAttributes = GetFileAttributes(oldFileName);
+	BOOL bDirectory = (dwAttributes != INVALID_FILE_ATTRIBUTES && (dwAttributes & FILE_ATTRIBUTE_DIRECTORY));
+	TaggerJob job(TAGGER_JOB_RECOVER, oldFileName, NULL, bDirectory);
+
+	// only the tagged files known to have gone to the recycle bin are recovered (tagger cannot tell a deleted file from one that never was tagged):
+	// no query, no walk of the restored directory (its recycle bin is looked up among all of them if it is not known)
+	wstring filePath;
+	if(trashIndex.Take(newFileName, oldFileName, &filePath)) job.vecFiles.push_back(filePath);
+	if(bDirectory) trashIndex.TakeUnder(newFileName, oldFileName, &job.vecFiles);
+	if(job.vecFiles.empty()) {
+		// i.e. removed while tfmon was not running, or from a recycle bin that was emptied since
+		appendLog(ID_LOG_FS, L"Restored item holds no tagged file known to have gone to the recycle bin: nothing to recover");
+		return;
+	}
+	trashIndex.Save(trashIndexPath.c_str());
+
+	refreshTaggedIndex(FALSE);
+	if(!runJob(&job)) return;
+	for(UINT i = 0, uiCount = job.vecFiles.size(); i < uiCount; ++i) taggedIndex.Add(job.vecFiles[i].c_str());
+	ackTaggedIndex();
+}
+
+void fileOverflow(HWND hWnd, WPARAM wParam, LPARAM lParam) {
+	static WCHAR buff[4192];
+	LPWSTR rootPath = (LPWSTR) wParam;
+
+	// storms summaries, taken from the notifier ahead of their own notification
+	static vector<EventStorm> vecStorms;
+
+	if(rootPath == NULL) return;
+
+	FSChangeNotifier::GetInstance()->TakeStorms(&vecStorms);
+	BOOL bStorm = FALSE;
+	for(UINT i = 0, uiCount = vecStorms.size(); i < uiCount; ++i) {
+		if(lstrcmpiW(vecStorms[i].path.c_str(), rootPath) != 0) continue;
+		// events were suspended rather than lost
+		wsprintf(buff, L"Event storm on %s: %u event(s) suspended over %u s (peak %u/s)", rootPath, vecStorms[i].nSuspended, (UINT) ((vecStorms[i].ullLast - vecStorms[i].ullStart) / 1000000), vecStorms[i].nPeak * 1000 / FS_STORM_PERIOD);
+		appendLog(ID_LOG_APP, buff);
+		vecStorms.erase(vecStorms.begin() + i);
+		bStorm = TRUE;
+		break;
+	}
+	if(!bStorm) {
+		wsprintf(buff, L"Events lost (buffer overflow) for %s", rootPath);
+		appendLog(ID_LOG_APP, buff);
+	}
+
+	// the watch of the root itself might have stopped (its directory was removed or could no longer be read): it is watched again, or released.
+	// A released root is not reconciled: its files are unknown rather than missing (i.e. drive unplugged, share dropped)
+	BOOL bReconcile = TRUE;
+	FSChangeNotifier* lpNotifier = FSChangeNotifier::GetInstance();
+	UINT nRootLen = wcslen(rootPath);
+	if(nRootLen && rootPath[nRootLen-1] == L'\\') --nRootLen;
+	for(UINT i = 0, uiCount = lpNotifier->GetPathCount(); i < uiCount; ++i) {
+		LPCWSTR path = lpNotifier->GetPath(i);
+		UINT nLen = wcslen(path);
+		if(nLen && path[nLen-1] == L'\\') --nLen;
+		if(nLen != nRootLen || _wcsnicmp(path, rootPath, nLen) != 0) continue;
+		if(!lpNotifier->IsFailed(i)) break;
+		wstring watchedPath = path;
+		if(lpNotifier->ReplacePath(watchedPath.c_str(), watchedPath.c_str(), lpNotifier->IsSubTree(i)) == E_FILESYSMON_SUCCESS) {
+			wsprintf(buff, L"Watch of %s stopped, directory watched again", watchedPath.c_str());
+			appendLog(ID_LOG_APP, buff);
+		}
+		else {
+			wsprintf(buff, L"Watch of %s stopped, directory released", watchedPath.c_str());
+			appendLog(ID_LOG_APP, buff);
+			lpNotifier->RemovePath(i);
+			bReconcile = FALSE;
+			// tagged files it held are watched through another directory
+			if(bWatchTagged) refreshTaggedIndex(TRUE);
+		}
+		break;
+	}
+
+	if(bReconcile) {
+		reconciler.Schedule(rootPath);
+		wsprintf(buff, L"Reconciliation scheduled for %s", rootPath);
+		appendLog(ID_LOG_APP, buff);
+	}
+}
+
+/*
+Runs on the reconciler thread: DosExec does not share any state, but logs must be written from the UI thread.
+*/
+BOOL reconcileList(LPCWSTR rootPath, vector<wstring>* vecPaths, LPVOID lpParam) {
+	WCHAR buff[4192];
+	wsprintf(buff, L"%s --quiet --files list \"%s*\"", Settings.taggerCommandLinePath, rootPath);
+	LPWSTR output = DosExec(buff);
+	if(!output) return FALSE;
+
+	LPWSTR context = NULL;
+	for(LPWSTR line = wcstok_s(output, L"\n", &context); line; line = wcstok_s(NULL, L"\n", &context)) {
+		SIZE_T len = wcslen(line);
+		if(len && line[len-1] == '\r') line[--len] = '\0';
+		if(len) vecPaths->push_back(line);
+	}
+	LocalFree(output);
+	return TRUE;
+}
+
+void reconcileMissing(LPCWSTR rootPath, vector<wstring>* vecMissing, vector<wstring>* vecExcess, LPVOID lpParam) {
+	// posted (not sent) so that stopping the reconciler from the UI thread cannot deadlock: handler releases the copies
+	ScanBatch* lpBatch = new ScanBatch();
+	lpBatch->vecMissing = *vecMissing;
+	lpBatch->vecExcess = *vecExcess;
+	PostMessage(hWnd, WM_RECONCILED, (WPARAM) _wcsdup(rootPath), (LPARAM) lpBatch);
+}
+
+/*
+Runs on the scanner thread, see reconcileList.
+*/
+BOOL scanList(vector<wstring>* vecPaths, LPVOID lpParam) {
+	WCHAR buff[4192];
+	wsprintf(buff, L"%s --quiet --files list", Settings.taggerCommandLinePath);
+	LPWSTR output = DosExec(buff);
+	if(!output) return FALSE;
+
+	LPWSTR context = NULL;
+	for(LPWSTR line = wcstok_s(output, L"\n", &context); line; line = wcstok_s(NULL, L"\n", &context)) {
+		SIZE_T len = wcslen(line);
+		if(len && line[len-1] == '\r') line[--len] = '\0';
+		if(len) vecPaths->push_back(line);
+	}
+	LocalFree(output);
+	return TRUE;
+}
+
+void scanStale(ScanBatch* lpBatch, LPVOID lpParam) {
+	// posted (not sent) so that stopping the scanner from the UI thread cannot deadlock: handler releases the copy
+	PostMessage(hWnd, WM_SCANNED, (WPARAM) new ScanBatch(*lpBatch), 0);
+}
+
+DWORD scanIdle(LPVOID lpParam) {
+	LASTINPUTINFO lii;
+	lii.cbSize = sizeof(LASTINPUTINFO);
+	if(!GetLastInputInfo(&lii)) return 0;
+	return GetTickCount() - lii.dwTime;
+}
 
-	if(wcscmp(output, L"No tag currently applied on given file(s).\r\n") == 0) {
-		LocalFree(output);
-		// given file is in the tagger DB
-		wsprintf(buff, L"%s --files recover \"%s\"", Settings.taggerCommandLinePath, oldFileName);
-		output = DosExec(buff);
-		appendLog(ID_LOG_TAGGER, buff, true);
-		appendLog(ID_LOG_TAGGER, output);
+/*
+Last write time of the tagger database (newest file in the .tagger directory).
+*/
+ULONGLONG taggerDatabaseStamp() {
+	WCHAR buff[MAX_PATH];
+	ULONGLONG result = 0;
+	LPCURRENTUSERINFO lpInfo = WinEnv_GetCurrentUserInfo();
+	wsprintf(buff, L"%s\\.tagger\\*", lpInfo->szHomeDirectory);
+	WIN32_FIND_DATA fd;
+	HANDLE hFind = FindFirstFile(buff, &fd);
+	if(hFind == INVALID_HANDLE_VALUE) return result;
+	do {
+		ULONGLONG ullTime = ((ULONGLONG) fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime;
+		if(ullTime > result) result = ullTime;
+	} while(FindNextFile(hFind, &fd));
+	FindClose(hFind);
+	return result;
+}
+
+/*
+(Re)build the index of tagged paths from 'tagger --files list' if the tagger database was changed by another application
+(the database is checked at most every TAGGED_INDEX_CHECK_DELAY ms), or unconditionally if bForce is set.
+*/
+void refreshTaggedIndex(BOOL bForce) {
+	static ULONGLONG ullLastCheck = 0;
+	static WCHAR buff[4192];
+	ULONGLONG ullNow = GetTickCount64();
+	if(!bForce && ullNow - ullLastCheck < TAGGED_INDEX_CHECK_DELAY) return;
+	ullLastCheck = ullNow;
+	ULONGLONG ullStamp = taggerDatabaseStamp();
+	if(!bForce && bTaggedIndex && ullStamp == ullTaggedStamp) return;
+
+	wsprintf(buff, L"%s --quiet --files list", Settings.taggerCommandLinePath);
+	LPWSTR output = DosExec(buff);
+	if(!output) {
+		// without the index, every change goes to tagger
+		if(bTaggedIndex) appendLog(ID_LOG_APP, L"Unable to list tagged files: changes are no longer filtered");
+		// watched directories cannot be planned either: fall back to whole drives
+		if(bWatchTagged && (bTaggedIndex || bForce)) watchDrives();
+		bTaggedIndex = FALSE;
+		return;
+	}
+	vector<wstring> vecPaths;
+	LPWSTR context = NULL;
+	for(LPWSTR line = wcstok_s(output, L"\n", &context); line; line = wcstok_s(NULL, L"\n", &context)) {
+		SIZE_T len = wcslen(line);
+		if(len && line[len-1] == '\r') line[--len] = '\0';
+		if(len) vecPaths.push_back(line);
 	}
 	LocalFree(output);
+	// invocations of tagger still deferred are accounted for, as in listTagged
+	taggerBatch.ApplyDeferred(NULL, &vecPaths);
+	taggedIndex.Build(vecPaths);
+	bTaggedIndex = TRUE;
+	ullTaggedStamp = ullStamp;
+
+	wsprintf(buff, L"Tagged path(s) indexed: %u", taggedIndex.GetCount());
+	appendLog(ID_LOG_APP, buff);
+
+	// identities of the tagged files let their moves be paired even when the system does not report them
+	// (identities are read in the background: the files are not opened here)
+	UINT nTracked = FSChangeNotifier::GetInstance()->SetTrackedFiles(vecPaths);
+	wsprintf(buff, L"Tagged files tracked: %u", nTracked);
+	appendLog(ID_LOG_APP, buff);
+
+	// files tagged outside of the watched directories extend them
+	if(bWatchTagged) applyWatchPlan(vecPaths);
+}
+
+/*
+Changes made to the tagger database by tfmon itself are applied to the index as well: index is still in sync.
+*/
+void ackTaggedIndex() {
+	ullTaggedStamp = taggerDatabaseStamp();
+}
+
+/*
+Appends given paths to the FS log, under given title.
+*/
+void logPaths(LPCWSTR title, const vector<wstring>& vecPaths) {
+	static WCHAR buff[4192];
+	appendLog(ID_LOG_FS, title);
+	for(UINT i = 0, uiCount = vecPaths.size(); i < uiCount; ++i) {
+		wsprintf(buff, L"    %s", vecPaths[i].c_str());
+		appendLog(ID_LOG_FS, buff);
+	}
+	appendLog(ID_LOG_FS, L"");
+}
+
+void filesReconciled(HWND hWnd, WPARAM wParam, LPARAM lParam) {
+	static WCHAR buff[4192];
+	LPWSTR rootPath = (LPWSTR) wParam;
+	ScanBatch* lpBatch = (ScanBatch*) lParam;
+
+	if(rootPath == NULL || lpBatch == NULL) {
+		free(rootPath);
+		delete lpBatch;
+		return;
+	}
+
+	// files moved, removed or brought back by a change handled in the meantime are left alone, as are the files of a volume that went away
+	TaggerJob job(TAGGER_JOB_DELETE, rootPath);
+	for(UINT i = 0, uiCount = lpBatch->vecMissing.size(); i < uiCount; ++i) {
+		LPCWSTR path = lpBatch->vecMissing[i].c_str();
+		if(bTaggedIndex && !taggedIndex.Contains(path)) continue;
+		if(!ConsistencyScanner::IsMissing(path)) continue;
+		job.vecFiles.push_back(lpBatch->vecMissing[i]);
+	}
+
+	wsprintf(buff, L"Reconciled %s: %d tagged file(s) no longer present", rootPath, job.vecFiles.size());
+	appendLog(ID_LOG_APP, buff);
+	if(!job.vecFiles.empty()) {
+		logPaths(L"Files missing after overflow:", job.vecFiles);
+
+		// their destination is unknown: handle them as deleted (they can still be recovered), as a single job
+		runJob(&job);
+		for(UINT i = 0, uiCount = job.vecFiles.size(); i < uiCount; ++i) taggedIndex.Remove(job.vecFiles[i].c_str());
+		ackTaggedIndex();
+	}
+
+	// deletions beyond the cap of a pass are left to the user (see filesScanned)
+	if(!lpBatch->vecExcess.empty()) {
+		wsprintf(buff, L"Reconciled %s: %d more tagged file(s) missing, beyond the deletions allowed per pass: database left unchanged", rootPath, lpBatch->vecExcess.size());
+		appendLog(ID_LOG_APP, buff);
+		logPaths(L"Files missing after overflow (not deleted):", lpBatch->vecExcess);
+	}
+
+	free(rootPath);
+	delete lpBatch;
+}
+
+void filesScanned(HWND hWnd, WPARAM wParam, LPARAM lParam) {
+	static WCHAR buff[4192];
+	ScanBatch* lpBatch = (ScanBatch*) wParam;
+
+	if(lpBatch == NULL) return;
+
+	// files moved, removed or brought back by a change handled in the meantime are left alone, as are the files of a volume that went away
+	TaggerJob job(TAGGER_JOB_DELETE, NULL);
+	for(UINT i = 0, uiCount = lpBatch->vecMissing.size(); i < uiCount; ++i) {
+		LPCWSTR path = lpBatch->vecMissing[i].c_str();
+		if(bTaggedIndex && !taggedIndex.Contains(path)) continue;
+		if(!ConsistencyScanner::IsMissing(path)) continue;
+		job.vecFiles.push_back(lpBatch->vecMissing[i]);
+	}
+
+	if(!job.vecFiles.empty()) {
+		wsprintf(buff, L"Scan: %d tagged file(s) no longer present", job.vecFiles.size());
+		appendLog(ID_LOG_APP, buff);
+		logPaths(L"Files found missing by the scan:", job.vecFiles);
+
+		// their destination is unknown: handle them as deleted (they can still be recovered), as a single job
+		runJob(&job);
+		for(UINT i = 0, uiCount = job.vecFiles.size(); i < uiCount; ++i) taggedIndex.Remove(job.vecFiles[i].c_str());
+		ackTaggedIndex();
+	}
+
+	// deletions beyond the cap of a sweep are left to the user: that many files missing at once is more likely a volume or share gone wrong
+	if(!lpBatch->vecExcess.empty()) {
+		wsprintf(buff, L"Scan: %d more tagged file(s) missing, beyond the deletions allowed per sweep: database left unchanged", lpBatch->vecExcess.size());
+		appendLog(ID_LOG_APP, buff);
+		logPaths(L"Files found missing by the scan (not deleted):", lpBatch->vecExcess);
+	}
+
+	// tags stay with the path: the replacing file is most likely the same document, saved by an application
+	if(!lpBatch->vecReplaced.empty()) {
+		wsprintf(buff, L"Scan: %d tagged file(s) replaced by another file since the previous sweep", lpBatch->vecReplaced.size());
+		appendLog(ID_LOG_APP, buff);
+		logPaths(L"Files replaced (tags kept):", lpBatch->vecReplaced);
+	}
+
+	delete lpBatch;
 }
 
 void watcherStopped(HWND hWnd, WPARAM wParam, LPARAM lParam) {
 	MessageBox(NULL, L"Watcher thread stopped unexpectedly\r\nPlease, try to restart the application.", L"Error", MB_OK);
 }
 
+void timerElapsed(HWND hWnd, WPARAM wParam, LPARAM lParam) {
+	switch(wParam) {
+	case ID_TIMER_TAGGED_INDEX:
+		// changes made to the tagger database by other applications are caught even if no file is changed
+		refreshTaggedIndex(FALSE);
+		break;
+	case ID_TIMER_TAGGER_QUEUE:
+		runDeferred(FALSE);
+		break;
+	}
+}
+
 void notifyIcon(HWND hWnd, WPARAM wParam, LPARAM lParam) {	
 	HMENU hMenu = GetSubMenu( LoadMenu(GetModuleHandle(NULL), MAKEINTRESOURCE(ID_POPUP_MENU)), 0);
 	if ((UINT) lParam == WM_LBUTTONDOWN) {
@@ -559,9 +1280,10 @@ void menuAbout(HWND hWnd, WPARAM wParam, LPARAM lParam) {
 
 void menuRestart(HWND hWnd, WPARAM wParam, LPARAM lParam) {	
 
-	FSChangeNotifier* lpNotifier = FSChangeNotifier::GetInstance();
-	// stop watching thread
-	lpNotifier->Stop();
+	// watching threads keep running: StartMonitoring applies the differences of the configuration (watched paths are added, replaced
+	// or released, exclusions and recycle bins are added, limits are changed in place), and starts the threads of new volumes only
+	// (the scan is restarted, since its limits are given before it starts; roots waiting for their reconciliation are kept)
+	scanner.Stop();
 
 	// empty all logs
 	DlgCtrl_SendMessage(hWndActivity, ID_LOG_APP, LB_RESETCONTENT, 0, 0 );
@@ -580,6 +1302,14 @@ void closeDialog(HWND hWnd, WPARAM, LPARAM) {
 void closeApp(HWND hWnd, WPARAM, LPARAM) {
 	if(MessageBox(hWnd, L"Terminating this program means that filesystem changes will no longer be monitored.\r\n This might result in Tagger database inconsistency (if tagged files are moved, deleted or restored).\r\n\r\nAre you sure you want to end monitoring ?", L"TaggerUI", MB_YESNO | MB_ICONWARNING | MB_DEFBUTTON2) == IDYES) {
 
+		// events still held (pending removals, coalescing window, saves) are notified, and handled, before the watching threads leave
+		FSChangeNotifier::GetInstance()->Stop();
+		reconciler.Stop();
+		scanner.Stop();
+		statPool.Stop();
+		// indexes already account for the deferred invocations of tagger: they must reach the database
+		runDeferred(TRUE);
+
 		// free allocated memory
 		if(Settings.taggerCommandLinePath) LocalFree(Settings.taggerCommandLinePath);
 				
@@ -32,3 +32,6 @@
 #define ID_POPUP_MENU				500
 #define IDM_QUIT					501
 #define IDM_RESTART					502
+
+#define ID_TIMER_TAGGED_INDEX		601
+#define ID_TIMER_TAGGER_QUEUE		602